@@ -3,9 +3,101 @@
 #include "../gui/window_manager.h"
 #include "../lib/memory.h"
 #include "../lib/printf.h"
+#include "../lib/alloc_trace.h"
 
 #define WIN_W 300
-#define WIN_H 150
+#define WIN_H 400
+
+#define USAGE_TOP_SITES 4
+
+/* Unsigned to decimal string (buf must hold 21 chars) */
+static char *usage_utoa(size_t val, char *buf) {
+    char tmp[21];
+    int j = 0;
+    if (val == 0) tmp[j++] = '0';
+    while (val > 0) {
+        tmp[j++] = '0' + (val % 10);
+        val /= 10;
+    }
+    int k = 0;
+    while (j > 0) buf[k++] = tmp[--j];
+    buf[k] = 0;
+    return buf;
+}
+
+/* Per-size-class slab occupancy: one row per class with a small bar */
+static void usagemgr_draw_slabs(window_t *win, int y) {
+    char num[21];
+    wm_draw_string(win, 10, y, "Heap Slabs:", 0xFFAAAAAA);
+    wm_draw_string(win, 100, y, "pages", 0xFF777777);
+    wm_draw_string(win, 150, y, "used/total", 0xFF777777);
+    y += 14;
+
+    for (int cls = 0; cls < KMALLOC_NUM_CLASSES; cls++) {
+        kmalloc_class_stats_t st;
+        kmalloc_get_class_stats(cls, &st);
+
+        int cx = 10;
+        wm_draw_string(win, cx, y, usage_utoa(st.obj_size, num), 0xFFFFFFFF);
+        wm_draw_string(win, 50, y, "B", 0xFFFFFFFF);
+        wm_draw_string(win, 100, y, usage_utoa(st.slabs, num), 0xFFFFFFFF);
+
+        cx = 150;
+        usage_utoa(st.used_objs, num);
+        wm_draw_string(win, cx, y, num, 0xFFFFFFFF);
+        for (char *p = num; *p; p++) cx += 8;
+        wm_draw_string(win, cx, y, "/", 0xFF777777);
+        wm_draw_string(win, cx + 8, y, usage_utoa(st.total_objs, num), 0xFFFFFFFF);
+
+        // Occupancy bar
+        int bar_x = 250, bar_w = 40;
+        wm_fill_rect(win, bar_x, y, bar_w, 8, 0xFF404040);
+        if (st.total_objs) {
+            int fill = (int)((st.used_objs * bar_w) / st.total_objs);
+            wm_fill_rect(win, bar_x, y, fill, 8, 0xFF00A0DD);
+        }
+        y += 12;
+    }
+
+    int cx = 10;
+    wm_draw_string(win, cx, y + 4, "Large pages:", 0xFFAAAAAA);
+    cx += 13 * 8;
+    wm_draw_string(win, cx, y + 4, usage_utoa(kmalloc_get_large_pages(), num), 0xFFFFFFFF);
+}
+
+/* Low 32 bits of a kernel address as hex (buf must hold 9 chars);
+   the upper half is always 0xffffffff */
+static char *usage_hex32(uintptr_t val, char *buf) {
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 7; i >= 0; i--) {
+        buf[i] = digits[val & 0xF];
+        val >>= 4;
+    }
+    buf[8] = 0;
+    return buf;
+}
+
+/* Biggest live kmalloc call sites, when 'memstat on' is tracing them */
+static void usagemgr_draw_sites(window_t *win, int y) {
+    char num[21];
+    wm_draw_string(win, 10, y, "Top kmalloc sites:", 0xFFAAAAAA);
+    y += 14;
+
+    if (!alloc_trace_enabled()) {
+        wm_draw_string(win, 10, y, "off ('memstat on' in shell)", 0xFF777777);
+        return;
+    }
+
+    alloc_site_stats_t top[USAGE_TOP_SITES];
+    int n = alloc_trace_top(top, USAGE_TOP_SITES);
+    for (int i = 0; i < n; i++) {
+        wm_draw_string(win, 10, y, usage_hex32(top[i].site, num), 0xFFFFFFFF);
+        wm_draw_string(win, 100, y, usage_utoa(top[i].live_bytes / 1024, num), 0xFFFFFFFF);
+        wm_draw_string(win, 150, y, "KB live", 0xFF777777);
+        wm_draw_string(win, 220, y, usage_utoa(top[i].live_objs, num), 0xFFFFFFFF);
+        y += 12;
+    }
+}
 
 static void usagemgr_paint(window_t *win, uint32_t *buf, int stride, int height) {
     (void)buf;
@@ -30,48 +122,10 @@ static void usagemgr_paint(window_t *win, uint32_t *buf, int stride, int height)
     if (total_kb == 0) total_kb = 1; 
     if (used_kb > total_kb) used_kb = total_kb;
     
-    // Ram Labels
-    
-    // Not using sprintf yet, manual conversion for now
-    // A quick hack since we don't have a robust sprintf for userland strings yet
-    // "RAM: X MB / Y MB"
-    // For simplicity, we'll draw the string manually since kprintf prints to terminal. 
-    // We already have string drawing. 
-    // Let's implement a very simple num_to_str
-    
-    char num1[16];
-    char num2[16];
-    
-    // Used MB
-    int val = used_mb;
-    int j = 0;
-    if (val == 0) num1[j++] = '0';
-    while (val > 0) {
-        num1[j++] = '0' + (val % 10);
-        val /= 10;
-    }
-    // Reverse
-    for (int k = 0; k < j / 2; k++) {
-        char tmp = num1[k];
-        num1[k] = num1[j - 1 - k];
-        num1[j - 1 - k] = tmp;
-    }
-    num1[j] = 0;
-    
-    // Total MB
-    val = total_mb;
-    j = 0;
-    if (val == 0) num2[j++] = '0';
-    while (val > 0) {
-        num2[j++] = '0' + (val % 10);
-        val /= 10;
-    }
-    for (int k = 0; k < j / 2; k++) {
-        char tmp = num2[k];
-        num2[k] = num2[j - 1 - k];
-        num2[j - 1 - k] = tmp;
-    }
-    num2[j] = 0;
+    char num1[21];
+    char num2[21];
+    usage_utoa(used_mb, num1);
+    usage_utoa(total_mb, num2);
 
     wm_draw_string(win, 10, 40, "RAM Usage:", 0xFFAAAAAA);
     
@@ -103,6 +157,9 @@ static void usagemgr_paint(window_t *win, uint32_t *buf, int stride, int height)
     else if (used_kb * 100 / total_kb > 50) bar_color = 0xFFDDDD00; // Yellow
 
     wm_fill_rect(win, bar_x, bar_y, fill_w, bar_h, bar_color);
+
+    usagemgr_draw_slabs(win, 100);
+    usagemgr_draw_sites(win, 250);
     
     // Draw refresh hint
     wm_draw_string(win, 10, WIN_H - 24, "Hover to refresh...", 0xFF777777);
@@ -85,7 +85,11 @@ void* acpi_find_table(const char* signature) {
 }
 
 static uintptr_t g_lapic_addr = 0;
-static uintptr_t g_ioapic_addr = 0;
+static uintptr_t g_ioapic_addr[ACPI_MAX_IOAPICS];
+static uint32_t g_ioapic_gsi_base[ACPI_MAX_IOAPICS];
+static uint32_t g_ioapic_count = 0;
+static uint32_t g_isa_gsi[16];
+static uint16_t g_isa_flags[16];
 static uint8_t g_cpu_ids[64];
 static uint32_t g_cpu_count = 0;
 
@@ -103,6 +107,11 @@ void acpi_parse_madt(void) {
     uint8_t* end = (uint8_t*)madt + madt->header.length;
 
     g_cpu_count = 0;
+    g_ioapic_count = 0;
+    for (int i = 0; i < 16; i++) {
+        g_isa_gsi[i] = i;
+        g_isa_flags[i] = 0;
+    }
     while (ptr < end) {
         madt_entry_header_t* entry = (madt_entry_header_t*)ptr;
         if (entry->type == 0) { // Processor Local APIC
@@ -114,15 +123,36 @@ void acpi_parse_madt(void) {
                     lapic->processor_id, lapic->apic_id, lapic->flags);
         } else if (entry->type == 1) { // I/O APIC
             madt_ioapic_t* ioapic = (madt_ioapic_t*)ptr;
-            g_ioapic_addr = ioapic->ioapic_addr;
+            if (g_ioapic_count < ACPI_MAX_IOAPICS) {
+                g_ioapic_addr[g_ioapic_count] = ioapic->ioapic_addr;
+                g_ioapic_gsi_base[g_ioapic_count++] = ioapic->global_system_interrupt_base;
+            }
             kprintf("ACPI: Found IOAPIC ID %d at %x, GSI Base %d\n", 
                     ioapic->ioapic_id, ioapic->ioapic_addr, ioapic->global_system_interrupt_base);
+        } else if (entry->type == 2) { // Interrupt Source Override
+            madt_iso_t* iso = (madt_iso_t*)ptr;
+            if (iso->bus == 0 && iso->source < 16) {
+                g_isa_gsi[iso->source] = iso->gsi;
+                g_isa_flags[iso->source] = iso->flags;
+            }
+            kprintf("ACPI: IRQ %d is GSI %d, flags %x\n", iso->source, iso->gsi, iso->flags);
         }
         ptr += entry->length;
     }
 }
 
 uintptr_t acpi_get_lapic_addr(void) { return g_lapic_addr; }
-uintptr_t acpi_get_ioapic_addr(void) { return g_ioapic_addr; }
+uint32_t acpi_get_ioapic_count(void) { return g_ioapic_count; }
+uintptr_t acpi_get_ioapic_addr(uint32_t index) { return g_ioapic_addr[index]; }
+uint32_t acpi_get_ioapic_gsi_base(uint32_t index) { return g_ioapic_gsi_base[index]; }
+
+uint32_t acpi_get_isa_irq(uint8_t irq, uint16_t* flags) {
+    if (irq >= 16) {
+        *flags = 0;
+        return irq;
+    }
+    *flags = g_isa_flags[irq];
+    return g_isa_gsi[irq];
+}
 uint32_t acpi_get_cpu_count(void) { return g_cpu_count; }
 uint8_t acpi_get_cpu_apic_id(uint32_t index) { return g_cpu_ids[index]; }
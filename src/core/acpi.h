@@ -58,6 +58,25 @@ typedef struct madt_ioapic {
     uint32_t global_system_interrupt_base;
 } __attribute__((packed)) madt_ioapic_t;
 
+/* Where an ISA IRQ really arrives, when it is not the GSI of the same
+   number, and its trigger mode */
+typedef struct madt_iso {
+    madt_entry_header_t header;
+    uint8_t bus;                /* 0: ISA */
+    uint8_t source;             /* ISA IRQ */
+    uint32_t gsi;
+    uint16_t flags;             /* MADT_INTI_* */
+} __attribute__((packed)) madt_iso_t;
+
+#define MADT_INTI_POLARITY_MASK 0x3
+#define MADT_INTI_ACTIVE_HIGH   0x1
+#define MADT_INTI_ACTIVE_LOW    0x3
+#define MADT_INTI_TRIGGER_MASK  0xC
+#define MADT_INTI_EDGE          0x4
+#define MADT_INTI_LEVEL         0xC
+
+#define ACPI_MAX_IOAPICS 8
+
 typedef struct hpet_table {
     acpi_sdt_header_t header;
     uint32_t event_timer_block_id;
@@ -75,7 +94,13 @@ void acpi_init(void);
 void* acpi_find_table(const char* signature);
 void acpi_parse_madt(void);
 uintptr_t acpi_get_lapic_addr(void);
-uintptr_t acpi_get_ioapic_addr(void);
+uint32_t acpi_get_ioapic_count(void);
+/* Physical address and first GSI of an IOAPIC */
+uintptr_t acpi_get_ioapic_addr(uint32_t index);
+uint32_t acpi_get_ioapic_gsi_base(uint32_t index);
+/* GSI and MADT_INTI_* flags of ISA IRQ irq: the override if the MADT
+   has one, else the same-numbered GSI with flags 0 (bus defaults) */
+uint32_t acpi_get_isa_irq(uint8_t irq, uint16_t* flags);
 uint32_t acpi_get_cpu_count(void);
 uint8_t acpi_get_cpu_apic_id(uint32_t index);
 
@@ -1,10 +1,15 @@
 #include "apic.h"
 #include "acpi.h"
 #include "io.h"
+#include "hpet.h"
+#include "clock.h"
+#include "smp.h"
+#include "spinlock.h"
 #include "../lib/printf.h"
 
 static uintptr_t g_lapic_base = 0;
-static uintptr_t g_ioapic_base = 0;
+static uint32_t g_lapic_ticks_per_ms = 0;
+static int g_tsc_deadline = 0;
 extern uint64_t g_hhdm_offset;
 
 void lapic_write(uint32_t reg, uint32_t val) {
@@ -32,45 +37,240 @@ void lapic_init(void) {
     kprintf("APIC: LAPIC ID %d Version %x\n", lapic_get_id(), lapic_read(LAPIC_VER));
 }
 
+#define LAPIC_TIMER_DIV16   0x3
+#define LAPIC_CALIBRATE_MS  10
+
+int lapic_timer_calibrate(void) {
+    if (!g_lapic_base) return -1;
+
+    // Count down from the top with the timer masked for a known interval
+    lapic_write(LAPIC_TMRDIV, LAPIC_TIMER_DIV16);
+    lapic_write(LAPIC_LVT_TMR, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TMRINIT, 0xFFFFFFFF);
+    hpet_sleep(LAPIC_CALIBRATE_MS);
+    uint32_t elapsed = 0xFFFFFFFF - lapic_read(LAPIC_TMRCURR);
+    lapic_write(LAPIC_TMRINIT, 0);
+
+    g_lapic_ticks_per_ms = elapsed / LAPIC_CALIBRATE_MS;
+
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    g_tsc_deadline = (c & CPUID_1_ECX_TSC_DEADLINE) && clock_tsc_khz();
+
+    kprintf("APIC: LAPIC timer runs at %d kHz (divide by 16), TSC at %d kHz, %s\n",
+            g_lapic_ticks_per_ms, (uint32_t)clock_tsc_khz(),
+            g_tsc_deadline ? "TSC-deadline mode" : "one-shot mode");
+    return g_lapic_ticks_per_ms ? 0 : -1;
+}
+
+int lapic_timer_has_tsc_deadline(void) {
+    return g_tsc_deadline;
+}
+
+void lapic_timer_init_cpu(void) {
+    if (!g_lapic_ticks_per_ms) return;
+    if (g_tsc_deadline) {
+        lapic_write(LAPIC_LVT_TMR, LAPIC_TIMER_VECTOR | LAPIC_TIMER_TSC_DEADLINE);
+        // The LVT write must land before the first deadline MSR write
+        __asm__ volatile("mfence" ::: "memory");
+        wrmsr(MSR_IA32_TSC_DEADLINE, 0);
+    } else {
+        lapic_write(LAPIC_TMRDIV, LAPIC_TIMER_DIV16);
+        lapic_write(LAPIC_LVT_TMR, LAPIC_TIMER_VECTOR | LAPIC_TIMER_ONESHOT);
+        lapic_write(LAPIC_TMRINIT, 0);
+    }
+}
+
+void lapic_timer_arm(uint64_t delta_ns) {
+    if (g_tsc_deadline) {
+        wrmsr(MSR_IA32_TSC_DEADLINE, rdtsc() + delta_ns * clock_tsc_khz() / 1000000 + 1);
+        return;
+    }
+
+    // Deadlines further out than the counter reaches just fire early and
+    // get re-armed
+    uint64_t count = delta_ns * g_lapic_ticks_per_ms / 1000000;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFF) count = 0xFFFFFFFF;
+    lapic_write(LAPIC_TMRINIT, (uint32_t)count);
+}
+
+void lapic_timer_disarm(void) {
+    if (g_tsc_deadline) wrmsr(MSR_IA32_TSC_DEADLINE, 0);
+    else lapic_write(LAPIC_TMRINIT, 0);
+}
+
 void lapic_eoi(void) {
     lapic_write(LAPIC_EOI, 0);
 }
 
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    // The previous IPI must have been accepted before ICR is reused
+    while (lapic_read(LAPIC_ICRL) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+    lapic_write(LAPIC_ICRH, apic_id << 24);
+    lapic_write(LAPIC_ICRL, vector);  // Fixed, physical destination, edge
+}
+
 uint32_t lapic_get_id(void) {
     return lapic_read(LAPIC_ID) >> 24;
 }
 
 /* IOAPIC implementation */
-static void ioapic_write(uint32_t reg, uint32_t val) {
-    *(volatile uint32_t*)(g_ioapic_base) = reg;
-    *(volatile uint32_t*)(g_ioapic_base + 0x10) = val;
+typedef struct {
+    uintptr_t base;
+    uint32_t gsi_base;
+    uint32_t count;             /* Redirection entries */
+} ioapic_t;
+
+#define IOAPIC_MAX_ROUTES 64
+
+static ioapic_t g_ioapics[ACPI_MAX_IOAPICS];
+static uint32_t g_ioapic_count = 0;
+static ioapic_route_t g_routes[IOAPIC_MAX_ROUTES];
+static int g_route_count = 0;
+static uint32_t g_irq_cpu_cursor = 0;
+
+/* IOREGSEL and IOWIN are a pair, so every access holds this */
+static spinlock_t g_ioapic_lock = SPINLOCK_INIT;
+
+static void ioapic_write(ioapic_t* io, uint32_t reg, uint32_t val) {
+    *(volatile uint32_t*)(io->base) = reg;
+    *(volatile uint32_t*)(io->base + 0x10) = val;
+}
+
+static uint32_t ioapic_read(ioapic_t* io, uint32_t reg) {
+    *(volatile uint32_t*)(io->base) = reg;
+    return *(volatile uint32_t*)(io->base + 0x10);
 }
 
-static uint32_t ioapic_read(uint32_t reg) {
-    *(volatile uint32_t*)(g_ioapic_base) = reg;
-    return *(volatile uint32_t*)(g_ioapic_base + 0x10);
+static ioapic_t* ioapic_for(uint32_t gsi) {
+    for (uint32_t i = 0; i < g_ioapic_count; i++) {
+        ioapic_t* io = &g_ioapics[i];
+        if (gsi >= io->gsi_base && gsi < io->gsi_base + io->count) return io;
+    }
+    return NULL;
 }
 
 void ioapic_init(void) {
-    g_ioapic_base = acpi_get_ioapic_addr() + g_hhdm_offset;
-    if (!g_ioapic_base) return;
-
-    kprintf("APIC: Initializing IOAPIC at %lx\n", g_ioapic_base);
-    
-    uint32_t ver = ioapic_read(0x01);
-    uint32_t max_intr = (ver >> 16) & 0xFF;
-    kprintf("APIC: IOAPIC Version %x, Max Interrupts %d\n", ver & 0xFF, max_intr + 1);
-
-    // Disable all IRQs initially
-    for (uint32_t i = 0; i <= max_intr; i++) {
-        ioapic_set_irq(i, 0, (1 << 16)); // Masked
+    g_ioapic_count = 0;
+    for (uint32_t i = 0; i < acpi_get_ioapic_count(); i++) {
+        ioapic_t* io = &g_ioapics[g_ioapic_count];
+        io->base = acpi_get_ioapic_addr(i) + g_hhdm_offset;
+        io->gsi_base = acpi_get_ioapic_gsi_base(i);
+
+        kprintf("APIC: Initializing IOAPIC at %lx\n", io->base);
+        uint32_t ver = ioapic_read(io, 0x01);
+        io->count = ((ver >> 16) & 0xFF) + 1;
+        kprintf("APIC: IOAPIC Version %x, GSIs %d-%d\n", ver & 0xFF,
+                io->gsi_base, io->gsi_base + io->count - 1);
+
+        // Disable all IRQs initially
+        for (uint32_t pin = 0; pin < io->count; pin++) {
+            ioapic_write(io, 0x10 + pin * 2, IOAPIC_MASKED);
+            ioapic_write(io, 0x11 + pin * 2, 0);
+        }
+        g_ioapic_count++;
+    }
+}
+
+int irq_target_cpu(int cpu) {
+    uint32_t online = smp_get_cpu_count();
+    if (cpu == IRQ_CPU_ANY) {
+        // Round robin, starting with the first AP: the BSP already has
+        // the GUI and the legacy devices
+        return (int)(__atomic_add_fetch(&g_irq_cpu_cursor, 1, __ATOMIC_RELAXED) % online);
+    }
+    if (cpu < 0 || (uint32_t)cpu >= online) return 0;
+    return cpu;
+}
+
+static ioapic_route_t* route_of(uint32_t gsi) {
+    for (int i = 0; i < g_route_count; i++) {
+        if (g_routes[i].gsi == gsi) return &g_routes[i];
+    }
+    return NULL;
+}
+
+static int ioapic_route(uint32_t gsi, uint16_t inti, int level, int active_low,
+                        uint8_t vector, int cpu) {
+    ioapic_t* io = ioapic_for(gsi);
+    if (!io) return -1;
+
+    // The MADT flags win over the bus defaults the caller passed
+    if ((inti & MADT_INTI_POLARITY_MASK) == MADT_INTI_ACTIVE_HIGH) active_low = 0;
+    if ((inti & MADT_INTI_POLARITY_MASK) == MADT_INTI_ACTIVE_LOW) active_low = 1;
+    if ((inti & MADT_INTI_TRIGGER_MASK) == MADT_INTI_EDGE) level = 0;
+    if ((inti & MADT_INTI_TRIGGER_MASK) == MADT_INTI_LEVEL) level = 1;
+
+    cpu = irq_target_cpu(cpu);
+    uint32_t low = vector; // Fixed delivery, physical destination
+    if (active_low) low |= IOAPIC_ACTIVE_LOW;
+    if (level) low |= IOAPIC_LEVEL;
+    uint32_t pin = gsi - io->gsi_base;
+
+    uint64_t flags = spinlock_lock_irqsave(&g_ioapic_lock);
+    ioapic_route_t* r = route_of(gsi);
+    if (!r && g_route_count < IOAPIC_MAX_ROUTES) r = &g_routes[g_route_count++];
+    if (r) {
+        r->gsi = gsi;
+        r->vector = vector;
+        r->cpu = (uint8_t)cpu;
+        r->level = (uint8_t)level;
+        r->active_low = (uint8_t)active_low;
     }
+    ioapic_write(io, 0x11 + pin * 2, smp_cpu_apic_id(cpu) << 24);
+    ioapic_write(io, 0x10 + pin * 2, low);
+    spinlock_unlock_irqrestore(&g_ioapic_lock, flags);
+
+    kprintf("APIC: GSI %d -> vector %x on CPU %d (%s, active %s)\n", gsi, vector, cpu,
+            level ? "level" : "edge", active_low ? "low" : "high");
+    return (int)gsi;
 }
 
-void ioapic_set_irq(uint8_t irq, uint32_t apic_id, uint32_t flags_vector) {
-    uint32_t low = flags_vector;
-    uint32_t high = (apic_id << 24);
+int ioapic_route_isa(uint8_t irq, uint8_t vector, int cpu) {
+    uint16_t inti;
+    uint32_t gsi = acpi_get_isa_irq(irq, &inti);
+    return ioapic_route(gsi, inti, 0, 0, vector, cpu);
+}
+
+int ioapic_route_pci(uint8_t line, uint8_t vector, int cpu) {
+    // Firmware programs the line with the ISA-style number the chipset
+    // routes the pin to, so the ISA overrides apply to it as well
+    uint16_t inti;
+    uint32_t gsi = acpi_get_isa_irq(line, &inti);
+    return ioapic_route(gsi, inti, 1, 1, vector, cpu);
+}
+
+int ioapic_set_affinity(uint32_t gsi, int cpu) {
+    ioapic_t* io = ioapic_for(gsi);
+    ioapic_route_t* r = route_of(gsi);
+    if (!io || !r) return -1;
+
+    cpu = irq_target_cpu(cpu);
+    uint32_t pin = gsi - io->gsi_base;
+    uint64_t flags = spinlock_lock_irqsave(&g_ioapic_lock);
+    ioapic_write(io, 0x11 + pin * 2, smp_cpu_apic_id(cpu) << 24);
+    r->cpu = (uint8_t)cpu;
+    spinlock_unlock_irqrestore(&g_ioapic_lock, flags);
+    return 0;
+}
+
+void ioapic_mask(uint32_t gsi) {
+    ioapic_t* io = ioapic_for(gsi);
+    if (!io) return;
+
+    uint32_t pin = gsi - io->gsi_base;
+    uint64_t flags = spinlock_lock_irqsave(&g_ioapic_lock);
+    ioapic_write(io, 0x10 + pin * 2, ioapic_read(io, 0x10 + pin * 2) | IOAPIC_MASKED);
+    spinlock_unlock_irqrestore(&g_ioapic_lock, flags);
+}
 
-    ioapic_write(0x10 + irq * 2, low);
-    ioapic_write(0x11 + irq * 2, high);
+int ioapic_routes(ioapic_route_t* out, int max) {
+    uint64_t flags = spinlock_lock_irqsave(&g_ioapic_lock);
+    int n = g_route_count < max ? g_route_count : max;
+    for (int i = 0; i < n; i++) out[i] = g_routes[i];
+    spinlock_unlock_irqrestore(&g_ioapic_lock, flags);
+    return n;
 }
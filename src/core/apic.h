@@ -14,6 +14,11 @@
 #define LAPIC_ESR           0x280
 #define LAPIC_ICRL          0x300
 #define LAPIC_ICRH          0x310
+#define LAPIC_ICR_PENDING   (1 << 12)   /* Delivery status */
+#define LAPIC_ICR_INIT      (5 << 8)    /* Delivery modes */
+#define LAPIC_ICR_STARTUP   (6 << 8)
+#define LAPIC_ICR_ASSERT    (1 << 14)
+#define LAPIC_ICR_ALL_BUT_SELF (3 << 18) /* Destination shorthand */
 #define LAPIC_LVT_TMR       0x320
 #define LAPIC_LVT_PERF      0x340
 #define LAPIC_LVT_LINT0     0x350
@@ -23,13 +28,75 @@
 #define LAPIC_TMRCURR       0x390
 #define LAPIC_TMRDIV        0x3E0
 
+/* LVT timer */
+#define LAPIC_TIMER_VECTOR   0xEF
+#define LAPIC_TIMER_ONESHOT  (0 << 17)
+#define LAPIC_TIMER_PERIODIC (1 << 17)
+#define LAPIC_TIMER_TSC_DEADLINE (2 << 17)
+#define LAPIC_LVT_MASKED     (1 << 16)
+
+#define MSR_IA32_TSC_DEADLINE 0x6E0
+#define CPUID_1_ECX_TSC_DEADLINE (1 << 24)
+
 void lapic_init(void);
 void lapic_eoi(void);
 uint32_t lapic_get_id(void);
 void lapic_write(uint32_t reg, uint32_t val);
 uint32_t lapic_read(uint32_t reg);
 
+/* Measure the LAPIC timer against the HPET (BSP, before any AP starts
+   its timer; after clock_init, whose TSC rate TSC-deadline mode uses).
+   All CPUs are assumed to run it alike. Returns 0 on success, -1 if
+   there is no LAPIC timer to use. */
+int lapic_timer_calibrate(void);
+int lapic_timer_has_tsc_deadline(void);
+
+/* Put the calling CPU's timer in one-shot mode, TSC-deadline if the CPU
+   has it, with nothing armed */
+void lapic_timer_init_cpu(void);
+/* Raise LAPIC_TIMER_VECTOR once, delta_ns from now */
+void lapic_timer_arm(uint64_t delta_ns);
+void lapic_timer_disarm(void);
+
+/* Fixed-delivery IPI to one CPU */
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+/* IOAPIC redirection entry, low word */
+#define IOAPIC_ACTIVE_LOW   (1 << 13)
+#define IOAPIC_LEVEL        (1 << 15)
+#define IOAPIC_MASKED       (1 << 16)
+
+/* For the cpu argument below: spread interrupts over the online CPUs */
+#define IRQ_CPU_ANY -1
+
+/* The CPU an interrupt asked for with cpu goes to: the next one round
+   robin for IRQ_CPU_ANY, the BSP if cpu is not online */
+int irq_target_cpu(int cpu);
+
+/* Mask every pin of every IOAPIC the MADT lists */
 void ioapic_init(void);
-void ioapic_set_irq(uint8_t irq, uint32_t apic_id, uint32_t flags_vector);
+
+/* Deliver a legacy interrupt line as vector on cpu and unmask it. For
+   an ISA IRQ the MADT's source override gives the GSI and trigger mode
+   (edge, active high by default); a PCI device's interrupt line is
+   taken as a GSI, level triggered and active low unless overridden.
+   Returns the GSI, or -1 if no IOAPIC serves it. */
+int ioapic_route_isa(uint8_t irq, uint8_t vector, int cpu);
+int ioapic_route_pci(uint8_t line, uint8_t vector, int cpu);
+
+/* Send an already routed GSI to another CPU. Returns 0 or -1. */
+int ioapic_set_affinity(uint32_t gsi, int cpu);
+void ioapic_mask(uint32_t gsi);
+
+typedef struct {
+    uint32_t gsi;
+    uint8_t vector;
+    uint8_t cpu;
+    uint8_t level;
+    uint8_t active_low;
+} ioapic_route_t;
+
+/* Copy up to max routed GSIs into out; returns how many */
+int ioapic_routes(ioapic_route_t* out, int max);
 
 #endif
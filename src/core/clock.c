@@ -0,0 +1,208 @@
+#include "clock.h"
+#include "io.h"
+#include "hpet.h"
+#include "timer.h"
+#include "printf.h"
+
+/*
+   Monotonic clock.
+
+   With an invariant TSC, time is base_ns + (rdtsc() - base_tsc) * mult,
+   mult being nanoseconds per cycle in 32.32 fixed point. The triple is
+   published under a sequence count: the writer makes the count odd,
+   updates, then makes it even again, and a reader retries if it saw an
+   odd count or the count changed under it. x86 keeps loads in order with
+   loads and stores with stores, so compiler barriers are all either side
+   needs for memory; RDTSC is not ordered that way and is fenced.
+
+   The boot calibration is short; once a second has gone by a kernel
+   timer measures the rate again over the whole second and republishes
+   it, starting from the current reading so the clock stays continuous.
+   Those are the only two writers and they never overlap.
+
+   Without an HPET the TSC is calibrated once against PIT channel 2
+   instead and used whether or not it is invariant: it is the only
+   clock left. If that fails too there is no clocksource at all and the
+   clock reads 0; callers that wait on it must also bound their loops.
+
+   All CPUs are assumed to share one TSC, as they do with an invariant
+   TSC on a single board.
+*/
+
+#define CLOCK_CALIBRATE_NS  20000000ULL     /* Boot calibration window */
+#define CLOCK_REFINE_NS     1000000000ULL   /* Second calibration, from boot */
+#define CLOCK_SAMPLE_TRIES  5
+
+/* PIT channel 2, counted down once with the speaker off */
+#define PIT_HZ              1193182ULL
+#define PIT_CALIBRATE_COUNT 23863           /* About 20 ms */
+#define PIT_POLL_LIMIT      10000000        /* Port reads before giving up */
+
+static struct {
+    volatile uint32_t seq;
+    uint64_t base_tsc;
+    uint64_t base_ns;
+    uint64_t mult;
+} g_clock;
+
+static int g_use_tsc = 0;
+static uint64_t g_tsc_khz = 0;
+static uint64_t g_hpet_epoch = 0;
+
+/* Calibration start, measured again by the refinement */
+static uint64_t g_cal_tsc = 0;
+static uint64_t g_cal_hpet = 0;
+static ktimer_t g_refine_timer;
+
+/* A TSC reading and the HPET time at that moment. The HPET read sits
+   between two RDTSCs; the tightest of a few tries is taken, so an
+   interrupt or a slow MMIO exit does not skew the pair. */
+static void clock_sample(uint64_t* tsc, uint64_t* hpet_ns) {
+    uint64_t best = ~0ULL;
+    for (int i = 0; i < CLOCK_SAMPLE_TRIES; i++) {
+        uint64_t t0 = rdtsc();
+        uint64_t ns = hpet_get_nanos();
+        uint64_t t1 = rdtsc();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+            *tsc = t0 + (t1 - t0) / 2;
+            *hpet_ns = ns;
+        }
+    }
+}
+
+static uint64_t tsc_to_ns(uint64_t tsc, uint64_t base_tsc, uint64_t base_ns, uint64_t mult) {
+    // A CPU whose TSC is a hair behind the one that last published
+    if (tsc < base_tsc) tsc = base_tsc;
+    return base_ns + (uint64_t)(((unsigned __int128)(tsc - base_tsc) * mult) >> 32);
+}
+
+static void clock_publish(uint64_t base_tsc, uint64_t base_ns, uint64_t mult) {
+    g_clock.seq++;
+    __asm__ volatile("" ::: "memory");
+    g_clock.base_tsc = base_tsc;
+    g_clock.base_ns = base_ns;
+    g_clock.mult = mult;
+    __asm__ volatile("" ::: "memory");
+    g_clock.seq++;
+}
+
+uint64_t clock_monotonic_ns(void) {
+    if (!g_use_tsc) return g_hpet_epoch ? hpet_get_nanos() - g_hpet_epoch : 0;
+
+    // The TSC is read inside the retry loop, and LFENCE keeps the
+    // recheck from going ahead of it: a reading taken after a newer
+    // triple was published must be converted with that one, or the
+    // stale mult could put it before an earlier result
+    uint32_t seq;
+    uint64_t base_tsc, base_ns, mult, tsc;
+    do {
+        seq = g_clock.seq;
+        __asm__ volatile("" ::: "memory");
+        base_tsc = g_clock.base_tsc;
+        base_ns = g_clock.base_ns;
+        mult = g_clock.mult;
+        tsc = rdtsc();
+        __asm__ volatile("lfence" ::: "memory");
+    } while ((seq & 1) || seq != g_clock.seq);
+
+    return tsc_to_ns(tsc, base_tsc, base_ns, mult);
+}
+
+uint64_t clock_tsc_khz(void) {
+    return g_tsc_khz;
+}
+
+const char* clock_source_name(void) {
+    if (g_use_tsc) return "tsc";
+    return g_hpet_epoch ? "hpet" : "none";
+}
+
+int clock_available(void) {
+    return g_use_tsc || g_hpet_epoch;
+}
+
+/* TSC cycles over PIT_CALIBRATE_COUNT PIT ticks, or 0 if the PIT never
+   reached terminal count */
+static uint64_t clock_pit_cycles(void) {
+    uint8_t gate = inb(0x61);
+    outb(0x61, (gate & ~0x02) | 0x01);      // Gate channel 2 on, speaker off
+    outb(0x43, 0xB0);                       // Channel 2, lo/hi byte, mode 0
+    outb(0x42, PIT_CALIBRATE_COUNT & 0xFF);
+    outb(0x42, PIT_CALIBRATE_COUNT >> 8);
+
+    uint64_t t0 = rdtsc();
+    int polls = 0;
+    while (!(inb(0x61) & 0x20) && polls < PIT_POLL_LIMIT) polls++;
+    uint64_t t1 = rdtsc();
+    outb(0x61, gate);
+    return polls < PIT_POLL_LIMIT ? t1 - t0 : 0;
+}
+
+static void clock_init_pit(void) {
+    uint64_t cycles = clock_pit_cycles();
+    if (!cycles) {
+        kprintf("clock: no HPET and the PIT did not count; no clocksource\n");
+        return;
+    }
+    uint64_t ns = PIT_CALIBRATE_COUNT * 1000000000ULL / PIT_HZ;
+    g_tsc_khz = cycles * 1000000ULL / ns;
+    clock_publish(rdtsc(), 0, (ns << 32) / cycles);
+    g_use_tsc = 1;
+    kprintf("clock: no HPET, TSC at %d kHz from the PIT, clocksource tsc\n",
+            (uint32_t)g_tsc_khz);
+}
+
+/* Rate between the calibration start and (tsc, hpet_ns) */
+static void clock_rate(uint64_t tsc, uint64_t hpet_ns, uint64_t* mult, uint64_t* khz) {
+    uint64_t cycles = tsc - g_cal_tsc;
+    uint64_t ns = hpet_ns - g_cal_hpet;
+    *mult = (ns << 32) / cycles;
+    *khz = cycles * 1000000ULL / ns;
+}
+
+static void clock_refine(ktimer_t* timer) {
+    (void)timer;
+    uint64_t tsc = 0, hpet_ns = 0, mult, khz;
+    clock_sample(&tsc, &hpet_ns);
+    clock_rate(tsc, hpet_ns, &mult, &khz);
+
+    uint64_t now = tsc_to_ns(tsc, g_clock.base_tsc, g_clock.base_ns, g_clock.mult);
+    clock_publish(tsc, now, mult);
+    g_tsc_khz = khz;
+}
+
+void clock_init(void) {
+    g_hpet_epoch = hpet_get_nanos();
+    if (!g_hpet_epoch) {
+        clock_init_pit();
+        return;
+    }
+
+    clock_sample(&g_cal_tsc, &g_cal_hpet);
+    uint64_t tsc = 0, hpet_ns = 0;
+    do {
+        clock_sample(&tsc, &hpet_ns);
+    } while (hpet_ns - g_cal_hpet < CLOCK_CALIBRATE_NS);
+
+    uint64_t mult;
+    clock_rate(tsc, hpet_ns, &mult, &g_tsc_khz);
+
+    uint32_t a, b, c, d;
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    int invariant = 0;
+    if (a >= 0x80000007) {
+        cpuid(0x80000007, 0, &a, &b, &c, &d);
+        invariant = (d & CPUID_80000007_EDX_INVARIANT_TSC) != 0;
+    }
+
+    if (invariant) {
+        clock_publish(g_cal_tsc, g_cal_hpet - g_hpet_epoch, mult);
+        g_use_tsc = 1;
+        ktimer_init(&g_refine_timer, clock_refine, NULL);
+        ktimer_add(&g_refine_timer, CLOCK_REFINE_NS);
+    }
+
+    kprintf("clock: TSC at %d kHz, %s, clocksource %s\n", (uint32_t)g_tsc_khz,
+            invariant ? "invariant" : "not invariant", clock_source_name());
+}
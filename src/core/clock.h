@@ -0,0 +1,38 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "common.h"
+
+/* CPUID 0x80000007 EDX: the TSC runs at a constant rate in all P-, C-
+   and T-states */
+#define CPUID_80000007_EDX_INVARIANT_TSC (1 << 8)
+
+/* Calibrate the TSC against the HPET and pick the clocksource (BSP, after
+   hpet_init). The TSC is used when it is invariant; otherwise, or when it
+   cannot be calibrated, every read goes to the HPET. Without an HPET the
+   TSC is calibrated against the PIT and used regardless. */
+void clock_init(void);
+
+/* Nanoseconds since clock_init. Never goes backwards, and on the TSC path
+   costs an RDTSC and a multiply, with no locks and no MMIO. */
+uint64_t clock_monotonic_ns(void);
+
+/* Calibrated TSC frequency (even when the TSC is not used as the
+   clocksource), 0 if unknown */
+uint64_t clock_tsc_khz(void);
+
+/* Human-readable name of the clocksource in use: "tsc", "hpet" or
+   "none" */
+const char* clock_source_name(void);
+
+/* Whether the clock advances at all. When it does not, clock_monotonic_ns
+   stays at 0 and a wait on it must end on an iteration count instead. */
+int clock_available(void);
+
+/* Iteration cap for a loop that polls a device register until ns have
+   passed on the clock. A register read takes well over 100 ns, so the
+   cap never ends such a wait early; it is the backstop for when the
+   clock does not run. */
+#define CLOCK_POLL_LIMIT(ns) ((uint64_t)(ns) / 100)
+
+#endif
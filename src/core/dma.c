@@ -0,0 +1,136 @@
+#include "dma.h"
+#include "pmm.h"
+#include "../lib/memory.h"
+#include "../drivers/serial.h"
+
+/*
+   DMA buffers come straight from the buddy allocator rather than the
+   kmalloc heap: a buddy block of order n is naturally aligned to
+   2^n pages and contiguous, and PMM_ZONE_DMA32 gives the 4 GiB limit.
+   Pools keep their pages for their whole lifetime, so recycling
+   descriptors does not fragment anything else.
+*/
+
+static unsigned order_for(size_t npages) {
+    unsigned order = 0;
+    while (((size_t)1 << order) < npages) order++;
+    return order;
+}
+
+int dma_alloc(dma_buf_t* buf, size_t size, size_t align, uint32_t flags) {
+    buf->virt = NULL;
+    buf->phys = 0;
+    buf->size = 0;
+    if (size == 0 || (align & (align - 1))) return -1;
+
+    size_t npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    unsigned order = order_for(npages);
+    unsigned align_order = align > PAGE_SIZE ? order_for(align / PAGE_SIZE) : 0;
+    if (align_order > order) order = align_order;
+    if (order > PMM_MAX_ORDER) return -1;
+
+    uintptr_t phys = (flags & DMA_32BIT) ? pmm_alloc_pages_dma32(order)
+                                         : pmm_alloc_pages(order);
+    if (!phys) return -1;
+
+    /* Only the head of the block has to be aligned; give back the tail */
+    size_t excess = ((size_t)1 << order) - npages;
+    if (excess) pmm_free_contig(phys + npages * PAGE_SIZE, excess);
+
+    buf->virt = (void*)PHYS_TO_VIRT(phys);
+    buf->phys = phys;
+    buf->size = size;
+    memset(buf->virt, 0, npages * PAGE_SIZE);
+    return 0;
+}
+
+void dma_free(dma_buf_t* buf) {
+    if (!buf->virt) return;
+    pmm_free_contig(buf->phys, (buf->size + PAGE_SIZE - 1) / PAGE_SIZE);
+    buf->virt = NULL;
+    buf->phys = 0;
+    buf->size = 0;
+}
+
+dma_pool_t* dma_pool_create(const char* name, size_t size, size_t align, uint32_t flags) {
+    if (align < sizeof(void*)) align = sizeof(void*);
+    if (size == 0 || size > PAGE_SIZE || align > PAGE_SIZE || (align & (align - 1))) {
+        return NULL;
+    }
+
+    dma_pool_t* pool = kmalloc_z(sizeof(dma_pool_t));
+    if (!pool) return NULL;
+    pool->name = name;
+    pool->obj_size = (size + align - 1) & ~(align - 1);
+    pool->align = align;
+    pool->flags = flags;
+    spinlock_init(&pool->lock);
+    return pool;
+}
+
+void dma_pool_destroy(dma_pool_t* pool) {
+    if (!pool) return;
+    if (pool->in_use) {
+        serial_printf("dma: pool %s destroyed with %d objects in use\n",
+                      pool->name, (int)pool->in_use);
+    }
+    for (size_t i = 0; i < pool->page_count; i++) {
+        pmm_free_pages(pool->pages[i], 0);
+    }
+    kfree(pool->pages);
+    kfree(pool);
+}
+
+/* Add one page worth of objects to the free list; called with the lock held */
+static int pool_grow(dma_pool_t* pool) {
+    if (pool->page_count == pool->page_capacity) {
+        size_t cap = pool->page_capacity ? pool->page_capacity * 2 : 4;
+        uintptr_t* pages = kmalloc(cap * sizeof(uintptr_t));
+        if (!pages) return -1;
+        if (pool->pages) {
+            memcpy(pages, pool->pages, pool->page_count * sizeof(uintptr_t));
+            kfree(pool->pages);
+        }
+        pool->pages = pages;
+        pool->page_capacity = cap;
+    }
+
+    uintptr_t phys = (pool->flags & DMA_32BIT) ? pmm_alloc_pages_dma32(0)
+                                               : pmm_alloc_pages(0);
+    if (!phys) return -1;
+    pool->pages[pool->page_count++] = phys;
+
+    uint8_t* page = (uint8_t*)PHYS_TO_VIRT(phys);
+    size_t count = PAGE_SIZE / pool->obj_size;
+    for (size_t i = count; i-- > 0;) {
+        void** obj = (void**)(page + i * pool->obj_size);
+        *obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    return 0;
+}
+
+void* dma_pool_alloc(dma_pool_t* pool, uint64_t* phys) {
+    uint64_t flags = spinlock_lock_irqsave(&pool->lock);
+    if (!pool->free_list && pool_grow(pool) != 0) {
+        spinlock_unlock_irqrestore(&pool->lock, flags);
+        return NULL;
+    }
+    void** obj = pool->free_list;
+    pool->free_list = *obj;
+    pool->in_use++;
+    spinlock_unlock_irqrestore(&pool->lock, flags);
+
+    memset(obj, 0, pool->obj_size);
+    if (phys) *phys = VIRT_TO_PHYS(obj);
+    return obj;
+}
+
+void dma_pool_free(dma_pool_t* pool, void* vaddr) {
+    if (!vaddr) return;
+    uint64_t flags = spinlock_lock_irqsave(&pool->lock);
+    *(void**)vaddr = pool->free_list;
+    pool->free_list = vaddr;
+    pool->in_use--;
+    spinlock_unlock_irqrestore(&pool->lock, flags);
+}
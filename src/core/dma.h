@@ -0,0 +1,53 @@
+#ifndef DMA_H
+#define DMA_H
+
+#include "common.h"
+#include "spinlock.h"
+
+/*
+   Memory for bus-master devices. Everything handed out here is
+   physically contiguous, zeroed, mapped write-back in the direct map and
+   never moved, so the physical address can be programmed into a device
+   for as long as the buffer is held.
+*/
+
+/* dma_alloc / dma_pool_create flags */
+#define DMA_32BIT  0x1      /* Entire buffer below 4 GiB */
+
+typedef struct {
+    void* virt;
+    uint64_t phys;
+    size_t size;            /* Bytes requested */
+} dma_buf_t;
+
+/* Allocate whole pages aligned to max(align, PAGE_SIZE); align must be a
+   power of two. Returns 0 on success, -1 if no suitable run is free. */
+int dma_alloc(dma_buf_t* buf, size_t size, size_t align, uint32_t flags);
+void dma_free(dma_buf_t* buf);
+
+/* Fixed-size objects (command tables, descriptor rings, packet buffers)
+   carved from dedicated pages. Objects never straddle a page boundary and
+   freed ones are reused, so the pool only ever grows to its high-water
+   mark and never touches the kmalloc heap. */
+typedef struct dma_pool {
+    const char* name;
+    size_t obj_size;        /* Rounded up to align */
+    size_t align;
+    uint32_t flags;
+    void* free_list;        /* Linked through the first word of each object */
+    uintptr_t* pages;       /* Physical address of every page owned */
+    size_t page_count;
+    size_t page_capacity;
+    size_t in_use;
+    spinlock_t lock;
+} dma_pool_t;
+
+/* size and align must not exceed PAGE_SIZE; align is a power of two */
+dma_pool_t* dma_pool_create(const char* name, size_t size, size_t align, uint32_t flags);
+void dma_pool_destroy(dma_pool_t* pool);
+
+/* Zeroed object, or NULL; its bus address is stored in *phys */
+void* dma_pool_alloc(dma_pool_t* pool, uint64_t* phys);
+void dma_pool_free(dma_pool_t* pool, void* vaddr);
+
+#endif
@@ -1,7 +1,10 @@
 #include "elf.h"
 #include "../lib/memory.h"
 #include "../lib/printf.h"
-#include "paging.h"
+
+/* End of the lower canonical half, where user programs live, less its
+   last page: a SYSCALL there would return to a non-canonical address */
+#define ELF_USER_LIMIT 0x00007FFFFFFFF000ULL
 
 /* Validate ELF header */
 int elf_validate(const void* elf_data) {
@@ -16,9 +19,10 @@ int elf_validate(const void* elf_data) {
         return -1;
     }
     
-    // Check 32-bit
-    if (hdr->e_ident[4] != ELF_CLASS_32) {
-        kprintf("elf: not 32-bit\n");
+    // Check 32-bit i386 or 64-bit x86_64
+    uint8_t elf_class = hdr->e_ident[4];
+    if (elf_class != ELF_CLASS_32 && elf_class != ELF_CLASS_64) {
+        kprintf("elf: not 32 or 64-bit\n");
         return -1;
     }
     
@@ -29,7 +33,8 @@ int elf_validate(const void* elf_data) {
     }
     
     // Check x86
-    if (hdr->e_machine != ELF_MACHINE_386) {
+    uint16_t machine = elf_class == ELF_CLASS_64 ? ELF_MACHINE_X86_64 : ELF_MACHINE_386;
+    if (hdr->e_machine != machine) {
         kprintf("elf: not x86\n");
         return -1;
     }
@@ -37,50 +42,127 @@ int elf_validate(const void* elf_data) {
     return 0;
 }
 
+int elf_is_64bit(const void* elf_data) {
+    return ((const uint8_t*)elf_data)[4] == ELF_CLASS_64;
+}
+
 /* Get entry point */
-uint32_t elf_get_entry(const void* elf_data) {
+uint64_t elf_get_entry(const void* elf_data) {
+    if (elf_is_64bit(elf_data)) return ((const elf64_header_t*)elf_data)->e_entry;
     const elf_header_t* hdr = (const elf_header_t*)elf_data;
     return hdr->e_entry;
 }
 
-/* Load ELF into memory and return entry point */
-int elf_load(const void* elf_data, size_t size) {
+/* The fields elf_load needs from either header format */
+typedef struct {
+    uint64_t phoff;
+    uint16_t phentsize;
+    uint16_t phnum;
+} elf_layout_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t flags;
+    uint64_t offset;
+    uint64_t vaddr;
+    uint64_t filesz;
+    uint64_t memsz;
+} elf_segment_t;
+
+static void elf_layout(const void* elf_data, elf_layout_t* out) {
+    if (elf_is_64bit(elf_data)) {
+        const elf64_header_t* hdr = (const elf64_header_t*)elf_data;
+        out->phoff = hdr->e_phoff;
+        out->phentsize = hdr->e_phentsize;
+        out->phnum = hdr->e_phnum;
+    } else {
+        const elf_header_t* hdr = (const elf_header_t*)elf_data;
+        out->phoff = hdr->e_phoff;
+        out->phentsize = hdr->e_phentsize;
+        out->phnum = hdr->e_phnum;
+    }
+}
+
+static void elf_segment(const void* elf_data, const uint8_t* phdr_data, elf_segment_t* out) {
+    if (elf_is_64bit(elf_data)) {
+        const elf64_program_header_t* phdr = (const elf64_program_header_t*)phdr_data;
+        out->type = phdr->p_type;
+        out->flags = phdr->p_flags;
+        out->offset = phdr->p_offset;
+        out->vaddr = phdr->p_vaddr;
+        out->filesz = phdr->p_filesz;
+        out->memsz = phdr->p_memsz;
+    } else {
+        const elf_program_header_t* phdr = (const elf_program_header_t*)phdr_data;
+        out->type = phdr->p_type;
+        out->flags = phdr->p_flags;
+        out->offset = phdr->p_offset;
+        out->vaddr = phdr->p_vaddr;
+        out->filesz = phdr->p_filesz;
+        out->memsz = phdr->p_memsz;
+    }
+}
+
+/* Describe the PT_LOAD segments as areas of the given address space.
+   Nothing is copied into place: pages fault in from a private copy of the
+   file (and zero-fill past p_filesz) as the program touches them. */
+int elf_load(vm_space_t* space, const void* elf_data, size_t size) {
     if (elf_validate(elf_data) != 0) {
         return -1;
     }
     
-    const elf_header_t* hdr = (const elf_header_t*)elf_data;
     const uint8_t* data = (const uint8_t*)elf_data;
+    elf_layout_t layout;
+    elf_layout(elf_data, &layout);
     
-    kprintf("elf: entry point = 0x%x\n", hdr->e_entry);
-    kprintf("elf: program headers = %d\n", hdr->e_phnum);
+    kprintf("elf: entry point = 0x%x\n", (uint32_t)elf_get_entry(elf_data));
+    kprintf("elf: program headers = %d\n", layout.phnum);
+
+    if (layout.phoff + (uint64_t)layout.phnum * layout.phentsize > size) {
+        kprintf("elf: program headers extend past end of file\n");
+        return -1;
+    }
+
+    vm_image_t* image = vmm_image_create(elf_data, size);
+    if (!image) {
+        kprintf("elf: out of memory\n");
+        return -1;
+    }
     
     // Process program headers
-    for (int i = 0; i < hdr->e_phnum; i++) {
-        const elf_program_header_t* phdr = 
-            (const elf_program_header_t*)(data + hdr->e_phoff + i * hdr->e_phentsize);
+    int ret = 0;
+    for (int i = 0; i < layout.phnum; i++) {
+        elf_segment_t seg;
+        elf_segment(elf_data, data + layout.phoff + i * layout.phentsize, &seg);
         
-        if (phdr->p_type == PT_LOAD) {
-            // Allocate physical memory for this segment and map it
-            // We'll simplify: map vaddr to vaddr in the *current* process directory
-            // Note: Since we switch directory in process_execute, we should probably 
-            // map them here. 
-            uint32_t num_pages = (phdr->p_memsz + 4095) / 4096;
-            for (uint32_t j = 0; j < num_pages; j++) {
-                uint32_t page_vaddr = phdr->p_vaddr + j * 4096;
-                // Allocate a fresh physical page for this process
-                // Use raw aligned to avoid heap corruption from headers
-                void* phys_page = kmalloc_raw_aligned(4096); 
-                paging_map((page_directory_t*)__asm_get_cr3(), page_vaddr, (uint32_t)phys_page, 1);
-            }
-
-            void* dest = (void*)phdr->p_vaddr;
-            memset(dest, 0, phdr->p_memsz);
-            if (phdr->p_filesz > 0) {
-                memcpy(dest, data + phdr->p_offset, phdr->p_filesz);
-            }
+        if (seg.type != PT_LOAD || seg.memsz == 0) continue;
+
+        if (seg.filesz > size || seg.offset > size - seg.filesz || seg.filesz > seg.memsz) {
+            kprintf("elf: segment %d extends past end of file\n", i);
+            ret = -1;
+            break;
+        }
+
+        // ELF64 addresses can be anywhere; keep to the canonical lower half
+        if (seg.vaddr >= ELF_USER_LIMIT || seg.memsz > ELF_USER_LIMIT - seg.vaddr) {
+            kprintf("elf: segment %d outside user memory\n", i);
+            ret = -1;
+            break;
+        }
+
+        uint32_t flags = VMA_READ;
+        if (seg.flags & PF_W) flags |= VMA_WRITE;
+        if (seg.flags & PF_X) flags |= VMA_EXEC;
+
+        if (vmm_map_file(space, seg.vaddr, seg.memsz, flags, image,
+                         seg.vaddr, seg.offset, seg.filesz) != 0) {
+            kprintf("elf: cannot map segment %d\n", i);
+            ret = -1;
+            break;
         }
     }
-    
-    return 0;
+
+    // The areas hold their own references
+    vmm_image_put(image);
+    return ret;
 }
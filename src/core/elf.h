@@ -2,14 +2,17 @@
 #define ELF_H
 
 #include "common.h"
+#include "vmm.h"
 
 /* ELF32 Header */
 #define ELF_MAGIC 0x464C457F  // "\x7FELF"
 
 #define ELF_CLASS_32 1
+#define ELF_CLASS_64 2
 #define ELF_DATA_LSB 1
 #define ELF_TYPE_EXEC 2
 #define ELF_MACHINE_386 3
+#define ELF_MACHINE_X86_64 62
 
 typedef struct {
     uint8_t  e_ident[16];     // Magic number and other info
@@ -28,6 +31,24 @@ typedef struct {
     uint16_t e_shstrndx;      // Section header string table index
 } __attribute__((packed)) elf_header_t;
 
+/* ELF64 Header: 64-bit programs run in long mode proper */
+typedef struct {
+    uint8_t  e_ident[16];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+} __attribute__((packed)) elf64_header_t;
+
 /* Program Header */
 #define PT_NULL    0
 #define PT_LOAD    1
@@ -49,9 +70,22 @@ typedef struct {
     uint32_t p_align;         // Segment alignment
 } __attribute__((packed)) elf_program_header_t;
 
+typedef struct {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+} __attribute__((packed)) elf64_program_header_t;
+
 /* ELF Loader Functions */
 int elf_validate(const void* elf_data);
-uint32_t elf_get_entry(const void* elf_data);
-int elf_load(const void* elf_data, size_t size);
+/* Whether a validated image is ELF64 (x86_64) rather than ELF32 (i386) */
+int elf_is_64bit(const void* elf_data);
+uint64_t elf_get_entry(const void* elf_data);
+int elf_load(vm_space_t* space, const void* elf_data, size_t size);
 
 #endif
@@ -1,4 +1,7 @@
 #include "gdt.h"
+#include "smp.h"
+#include "percpu.h"
+#include "../lib/memory.h"
 
 struct gdt_entry {
     uint16_t limit_low;
@@ -14,8 +17,24 @@ struct gdt_ptr {
     uint64_t base;
 } __attribute__((packed));
 
-static struct gdt_entry gdt[3];
+/* 64-bit TSS: only the stack pointers matter in long mode */
+struct tss {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} __attribute__((packed));
+
+#define GDT_ENTRIES (6 + 2 * SMP_MAX_CPUS)  /* null, 5 segments, a 16-byte TSS descriptor per CPU */
+#define IST_STACK_SIZE 16384
+
+static struct gdt_entry gdt[GDT_ENTRIES];
 static struct gdt_ptr   gp;
+static struct tss       tss[SMP_MAX_CPUS];
+static uint8_t df_stack[IST_STACK_SIZE] __attribute__((aligned(16)));  /* BSP; APs allocate theirs */
 
 extern void gdt_flush(uint64_t);
 
@@ -32,14 +51,40 @@ static void gdt_set_gate(int num, uint32_t base, uint32_t limit,
     gdt[num].access      = access;
 }
 
+/* System descriptor for the TSS; its upper half takes the next slot */
+static void gdt_set_tss(int num, uint64_t base, uint32_t limit) {
+    gdt_set_gate(num, (uint32_t)base, limit, 0x89, 0x00);  // Present, 64-bit TSS (available)
+    uint32_t* high = (uint32_t*)&gdt[num + 1];
+    high[0] = (uint32_t)(base >> 32);
+    high[1] = 0;
+}
+
 void gdt_flush(uint64_t);
  
-void gdt_ap_load(void) {
+void gdt_set_kernel_stack(uint64_t rsp0) {
+    tss[smp_current_cpu()].rsp[0] = rsp0;
+    // SYSCALL does not switch stacks itself; syscall_entry loads this
+    this_cpu()->kernel_stack = rsp0;
+}
+
+/* Give a CPU its own TSS (a busy TSS can't be loaded twice) and load it
+   together with the shared GDT */
+static void gdt_load_cpu(int cpu, uint64_t df_stack_top) {
+    tss[cpu].iomap_base = sizeof(struct tss);
+    tss[cpu].ist[IST_DOUBLE_FAULT - 1] = df_stack_top;
+    gdt_set_tss(6 + 2 * cpu, (uint64_t)&tss[cpu], sizeof(struct tss) - 1);
+
     gdt_flush((uint64_t)&gp);
+    __asm__ __volatile__("ltr %w0" : : "r"((uint16_t)GDT_TSS_CPU(cpu)));
+}
+
+void gdt_init_ap(int cpu) {
+    uint8_t* stack = kmalloc(IST_STACK_SIZE);
+    gdt_load_cpu(cpu, stack ? (uint64_t)(stack + IST_STACK_SIZE) : 0);
 }
 
 void gdt_init(void) {
-    gp.limit = (sizeof(struct gdt_entry) * 3) - 1;
+    gp.limit = (sizeof(struct gdt_entry) * GDT_ENTRIES) - 1;
     gp.base  = (uint64_t)&gdt;
 
     // Null descriptor
@@ -56,5 +101,13 @@ void gdt_init(void) {
     // Do we need L-bit for data? No.
     gdt_set_gate(2, 0, 0xFFFFFFFF, 0x92, 0xCF);
 
-    gdt_flush((uint64_t)&gp);
+    // User segments (DPL 3): 32-bit code for ELF32 programs running in
+    // compatibility mode, data, and 64-bit code
+    gdt_set_gate(3, 0, 0xFFFFFFFF, 0xFA, 0xCF);
+    gdt_set_gate(4, 0, 0xFFFFFFFF, 0xF2, 0xCF);
+    gdt_set_gate(5, 0, 0xFFFFFFFF, 0xFA, 0xAF);
+
+    // TSS: RSP0 is set per process by the scheduler; double faults get a
+    // known-good stack so a kernel stack overflow still reaches the handler
+    gdt_load_cpu(0, (uint64_t)(df_stack + sizeof(df_stack)));
 }
\ No newline at end of file
@@ -3,6 +3,27 @@
 
 #include "common.h"
 
+/* Segment selectors. The user entries are ordered for SYSRET:
+   32-bit code, data, then 64-bit code. */
+#define GDT_KERNEL_CODE  0x08
+#define GDT_KERNEL_DATA  0x10
+#define GDT_USER_CODE32  0x18
+#define GDT_USER_DATA    0x20
+#define GDT_USER_CODE    0x28
+#define GDT_TSS          0x30   /* CPU 0; each CPU has its own descriptor */
+#define GDT_TSS_CPU(cpu) (GDT_TSS + 16 * (cpu))
+
+#define GDT_RPL_USER     3
+
+/* Interrupt stack table slots (1-based, as stored in the IDT) */
+#define IST_DOUBLE_FAULT 1
+
 void gdt_init(void);
+/* Load the GDT and this AP's own TSS (dense CPU index) */
+void gdt_init_ap(int cpu);
+
+/* Stack the calling CPU switches to when an interrupt or SYSCALL arrives
+   in ring 3 */
+void gdt_set_kernel_stack(uint64_t rsp0);
 
-#endif
\ No newline at end of file
+#endif
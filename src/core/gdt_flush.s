@@ -6,12 +6,12 @@ gdt_flush:
     /* Arg1 (RDI) = Pointer to GDT Pointer structure */
     lgdt (%rdi)
 
-    /* Reload Data Segments */
+    /* Reload Data Segments. GS is left alone: loading it would reset
+       the GS base, which holds the per-CPU area (percpu.h). */
     mov $0x10, %ax
     mov %ax, %ds
     mov %ax, %es
     mov %ax, %fs
-    mov %ax, %gs
     mov %ax, %ss
 
     /* Reload CS using Far Return (push stack and lretq) */
@@ -51,5 +51,7 @@ uint64_t hpet_get_nanos(void) {
     if (g_hpet_base == 0 || g_hpet_period == 0) {
         return 0;
     }
-    return (hpet_read(HPET_REG_MAIN_COUNTER_VALUE) * g_hpet_period) / 1000000ULL;
+    // Split so counter * period cannot overflow (it would after a few hours)
+    uint64_t counter = hpet_read(HPET_REG_MAIN_COUNTER_VALUE);
+    return (counter / 1000000ULL) * g_hpet_period + (counter % 1000000ULL) * g_hpet_period / 1000000ULL;
 }
@@ -5,7 +5,7 @@
 struct idt_entry {
     uint16_t base_low;   // Offset 0-15
     uint16_t sel;        // Segment Selector
-    uint8_t  ist;        // Interrupt Stack Table (0 for now)
+    uint8_t  ist;        // Interrupt Stack Table index (0 = current stack)
     uint8_t  flags;      // Type and Attributes
     uint16_t base_mid;   // Offset 16-31
     uint32_t base_high;  // Offset 32-63
@@ -33,6 +33,11 @@ void idt_set_gate(uint8_t num, uint64_t base, uint16_t sel, uint8_t flags) {
     idt[num].reserved  = 0;
 }
 
+/* Run the handler on an interrupt stack table entry (0 = current stack) */
+void idt_set_ist(uint8_t num, uint8_t ist) {
+    idt[num].ist = ist & 0x7;
+}
+
 void idt_ap_load(void) {
     idt_load((uint64_t)&idtp);
 }
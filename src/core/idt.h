@@ -5,5 +5,6 @@
 
 void idt_init(void);
 void idt_set_gate(uint8_t num, uint64_t base, uint16_t sel, uint8_t flags);
+void idt_set_ist(uint8_t num, uint8_t ist);
 
 #endif
\ No newline at end of file
@@ -1,6 +1,15 @@
 #include "isr.h"
 #include "io.h"
 #include "terminal.h"
+#include "process.h"
+#include "vmm.h"
+#include "gdt.h"
+#include "idt.h"
+#include "apic.h"
+#include "timer.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "softirq.h"
 
 #define IDT_FLAG_PRESENT 0x80
 #define IDT_FLAG_INT32   0x0E
@@ -42,6 +51,7 @@ extern void isr29();
 extern void isr30();
 extern void isr31();
 extern void isr80();
+extern void isr_yield();  /* Vector 0x81: kernel-mode yield */
 
 /* IRQ handlers from assembly */
 extern void irq0();
@@ -61,14 +71,46 @@ extern void irq13();
 extern void irq14();
 extern void irq15();
 
-static irq_handler_t irq_handlers[16] = { 0 };
+extern void irq207();  /* Vector 0xEF: LAPIC timer */
+extern void irq208();  /* Vector 0xF0: TLB shootdown IPI */
+extern void irq209();  /* Vector 0xF1: reschedule IPI */
+extern char irq_vector_table[];  /* IRQ_VECTOR_FIRST on, 16 bytes apart */
+
+static irq_handler_t irq_handlers[IRQ_COUNT] = { 0 };
 
 void irq_register_handler(int irq, irq_handler_t handler) {
-    if (irq >= 0 && irq < 16) {
+    if (irq >= 0 && irq < IRQ_COUNT) {
         irq_handlers[irq] = handler;
     }
 }
 
+static spinlock_t g_vector_lock = SPINLOCK_INIT;
+
+static int vector_reserved(int vector) {
+    return vector == 0x80 || vector == SCHED_YIELD_VECTOR;
+}
+
+int irq_alloc_vector(irq_handler_t handler) {
+    int found = -1;
+    uint64_t flags = spinlock_lock_irqsave(&g_vector_lock);
+    for (int vector = IRQ_VECTOR_FIRST; vector <= IRQ_VECTOR_LAST; vector++) {
+        if (!vector_reserved(vector) && !irq_handlers[vector - 32]) {
+            irq_handlers[vector - 32] = handler;
+            found = vector;
+            break;
+        }
+    }
+    spinlock_unlock_irqrestore(&g_vector_lock, flags);
+    return found;
+}
+
+void irq_free_vector(int vector) {
+    if (vector < IRQ_VECTOR_FIRST || vector > IRQ_VECTOR_LAST || vector_reserved(vector)) return;
+    uint64_t flags = spinlock_lock_irqsave(&g_vector_lock);
+    irq_handlers[vector - 32] = NULL;
+    spinlock_unlock_irqrestore(&g_vector_lock, flags);
+}
+
 #include "serial.h"
 
 static const char* exception_messages[] = {
@@ -81,8 +123,35 @@ static const char* exception_messages[] = {
     "Reserved", "Reserved", "Reserved", "Reserved", "Reserved", "Reserved"
 };
 
-/* Called by common ISR stub */
-void isr_handler(struct registers* regs) {
+/* Forward declaration from process.c */
+struct registers* scheduler_schedule(struct registers* regs);
+
+/* Called by common ISR stub; returns the frame to resume */
+struct registers* isr_handler(struct registers* regs) {
+    // A process blocking in the kernel (scheduler_sleep)
+    if (regs->int_no == SCHED_YIELD_VECTOR) {
+        return scheduler_schedule(regs);
+    }
+
+    // Page faults inside a process's areas are demand paging, not errors
+    if (regs->int_no == 14) {
+        percpu_inc(PERCPU_STAT_PAGE_FAULTS);
+        uint64_t cr2;
+        __asm__ __volatile__("mov %%cr2, %0" : "=r"(cr2));
+        if (current_process && vmm_handle_fault(current_process->vm, cr2, regs->err_code) == 0) {
+            return regs;
+        }
+    }
+
+    // A fault in ring 3 only takes down the process that caused it
+    if ((regs->cs & 3) && current_process && current_process->vm) {
+        serial_printf("process: pid=%d (%s) killed by exception %d (%s) at RIP 0x%lx\n",
+                      current_process->pid, current_process->name, (int)regs->int_no,
+                      regs->int_no < 32 ? exception_messages[regs->int_no] : "Unknown", regs->rip);
+        process_exit(current_process, -1);
+        return scheduler_schedule(regs);
+    }
+
     static int isr_panic_active = 0;
     if (isr_panic_active) {
         // Recursive fault during panic! Halt immediately to avoid QEMU shutdown.
@@ -112,26 +181,53 @@ void isr_handler(struct registers* regs) {
     for (;;);
 }
 
-/* Forward declaration from process.c */
-struct registers* scheduler_schedule(struct registers* regs);
-
-/* Called by common IRQ stub */
-struct registers* irq_handler(struct registers* regs) {
+static void irq_dispatch(struct registers* regs) {
     int irq = regs->int_no - 32;
 
-    if (irq >= 0 && irq < 16 && irq_handlers[irq]) {
+    if (irq >= 0 && irq < IRQ_COUNT && irq_handlers[irq]) {
         irq_handlers[irq](regs);
     }
 
     /* Send EOI to LAPIC */
-    extern void lapic_eoi(void);
     lapic_eoi();
+}
 
-    // If timer interrupt, call scheduler
-    if (irq == 0) {
-        return scheduler_schedule(regs);
+static struct registers* irq_schedule(percpu_t* pc, struct registers* regs) {
+    int irq = regs->int_no - 32;
+
+    // Scheduler tick: each CPU's own LAPIC timer, or the PIT on the BSP
+    // when there is none
+    if (regs->int_no == LAPIC_TIMER_VECTOR || irq == 0) {
+        regs = timer_interrupt(regs);
+    } else if (regs->int_no == TIMER_RESCHED_VECTOR) {
+        regs = timer_resched_interrupt(regs);
     }
 
+    // A switch a softirq put off, unless we are inside one ourselves
+    if (pc->need_resched && !pc->softirq_active) {
+        pc->need_resched = 0;
+        regs = scheduler_schedule(regs);
+    }
+    return regs;
+}
+
+/* Called by common IRQ stub. The device handler runs with interrupts
+   off and should only queue work; what it queued runs next, with them
+   back on (softirq.c), before the tick or any task switch. The nesting
+   depth goes back down on this CPU even when the frame returned belongs
+   to another task. */
+struct registers* irq_handler(struct registers* regs) {
+    percpu_t* pc = this_cpu();
+    pc->irq_depth++;
+    percpu_inc(PERCPU_STAT_IRQS);
+    irq_dispatch(regs);
+    pc->irq_depth--;
+
+    if (pc->softirq_pending && !pc->softirq_active) softirq_run();
+
+    pc->irq_depth++;
+    regs = irq_schedule(pc, regs);
+    pc->irq_depth--;
     return regs;
 }
 
@@ -172,10 +268,19 @@ void isr_install(void) {
     idt_set_gate(30, (uint64_t)isr30, sel, flags);
     idt_set_gate(31, (uint64_t)isr31, sel, flags);
 
+    // Double faults usually mean a blown stack: run on a known-good one
+    idt_set_ist(8, IST_DOUBLE_FAULT);
+
+    // Blocking in the kernel; ring 0 only
+    idt_set_gate(SCHED_YIELD_VECTOR, (uint64_t)isr_yield, sel, flags);
+
     // Syscall: Vector 0x80, User Mode (Ring 3)
     idt_set_gate(0x80, (uint64_t)isr80, sel, flags | 0x60);
 }
 
+/* Device interrupts come through the IOAPIC. The PICs are remapped
+   anyway, so a spurious IRQ 7 or 15 lands on 0x27/0x2F rather than on
+   an exception vector, and then masked for good. */
 static void pic_remap(void) {
     /* Remap PIC 1 to 0x20-0x27, PIC 2 to 0x28-0x2F */
     outb(0x20, 0x11);
@@ -186,8 +291,8 @@ static void pic_remap(void) {
     outb(0xA1, 0x02);
     outb(0x21, 0x01);
     outb(0xA1, 0x01);
-    outb(0x21, 0x0);
-    outb(0xA1, 0x0);
+    outb(0x21, 0xFF);
+    outb(0xA1, 0xFF);
 }
 
 void irq_install(void) {
@@ -212,4 +317,15 @@ void irq_install(void) {
     idt_set_gate(45, (uint64_t)irq13, sel, flags);
     idt_set_gate(46, (uint64_t)irq14, sel, flags);
     idt_set_gate(47, (uint64_t)irq15, sel, flags);
+
+    // Device vectors; isr_install has claimed the syscall and yield gates
+    for (int vector = IRQ_VECTOR_FIRST; vector <= IRQ_VECTOR_LAST; vector++) {
+        if (vector_reserved(vector)) continue;
+        idt_set_gate(vector, (uint64_t)(irq_vector_table + (vector - IRQ_VECTOR_FIRST) * 16), sel, flags);
+    }
+
+    // Local timer and inter-processor interrupts
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint64_t)irq207, sel, flags);
+    idt_set_gate(0xF0, (uint64_t)irq208, sel, flags);
+    idt_set_gate(TIMER_RESCHED_VECTOR, (uint64_t)irq209, sel, flags);
 }
\ No newline at end of file
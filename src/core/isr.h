@@ -14,7 +14,21 @@ struct registers {
 void isr_install(void);
 void irq_install(void);
 
+/* IRQ numbers are vectors minus 32, so IPIs and other high vectors can be
+   registered the same way as the legacy lines */
+#define IRQ_COUNT (256 - 32)
+
 typedef void (*irq_handler_t)(struct registers* regs);
 void irq_register_handler(int irq, irq_handler_t handler);
 
+/* Vectors handed out to devices; 0xEF and up are the LAPIC timer and
+   IPIs, and the syscall and yield gates in between are never given out */
+#define IRQ_VECTOR_FIRST 0x30
+#define IRQ_VECTOR_LAST  0xEE
+
+/* Take a free device vector and install handler on it. Returns the
+   vector, or -1 when none is left. */
+int irq_alloc_vector(irq_handler_t handler);
+void irq_free_vector(int vector);
+
 #endif
\ No newline at end of file
@@ -6,12 +6,47 @@
 .extern isr_handler
 .extern irq_handler
 .extern syscall_handler
+.extern scheduler_finish_switch
 
 /* Load IDT pointer */
 idt_load:
     lidt (%rdi)
     ret
 
+/* Resume the frame in RAX. If it is not the one we entered with, a
+   task switch happened: now that the old task's kernel stack is no
+   longer in use, let the scheduler release it to other CPUs. */
+.macro SWITCH_FRAME
+    movq %rax, %rsp
+    cmpq %rax, %rbx
+    je 1f
+    movq %rax, %rbx
+    andq $-16, %rsp
+    call scheduler_finish_switch
+    movq %rbx, %rsp
+1:
+.endm
+
+/* Kernel code runs with GS base on the per-CPU area (percpu.h). When
+   an interrupt arrives from ring 3, swap it in on entry and swap the
+   user's back on the way out; nested entries from ring 0 leave it. The
+   CS checked is the one in the interrupt frame, at 24(%rsp) once the
+   stub has pushed int_no and the error code, at 8(%rsp) after they are
+   dropped again. */
+.macro SWAPGS_ENTRY
+    testb $3, 24(%rsp)
+    jz 9f
+    swapgs
+9:
+.endm
+
+.macro SWAPGS_EXIT
+    testb $3, 8(%rsp)
+    jz 9f
+    swapgs
+9:
+.endm
+
 /* Macro for exception without error code */
 .macro ISR_NOERR num
 .global isr\num
@@ -73,6 +108,15 @@ isr80:
     pushq $80
     jmp syscall_common_stub
 
+/* Kernel-mode yield (SCHED_YIELD_VECTOR): a process that is going to
+   sleep switches away through the same path as an exception */
+.global isr_yield
+isr_yield:
+    cli
+    pushq $0
+    pushq $0x81
+    jmp isr_common_stub
+
 /* Macro for IRQ */
 .macro IRQ num
 .global irq\num
@@ -101,8 +145,30 @@ IRQ 13
 IRQ 14
 IRQ 15
 
+/* Device vectors 0x30-0xEE (irq_alloc_vector), one 16-byte entry each
+   starting at irq_vector_table. 0x80 and 0x81 get entries too but their
+   gates point elsewhere. */
+.global irq_vector_table
+.align 16
+irq_vector_table:
+.set vector, 0x30
+.rept 0xEF - 0x30
+    .align 16
+    cli
+    pushq $0
+    pushq $vector
+    jmp irq_common_stub
+    .set vector, vector + 1
+.endr
+
+/* Local APIC timer and inter-processor interrupts */
+IRQ 207   /* 0xEF: LAPIC timer */
+IRQ 208   /* 0xF0: TLB shootdown */
+IRQ 209   /* 0xF1: reschedule */
+
 /* Common ISR Stub */
 isr_common_stub:
+    SWAPGS_ENTRY
     pushq %rax
     pushq %rcx
     pushq %rdx
@@ -122,6 +188,7 @@ isr_common_stub:
     pushq %rax
 
     movq %rsp, %rdi
+    movq %rsp, %rbx   /* Entry frame; RBX is restored from the frame */
     
     /* Align stack to 16 bytes for C call */
     movq %rsp, %rax
@@ -130,11 +197,13 @@ isr_common_stub:
     
     call isr_handler
     
-    /* Restore stack */
-    popq %rsp
+    /* isr_handler returns the frame to resume: the faulting one, or
+       another process's if the faulting process was killed */
+    SWITCH_FRAME
 
     popq %rax
-    /* mov %ax, %ds */
+    movw %ax, %ds
+    movw %ax, %es
     
     popq %r15
     popq %r14
@@ -153,10 +222,12 @@ isr_common_stub:
     popq %rax
     
     addq $16, %rsp
+    SWAPGS_EXIT
     iretq
 
 /* Common IRQ Stub */
 irq_common_stub:
+    SWAPGS_ENTRY
     pushq %rax
     pushq %rcx
     pushq %rdx
@@ -176,6 +247,7 @@ irq_common_stub:
     pushq %rax
 
     movq %rsp, %rdi
+    movq %rsp, %rbx   /* Entry frame; RBX is restored from the frame */
     
     /* Align stack to 16 bytes for C call */
     movq %rsp, %rax
@@ -188,9 +260,11 @@ irq_common_stub:
        We need to carefully restore the stack pointer.
        If task switching occurred, the returned RAX is the new RSP.
     */
-    movq %rax, %rsp
+    SWITCH_FRAME
 
     popq %rax
+    movw %ax, %ds
+    movw %ax, %es
     popq %r15
     popq %r14
     popq %r13
@@ -208,10 +282,12 @@ irq_common_stub:
     popq %rax
     
     addq $16, %rsp
+    SWAPGS_EXIT
     iretq
 
 /* Common Syscall Stub */
 syscall_common_stub:
+    SWAPGS_ENTRY
     pushq %rax
     pushq %rcx
     pushq %rdx
@@ -232,6 +308,7 @@ syscall_common_stub:
     pushq %rax
 
     movq %rsp, %rdi
+    movq %rsp, %rbx   /* Entry frame; RBX is restored from the frame */
     
     /* Align stack to 16 bytes for C call */
     movq %rsp, %rax
@@ -240,14 +317,15 @@ syscall_common_stub:
     
     call syscall_handler
     
-    popq %rsp
-    /* syscall_handler returned new ESP in 32-bit.
-       Here it should return new RSP?
-       
-       Let's assume for now no task switching in syscall
-    */
+    /* As for IRQs, a different frame is returned when the calling
+       process exits. syscall_entry joins here with RAX and RBX set up
+       the same way. */
+syscall_resume:
+    SWITCH_FRAME
     
     popq %rax
+    movw %ax, %ds
+    movw %ax, %es
     popq %r15
     popq %r14
     popq %r13
@@ -265,4 +343,98 @@ syscall_common_stub:
     popq %rax
     
     addq $16, %rsp
-    iretq
\ No newline at end of file
+    SWAPGS_EXIT
+    iretq
+
+/* SYSCALL entry (LSTAR) for 64-bit programs. The number is in RAX and
+   the arguments in RDI, RSI, RDX, R10, R8; the result comes back in RAX.
+   As in a function call, RCX, RDX, RSI, RDI and R8-R11 are clobbered.
+
+   Only what the CPU or the syscall needs goes into the frame: the iret
+   part, RAX, and the arguments in the slots syscall_handler reads for
+   int 0x80 (RBX, RCX, RDX, RSI, RDI). The callee-saved registers still
+   hold the user's values when syscall_handler returns, so the common
+   case leaves through SYSRET without touching them. Only when the
+   handler switched tasks, and this frame will be resumed later by
+   iretq, are they written into it. */
+.set PERCPU_KERNEL_STACK, 16        /* percpu.h */
+.set PERCPU_USER_RSP, 24
+.set USER_CS, 0x2B                  /* GDT_USER_CODE | 3 */
+.set USER_DS, 0x23                  /* GDT_USER_DATA | 3 */
+
+.global syscall_entry
+syscall_entry:
+    swapgs
+    movq %rsp, %gs:PERCPU_USER_RSP
+    movq %gs:PERCPU_KERNEL_STACK, %rsp
+
+    pushq $USER_DS                  /* ss */
+    pushq %gs:PERCPU_USER_RSP       /* rsp */
+    pushq %r11                      /* rflags */
+    pushq $USER_CS                  /* cs */
+    pushq %rcx                      /* rip */
+    pushq $0                        /* err_code */
+    pushq $80                       /* int_no, as isr80 */
+    pushq %rax                      /* rax: number */
+    pushq %rsi                      /* rcx: second argument */
+    pushq %rdx                      /* rdx: third */
+    pushq %rdi                      /* rbx: first */
+    subq $8, %rsp                   /* rbp */
+    pushq %r10                      /* rsi: fourth */
+    pushq %r8                       /* rdi: fifth */
+    subq $64, %rsp                  /* r8-r15 */
+    pushq $USER_DS                  /* ds */
+
+    /* The 184-byte frame leaves RSP 8 off the 16-byte aligned stack top */
+    movq %rsp, %rdi
+    subq $8, %rsp
+    call syscall_handler
+    addq $8, %rsp
+
+    cmpq %rax, %rsp
+    jne syscall_entry_slow
+
+    /* SYSRET to a non-canonical RIP would fault in ring 0 */
+    movq 144(%rsp), %rcx            /* rip */
+    movq %rcx, %r11
+    sarq $47, %r11
+    jnz syscall_entry_slow
+
+    movq 160(%rsp), %r11            /* rflags */
+    movq 120(%rsp), %rax            /* result */
+    xorl %edx, %edx                 /* Leave no kernel values behind */
+    xorl %esi, %esi
+    xorl %edi, %edi
+    xorl %r8d, %r8d
+    xorl %r9d, %r9d
+    xorl %r10d, %r10d
+    movq 168(%rsp), %rsp
+    swapgs
+    sysretq
+
+/* Complete the frame so iretq can resume it, then leave the way
+   int 0x80 does */
+syscall_entry_slow:
+    movq %r15, 8(%rsp)
+    movq %r14, 16(%rsp)
+    movq %r13, 24(%rsp)
+    movq %r12, 32(%rsp)
+    movq $0, 40(%rsp)               /* r11 */
+    movq $0, 48(%rsp)               /* r10 */
+    movq $0, 56(%rsp)               /* r9 */
+    movq $0, 64(%rsp)               /* r8 */
+    movq $0, 72(%rsp)               /* rdi */
+    movq $0, 80(%rsp)               /* rsi */
+    movq %rbp, 88(%rsp)
+    movq %rbx, 96(%rsp)
+    movq $0, 104(%rsp)              /* rdx */
+    movq $0, 112(%rsp)              /* rcx */
+    movq %rsp, %rbx
+    jmp syscall_resume
+
+/* SYSCALL from compatibility mode (CSTAR; AMD only, Intel raises #UD).
+   ELF32 programs use int 0x80; refuse without touching the stack. */
+.global syscall_entry_compat
+syscall_entry_compat:
+    movl $-1, %eax
+    sysretl
@@ -12,7 +12,9 @@
 #include "acpi.h"
 #include "apic.h"
 #include "hpet.h"
+#include "clock.h"
 #include "smp.h"
+#include "percpu.h"
 
 #include "../drivers/pci.h"
 #include "../drivers/nvme.h"
@@ -24,9 +26,15 @@
 #include "../gui/gui.h"
 #include "../drivers/serial.h"
 #include "paging.h"
+#include "pmm.h"
 #include "process.h"
+#include "tlb.h"
+#include "timer.h"
+#include "softirq.h"
+#include "syscall.h"
 #include "vesa.h"
 #include "limine.h"
+#include "../lib/memory.h"
 
 // Set the base revision to 2, this is recommended as this is the latest
 // revision described by the Limine boot protocol specification.
@@ -75,6 +83,13 @@ static volatile struct limine_memmap_request memmap_request = {
     .revision = 0
 };
 
+// The Limine kernel address request, needed to map the kernel image.
+__attribute__((used, section(".requests")))
+static volatile struct limine_kernel_address_request kernel_address_request = {
+    .id = LIMINE_KERNEL_ADDRESS_REQUEST,
+    .revision = 0
+};
+
 uint64_t g_hhdm_offset = 0;
 
 extern uint8_t _binary_ext2_img_start[];
@@ -136,6 +151,9 @@ static void tty_key_handler(char c) {
 }
 
 void kernel_main(void) {
+  // Everything from the allocators on asks which CPU it is on
+  percpu_init_cpu(0, 0);
+
   if (hhdm_request.response != NULL) {
     g_hhdm_offset = hhdm_request.response->offset;
   } else {
@@ -144,41 +162,22 @@ void kernel_main(void) {
     for(;;) __asm__("hlt");
   }
 
-  // Initialize heap using first large usable memory chunk AS EARLY AS POSSIBLE
-  int heap_initialized = 0;
-  size_t total_usable_mem_kb = 0;
-  
-  if (memmap_request.response != NULL) {
-    for (uint64_t i = 0; i < memmap_request.response->entry_count; i++) {
-        struct limine_memmap_entry *entry = memmap_request.response->entries[i];
-        if (entry->type == LIMINE_MEMMAP_USABLE || entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) {
-            total_usable_mem_kb += (entry->length / 1024);
-        }
-        
-        if (entry->type == LIMINE_MEMMAP_USABLE && entry->length >= 1*1024*1024 && !heap_initialized) {
-            uintptr_t heap_base = entry->base + g_hhdm_offset;
-            heap_initialized = 1;
-            // memory_init called after the loop to ensure we have total_usable_mem_kb computed
-            extern void memory_init(uintptr_t base, size_t total_kb);
-            memory_init(heap_base, 0); // Temporary, we will fix this logic below
-        }
-    }
-  }
-
-  // Proper heap init call (since memory_init now takes total RAM)
-  if (heap_initialized) {
-      extern void memory_init(uintptr_t base, size_t total_kb);
-      extern uintptr_t get_heap_base(void);
-      memory_init(get_heap_base(), total_usable_mem_kb); 
-  }
-
   serial_init();
-  
-  // Debug: Show where heap is
-  extern uintptr_t get_heap_base(void);
   serial_printf("hzOS: Kernel Main (Limine UEFI Mode)\n");
   serial_printf("Memory: HHDM offset = %p\n", (void*)g_hhdm_offset);
-  serial_printf("Memory: Heap base = %p\n", (void*)get_heap_base());
+
+  // Hand every usable region to the page allocator AS EARLY AS POSSIBLE
+  if (memmap_request.response != NULL) {
+    pmm_init(memmap_request.response->entries, memmap_request.response->entry_count);
+    memory_init();
+
+    // Move off the bootloader's page tables onto our own direct map
+    if (kernel_address_request.response != NULL) {
+      paging_init(memmap_request.response->entries, memmap_request.response->entry_count,
+                  kernel_address_request.response->physical_base,
+                  kernel_address_request.response->virtual_base);
+    }
+  }
 
   gdt_init();
 
@@ -191,8 +190,8 @@ void kernel_main(void) {
     vesa_init_limine(fb);
   }
 
-  // paging_init(); // Disabled for 64-bit port (using identity map from boot_64.s)
   terminal_init();
+  printf_init();
   kprintf("hzOS: paging enabled and console initialized\n");
 
   kprintf("acpi: initializing...\n");
@@ -205,8 +204,14 @@ void kernel_main(void) {
   extern void acpi_init_with_rsdp(void*);
   acpi_init_with_rsdp(rsdp_addr);
 
+  // Limine's responses and page tables are no longer referenced
+  if (paging_kernel_directory()) {
+    pmm_reclaim_bootloader_memory();
+  }
+
   kprintf("hpet: initializing...\n");
   hpet_init();
+  clock_init();
 
   kprintf("apic: initializing...\n");
   lapic_init();
@@ -214,9 +219,8 @@ void kernel_main(void) {
 
   kprintf("idt: initializing interrupts...\n");
   idt_init();
-
-  // kprintf("smp: initializing...\n");
-  // smp_init();
+  syscall_init();
+  tlb_init();
 
   kprintf("fs: initializing dynamic filesystem...\n");
   fs_init();
@@ -226,14 +230,21 @@ void kernel_main(void) {
   kprintf("process: initializing process manager...\n");
   process_init();
 
+  // Calibrates the LAPIC timer the APs tick with too
+  kprintf("scheduler: starting timer...\n");
+  timer_init(SCHEDULER_HZ);
+
+  // APs join the scheduler as soon as they are up
+  kprintf("smp: initializing...\n");
+  smp_init();
+
+  // Bottom halves: drivers below queue their interrupt work here
+  softirq_init();
+
   kprintf("input: initializing keyboard and mouse...\n");
   keyboard_init();
   mouse_init();
 
-  kprintf("scheduler: starting timer...\n");
-  extern void timer_init(uint32_t frequency);
-  timer_init(20); // 20Hz scheduler - ultra stable
-
   kprintf("pci: scanning bus...\n");
   pci_init();
 
@@ -1,35 +1,407 @@
 #include "paging.h"
+#include "pmm.h"
+#include "io.h"
+#include "tlb.h"
 #include "../lib/memory.h"
 #include "../lib/printf.h"
+#include "../drivers/serial.h"
 
-/* 
-   Placeholder for 64-bit Paging.
-   Currently relies on the Identity Map set up by boot_64.s
-   and shares it across all processes.
+/*
+   4-level paging.
+
+   The kernel PML4 holds a direct map of physical memory at the HHDM
+   offset (the same layout Limine uses) built from 1 GiB pages where the
+   CPU supports them and 2 MiB pages otherwise. The kernel image is also
+   mapped at its link address; like every paging_map_range mapping, it
+   uses 2 MiB pages where the alignment allows and 4 KiB ones elsewhere.
+   All 256 kernel-half PDPTs are allocated up front, so address spaces
+   can share the kernel half by copying PML4 entries and never go stale.
 */
 
-static page_directory_t* kernel_pml4 = 0;
+#define MSR_EFER  0xC0000080
+#define EFER_NXE  (1ULL << 11)
+#define MSR_PAT   0x277
+#define CR4_PGE   (1ULL << 7)
+#define CR0_WP    (1ULL << 16)
+
+/* PAT memory types */
+#define PAT_UC   0x00
+#define PAT_WC   0x01
+#define PAT_WT   0x04
+#define PAT_WB   0x06
+#define PAT_UCM  0x07  /* UC- */
+
+/* Power-on layout for entries 0-3 and 5-7; entry 4 becomes write-combining */
+#define PAT_VALUE ((uint64_t)PAT_WB | ((uint64_t)PAT_WT << 8) | ((uint64_t)PAT_UCM << 16) | \
+                   ((uint64_t)PAT_UC << 24) | ((uint64_t)PAT_WC << 32) | ((uint64_t)PAT_WT << 40) | \
+                   ((uint64_t)PAT_UCM << 48) | ((uint64_t)PAT_UC << 56))
+
+extern uint8_t _end[];
+
+static uint64_t kernel_pml4 = 0;
+static int g_have_1g = 0;
+static int g_have_nx = 0;
+static int g_have_pat = 0;
+static uint64_t g_pte_mask = ~0ULL;   /* Strips PTE_NX on CPUs without NX */
+
+static inline uint64_t* table_virt(uint64_t entry) {
+    return (uint64_t*)PHYS_TO_VIRT(entry & PTE_ADDR_MASK);
+}
+
+static inline int pt_index(uint64_t vaddr, int level) {
+    return (int)((vaddr >> (12 + 9 * (level - 1))) & 511);
+}
+
+/* Bytes covered by one entry at the given level (1 = PT ... 4 = PML4) */
+static inline uint64_t level_size(int level) {
+    return 1ULL << (12 + 9 * (level - 1));
+}
+
+static inline void invlpg(uint64_t vaddr) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
+/* Kernel-half changes are visible in every address space; user-half ones
+   only matter if the directory is the one currently loaded. */
+static void invalidate(uint64_t root, uint64_t vaddr) {
+    if (vaddr >= KERNEL_HALF_BASE || root == (__asm_get_cr3() & PTE_ADDR_MASK)) {
+        invlpg(vaddr);
+    }
+}
+
+static uint64_t alloc_table(void) {
+    uintptr_t phys = pmm_alloc_pages(0);
+    if (phys) memset((void*)PHYS_TO_VIRT(phys), 0, PAGE_SIZE);
+    return phys;
+}
+
+/* Intermediate entries are permissive; leaves carry the real protection */
+static inline uint64_t table_flags(uint64_t vaddr) {
+    return PTE_PRESENT | PTE_WRITABLE | (vaddr < KERNEL_HALF_BASE ? PTE_USER : 0);
+}
 
-void paging_init(void) {
-    kprintf("paging64: using bootloader identity map.\n");
-    // We don't overwrite the page tables here yet.
+/* Leaf flags are given for 4 KiB pages: move the PAT bit for huge leaves */
+static inline uint64_t huge_flags(uint64_t flags) {
+    uint64_t f = flags & ~PTE_PAT;
+    if (flags & PTE_PAT) f |= PTE_PAT_HUGE;
+    return f | PTE_HUGE;
+}
+
+/* Replace a huge leaf with a table of 512 smaller leaves with the same
+   frames and attributes. No flush is needed: translations don't change. */
+static int split_huge(uint64_t* entry, int level) {
+    uint64_t table = alloc_table();
+    if (!table) return -1;
+
+    uint64_t old = *entry;
+    uint64_t child = level_size(level - 1);
+    uint64_t base = old & PTE_ADDR_MASK & ~(level_size(level) - 1);
+    int pat = (old & PTE_PAT_HUGE) != 0;
+    uint64_t flags = old & ~PTE_ADDR_MASK & ~PTE_HUGE;
+    if (level - 1 > 1) flags |= PTE_HUGE | (pat ? PTE_PAT_HUGE : 0);
+    else if (pat) flags |= PTE_PAT;
+
+    uint64_t* t = (uint64_t*)PHYS_TO_VIRT(table);
+    for (int i = 0; i < 512; i++) {
+        t[i] = (base + i * child) | flags;
+    }
+    *entry = table | PTE_PRESENT | PTE_WRITABLE | (old & PTE_USER);
+    return 0;
+}
+
+/* Entry for vaddr at the target level, creating tables and splitting huge
+   leaves above it as needed. NULL if out of memory (or absent, !create). */
+static uint64_t* walk(uint64_t root, uint64_t vaddr, int target, int create) {
+    uint64_t* table = (uint64_t*)PHYS_TO_VIRT(root);
+    for (int level = 4; level > target; level--) {
+        uint64_t* e = &table[pt_index(vaddr, level)];
+        if (!(*e & PTE_PRESENT)) {
+            if (!create) return NULL;
+            uint64_t t = alloc_table();
+            if (!t) return NULL;
+            *e = t | table_flags(vaddr);
+        } else if (*e & PTE_HUGE) {
+            if (split_huge(e, level) != 0) return NULL;
+        }
+        table = table_virt(*e);
+    }
+    return &table[pt_index(vaddr, target)];
+}
+
+/* Read-only walk: returns the leaf (or the first non-present entry) and
+   the level it sits at. */
+static uint64_t* lookup(uint64_t root, uint64_t vaddr, int* level_out) {
+    uint64_t* table = (uint64_t*)PHYS_TO_VIRT(root);
+    for (int level = 4; level >= 1; level--) {
+        uint64_t* e = &table[pt_index(vaddr, level)];
+        if (level == 1 || !(*e & PTE_PRESENT) || (*e & PTE_HUGE)) {
+            *level_out = level;
+            return e;
+        }
+        table = table_virt(*e);
+    }
+    return NULL;
+}
+
+void paging_init_cpu(void) {
+    if (g_have_nx) wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+
+    uint64_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4 | CR4_PGE));
+    tlb_init_cpu();
+
+    // Make ring 0 honour read-only user pages so kernel writes into a
+    // copy-on-write page fault like user writes do
+    uint64_t cr0;
+    __asm__ __volatile__("mov %%cr0, %0" : "=r"(cr0));
+    __asm__ __volatile__("mov %0, %%cr0" : : "r"(cr0 | CR0_WP));
+
+    if (g_have_pat) {
+        // Nothing maps PAT entry 4 yet, so no stale cache lines can exist
+        // with the new type; flush anyway as the SDM recommends.
+        __asm__ __volatile__("wbinvd" : : : "memory");
+        wrmsr(MSR_PAT, PAT_VALUE);
+        tlb_flush_all();
+    }
+}
+
+void paging_init(struct limine_memmap_entry** entries, uint64_t count,
+                 uint64_t kernel_phys, uint64_t kernel_virt) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    g_have_pat = (d >> 16) & 1;
+    cpuid(0x80000000, 0, &a, &b, &c, &d);
+    if (a >= 0x80000001) {
+        cpuid(0x80000001, 0, &a, &b, &c, &d);
+        g_have_1g = (d >> 26) & 1;
+        g_have_nx = (d >> 20) & 1;
+    }
+    if (!g_have_nx) g_pte_mask = ~PTE_NX;
+    paging_init_cpu();
+
+    // The AP trampoline loads CR3 in 32-bit mode, so keep the PML4 low
+    kernel_pml4 = pmm_alloc_pages_dma32(0);
+    if (!kernel_pml4) {
+        serial_printf("paging: cannot allocate kernel PML4, keeping bootloader tables\n");
+        return;
+    }
+    memset((void*)PHYS_TO_VIRT(kernel_pml4), 0, PAGE_SIZE);
+    uint64_t* pml4 = (uint64_t*)PHYS_TO_VIRT(kernel_pml4);
+    for (int i = 256; i < 512; i++) {
+        uint64_t t = alloc_table();
+        if (!t) return;
+        pml4[i] = t | PTE_PRESENT | PTE_WRITABLE;
+    }
+
+    // Direct map: all of the low 4 GiB (RAM and MMIO holes alike, as Limine
+    // does), then any memory-like region above it
+    paging_map_range((page_directory_t*)kernel_pml4, PHYS_TO_VIRT(0), 0, 0x100000000ULL, PAGE_KERNEL_RW);
+    for (uint64_t i = 0; i < count; i++) {
+        struct limine_memmap_entry* e = entries[i];
+        if (e->type == LIMINE_MEMMAP_RESERVED || e->type == LIMINE_MEMMAP_BAD_MEMORY) continue;
+
+        uint64_t start = e->base & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = (e->base + e->length + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        if (end <= 0x100000000ULL) continue;
+        if (start < 0x100000000ULL) start = 0x100000000ULL;
+        paging_map_range((page_directory_t*)kernel_pml4, PHYS_TO_VIRT(start), start, end - start, PAGE_KERNEL_RW);
+    }
+
+    // Kernel image (text, data and the boot stack in .bss)
+    uint64_t image_size = ((uint64_t)(uintptr_t)_end - kernel_virt + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    paging_map_range((page_directory_t*)kernel_pml4, kernel_virt, kernel_phys, image_size,
+                     PTE_PRESENT | PTE_WRITABLE | PTE_GLOBAL);
+
+    switch_page_directory((page_directory_t*)kernel_pml4);
+    tlb_flush_all();
+
+    serial_printf("paging: kernel PML4 at %p, direct map uses %s pages\n",
+                  (void*)kernel_pml4, g_have_1g ? "1 GiB" : "2 MiB");
 }
 
 void switch_page_directory(page_directory_t* dir) {
     // Only switch if different (and valid)
     if (dir) {
-        __asm__ __volatile__("mov %0, %%cr3" :: "r"(dir));
+        __asm__ __volatile__("mov %0, %%cr3" :: "r"(dir) : "memory");
     }
 }
 
+page_directory_t* paging_kernel_directory(void) {
+    return (page_directory_t*)kernel_pml4;
+}
+
 page_directory_t* paging_create_directory(void) {
-    // Return current CR3 (Shared Paging for now)
-    return (page_directory_t*)__asm_get_cr3();
+    if (!kernel_pml4) return (page_directory_t*)__asm_get_cr3();
+
+    uint64_t dir = alloc_table();
+    if (!dir) return NULL;
+
+    // Share the kernel half; the user half starts empty
+    uint64_t* src = (uint64_t*)PHYS_TO_VIRT(kernel_pml4);
+    uint64_t* dst = (uint64_t*)PHYS_TO_VIRT(dir);
+    for (int i = 256; i < 512; i++) {
+        dst[i] = src[i];
+    }
+    return (page_directory_t*)dir;
+}
+
+int paging_map(page_directory_t* dir, uint64_t vaddr, uint64_t paddr, uint64_t flags) {
+    uint64_t root = (uint64_t)dir & PTE_ADDR_MASK;
+    uint64_t* e = walk(root, vaddr, 1, 1);
+    if (!e) return -1;
+
+    uint64_t old = *e;
+    *e = (paddr & PTE_ADDR_MASK) | (flags & g_pte_mask);
+    if (old & PTE_PRESENT) invalidate(root, vaddr);
+    return 0;
+}
+
+int paging_map_range(page_directory_t* dir, uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t flags) {
+    uint64_t root = (uint64_t)dir & PTE_ADDR_MASK;
+    flags &= g_pte_mask;
+
+    while (size > 0) {
+        int level = 1;
+        if (g_have_1g && !((vaddr | paddr) & (PAGE_SIZE_1G - 1)) && size >= PAGE_SIZE_1G) level = 3;
+        else if (!((vaddr | paddr) & (PAGE_SIZE_2M - 1)) && size >= PAGE_SIZE_2M) level = 2;
+
+        if (level > 1) {
+            uint64_t* e = walk(root, vaddr, level, 1);
+            if (!e) return -1;
+
+            // A table already lives here: fill it with small pages instead
+            if ((*e & PTE_PRESENT) && !(*e & PTE_HUGE)) {
+                level = 1;
+            } else {
+                uint64_t old = *e;
+                *e = paddr | huge_flags(flags);
+                if (old & PTE_PRESENT) invalidate(root, vaddr);
+            }
+        }
+
+        if (level == 1 && paging_map(dir, vaddr, paddr, flags) != 0) return -1;
+
+        uint64_t step = level_size(level);
+        vaddr += step;
+        paddr += step;
+        size -= step;
+    }
+    return 0;
+}
+
+void paging_unmap(page_directory_t* dir, uint64_t vaddr, uint64_t size) {
+    uint64_t root = (uint64_t)dir & PTE_ADDR_MASK;
+    uint64_t end = (vaddr + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    vaddr &= ~(uint64_t)(PAGE_SIZE - 1);
+
+    while (vaddr < end) {
+        int level;
+        uint64_t* e = lookup(root, vaddr, &level);
+        uint64_t step = level_size(level);
+
+        if (*e & PTE_PRESENT) {
+            // Only part of a huge page is going away: split it and retry
+            if (level > 1 && ((vaddr & (step - 1)) || end - vaddr < step)) {
+                if (split_huge(e, level) != 0) return;
+                continue;
+            }
+            *e = 0;
+            invalidate(root, vaddr);
+        }
+
+        uint64_t next = (vaddr & ~(step - 1)) + step;
+        if (next <= vaddr) break;
+        vaddr = next;
+    }
+}
+
+void paging_protect(page_directory_t* dir, uint64_t vaddr, uint64_t size, uint64_t flags) {
+    uint64_t root = (uint64_t)dir & PTE_ADDR_MASK;
+    uint64_t end = (vaddr + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    vaddr &= ~(uint64_t)(PAGE_SIZE - 1);
+    flags &= g_pte_mask;
+
+    while (vaddr < end) {
+        int level;
+        uint64_t* e = lookup(root, vaddr, &level);
+        uint64_t step = level_size(level);
+
+        if (*e & PTE_PRESENT) {
+            if (level > 1 && ((vaddr & (step - 1)) || end - vaddr < step)) {
+                if (split_huge(e, level) != 0) return;
+                continue;
+            }
+            uint64_t frame = *e & PTE_ADDR_MASK & ~(step - 1);
+            *e = frame | (level > 1 ? huge_flags(flags) : flags);
+            invalidate(root, vaddr);
+        }
+
+        uint64_t next = (vaddr & ~(step - 1)) + step;
+        if (next <= vaddr) break;
+        vaddr = next;
+    }
+}
+
+uint64_t paging_get_phys(page_directory_t* dir, uint64_t vaddr) {
+    int level;
+    uint64_t* e = lookup((uint64_t)dir & PTE_ADDR_MASK, vaddr, &level);
+    if (!(*e & PTE_PRESENT)) return 0;
+
+    uint64_t step = level_size(level);
+    return (*e & PTE_ADDR_MASK & ~(step - 1)) + (vaddr & (step - 1));
 }
 
-void paging_map(page_directory_t* dir, uint64_t vaddr, uint64_t paddr, int user) {
-    UNUSED(dir); UNUSED(vaddr); UNUSED(paddr); UNUSED(user);
-    // TODO: Implement 4-level paging map
+uint64_t paging_get_entry(page_directory_t* dir, uint64_t vaddr) {
+    int level;
+    uint64_t* e = lookup((uint64_t)dir & PTE_ADDR_MASK, vaddr, &level);
+    if (level != 1 || !(*e & PTE_PRESENT)) return 0;
+    return *e;
+}
+
+static void walk_table(uint64_t* table, int level, uint64_t base, uint64_t start, uint64_t end,
+                       paging_leaf_fn fn, void* ctx) {
+    uint64_t size = level_size(level);
+    for (int i = 0; i < 512; i++) {
+        uint64_t lo = base + (uint64_t)i * size;
+        if (lo >= end) break;
+        if (lo + size <= start || !(table[i] & PTE_PRESENT)) continue;
+
+        if (level == 1) {
+            fn(lo, &table[i], ctx);
+        } else if (!(table[i] & PTE_HUGE)) {
+            walk_table(table_virt(table[i]), level - 1, lo, start, end, fn, ctx);
+        }
+    }
+}
+
+void paging_walk_range(page_directory_t* dir, uint64_t start, uint64_t end,
+                       paging_leaf_fn fn, void* ctx) {
+    if (end > KERNEL_HALF_BASE) end = KERNEL_HALF_BASE;
+    if (start >= end) return;
+    walk_table((uint64_t*)PHYS_TO_VIRT((uint64_t)dir & PTE_ADDR_MASK), 4, 0, start, end, fn, ctx);
+}
+
+void paging_flush_user(void) {
+    // User mappings are never global, so reloading CR3 is enough
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(__asm_get_cr3()) : "memory");
+}
+
+static void free_tables(uint64_t* table, int level, int count) {
+    for (int i = 0; i < count; i++) {
+        if (!(table[i] & PTE_PRESENT) || (table[i] & PTE_HUGE)) continue;
+        if (level > 2) free_tables(table_virt(table[i]), level - 1, 512);
+        pmm_free_pages(table[i] & PTE_ADDR_MASK, 0);
+    }
+}
+
+void paging_destroy_directory(page_directory_t* dir) {
+    uint64_t root = (uint64_t)dir & PTE_ADDR_MASK;
+    if (!root || root == kernel_pml4) return;
+
+    // Only the lower 256 entries belong to this directory
+    free_tables((uint64_t*)PHYS_TO_VIRT(root), 4, 256);
+    pmm_free_pages(root, 0);
 }
 
 uint64_t __asm_get_cr3(void) {
@@ -38,7 +410,27 @@ uint64_t __asm_get_cr3(void) {
     return cr3;
 }
 
-void paging_map_mmio(uint64_t paddr, uint64_t size) {
-    UNUSED(paddr); UNUSED(size);
-    // Identity mapped by bootloader for now
+void* paging_map_cached(uint64_t paddr, uint64_t size, uint64_t cache) {
+    if (!kernel_pml4) return (void*)PHYS_TO_VIRT(paddr);
+    if (!g_have_pat && cache == PAGE_CACHE_WC) cache = PAGE_CACHE_UC;
+
+    uint64_t start = paddr & ~(uint64_t)(PAGE_SIZE - 1);
+    uint64_t end = (paddr + size + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+    if (paging_map_range((page_directory_t*)kernel_pml4, PHYS_TO_VIRT(start), start, end - start,
+                         PAGE_KERNEL_RW | cache) != 0) {
+        kprintf("paging: out of memory mapping %p\n", (void*)start);
+    }
+
+    // Other CPUs may still hold translations with the old type
+    tlb_shootdown_kernel(PHYS_TO_VIRT(start), end - start);
+
+    // Lines cached under the old type must not be written back later
+    if (cache != PAGE_CACHE_UC) {
+        __asm__ __volatile__("wbinvd" : : : "memory");
+    }
+    return (void*)PHYS_TO_VIRT(paddr);
+}
+
+void* paging_map_mmio(uint64_t paddr, uint64_t size) {
+    return paging_map_cached(paddr, size, PAGE_CACHE_UC);
 }
@@ -2,6 +2,41 @@
 #define PAGING_H
 
 #include "common.h"
+#include "limine.h"
+
+/* Page table entry bits */
+#define PTE_PRESENT   (1ULL << 0)
+#define PTE_WRITABLE  (1ULL << 1)
+#define PTE_USER      (1ULL << 2)
+#define PTE_PWT       (1ULL << 3)
+#define PTE_PCD       (1ULL << 4)
+#define PTE_ACCESSED  (1ULL << 5)
+#define PTE_DIRTY     (1ULL << 6)
+#define PTE_HUGE      (1ULL << 7)   /* PS: 2 MiB (PD) or 1 GiB (PDPT) leaf */
+#define PTE_PAT       (1ULL << 7)   /* PAT bit of a 4 KiB leaf */
+#define PTE_GLOBAL    (1ULL << 8)
+#define PTE_COW       (1ULL << 9)   /* Software: read-only until copied (vmm) */
+#define PTE_SHARED    (1ULL << 10)  /* Software: shared with the kernel, never COW (vmm) */
+#define PTE_PAT_HUGE  (1ULL << 12)  /* PAT bit of a huge leaf */
+#define PTE_NX        (1ULL << 63)
+#define PTE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+
+/* Common leaf flag sets */
+#define PAGE_KERNEL_RW  (PTE_PRESENT | PTE_WRITABLE | PTE_GLOBAL | PTE_NX)
+#define PAGE_KERNEL_MMIO (PAGE_KERNEL_RW | PTE_PCD | PTE_PWT)
+#define PAGE_USER_RW    (PTE_PRESENT | PTE_WRITABLE | PTE_USER)
+
+/* Cache modes for paging_map_cached. The PAT is programmed so that entries
+   0-3 keep their power-on meaning and entry 4 (PAT bit alone) is WC. */
+#define PAGE_CACHE_WB  0ULL
+#define PAGE_CACHE_WC  PTE_PAT
+#define PAGE_CACHE_UC  (PTE_PCD | PTE_PWT)
+
+#define PAGE_SIZE_2M  0x200000ULL
+#define PAGE_SIZE_1G  0x40000000ULL
+
+/* First address of the shared kernel half (PML4 entries 256-511) */
+#define KERNEL_HALF_BASE 0xFFFF800000000000ULL
 
 typedef struct {
     uint64_t entries[512];
@@ -11,17 +46,59 @@ typedef struct {
     uint64_t entries[512];
 } page_table_t;
 
-void paging_init(void);
+/*
+   Address spaces are referred to by the physical address of their PML4
+   (the value loaded into CR3). Flags are PTE_* bits and always describe
+   a 4 KiB leaf; huge mappings translate the PAT bit themselves.
+*/
+
+/* Build the kernel PML4 (huge-page direct map + kernel image) and load it */
+void paging_init(struct limine_memmap_entry** entries, uint64_t count,
+                 uint64_t kernel_phys, uint64_t kernel_virt);
+/* Per-CPU paging features (NX, global pages, PAT); APs call this too */
+void paging_init_cpu(void);
 void switch_page_directory(page_directory_t* dir);
+page_directory_t* paging_kernel_directory(void);
 
-/* Clone a page directory (useful for creating process spaces) */
+/* New address space sharing the kernel half of the kernel PML4 */
 page_directory_t* paging_create_directory(void);
 
-/* Map a virtual page to a physical address */
-void paging_map(page_directory_t* dir, uint64_t vaddr, uint64_t paddr, int user);
+/* Map one 4 KiB page; returns 0 on success, -1 if a table can't be allocated */
+int paging_map(page_directory_t* dir, uint64_t vaddr, uint64_t paddr, uint64_t flags);
+
+/* Map a range, using 2 MiB / 1 GiB pages wherever alignment allows */
+int paging_map_range(page_directory_t* dir, uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t flags);
+
+/* Remove mappings; the frames themselves are not freed */
+void paging_unmap(page_directory_t* dir, uint64_t vaddr, uint64_t size);
+
+/* Replace the flags of every mapped page in the range */
+void paging_protect(page_directory_t* dir, uint64_t vaddr, uint64_t size, uint64_t flags);
+
+/* Physical address backing vaddr, or 0 if unmapped */
+uint64_t paging_get_phys(page_directory_t* dir, uint64_t vaddr);
+
+/* Raw 4 KiB leaf entry for vaddr, or 0 if unmapped or covered by a huge page */
+uint64_t paging_get_entry(page_directory_t* dir, uint64_t vaddr);
+
+/* Call fn for every present 4 KiB leaf in [start, end) of the user half,
+   skipping absent tables. fn may rewrite *pte; the caller flushes. */
+typedef void (*paging_leaf_fn)(uint64_t vaddr, uint64_t* pte, void* ctx);
+void paging_walk_range(page_directory_t* dir, uint64_t start, uint64_t end,
+                       paging_leaf_fn fn, void* ctx);
+
+/* Drop every cached user-half translation of the current address space */
+void paging_flush_user(void);
+
+/* Free the user-half page tables and the PML4 itself. Leaf frames must
+   already have been released by the owner. */
+void paging_destroy_directory(page_directory_t* dir);
+
+/* Map an MMIO range uncached into the direct map; returns its virtual address */
+void* paging_map_mmio(uint64_t paddr, uint64_t size);
 
-/* Map MMIO range (identity mapped for now) */
-void paging_map_mmio(uint64_t paddr, uint64_t size);
+/* (Re)map a physical range in the direct map with the given PAGE_CACHE_* mode */
+void* paging_map_cached(uint64_t paddr, uint64_t size, uint64_t cache);
 
 uint64_t __asm_get_cr3(void);
 
@@ -0,0 +1,24 @@
+#include "percpu.h"
+#include "io.h"
+
+percpu_t g_percpu[SMP_MAX_CPUS];
+
+void percpu_init_cpu(int cpu, uint32_t apic_id) {
+    percpu_t* p = &g_percpu[cpu];
+    p->self = p;
+    p->cpu = cpu;
+    p->apic_id = apic_id;
+
+    // Kernel code runs with the per-CPU area in GS base; KERNEL_GS_BASE
+    // holds ring 3's value for swapgs to exchange
+    wrmsr(MSR_GS_BASE, (uint64_t)p);
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+uint64_t percpu_stat_sum(percpu_stat_t stat) {
+    uint64_t sum = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        sum += __atomic_load_n(&g_percpu[cpu].stats[stat], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
@@ -0,0 +1,94 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include "common.h"
+#include "smp.h"
+
+/*
+   Per-CPU data. Each CPU's GS base points at its own percpu_t while it
+   runs kernel code; the interrupt stubs swapgs on the way in from and
+   out to ring 3, so user code never sees it and can't redirect it.
+   A field of the calling CPU is then one %gs-relative access, with no
+   LAPIC read or table lookup.
+
+   The statistics counters are written only by their own CPU with a
+   single non-locked increment, which an interrupt cannot split, so
+   they need neither atomics nor interrupts off. Readers sum them over
+   all CPUs and may be a few events behind.
+*/
+
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+typedef enum {
+    PERCPU_STAT_IRQS,           /* Hardware interrupts handled */
+    PERCPU_STAT_SYSCALLS,
+    PERCPU_STAT_CTX_SWITCHES,
+    PERCPU_STAT_PAGE_FAULTS,
+    PERCPU_STAT_NET_RX,         /* Packets received */
+    PERCPU_STAT_NET_TX,         /* Packets sent */
+    PERCPU_STAT_SOFTIRQS,       /* Softirq handler runs (softirq.c) */
+    PERCPU_STAT_COUNT
+} percpu_stat_t;
+
+struct process;
+struct runqueue;
+
+typedef struct percpu {
+    struct percpu* self;        /* %gs:0 */
+    int cpu;                    /* %gs:PERCPU_CPU_OFFSET, see smp.h */
+    uint32_t apic_id;
+    uint64_t kernel_stack;      /* %gs:16, top of the running task's kernel stack */
+    uint64_t user_rsp;          /* %gs:24, scratch for the SYSCALL entry */
+    struct process* current;    /* Task running here */
+    struct runqueue* rq;        /* This CPU's run queue (process.c) */
+    int irq_depth;              /* Hardware interrupt handlers running */
+    uint32_t softirq_pending;   /* Bit per softirq_t raised here */
+    int softirq_active;         /* Running softirqs; not preemptible */
+    int need_resched;           /* Preemption put off until softirqs finish */
+    uint64_t stats[PERCPU_STAT_COUNT];
+} __attribute__((aligned(64))) percpu_t;
+
+_Static_assert(__builtin_offsetof(percpu_t, cpu) == PERCPU_CPU_OFFSET,
+               "smp_current_cpu reads the CPU index at a fixed offset");
+_Static_assert(__builtin_offsetof(percpu_t, kernel_stack) == 16 &&
+               __builtin_offsetof(percpu_t, user_rsp) == 24,
+               "syscall_entry (isr_stub.s) uses these offsets");
+
+extern percpu_t g_percpu[SMP_MAX_CPUS];
+
+/* Point the calling CPU's GS base at g_percpu[cpu]. The BSP calls it
+   before anything else runs; each AP first thing in kernel_ap_main. */
+void percpu_init_cpu(int cpu, uint32_t apic_id);
+
+static inline percpu_t* this_cpu(void) {
+    percpu_t* p;
+    __asm__ volatile("movq %%gs:0, %0" : "=r"(p));
+    return p;
+}
+
+static inline percpu_t* percpu_of(int cpu) {
+    return &g_percpu[cpu];
+}
+
+static inline struct process* percpu_current(void) {
+    struct process* p;
+    __asm__ volatile("movq %%gs:%c1, %0" : "=r"(p) : "i"(__builtin_offsetof(percpu_t, current)));
+    return p;
+}
+
+/* Whether the calling CPU is inside a hardware interrupt handler */
+static inline int percpu_in_irq(void) {
+    return this_cpu()->irq_depth != 0;
+}
+
+/* Count an event on the calling CPU */
+#define percpu_inc(stat) \
+    __asm__ volatile("incq %%gs:%c0" \
+                     : : "i"(__builtin_offsetof(percpu_t, stats) + (stat) * sizeof(uint64_t)) \
+                     : "memory")
+
+/* A counter summed over every CPU */
+uint64_t percpu_stat_sum(percpu_stat_t stat);
+
+#endif
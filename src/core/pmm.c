@@ -0,0 +1,288 @@
+#include "pmm.h"
+#include "../lib/memory.h"
+#include "spinlock.h"
+#include "../drivers/serial.h"
+
+/*
+   Physical page-frame allocator.
+
+   A binary buddy allocator over every USABLE region of the Limine memory
+   map, split into a DMA32 zone (below 4 GiB) and a NORMAL zone. Each frame
+   has a page_t in a frame database carved out of the first region large
+   enough to hold it; free lists are linked through those descriptors by
+   PFN so free memory itself is never touched.
+*/
+
+#define PMM_LOW_RESERVE   0x100000     /* Leave real-mode memory (SMP trampoline) alone */
+#define PMM_DMA32_LIMIT   0x100000000ULL
+#define PMM_ORDER_INNER   0xFF         /* Free frame that is not a block head */
+#define PMM_MAX_RECLAIM   32
+
+static page_t* g_frames = NULL;
+static uint32_t g_max_pfn = 0;
+static uint32_t g_free_lists[PMM_NUM_ZONES][PMM_MAX_ORDER + 1];
+static size_t g_total_pages = 0;
+static size_t g_free_pages = 0;
+static spinlock_t g_pmm_lock = SPINLOCK_INIT;    /* Free lists and counters; taken with IRQs off */
+
+static struct {
+    uintptr_t base;
+    size_t length;
+} g_reclaim[PMM_MAX_RECLAIM];
+static int g_reclaim_count = 0;
+
+static inline int pfn_zone(uint32_t pfn) {
+    return ((uint64_t)pfn << PAGE_SHIFT) < PMM_DMA32_LIMIT ? PMM_ZONE_DMA32 : PMM_ZONE_NORMAL;
+}
+
+static void free_list_push(int zone, unsigned order, uint32_t pfn) {
+    page_t* pg = &g_frames[pfn];
+    pg->type = PAGE_FREE;
+    pg->order = (uint8_t)order;
+    pg->zone = (uint8_t)zone;
+    pg->prev = PMM_NO_PAGE;
+    pg->next = g_free_lists[zone][order];
+    if (pg->next != PMM_NO_PAGE) g_frames[pg->next].prev = pfn;
+    g_free_lists[zone][order] = pfn;
+}
+
+static void free_list_remove(int zone, unsigned order, uint32_t pfn) {
+    page_t* pg = &g_frames[pfn];
+    if (pg->prev != PMM_NO_PAGE) g_frames[pg->prev].next = pg->next;
+    else g_free_lists[zone][order] = pg->next;
+    if (pg->next != PMM_NO_PAGE) g_frames[pg->next].prev = pg->prev;
+    pg->next = pg->prev = PMM_NO_PAGE;
+    pg->order = PMM_ORDER_INNER;
+}
+
+static void buddy_free(uint32_t pfn, unsigned order) {
+    int zone = pfn_zone(pfn);
+    g_free_pages += (size_t)1 << order;
+
+    // Merge upwards while the buddy is a free block of the same order
+    while (order < PMM_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        if (buddy >= g_max_pfn) break;
+        page_t* b = &g_frames[buddy];
+        if (b->type != PAGE_FREE || b->order != order) break;
+
+        free_list_remove(zone, order, buddy);
+        pfn &= ~(1u << order);
+        order++;
+    }
+
+    g_frames[pfn].inuse = 0;
+    g_frames[pfn].refcount = 0;
+    g_frames[pfn].freelist = NULL;
+    free_list_push(zone, order, pfn);
+}
+
+static uint32_t buddy_alloc(int zone, unsigned order) {
+    unsigned o = order;
+    while (o <= PMM_MAX_ORDER && g_free_lists[zone][o] == PMM_NO_PAGE) o++;
+    if (o > PMM_MAX_ORDER) return PMM_NO_PAGE;
+
+    uint32_t pfn = g_free_lists[zone][o];
+    free_list_remove(zone, o, pfn);
+
+    // Split, returning the upper halves to the free lists
+    while (o > order) {
+        o--;
+        free_list_push(zone, o, pfn + (1u << o));
+    }
+
+    for (uint32_t i = 0; i < (1u << order); i++) {
+        page_t* pg = &g_frames[pfn + i];
+        pg->type = PAGE_USED;
+        pg->order = (uint8_t)order;
+        pg->refcount = 0;
+        pg->inuse = 0;
+        pg->freelist = NULL;
+    }
+
+    g_free_pages -= (size_t)1 << order;
+    return pfn;
+}
+
+/* Free an arbitrary run of frames as the largest aligned blocks possible */
+static void free_range(uint32_t pfn, size_t count) {
+    while (count > 0) {
+        unsigned order = 0;
+        while (order < PMM_MAX_ORDER &&
+               (pfn & ((2u << order) - 1)) == 0 &&
+               ((size_t)2 << order) <= count) {
+            order++;
+        }
+        buddy_free(pfn, order);
+        pfn += 1u << order;
+        count -= (size_t)1 << order;
+    }
+}
+
+/* Add [base, base + length) to the allocator, skipping low memory */
+static size_t add_region(uintptr_t base, size_t length, uintptr_t skip_base, size_t skip_len) {
+    uintptr_t start = (base + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t end = (base + length) & ~(uintptr_t)(PAGE_SIZE - 1);
+    if (start < PMM_LOW_RESERVE) start = PMM_LOW_RESERVE;
+    if (end <= start) return 0;
+
+    // Carve out the frame database if it lives in this region
+    if (skip_len && skip_base >= start && skip_base < end) {
+        size_t added = add_region(start, skip_base - start, 0, 0);
+        return added + add_region(skip_base + skip_len, end - (skip_base + skip_len), 0, 0);
+    }
+
+    size_t count = (end - start) / PAGE_SIZE;
+    free_range((uint32_t)(start / PAGE_SIZE), count);
+    g_total_pages += count;
+    return count;
+}
+
+void pmm_init(struct limine_memmap_entry** entries, uint64_t count) {
+    spinlock_track(&g_pmm_lock, "pmm");
+    for (int z = 0; z < PMM_NUM_ZONES; z++) {
+        for (int o = 0; o <= PMM_MAX_ORDER; o++) {
+            g_free_lists[z][o] = PMM_NO_PAGE;
+        }
+    }
+
+    // 1. Size the frame database from the highest allocatable address
+    uintptr_t top = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        struct limine_memmap_entry* e = entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE && e->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE) continue;
+        if (e->base + e->length > top) top = e->base + e->length;
+    }
+    g_max_pfn = (uint32_t)(top / PAGE_SIZE);
+    size_t db_bytes = ((size_t)g_max_pfn * sizeof(page_t) + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1);
+
+    // 2. Place it in the first usable region that fits
+    uintptr_t db_phys = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        struct limine_memmap_entry* e = entries[i];
+        if (e->type != LIMINE_MEMMAP_USABLE || e->base < PMM_LOW_RESERVE) continue;
+        if (e->length >= db_bytes) {
+            db_phys = e->base;
+            break;
+        }
+    }
+    if (!db_phys) {
+        serial_printf("pmm: no region can hold the frame database (%d KB)\n", (int)(db_bytes / 1024));
+        return;
+    }
+
+    g_frames = (page_t*)PHYS_TO_VIRT(db_phys);
+    memset(g_frames, 0, db_bytes);
+    for (uint32_t i = 0; i < g_max_pfn; i++) {
+        g_frames[i].next = g_frames[i].prev = PMM_NO_PAGE;
+        g_frames[i].order = PMM_ORDER_INNER;
+        g_frames[i].zone = (uint8_t)pfn_zone(i);
+    }
+
+    // 3. Release every usable frame; remember reclaimable ones for later
+    for (uint64_t i = 0; i < count; i++) {
+        struct limine_memmap_entry* e = entries[i];
+        if (e->type == LIMINE_MEMMAP_USABLE) {
+            add_region(e->base, e->length, db_phys, db_bytes);
+        } else if (e->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE && g_reclaim_count < PMM_MAX_RECLAIM) {
+            g_reclaim[g_reclaim_count].base = e->base;
+            g_reclaim[g_reclaim_count].length = e->length;
+            g_reclaim_count++;
+        }
+    }
+
+    serial_printf("pmm: %d MB usable, frame database %d KB\n",
+                  (int)(g_total_pages / 256), (int)(db_bytes / 1024));
+}
+
+void pmm_reclaim_bootloader_memory(void) {
+    size_t pages = 0;
+    uint64_t flags = spinlock_lock_irqsave(&g_pmm_lock);
+    for (int i = 0; i < g_reclaim_count; i++) {
+        pages += add_region(g_reclaim[i].base, g_reclaim[i].length, 0, 0);
+    }
+    g_reclaim_count = 0;
+    spinlock_unlock_irqrestore(&g_pmm_lock, flags);
+    serial_printf("pmm: reclaimed %d KB of bootloader memory\n", (int)(pages * 4));
+}
+
+static uint32_t zone_alloc(unsigned order, int dma32) {
+    uint32_t pfn = PMM_NO_PAGE;
+    if (!dma32) pfn = buddy_alloc(PMM_ZONE_NORMAL, order);
+    if (pfn == PMM_NO_PAGE) pfn = buddy_alloc(PMM_ZONE_DMA32, order);
+    return pfn;
+}
+
+static uintptr_t alloc_locked(unsigned order, int dma32) {
+    if (!g_frames || order > PMM_MAX_ORDER) return 0;
+    uint64_t flags = spinlock_lock_irqsave(&g_pmm_lock);
+    uint32_t pfn = zone_alloc(order, dma32);
+    spinlock_unlock_irqrestore(&g_pmm_lock, flags);
+    if (pfn == PMM_NO_PAGE) return 0;
+    return (uintptr_t)pfn << PAGE_SHIFT;
+}
+
+uintptr_t pmm_alloc_pages(unsigned order) {
+    return alloc_locked(order, 0);
+}
+
+uintptr_t pmm_alloc_pages_dma32(unsigned order) {
+    return alloc_locked(order, 1);
+}
+
+void pmm_free_pages(uintptr_t phys, unsigned order) {
+    uint32_t pfn = (uint32_t)(phys >> PAGE_SHIFT);
+    if (!g_frames || pfn >= g_max_pfn || order > PMM_MAX_ORDER) return;
+    uint64_t flags = spinlock_lock_irqsave(&g_pmm_lock);
+    buddy_free(pfn, order);
+    spinlock_unlock_irqrestore(&g_pmm_lock, flags);
+}
+
+uintptr_t pmm_alloc_contig(size_t npages, int dma32) {
+    if (!g_frames || npages == 0) return 0;
+    unsigned order = 0;
+    while (((size_t)1 << order) < npages) order++;
+    if (order > PMM_MAX_ORDER) return 0;
+
+    uint64_t flags = spinlock_lock_irqsave(&g_pmm_lock);
+    uint32_t pfn = zone_alloc(order, dma32);
+    if (pfn != PMM_NO_PAGE) {
+        size_t excess = ((size_t)1 << order) - npages;
+        if (excess) free_range(pfn + (uint32_t)npages, excess);
+    }
+    spinlock_unlock_irqrestore(&g_pmm_lock, flags);
+
+    if (pfn == PMM_NO_PAGE) return 0;
+    return (uintptr_t)pfn << PAGE_SHIFT;
+}
+
+void pmm_free_contig(uintptr_t phys, size_t npages) {
+    uint32_t pfn = (uint32_t)(phys >> PAGE_SHIFT);
+    if (!g_frames || pfn + npages > g_max_pfn) return;
+    uint64_t flags = spinlock_lock_irqsave(&g_pmm_lock);
+    free_range(pfn, npages);
+    spinlock_unlock_irqrestore(&g_pmm_lock, flags);
+}
+
+page_t* pmm_phys_to_page(uintptr_t phys) {
+    uintptr_t pfn = phys >> PAGE_SHIFT;
+    if (!g_frames || pfn >= g_max_pfn) return NULL;
+    return &g_frames[pfn];
+}
+
+page_t* pmm_pfn_to_page(uint32_t pfn) {
+    if (!g_frames || pfn >= g_max_pfn) return NULL;
+    return &g_frames[pfn];
+}
+
+uintptr_t pmm_page_to_phys(page_t* page) {
+    return (uintptr_t)(page - g_frames) << PAGE_SHIFT;
+}
+
+size_t pmm_get_total_pages(void) {
+    return g_total_pages;
+}
+
+size_t pmm_get_free_pages(void) {
+    return g_free_pages;
+}
@@ -0,0 +1,63 @@
+#ifndef PMM_H
+#define PMM_H
+
+#include "common.h"
+#include "limine.h"
+
+/* Largest buddy block is 2^PMM_MAX_ORDER pages (16 MiB) */
+#define PMM_MAX_ORDER 12
+#define PMM_NO_PAGE   0xFFFFFFFFu
+
+/* Physical memory zones */
+#define PMM_ZONE_DMA32  0   /* Frames below 4 GiB, for 32-bit DMA engines */
+#define PMM_ZONE_NORMAL 1
+#define PMM_NUM_ZONES   2
+
+/* page_t.type */
+enum {
+    PAGE_RESERVED = 0,  /* Hole, firmware, kernel image or frame database */
+    PAGE_FREE,          /* Head of a free buddy block */
+    PAGE_USED,          /* Allocated by pmm_alloc_* */
+    PAGE_SLAB,          /* kmalloc slab page */
+    PAGE_LARGE          /* Head of a multi-page kmalloc allocation */
+};
+
+/* One descriptor per physical frame */
+typedef struct page {
+    uint8_t  type;
+    uint8_t  order;       /* Block order (PAGE_FREE heads) */
+    uint8_t  slab_class;  /* PAGE_SLAB */
+    uint8_t  zone;
+    uint16_t inuse;       /* Allocated objects (PAGE_SLAB) */
+    uint16_t refcount;
+    uint32_t next;        /* PFN links for free lists / partial slabs */
+    uint32_t prev;
+    union {
+        void*  freelist;  /* Free objects (PAGE_SLAB) */
+        size_t npages;    /* Run length (PAGE_LARGE) */
+    };
+} page_t;
+
+void pmm_init(struct limine_memmap_entry** entries, uint64_t count);
+
+/* Allocate 2^order contiguous frames; returns the physical address or 0 */
+uintptr_t pmm_alloc_pages(unsigned order);
+uintptr_t pmm_alloc_pages_dma32(unsigned order);
+void pmm_free_pages(uintptr_t phys, unsigned order);
+
+/* Exact-size contiguous runs: the unused tail of the buddy block is freed */
+uintptr_t pmm_alloc_contig(size_t npages, int dma32);
+void pmm_free_contig(uintptr_t phys, size_t npages);
+
+/* Hand BOOTLOADER_RECLAIMABLE frames to the allocator. Only safe once the
+   kernel no longer uses Limine's page tables or response structures. */
+void pmm_reclaim_bootloader_memory(void);
+
+page_t* pmm_phys_to_page(uintptr_t phys);
+uintptr_t pmm_page_to_phys(page_t* page);
+page_t* pmm_pfn_to_page(uint32_t pfn);
+
+size_t pmm_get_total_pages(void);
+size_t pmm_get_free_pages(void);
+
+#endif
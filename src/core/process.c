@@ -4,16 +4,239 @@
 #include "syscall.h"
 #include "paging.h"
 #include "elf.h"
+#include "gdt.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "clock.h"
+#include "wait.h"
 
-static process_t processes[MAX_PROCESSES];
+/*
+   Scheduling.
+
+   Every CPU has a run queue made of two priority arrays, active and
+   expired. Each array keeps a FIFO per priority level and a bitmap of
+   the non-empty levels, so picking the next process is a find-first-set
+   on the bitmap. A process that uses up its timeslice moves to the
+   expired array; when the active one runs dry the two swap, so every
+   process gets a turn before anyone gets a second one.
+
+   Dynamic priority rewards sleeping: time spent waiting for input earns
+   sleep credit that running spends again, and a process with plenty of
+   it runs a couple of levels above its static priority. Such interactive
+   processes go straight back into the active array when their slice
+   runs out, unless the expired array has been starved for too long.
+   Programs here poll for input rather than block, so a process whose
+   polls keep coming back empty is put to sleep until input arrives or a
+   tick passes (scheduler_input_polled). Any other sleep on a wait queue
+   earns credit the same way.
+
+   A CPU with less queued work than the busiest one pulls a process over,
+   so an idle core steals from a busy one and load evens out over a few
+   ticks. APs with nothing to run return to their idle task and stop
+   ticking (timer.c); queueing work for them, or having more than we can
+   run, sends them a kick.
+
+   A process switched away from is still on its kernel stack until the
+   interrupt stub has loaded the next frame; on_cpu keeps other CPUs
+   from running it until then (scheduler_finish_switch).
+*/
+
+/* Sleep credit is capped at two seconds' worth. With none a process runs
+   SCHED_MAX_BONUS/2 levels below its static priority, with all of it
+   the same amount above. */
+#define SCHED_MAX_SLEEP_AVG    (2 * SCHEDULER_HZ)
+#define SCHED_MAX_BONUS        4
+
+#define SCHED_TICK_NS          (1000000000ULL / SCHEDULER_HZ)
+
+/* How long the expired array may wait while interactive processes keep
+   being put back into the active one */
+#define SCHED_STARVATION_NS    1000000000ULL
+
+/* Empty input polls in a row before a poller is put to sleep, and how
+   long it sleeps for at most */
+#define SCHED_POLL_SPINS       4
+#define SCHED_INPUT_TIMEOUT_NS SCHED_TICK_NS
+
+#define TASK_INTERACTIVE(p) ((p)->prio < (p)->static_prio)
+
+/* SCHED_NR_PRIO must fit the bitmap */
+typedef struct {
+    uint32_t bitmap;                  /* Bit p set: level p is non-empty */
+    uint32_t nr;
+    process_t* head[SCHED_NR_PRIO];
+    process_t* tail[SCHED_NR_PRIO];
+} prio_array_t;
+
+typedef struct runqueue {
+    spinlock_t lock;          /* Arrays and nr_queued; taken with IRQs off */
+    prio_array_t arrays[2];
+    prio_array_t* active;
+    prio_array_t* expired;
+    uint64_t expired_since;   /* When the expired array last became non-empty (ns) */
+    volatile uint32_t nr_queued;
+    process_t* idle;          /* Halts in a loop when nothing else can run */
+    process_t* switched_from; /* Waiting for scheduler_finish_switch */
+    int online;
+    char name[16];            /* For lockstat */
+} runqueue_t;
+
+static process_t** g_proc_table = NULL;
+static int g_proc_capacity = 0;
+static process_t idle_tasks[SMP_MAX_CPUS];
+static runqueue_t g_runqueues[SMP_MAX_CPUS];
 static uint32_t next_pid = 1;
-process_t* current_process = NULL;
+static spinlock_t g_proc_lock = SPINLOCK_INIT;   /* Process table and reaping */
+static volatile int g_zombies = 0;
+
+/* Processes sleeping until input arrives */
+static wait_queue_t g_input_wq = WAIT_QUEUE_INIT;
+
+static int effective_prio(process_t* p) {
+    int bonus = p->sleep_avg * SCHED_MAX_BONUS / SCHED_MAX_SLEEP_AVG - SCHED_MAX_BONUS / 2;
+    int prio = p->static_prio - bonus;
+    if (prio < 0) prio = 0;
+    if (prio > SCHED_NR_PRIO - 1) prio = SCHED_NR_PRIO - 1;
+    return prio;
+}
+
+/* Ticks a process runs before it is preempted: 1 at the lowest
+   priority up to 4 at the highest */
+static int task_timeslice(process_t* p) {
+    return 1 + (SCHED_NR_PRIO - 1 - p->static_prio) / 8;
+}
+
+static void array_push(runqueue_t* rq, prio_array_t* arr, process_t* p) {
+    int prio = p->prio;
+    p->rq_next = NULL;
+    if (arr->tail[prio]) arr->tail[prio]->rq_next = p;
+    else arr->head[prio] = p;
+    arr->tail[prio] = p;
+    arr->bitmap |= 1u << prio;
+    arr->nr++;
+    rq->nr_queued++;
+}
+
+static void array_unlink(runqueue_t* rq, prio_array_t* arr, process_t* prev, process_t* p) {
+    int prio = p->prio;
+    if (prev) prev->rq_next = p->rq_next;
+    else arr->head[prio] = p->rq_next;
+    if (arr->tail[prio] == p) arr->tail[prio] = prev;
+    if (!arr->head[prio]) arr->bitmap &= ~(1u << prio);
+    p->rq_next = NULL;
+    arr->nr--;
+    rq->nr_queued--;
+}
+
+/* Whether p may run on cpu: not pinned elsewhere and not still on
+   another CPU's stack */
+static int runnable_on(process_t* p, int cpu) {
+    if (p->affinity >= 0 && p->affinity != cpu) return 0;
+    return !__atomic_load_n(&p->on_cpu, __ATOMIC_ACQUIRE) || p == percpu_of(cpu)->current;
+}
+
+/* Unlink the most urgent process in arr that may run on cpu. The head of
+   the first non-empty level nearly always qualifies; the walk only goes
+   on past pinned processes or ones still being switched away from. */
+static process_t* array_take(runqueue_t* rq, prio_array_t* arr, int cpu) {
+    uint32_t levels = arr->bitmap;
+    while (levels) {
+        int prio = __builtin_ctz(levels);
+        levels &= levels - 1;
+        process_t* prev = NULL;
+        for (process_t* p = arr->head[prio]; p; prev = p, p = p->rq_next) {
+            if (!runnable_on(p, cpu)) continue;
+            array_unlink(rq, arr, prev, p);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/* Next process for cpu from its own queue; the arrays swap once every
+   active process has had its slice */
+static process_t* rq_pick(runqueue_t* rq, int cpu) {
+    if (!rq->active->nr && rq->expired->nr) {
+        prio_array_t* arr = rq->active;
+        rq->active = rq->expired;
+        rq->expired = arr;
+    }
+    process_t* p = array_take(rq, rq->active, cpu);
+    if (!p) p = array_take(rq, rq->expired, cpu);
+    return p;
+}
+
+static int expired_starving(runqueue_t* rq) {
+    return rq->expired->nr && clock_monotonic_ns() - rq->expired_since >= SCHED_STARVATION_NS;
+}
+
+/* Queue a READY process in cpu's active array */
+static void enqueue_on(process_t* proc, int cpu) {
+    runqueue_t* rq = &g_runqueues[cpu];
+    uint64_t flags = spinlock_lock_irqsave(&rq->lock);
+    proc->cpu = cpu;
+    proc->state = PROC_READY;
+    array_push(rq, rq->active, proc);
+    spinlock_unlock_irqrestore(&rq->lock, flags);
+
+    if (cpu != smp_current_cpu() && timer_tick_stopped(cpu)) timer_kick_cpu(cpu);
+}
+
+/* The online CPU with the least queued work that proc may run on */
+static int least_loaded_cpu(process_t* proc) {
+    if (proc->affinity >= 0) return proc->affinity;
+    int best = 0;
+    for (int cpu = 1; cpu < SMP_MAX_CPUS; cpu++) {
+        if (g_runqueues[cpu].online && g_runqueues[cpu].nr_queued < g_runqueues[best].nr_queued) {
+            best = cpu;
+        }
+    }
+    return best;
+}
+
+static void scheduler_enqueue(process_t* proc) {
+    enqueue_on(proc, least_loaded_cpu(proc));
+}
+
+/* "runqueue <cpu>" */
+static void rq_track(int cpu) {
+    runqueue_t* rq = &g_runqueues[cpu];
+    const char* prefix = "runqueue ";
+    int n = 0;
+    while (prefix[n]) {
+        rq->name[n] = prefix[n];
+        n++;
+    }
+    if (cpu >= 10) rq->name[n++] = '0' + cpu / 10;
+    rq->name[n++] = '0' + cpu % 10;
+    rq->name[n] = '\0';
+    spinlock_track(&rq->lock, rq->name);
+}
+
+static void idle_loop(void) {
+    for (;;) timer_idle(0);
+}
 
 void process_init(void) {
-    memset(processes, 0, sizeof(processes));
-    
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        g_runqueues[cpu].active = &g_runqueues[cpu].arrays[0];
+        g_runqueues[cpu].expired = &g_runqueues[cpu].arrays[1];
+    }
+    spinlock_track(&g_proc_lock, "process table");
+    rq_track(0);
+
+    g_proc_table = kmalloc_z(PROC_TABLE_INITIAL * sizeof(process_t*));
+    process_t* kproc = kmalloc_z(sizeof(process_t));
+    if (!g_proc_table || !kproc) {
+        kprintf("process: cannot allocate process table\n");
+        return;
+    }
+    g_proc_capacity = PROC_TABLE_INITIAL;
+
     // Create 'kernel' process for the main thread
-    process_t* kproc = &processes[0];
+    g_proc_table[0] = kproc;
+    kproc->slot = 0;
     kproc->pid = next_pid++;
     kproc->state = PROC_RUNNING;
     
@@ -24,105 +247,547 @@ void process_init(void) {
     
     kproc->page_directory = __asm_get_cr3();
     kproc->is_userland = 0;
-    current_process = kproc;
+
+    // The kernel process owns the boot stack and the GUI loop; it stays
+    // on the BSP and runs ahead of ordinary programs
+    kproc->affinity = 0;
+    kproc->on_cpu = 1;
+    kproc->static_prio = SCHED_PRIO_KERNEL;
+    kproc->sleep_avg = SCHED_MAX_SLEEP_AVG / 2;
+    kproc->prio = effective_prio(kproc);
+    kproc->timeslice = task_timeslice(kproc);
+    g_runqueues[0].online = 1;
+    percpu_of(0)->rq = &g_runqueues[0];
+    percpu_of(0)->current = kproc;
+
+    // The BSP needs an idle task for when the kernel process sleeps: a
+    // kernel frame halting in a loop on a stack of its own
+    process_t* idle = &idle_tasks[0];
+    idle->slot = -1;
+    idle->name[0] = 'i'; idle->name[1] = 'd'; idle->name[2] = 'l';
+    idle->name[3] = 'e'; idle->name[4] = '\0';
+    idle->page_directory = kproc->page_directory;
+    idle->affinity = 0;
+    idle->kernel_stack = (uint64_t)kmalloc_a(PROC_KERNEL_STACK_SIZE);
+    if (idle->kernel_stack) {
+        uint64_t top = idle->kernel_stack + PROC_KERNEL_STACK_SIZE;
+        struct registers* frame = (struct registers*)(top - sizeof(struct registers));
+        memset(frame, 0, sizeof(*frame));
+        frame->rip = (uint64_t)idle_loop;
+        frame->cs = GDT_KERNEL_CODE;
+        frame->ds = GDT_KERNEL_DATA;
+        frame->ss = GDT_KERNEL_DATA;
+        frame->rflags = 0x202; // IF = 1
+        frame->rsp = top - 8;  // As if called
+        idle->rsp = (uint64_t)frame;
+        g_runqueues[0].idle = idle;
+    }
 
     kprintf("process: multi-tasking enabled (kernel process pid=1)\n");
 }
 
+/* Put proc in a free table slot, doubling the table when it is full.
+   Called with g_proc_lock held. */
+static int table_insert(process_t* proc) {
+    for (int i = 0; i < g_proc_capacity; i++) {
+        if (!g_proc_table[i]) {
+            g_proc_table[i] = proc;
+            return i;
+        }
+    }
+
+    int capacity = g_proc_capacity * 2;
+    process_t** table = kmalloc_z(capacity * sizeof(process_t*));
+    if (!table) return -1;
+    memcpy(table, g_proc_table, g_proc_capacity * sizeof(process_t*));
+    kfree(g_proc_table);
+    g_proc_table = table;
+
+    int slot = g_proc_capacity;
+    g_proc_capacity = capacity;
+    g_proc_table[slot] = proc;
+    return slot;
+}
+
+/* Create a process entry. It stays PROC_STOPPED, and so invisible to the
+   scheduler, until its first register frame has been built. */
+static process_t* process_alloc(const char* name) {
+    process_t* proc = kmalloc_z(sizeof(process_t));
+    if (!proc) {
+        kprintf("process: out of memory\n");
+        return NULL;
+    }
+
+    proc->kernel_stack = (uint64_t)kmalloc_a(PROC_KERNEL_STACK_SIZE);
+    if (!proc->kernel_stack) {
+        kfree(proc);
+        kprintf("process: out of memory\n");
+        return NULL;
+    }
+
+    // Copy name
+    int j = 0;
+    while (name[j] && j < 31) {
+        proc->name[j] = name[j];
+        j++;
+    }
+    proc->name[j] = '\0';
+
+    proc->state = PROC_STOPPED;
+    proc->affinity = -1;
+    proc->static_prio = SCHED_PRIO_DEFAULT;
+    proc->sleep_avg = SCHED_MAX_SLEEP_AVG / 2;
+    proc->prio = effective_prio(proc);
+    proc->timeslice = task_timeslice(proc);
+    proc->is_userland = 1;
+
+    uint64_t flags = spinlock_lock_irqsave(&g_proc_lock);
+    proc->slot = table_insert(proc);
+    if (proc->slot >= 0) proc->pid = next_pid++;
+    spinlock_unlock_irqrestore(&g_proc_lock, flags);
+
+    if (proc->slot < 0) {
+        kfree((void*)proc->kernel_stack);
+        kfree(proc);
+        kprintf("process: cannot grow process table\n");
+        return NULL;
+    }
+    return proc;
+}
+
+/* Free a process that is no longer in the table */
+static void process_destroy(process_t* proc) {
+    vmm_destroy_space(proc->vm);
+    if (proc->kernel_stack) kfree((void*)proc->kernel_stack);
+    kfree(proc);
+}
+
+/* Release everything a process owns. It must not be running, and its
+   page tables must not be the ones loaded. */
+static void process_free(process_t* proc) {
+    uint64_t flags = spinlock_lock_irqsave(&g_proc_lock);
+    g_proc_table[proc->slot] = NULL;
+    spinlock_unlock_irqrestore(&g_proc_lock, flags);
+    process_destroy(proc);
+}
+
+/* The register frame a process is first switched to sits at the top of
+   its kernel stack, where the CPU would have pushed it on a trap */
+static struct registers* initial_frame(process_t* proc) {
+    return (struct registers*)(proc->kernel_stack + PROC_KERNEL_STACK_SIZE - sizeof(struct registers));
+}
+
 process_t* process_create(const char* name, uint64_t entry_point) {
-    // Find free slot
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (processes[i].state == PROC_UNUSED) {
-            process_t* proc = &processes[i];
-            proc->pid = next_pid++;
-            proc->entry_point = entry_point;
-            proc->state = PROC_READY;
-            
-            // Copy name
-            int j = 0;
-            while (name[j] && j < 31) {
-                proc->name[j] = name[j];
-                j++;
-            }
-            proc->name[j] = '\0';
-            
-            // Allocate stack (8KB for multitasking safety)
-            proc->stack_pointer = (uint64_t)kmalloc_a(8192) + 8192;
-            
-            // Setup paging subdirectory (Use shared for now)
-            proc->page_directory = (uint64_t)paging_create_directory();
-            
-            // kprintf("process: created pid=%d name=%s entry=0x%lx\n", 
-            //        proc->pid, proc->name, entry_point);
-            return proc;
+    process_t* proc = process_alloc(name);
+    if (!proc) return NULL;
+
+    proc->entry_point = entry_point;
+
+    // Own address space; the stack is an area like any other and costs
+    // nothing until it is touched
+    proc->vm = vmm_create_space();
+    if (!proc->vm || vmm_map_anon(proc->vm, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_SIZE,
+                                  VMA_READ | VMA_WRITE) != 0) {
+        kprintf("process: cannot create address space\n");
+        process_free(proc);
+        return NULL;
+    }
+    proc->page_directory = proc->vm->pml4;
+    proc->stack_pointer = USER_STACK_TOP;
+
+    // kprintf("process: created pid=%d name=%s entry=0x%lx\n", 
+    //        proc->pid, proc->name, entry_point);
+    return proc;
+}
+
+process_t* process_clone(process_t* parent, struct registers* regs) {
+    if (!parent || !parent->vm || !regs) return NULL;
+
+    process_t* proc = process_alloc(parent->name);
+    if (!proc) return NULL;
+
+    proc->vm = vmm_clone_space(parent->vm);
+    if (!proc->vm) {
+        kprintf("process: cannot clone address space\n");
+        process_free(proc);
+        return NULL;
+    }
+    proc->entry_point = parent->entry_point;
+    proc->stack_pointer = parent->stack_pointer;
+    proc->is_64bit = parent->is_64bit;
+    proc->page_directory = proc->vm->pml4;
+
+    struct registers* frame = initial_frame(proc);
+    *frame = *regs;
+    frame->rax = 0;
+    proc->rsp = (uint64_t)frame;
+    scheduler_enqueue(proc);
+    return proc;
+}
+
+process_t* kthread_create(const char* name, void (*entry)(void*), void* arg, int cpu) {
+    process_t* proc = process_alloc(name);
+    if (!proc) return NULL;
+
+    // Runs in ring 0 on the kernel's page tables, like the idle task
+    proc->is_userland = 0;
+    proc->page_directory = __asm_get_cr3();
+    proc->affinity = cpu;
+
+    uint64_t top = proc->kernel_stack + PROC_KERNEL_STACK_SIZE;
+    struct registers* frame = initial_frame(proc);
+    memset(frame, 0, sizeof(*frame));
+    frame->rip = (uint64_t)entry;
+    frame->rdi = (uint64_t)arg;
+    frame->cs = GDT_KERNEL_CODE;
+    frame->ds = GDT_KERNEL_DATA;
+    frame->ss = GDT_KERNEL_DATA;
+    frame->rflags = 0x202; // IF = 1
+    frame->rsp = top - 8;  // As if called
+    proc->rsp = (uint64_t)frame;
+    scheduler_enqueue(proc);
+    return proc;
+}
+
+void kthread_exit(void) {
+    irq_save();
+    process_t* self = current_process;
+    self->state = PROC_ZOMBIE;
+    __atomic_add_fetch(&g_zombies, 1, __ATOMIC_RELAXED);
+    // Not requeued; reap_zombies frees it once on_cpu drops
+    scheduler_sleep();
+    for (;;) __asm__ volatile("hlt");
+}
+
+void process_exit(process_t* proc, int code) {
+    if (!proc || !proc->vm) return;  // The kernel process never exits
+
+    kprintf("process: pid=%d (%s) exited with code %d\n", proc->pid, proc->name, code);
+    proc->state = PROC_ZOMBIE;
+    __atomic_add_fetch(&g_zombies, 1, __ATOMIC_RELAXED);
+
+    if (proc->exit_status) *proc->exit_status = code;
+    if (proc->exit_wait) wait_queue_wake_all(proc->exit_wait);
+}
+
+/* Tear down processes that exited and whose kernel stack no CPU is on
+   any more. The caller has interrupts disabled. */
+static void reap_zombies(void) {
+    if (!__atomic_load_n(&g_zombies, __ATOMIC_RELAXED)) return;
+
+    process_t* dead = NULL;
+    spinlock_lock(&g_proc_lock);
+    for (int i = 0; i < g_proc_capacity; i++) {
+        process_t* p = g_proc_table[i];
+        if (p && p->state == PROC_ZOMBIE && !__atomic_load_n(&p->on_cpu, __ATOMIC_ACQUIRE)) {
+            g_proc_table[i] = NULL;
+            p->rq_next = dead;
+            dead = p;
+            __atomic_sub_fetch(&g_zombies, 1, __ATOMIC_RELAXED);
         }
     }
-    
-    kprintf("process: no free process slots\n");
-    return NULL;
+    spinlock_unlock(&g_proc_lock);
+
+    while (dead) {
+        process_t* p = dead;
+        dead = p->rq_next;
+        process_destroy(p);
+    }
+}
+
+/* Queued plus running work of a CPU, as seen without its lock */
+static uint32_t cpu_load(int cpu) {
+    runqueue_t* rq = &g_runqueues[cpu];
+    process_t* cur = percpu_of(cpu)->current;
+    return rq->nr_queued + (cur && cur != rq->idle ? 1 : 0);
+}
+
+/* Pull one process from the busiest CPU if it has at least two more
+   runnable processes than we do (or any queued one while we are idle).
+   Expired processes have waited longest and go first; a process keeps
+   its array, so pulling work never lets it jump an epoch. */
+static void balance(int cpu) {
+    runqueue_t* rq = &g_runqueues[cpu];
+    uint32_t mine = rq->nr_queued;
+    int busiest = -1;
+    uint32_t max_load = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i == cpu || !g_runqueues[i].online || !g_runqueues[i].nr_queued) continue;
+        uint32_t load = cpu_load(i);
+        if (load > max_load) {
+            max_load = load;
+            busiest = i;
+        }
+    }
+    if (busiest < 0 || max_load < mine + 2) return;
+
+    runqueue_t* src = &g_runqueues[busiest];
+    spinlock_lock(&src->lock);
+    int expired = 1;
+    process_t* p = array_take(src, src->expired, cpu);
+    if (!p) {
+        expired = 0;
+        p = array_take(src, src->active, cpu);
+    }
+    spinlock_unlock(&src->lock);
+    if (!p) return;
+
+    spinlock_lock(&rq->lock);
+    p->cpu = cpu;
+    if (expired) {
+        if (!rq->expired->nr) rq->expired_since = clock_monotonic_ns();
+        array_push(rq, rq->expired, p);
+    } else {
+        array_push(rq, rq->active, p);
+    }
+    spinlock_unlock(&rq->lock);
+}
+
+void scheduler_wake(process_t* proc) {
+    uint64_t slept = clock_monotonic_ns() - proc->sleep_start;
+    proc->sleep_avg += (int)(slept / SCHED_TICK_NS) + 1;
+    if (proc->sleep_avg > SCHED_MAX_SLEEP_AVG) proc->sleep_avg = SCHED_MAX_SLEEP_AVG;
+    proc->prio = effective_prio(proc);
+
+    // Back where its cache is warm; balancing moves it if that CPU is busy
+    int cpu = proc->cpu;
+    if ((proc->affinity >= 0 && proc->affinity != cpu) || !g_runqueues[cpu].online) {
+        cpu = least_loaded_cpu(proc);
+    }
+    enqueue_on(proc, cpu);
+}
+
+int scheduler_can_sleep(void) {
+    percpu_t* pc = this_cpu();
+    process_t* cur = pc->current;
+    if (!cur || cur == pc->rq->idle) return 0;
+
+    // Interrupt handlers and softirqs run on whatever they interrupted
+    if (pc->irq_depth || pc->softirq_active) return 0;
+
+    // The kernel process runs with interrupts on once booted; syscalls
+    // run with them off, but on the calling process's own kernel stack
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0" : "=r"(flags));
+    return (flags & 0x200) || cur->vm;
+}
+
+void scheduler_sleep(void) {
+    // Lands in scheduler_schedule with a frame to come back to, like a
+    // preempted process
+    __asm__ volatile("int %0" : : "i"(SCHED_YIELD_VECTOR) : "memory");
+}
+
+void scheduler_pin_current(int cpu) {
+    process_t* cur = current_process;
+    if (!cur || !g_runqueues[cpu].online) return;
+    cur->affinity = cpu;
+    if (smp_current_cpu() != cpu && scheduler_can_sleep()) scheduler_sleep();
+}
+
+void scheduler_wake_input(void) {
+    wait_queue_wake_all(&g_input_wq);
+}
+
+struct registers* scheduler_input_polled(struct registers* regs, int found) {
+    process_t* cur = current_process;
+    if (!cur || !cur->vm) return regs;
+
+    // Input that arrives after this poll makes the next sleep return at once
+    uint32_t seq = cur->input_seq;
+    cur->input_seq = wait_queue_seq(&g_input_wq);
+    if (found) {
+        cur->input_spins = 0;
+        return regs;
+    }
+    if (++cur->input_spins < SCHED_POLL_SPINS) return regs;
+    cur->input_spins = 0;
+
+    wait_queue_sleep(&g_input_wq, seq, clock_monotonic_ns() + SCHED_INPUT_TIMEOUT_NS);
+    cur->input_seq = wait_queue_seq(&g_input_wq);
+    return regs;
 }
 
 struct registers* scheduler_schedule(struct registers* regs) {
-    if (!current_process) return regs;
+    percpu_t* pc = this_cpu();
+    process_t* prev = pc->current;
+    if (!prev) return regs;
+    // Softirqs run on the stack of whatever they interrupted and cannot be
+    // switched away from; the interrupt that started them switches once
+    // they are done
+    if (pc->softirq_active) {
+        pc->need_resched = 1;
+        return regs;
+    }
+    int cpu = pc->cpu;
+    runqueue_t* rq = pc->rq;
 
     // Save current process stack pointer
-    current_process->rsp = (uint64_t)regs;
-
-    // Pick next process (Simple Round Robin)
-    int current_idx = -1;
-    for (int i = 0; i < MAX_PROCESSES; i++) {
-        if (&processes[i] == current_process) {
-            current_idx = i;
-            break;
-        }
+    prev->rsp = (uint64_t)regs;
+    reap_zombies();
+
+    // A preempted process goes to the back of its level; one whose slice
+    // ran out may have been sent to the expired array (the idle task and
+    // processes that exited or blocked are never queued)
+    // One just pinned elsewhere (scheduler_pin_current) moves over now
+    if (prev != rq->idle && prev->state == PROC_RUNNING && prev->affinity >= 0 &&
+        prev->affinity != cpu) {
+        enqueue_on(prev, prev->affinity);
     }
 
-    process_t* next = NULL;
-    for (int i = 1; i <= MAX_PROCESSES; i++) {
-        int idx = (current_idx + i) % MAX_PROCESSES;
-        if (processes[idx].state == PROC_RUNNING || processes[idx].state == PROC_READY) {
-            next = &processes[idx];
-            break;
+    spinlock_lock(&rq->lock);
+    if (prev != rq->idle && prev->state == PROC_RUNNING) {
+        prev->state = PROC_READY;
+        if (prev->expired_wait) {
+            if (!rq->expired->nr) rq->expired_since = clock_monotonic_ns();
+            array_push(rq, rq->expired, prev);
+        } else {
+            array_push(rq, rq->active, prev);
         }
     }
+    prev->expired_wait = 0;
+    spinlock_unlock(&rq->lock);
+
+    balance(cpu);
+
+    spinlock_lock(&rq->lock);
+    process_t* next = rq_pick(rq, cpu);
+    spinlock_unlock(&rq->lock);
+    if (!next) next = rq->idle ? rq->idle : prev;
+
+    next->state = PROC_RUNNING;
+    if (next == prev) return regs;
+
+    pc->current = next;
+    next->on_cpu = 1;
+    rq->switched_from = prev;
+    percpu_inc(PERCPU_STAT_CTX_SWITCHES);
+
+    // Traps from ring 3 land on the incoming process's kernel stack
+    if (next->vm) {
+        gdt_set_kernel_stack(next->kernel_stack + PROC_KERNEL_STACK_SIZE);
+    }
+
+    // Switch address space; with PCIDs the outgoing one stays cached
+    if (prev->vm != next->vm) {
+        vmm_switch(prev->vm, next->vm);
+    }
 
-    if (next && next != current_process) {
-        current_process = next;
-        next->state = PROC_RUNNING;
-        
-        // Switch address space
-        if (__asm_get_cr3() != next->page_directory) {
-            switch_page_directory((page_directory_t*)next->page_directory);
+    return (struct registers*)next->rsp;
+}
+
+/* Wake one CPU that has stopped ticking so it can pull some of our work */
+static void kick_idle_cpu(int self) {
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        runqueue_t* rq = &g_runqueues[i];
+        if (i == self || !rq->online || percpu_of(i)->current != rq->idle) continue;
+        if (timer_tick_stopped(i)) {
+            timer_kick_cpu(i);
+            return;
         }
-        
-        return (struct registers*)next->rsp;
     }
+}
+
+struct registers* scheduler_tick(struct registers* regs) {
+    percpu_t* pc = this_cpu();
+    process_t* cur = pc->current;
+    if (!cur) return regs;
+    int cpu = pc->cpu;
+    runqueue_t* rq = pc->rq;
+
+    // Idle CPUs look for work on every tick
+    if (cur == rq->idle) return scheduler_schedule(regs);
 
+    if (cur->sleep_avg > 0) cur->sleep_avg--;
+    if (--cur->timeslice <= 0) {
+        cur->prio = effective_prio(cur);
+        cur->timeslice = task_timeslice(cur);
+        // Interactive processes get another turn straight away unless the
+        // expired array has been kept waiting too long
+        cur->expired_wait = !TASK_INTERACTIVE(cur) || expired_starving(rq);
+        return scheduler_schedule(regs);
+    }
+
+    // Otherwise keep running unless something more urgent is queued
+    balance(cpu);
+    if (rq->nr_queued) kick_idle_cpu(cpu);
+    return scheduler_preempt(regs);
+}
+
+struct registers* scheduler_preempt(struct registers* regs) {
+    percpu_t* pc = this_cpu();
+    process_t* cur = pc->current;
+    if (!cur) return regs;
+    runqueue_t* rq = pc->rq;
+
+    if (cur == rq->idle) return scheduler_schedule(regs);
+    uint32_t levels = rq->active->bitmap;
+    if (levels && __builtin_ctz(levels) < cur->prio) {
+        return scheduler_schedule(regs);
+    }
     return regs;
 }
 
+uint32_t scheduler_nr_queued(int cpu) {
+    return g_runqueues[cpu].nr_queued;
+}
+
+int scheduler_cpu_idle(int cpu) {
+    runqueue_t* rq = &g_runqueues[cpu];
+    return rq->idle && percpu_of(cpu)->current == rq->idle;
+}
+
+void scheduler_finish_switch(void) {
+    runqueue_t* rq = this_cpu()->rq;
+    process_t* prev = rq->switched_from;
+    if (prev) {
+        rq->switched_from = NULL;
+        __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+    }
+}
+
+void scheduler_init_cpu(int cpu) {
+    if (cpu <= 0 || cpu >= SMP_MAX_CPUS) return;
+    rq_track(cpu);
+
+    process_t* idle = &idle_tasks[cpu];
+    memset(idle, 0, sizeof(*idle));
+    idle->slot = -1;
+    idle->state = PROC_RUNNING;
+    idle->name[0] = 'i'; idle->name[1] = 'd'; idle->name[2] = 'l';
+    idle->name[3] = 'e'; idle->name[4] = '\0';
+    idle->page_directory = __asm_get_cr3();
+    idle->cpu = cpu;
+    idle->affinity = cpu;
+    idle->on_cpu = 1;
+
+    runqueue_t* rq = &g_runqueues[cpu];
+    rq->idle = idle;
+    percpu_of(cpu)->rq = rq;
+    percpu_of(cpu)->current = idle;
+    __atomic_store_n(&rq->online, 1, __ATOMIC_RELEASE);
+}
+
 void process_execute(process_t* proc) {
-    if (!proc) return;
-    
-    // In a multi-tasking system, 'execute' just marks as ready and waits for scheduler
-    proc->state = PROC_READY;
+    if (!proc || !proc->vm) return;
     
-    // Setup initial stack for switching
-    // We need to 'push' an initial register state onto its stack
-    // Since we identity map the stack, we can write to it here
-    // Setup initial stack for switching
-    // We need to 'push' an initial register state onto its stack
-    struct registers* regs = (struct registers*)(proc->stack_pointer - sizeof(struct registers));
+    // Build the frame the scheduler will "return" to: ring 3 at the entry
+    // point, on the (still unmapped) user stack. ELF32 programs run in
+    // compatibility mode, ELF64 ones in 64-bit mode.
+    struct registers* regs = initial_frame(proc);
     memset(regs, 0, sizeof(struct registers));
     
     regs->rip = proc->entry_point;
-    regs->cs = 0x08;
-    regs->ds = 0x10;
-    regs->ss = 0x10;
+    regs->cs = (proc->is_64bit ? GDT_USER_CODE : GDT_USER_CODE32) | GDT_RPL_USER;
+    regs->ds = GDT_USER_DATA | GDT_RPL_USER;
+    regs->ss = GDT_USER_DATA | GDT_RPL_USER;
     regs->rflags = 0x202; // IF = 1
     regs->rsp = proc->stack_pointer;
     
     proc->rsp = (uint64_t)regs;
+
+    // In a multi-tasking system, 'execute' just queues it for the scheduler
+    scheduler_enqueue(proc);
     
     // kprintf("process: pid=%d queued for execution\n", proc->pid);
 }
@@ -130,16 +795,13 @@ void process_execute(process_t* proc) {
 void process_load_and_execute(process_t* proc, const void* data, size_t size) {
     if (!proc || !data) return;
     
-    // Temporarily switch to process address space to load ELF
-    uint64_t old_cr3 = __asm_get_cr3();
-    switch_page_directory((page_directory_t*)proc->page_directory);
-    
-    if (elf_load(data, size) != 0) {
+    // Only the segment layout is recorded here; pages are faulted in later
+    if (elf_load(proc->vm, data, size) != 0) {
         kprintf("process: failed to load ELF segments\n");
-        switch_page_directory((page_directory_t*)old_cr3);
+        process_free(proc);
         return;
     }
+    proc->is_64bit = elf_is_64bit(data);
     
-    switch_page_directory((page_directory_t*)old_cr3);
     process_execute(proc);
 }
@@ -3,30 +3,82 @@
 
 #include "common.h"
 #include "isr.h"
+#include "vmm.h"
+#include "percpu.h"
 
-#define MAX_PROCESSES 32
+/* Initial size of the process table; it doubles whenever it fills up */
+#define PROC_TABLE_INITIAL 32
+
+/* Scheduler tick on every busy CPU (see timer.c) */
+#define SCHEDULER_HZ 100
+
+/* Priority levels, 0 being the most urgent. A process's static priority
+   is where it starts; its dynamic priority moves a little either side of
+   that depending on how much it sleeps. */
+#define SCHED_NR_PRIO      32
+#define SCHED_PRIO_KERNEL  8      /* The kernel process (GUI loop, shell) */
+#define SCHED_PRIO_DEFAULT 16
+
+/* Software interrupt a process in the kernel blocks through */
+#define SCHED_YIELD_VECTOR 0x81
+
+/* Kernel stack each user process traps onto (TSS RSP0) */
+#define PROC_KERNEL_STACK_SIZE 16384
+
+/* User stack area: reserved up front, materialized page by page. It sits
+   below 3 GiB so 32-bit programs can address it. */
+#define USER_STACK_TOP  0xC0000000ULL
+#define USER_STACK_SIZE (1024 * 1024)
 
 typedef enum {
     PROC_UNUSED = 0,
     PROC_READY,
     PROC_RUNNING,
     PROC_STOPPED,
-    PROC_WAITING
+    PROC_WAITING,
+    PROC_ZOMBIE        /* Exited; torn down once no longer on the CPU */
 } proc_state_t;
 
-typedef struct {
+typedef struct process {
     uint32_t pid;
     uint64_t entry_point;
-    uint64_t stack_pointer;   // Initial stack top
+    uint64_t stack_pointer;   // Initial user stack top
     uint64_t page_directory;
+    vm_space_t* vm;           // User address space (NULL for the kernel)
     proc_state_t state;
     char name[32];
     uint64_t kernel_stack;    // Kernel stack for this process
     uint64_t rsp;             // Saved stack pointer (points to registers)
     int is_userland;
+    int is_64bit;             // Runs in long mode rather than compatibility mode
+
+    // Scheduling
+    struct process* rq_next;  // Run queue link
+    int cpu;                  // Run queue it belongs to
+    int affinity;             // CPU it must stay on, or -1
+    volatile int on_cpu;      // Its kernel stack is in use by a CPU
+    int static_prio;          // Base priority, 0..SCHED_NR_PRIO-1
+    int prio;                 // Dynamic priority it is queued at
+    int timeslice;            // Ticks left before it is preempted
+    int sleep_avg;            // Credit earned sleeping, spent running
+    int expired_wait;         // Goes to the expired array when requeued
+    int input_spins;          // Empty input polls in a row
+    uint32_t input_seq;       // Input wait queue sequence at the last poll
+    uint64_t sleep_start;     // When it last went to sleep (ns)
+
+    // Sleeping (wait.c)
+    struct wait_queue* wait_queue; // Queue it sleeps on
+    struct process* wait_next;     // Wait queue link
+    volatile int wait_timed_out;
+
+    // Told the exit code, if set, by whoever started it
+    struct wait_queue* exit_wait;
+    volatile int* exit_status;
+    int slot;                 // Index in the process table
 } process_t;
 
-extern process_t* current_process;
+/* The process running on the calling CPU */
+#define current_process ((process_t*)percpu_current())
 
 /* Initialize process manager */
 void process_init(void);
@@ -38,4 +90,61 @@ process_t* process_create(const char* name, uint64_t entry_point);
 void process_execute(process_t* proc);
 void process_load_and_execute(process_t* proc, const void* data, size_t size);
 
+/* Fork-style copy of a user process whose trap frame is regs. The child
+   resumes from the same frame with RAX = 0; memory is shared copy-on-write. */
+process_t* process_clone(process_t* parent, struct registers* regs);
+
+/* Kernel thread running entry(arg) in ring 0, pinned to cpu (-1 for any).
+   entry must not return; it loops forever or ends with kthread_exit. */
+process_t* kthread_create(const char* name, void (*entry)(void*), void* arg, int cpu);
+
+/* End the calling kernel thread; it is reclaimed once switched away from */
+void kthread_exit(void) __attribute__((noreturn));
+
+/* Mark a process dead; its memory is reclaimed after it is switched away */
+void process_exit(process_t* proc, int code);
+
+/* Per-CPU priority run queues. scheduler_tick is the timer interrupt:
+   it charges the running process's timeslice and preempts it when that
+   runs out or something more urgent is queued. scheduler_schedule gives
+   up the CPU now (the caller exited, blocked or was killed). */
+struct registers* scheduler_tick(struct registers* regs);
+struct registers* scheduler_schedule(struct registers* regs);
+
+/* Called after an input-polling syscall with whether it found anything.
+   A process that keeps finding nothing is put to sleep until input
+   arrives (or a tick passes) and returned to with a priority boost. */
+struct registers* scheduler_input_polled(struct registers* regs, int found);
+
+/* Keep the calling process on cpu from now on, moving it there first if
+   it can sleep (a process in a syscall can). */
+void scheduler_pin_current(int cpu);
+
+/* New keyboard/mouse events or terminal output: wake sleeping pollers */
+void scheduler_wake_input(void);
+
+/* Called by an AP once it can take interrupts; its boot stack becomes
+   the idle task it falls back to when nothing is runnable */
+void scheduler_init_cpu(int cpu);
+
+/* Switch only if something more urgent than the current process is
+   queued here (or this CPU is idle); for interrupts other than the tick */
+struct registers* scheduler_preempt(struct registers* regs);
+
+/* For the tick (timer.c): processes waiting in cpu's run queue, and
+   whether cpu is running its idle task */
+uint32_t scheduler_nr_queued(int cpu);
+int scheduler_cpu_idle(int cpu);
+
+/* Blocking (wait.c). A process that has made itself PROC_WAITING, and
+   made sure someone will pass it to scheduler_wake, gives up the CPU with
+   scheduler_sleep. Only process context can sleep: not interrupt
+   handlers, the idle task, or the kernel before interrupts are on. */
+int scheduler_can_sleep(void);
+void scheduler_sleep(void);
+void scheduler_wake(process_t* proc);
+
+/* Called from the interrupt stubs after switching to another task's frame */
+void scheduler_finish_switch(void);
+
 #endif
@@ -1,62 +1,102 @@
 #include "smp.h"
 #include "acpi.h"
 #include "apic.h"
-#include "hpet.h"
 #include "../lib/memory.h"
 #include "../lib/printf.h"
 #include "gdt.h"
 #include "idt.h"
+#include "paging.h"
+#include "process.h"
+#include "syscall.h"
+#include "timer.h"
+#include "wait.h"
+#include "clock.h"
+#include "io.h"
+#include "percpu.h"
 extern uint64_t g_hhdm_offset;
 
 extern uint8_t _binary_build_smp_trampoline_bin_start[];
 extern uint8_t _binary_build_smp_trampoline_bin_end[];
 
 static volatile uint32_t g_cpus_online = 1;
+static uint8_t g_cpu_to_apic[SMP_MAX_CPUS];
 
-void kernel_ap_main(void) {
-    // Adopt kernel state
-    extern void gdt_ap_load(void);
+uint32_t smp_get_cpu_count(void) {
+    return g_cpus_online;
+}
+
+uint32_t smp_cpu_apic_id(int cpu) {
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS) return 0;
+    return g_cpu_to_apic[cpu];
+}
+
+#define AP_STACK_SIZE 16384
+#define AP_TRAMPOLINE_PHYS 0x8000
+
+/* All APs start together and get as long as this, in total, to arrive */
+#define AP_BOOT_TIMEOUT_NS 1000000000ULL
+#define AP_SIPI_DELAY_NS   200000ULL
+
+/* The data block at the end of smp_trampoline.S */
+typedef struct {
+    uint32_t pml4;          /* Kernel PML4; the trampoline loads CR3 from 32-bit code */
+    uint32_t count;         /* Stacks available */
+    uint32_t next;          /* Next ticket, taken with lock xadd */
+    uint32_t reserved;
+    uint64_t stacks;        /* uint64_t[count] of stack tops */
+    uint64_t entry;         /* kernel_ap_main */
+} __attribute__((packed)) smp_trampoline_data_t;
+
+static uint64_t g_ap_stacks[SMP_MAX_CPUS];
+
+/* cpu is the index the trampoline handed out */
+void kernel_ap_main(int cpu) {
+    // Nothing that looks at the per-CPU area can run before this
+    uint32_t apic_id = lapic_get_id();
+    percpu_init_cpu(cpu, apic_id);
+    g_cpu_to_apic[cpu] = (uint8_t)apic_id;
+
+    // Adopt kernel state: paging features, own TSS, shared IDT
     extern void idt_ap_load(void);
-    gdt_ap_load();
+    paging_init_cpu();
+    gdt_init_ap(cpu);
     idt_ap_load();
+    syscall_init_cpu();
 
     lapic_init(); // Init LAPIC for this CPU
     serial_printf("SMP: CPU %d is online\n", lapic_get_id());
+
+    // This stack is the CPU's idle task from here on
+    scheduler_init_cpu(cpu);
+    timer_init_cpu();
     __atomic_add_fetch(&g_cpus_online, 1, __ATOMIC_SEQ_CST);
-    while(1) { __asm__("hlt"); }
+    for (;;) timer_idle(0);
 }
 
-void smp_boot_cpu(uint8_t apic_id) {
-    uintptr_t trampoline_phys = 0x8000;
-    size_t trampoline_size = _binary_build_smp_trampoline_bin_end - _binary_build_smp_trampoline_bin_start;
-    
-    // Copy trampoline
-    memcpy((void*)(trampoline_phys + g_hhdm_offset), _binary_build_smp_trampoline_bin_start, trampoline_size);
-
-    // Setup data at the end of trampoline
-    // We'll use the last 24 bytes as defined in .S
-    uint64_t pml4;
-    __asm__ volatile("mov %%cr3, %0" : "=r"(pml4));
-
-    void* stack = kmalloc(16384); // 16KB stack
-    
-    // Offsets from end of trampoline: 20 (ap_pml4), 16 (ap_stack), 8 (ap_entry_ptr)
-    // Offsets from end of trampoline: 20 (ap_pml4), 16 (ap_stack), 8 (ap_entry_ptr)
-    *(uint32_t*)(trampoline_phys + g_hhdm_offset + trampoline_size - 20) = pml4;
-    *(uint64_t*)(trampoline_phys + g_hhdm_offset + trampoline_size - 16) = (uintptr_t)stack + 16384;
-    *(uint64_t*)(trampoline_phys + g_hhdm_offset + trampoline_size - 8) = (uintptr_t)kernel_ap_main;
-
-    // Send INIT IPI
-    lapic_write(LAPIC_ICRH, (uint32_t)apic_id << 24);
-    lapic_write(LAPIC_ICRL, 0x00004500); // Level Assert, INIT
-
-    hpet_sleep(10); // Wait 10ms
-
-    // Send STARTUP IPI (Vector 0x08 -> 0x8000)
-    lapic_write(LAPIC_ICRH, (uint32_t)apic_id << 24);
-    lapic_write(LAPIC_ICRL, 0x00004608); // Start-up, Vector 0x08
-
-    hpet_sleep(1);
+static void smp_send_all_but_self(uint32_t icr) {
+    while (lapic_read(LAPIC_ICRL) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+    lapic_write(LAPIC_ICRH, 0);
+    lapic_write(LAPIC_ICRL, LAPIC_ICR_ALL_BUT_SELF | icr);
+}
+
+/* INIT-SIPI-SIPI to every other CPU at once, rather than one at a time */
+static void smp_start_aps(void) {
+    smp_send_all_but_self(LAPIC_ICR_ASSERT | LAPIC_ICR_INIT);
+    sleep_ms(10);
+
+    // The second STARTUP is for CPUs that missed the first; one already
+    // running ignores it
+    uint8_t vector = AP_TRAMPOLINE_PHYS >> 12;
+    for (int i = 0; i < 2; i++) {
+        smp_send_all_but_self(LAPIC_ICR_ASSERT | LAPIC_ICR_STARTUP | vector);
+        uint64_t until = clock_monotonic_ns() + AP_SIPI_DELAY_NS;
+        // Port writes pace the loop, so the cap holds without a clock
+        for (uint64_t spins = 0; clock_monotonic_ns() < until && spins < CLOCK_POLL_LIMIT(AP_SIPI_DELAY_NS); spins++) {
+            io_wait();
+        }
+    }
 }
 
 void smp_init(void) {
@@ -65,19 +105,58 @@ void smp_init(void) {
 
     kprintf("SMP: Detected %d CPUs. BSP ID is %d\n", cpu_count, bsp_id);
 
-    for (uint32_t i = 0; i < cpu_count; i++) {
-        uint8_t id = acpi_get_cpu_apic_id(i);
-        if (id != bsp_id) {
-            uint32_t count_before = g_cpus_online;
-            smp_boot_cpu(id);
-            
-            // Wait for CPU to come online (max 1 second)
-            int timeout = 1000;
-            while (g_cpus_online == count_before && timeout--) {
-                hpet_sleep(1);
-            }
-        }
+    // APs number themselves from 1 in the order they reach the trampoline
+    if (cpu_count > SMP_MAX_CPUS) cpu_count = SMP_MAX_CPUS;
+    g_cpu_to_apic[0] = bsp_id;
+    percpu_of(0)->apic_id = bsp_id;
+    if (cpu_count <= 1) return;
+
+    // APs run the trampoline from its physical address with paging on,
+    // so identity-map that page in the kernel PML4 while they start.
+    // Only the kernel half is shared with user address spaces.
+    page_directory_t* kdir = paging_kernel_directory();
+    if (!kdir) {
+        kprintf("SMP: no kernel page tables, not starting APs\n");
+        return;
+    }
+    paging_map(kdir, AP_TRAMPOLINE_PHYS, AP_TRAMPOLINE_PHYS, PTE_PRESENT | PTE_WRITABLE);
+
+    uint32_t ap_count = 0;
+    while (ap_count < cpu_count - 1) {
+        void* stack = kmalloc(AP_STACK_SIZE);
+        if (!stack) break;
+        g_ap_stacks[ap_count++] = (uintptr_t)stack + AP_STACK_SIZE;
     }
 
-    kprintf("SMP: %d CPUs online total.\n", g_cpus_online);
+    size_t trampoline_size = _binary_build_smp_trampoline_bin_end - _binary_build_smp_trampoline_bin_start;
+    uint8_t* trampoline = (uint8_t*)(AP_TRAMPOLINE_PHYS + g_hhdm_offset);
+    memcpy(trampoline, _binary_build_smp_trampoline_bin_start, trampoline_size);
+
+    smp_trampoline_data_t* data =
+        (smp_trampoline_data_t*)(trampoline + trampoline_size - sizeof(smp_trampoline_data_t));
+    data->pml4 = (uint32_t)(uint64_t)kdir;
+    data->count = ap_count;
+    data->next = 0;
+    data->stacks = (uintptr_t)g_ap_stacks;
+    data->entry = (uintptr_t)kernel_ap_main;
+
+    uint64_t start = clock_monotonic_ns();
+    smp_start_aps();
+
+    // One wait for all of them. This runs before interrupts are on.
+    uint64_t deadline = start + AP_BOOT_TIMEOUT_NS;
+    uint64_t spins = 0;
+    while (g_cpus_online < ap_count + 1 && clock_monotonic_ns() < deadline &&
+           spins++ < CLOCK_POLL_LIMIT(AP_BOOT_TIMEOUT_NS)) {
+        io_wait();
+    }
+
+    // An AP still on its way through the trampoline needs the page
+    if (g_cpus_online == ap_count + 1) {
+        paging_unmap(kdir, AP_TRAMPOLINE_PHYS, PAGE_SIZE);
+    } else {
+        kprintf("SMP: %d of %d APs did not start\n", ap_count + 1 - g_cpus_online, ap_count);
+    }
+    kprintf("SMP: %d CPUs online total (%d us).\n", g_cpus_online,
+            (uint32_t)((clock_monotonic_ns() - start) / 1000));
 }
@@ -1,6 +1,24 @@
 #ifndef SMP_H
 #define SMP_H
 
+#include <stdint.h>
+
+#define SMP_MAX_CPUS 64
+
+/* Where percpu_t keeps the CPU index (see percpu.h) */
+#define PERCPU_CPU_OFFSET 8
+
 void smp_init(void);
 
+/* Dense index of the calling CPU (BSP is 0), from its per-CPU area */
+static inline int smp_current_cpu(void) {
+    int cpu;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(cpu) : "i"(PERCPU_CPU_OFFSET));
+    return cpu;
+}
+
+uint32_t smp_get_cpu_count(void);
+/* LAPIC ID of a CPU index, for addressing IPIs */
+uint32_t smp_cpu_apic_id(int cpu);
+
 #endif
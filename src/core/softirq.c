@@ -0,0 +1,142 @@
+#include "softirq.h"
+#include "process.h"
+#include "spinlock.h"
+#include "wait.h"
+#include "clock.h"
+#include "../lib/printf.h"
+
+/* One pass at interrupt exit: this many rounds or this long */
+#define SOFTIRQ_MAX_RESTART 10
+#define SOFTIRQ_BUDGET_NS   2000000ULL
+
+static softirq_handler_t g_handlers[SOFTIRQ_COUNT];
+static process_t* g_ksoftirqd[SMP_MAX_CPUS];
+static wait_queue_t g_ksoftirqd_wait[SMP_MAX_CPUS];
+
+/* Tasklets scheduled on each CPU and not yet run; only that CPU touches
+   its list, with interrupts off */
+static tasklet_t* g_tasklet_head[SMP_MAX_CPUS];
+static tasklet_t* g_tasklet_tail[SMP_MAX_CPUS];
+
+void softirq_register(softirq_t nr, softirq_handler_t handler) {
+    if (nr < SOFTIRQ_COUNT) g_handlers[nr] = handler;
+}
+
+static uint32_t take_pending(void) {
+    uint32_t pending = 0;
+    __asm__ volatile("xchgl %0, %%gs:%c1"
+                     : "+r"(pending) : "i"(__builtin_offsetof(percpu_t, softirq_pending))
+                     : "memory");
+    return pending;
+}
+
+/* Handle pending softirqs until there are none or the budget is spent.
+   Called with interrupts off; they are on while handlers run. Returns
+   whether work is left. */
+static int softirq_batch(percpu_t* pc) {
+    uint64_t deadline = clock_monotonic_ns() + SOFTIRQ_BUDGET_NS;
+    pc->softirq_active = 1;
+    for (int round = 0; round < SOFTIRQ_MAX_RESTART; round++) {
+        uint32_t pending = take_pending();
+        if (!pending) break;
+
+        __asm__ volatile("sti" : : : "memory");
+        while (pending) {
+            int nr = __builtin_ctz(pending);
+            pending &= pending - 1;
+            if (g_handlers[nr]) g_handlers[nr]();
+            percpu_inc(PERCPU_STAT_SOFTIRQS);
+        }
+        __asm__ volatile("cli" : : : "memory");
+
+        if (clock_monotonic_ns() >= deadline) break;
+    }
+    pc->softirq_active = 0;
+    return pc->softirq_pending != 0;
+}
+
+void softirq_run(void) {
+    percpu_t* pc = this_cpu();
+    if (softirq_batch(pc) && g_ksoftirqd[pc->cpu]) {
+        wait_queue_wake_one(&g_ksoftirqd_wait[pc->cpu]);
+    }
+}
+
+static void ksoftirqd(void* arg) {
+    wait_queue_t* wq = &g_ksoftirqd_wait[(int)(uintptr_t)arg];
+    for (;;) {
+        uint32_t seq = wait_queue_seq(wq);
+        if (!this_cpu()->softirq_pending) {
+            wait_queue_sleep(wq, seq, 0);
+            continue;
+        }
+        // Between batches processes get their turn at the next tick
+        uint64_t flags = irq_save();
+        softirq_batch(this_cpu());
+        irq_restore(flags);
+    }
+}
+
+/* Tasklets */
+
+static void tasklet_enqueue(tasklet_t* t) {
+    int cpu = smp_current_cpu();
+    t->next = NULL;
+    if (g_tasklet_tail[cpu]) g_tasklet_tail[cpu]->next = t;
+    else g_tasklet_head[cpu] = t;
+    g_tasklet_tail[cpu] = t;
+    softirq_raise(SOFTIRQ_TASKLET);
+}
+
+void tasklet_init(tasklet_t* t, void (*func)(void* data), void* data) {
+    t->next = NULL;
+    t->func = func;
+    t->data = data;
+    t->state = 0;
+}
+
+void tasklet_schedule(tasklet_t* t) {
+    if (__atomic_fetch_or(&t->state, TASKLET_SCHEDULED, __ATOMIC_ACQ_REL) & TASKLET_SCHEDULED) return;
+    uint64_t flags = irq_save();
+    tasklet_enqueue(t);
+    irq_restore(flags);
+}
+
+static void tasklet_action(void) {
+    uint64_t flags = irq_save();
+    int cpu = smp_current_cpu();
+    tasklet_t* list = g_tasklet_head[cpu];
+    g_tasklet_head[cpu] = NULL;
+    g_tasklet_tail[cpu] = NULL;
+    irq_restore(flags);
+
+    while (list) {
+        tasklet_t* t = list;
+        list = t->next;
+
+        // Still running on another CPU: leave it for the next round
+        if (__atomic_fetch_or(&t->state, TASKLET_RUNNING, __ATOMIC_ACQUIRE) & TASKLET_RUNNING) {
+            flags = irq_save();
+            tasklet_enqueue(t);
+            irq_restore(flags);
+            continue;
+        }
+        __atomic_and_fetch(&t->state, ~TASKLET_SCHEDULED, __ATOMIC_ACQ_REL);
+        t->func(t->data);
+        __atomic_and_fetch(&t->state, ~TASKLET_RUNNING, __ATOMIC_RELEASE);
+    }
+}
+
+void softirq_init(void) {
+    softirq_register(SOFTIRQ_TASKLET, tasklet_action);
+
+    int started = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        wait_queue_init(&g_ksoftirqd_wait[cpu]);
+        // CPUs with a run queue are the ones that came up
+        if (!percpu_of(cpu)->rq) continue;
+        g_ksoftirqd[cpu] = kthread_create("ksoftirqd", ksoftirqd, (void*)(uintptr_t)cpu, cpu);
+        if (g_ksoftirqd[cpu]) started++;
+    }
+    kprintf("softirq: ksoftirqd on %d CPUs\n", started);
+}
@@ -0,0 +1,64 @@
+#ifndef SOFTIRQ_H
+#define SOFTIRQ_H
+
+#include "common.h"
+#include "percpu.h"
+
+/*
+   Deferred interrupt work. A hard IRQ handler only acknowledges its
+   device and raises a softirq (or schedules a tasklet); that work then
+   runs on the same CPU once the handler is done and the LAPIC has had
+   its EOI, with interrupts enabled, so the mouse, keyboard and timer
+   are not held up behind protocol processing.
+
+   Softirqs are not preempted and must not sleep. A pass at interrupt
+   exit is bounded; work still pending after it (a packet flood, say)
+   is left to the CPU's ksoftirqd thread, which the scheduler treats
+   like any other task.
+*/
+
+typedef enum {
+    SOFTIRQ_TASKLET,
+    SOFTIRQ_COUNT
+} softirq_t;
+
+typedef void (*softirq_handler_t)(void);
+
+void softirq_register(softirq_t nr, softirq_handler_t handler);
+
+/* Mark nr pending on the calling CPU. Callable from anywhere; a single
+   or to memory, which an interrupt cannot split. */
+static inline void softirq_raise(softirq_t nr) {
+    __asm__ volatile("orl %0, %%gs:%c1"
+                     : : "r"(1u << nr), "i"(__builtin_offsetof(percpu_t, softirq_pending))
+                     : "memory");
+}
+
+/* Run what is pending on this CPU. For irq_handler: called with
+   interrupts off and outside any softirq, returns with them off. */
+void softirq_run(void);
+
+/* Start a ksoftirqd thread on each online CPU */
+void softirq_init(void);
+
+/*
+   Tasklets: a function queued from an interrupt handler to run once in
+   softirq context. A tasklet scheduled again before it ran runs once;
+   one never runs on two CPUs at the same time.
+*/
+typedef struct tasklet {
+    struct tasklet* next;
+    void (*func)(void* data);
+    void* data;
+    volatile uint32_t state;    /* TASKLET_* */
+} tasklet_t;
+
+#define TASKLET_SCHEDULED 1
+#define TASKLET_RUNNING   2
+
+void tasklet_init(tasklet_t* t, void (*func)(void* data), void* data);
+
+/* Queue t on the calling CPU unless it is already queued */
+void tasklet_schedule(tasklet_t* t);
+
+#endif
@@ -0,0 +1,40 @@
+#include "spinlock.h"
+#include "../lib/memory.h"
+
+/* Statistics live here rather than in the locks so the locks stay small
+   and lockstat has one place to look. Counters are only written by the
+   CPU holding the lock in question; reads and resets from lockstat do
+   not take it, so they may be a few acquisitions off. */
+static lock_stat_t g_lock_stats[LOCKSTAT_MAX];
+static volatile int g_lock_stat_count = 0;
+
+int spinlock_track(spinlock_t* lock, const char* name) {
+    int i = __atomic_fetch_add(&g_lock_stat_count, 1, __ATOMIC_RELAXED);
+    if (i >= LOCKSTAT_MAX) {
+        __atomic_fetch_sub(&g_lock_stat_count, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    memset(&g_lock_stats[i], 0, sizeof(lock_stat_t));
+    g_lock_stats[i].name = name;
+    __atomic_store_n(&lock->stat, &g_lock_stats[i], __ATOMIC_RELEASE);
+    return 0;
+}
+
+int spinlock_stats(lock_stat_t* out, int max) {
+    int count = g_lock_stat_count;
+    if (count > LOCKSTAT_MAX) count = LOCKSTAT_MAX;
+    if (count > max) count = max;
+    for (int i = 0; i < count; i++) out[i] = g_lock_stats[i];
+    return count;
+}
+
+void spinlock_stats_reset(void) {
+    int count = g_lock_stat_count;
+    if (count > LOCKSTAT_MAX) count = LOCKSTAT_MAX;
+    for (int i = 0; i < count; i++) {
+        g_lock_stats[i].acquisitions = 0;
+        g_lock_stats[i].contended = 0;
+        g_lock_stats[i].spins = 0;
+        g_lock_stats[i].max_hold_cycles = 0;
+    }
+}
@@ -2,24 +2,130 @@
 #define SPINLOCK_H
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 
-typedef volatile int spinlock_t;
+/*
+   Ticket spinlock: a CPU takes the next ticket and waits until the owner
+   count reaches it, so the lock is handed out in arrival order and
+   waiters only read the shared line until their turn comes.
+
+   A lock may also carry a lock_stat_t (see spinlock_track), in which case
+   every acquisition is counted along with how long it spun and how long
+   it was held. Untracked locks pay only for the NULL check.
+*/
+
+typedef struct lock_stat {
+    const char* name;
+    uint64_t acquisitions;
+    uint64_t contended;         /* Acquisitions that had to wait */
+    uint64_t spins;             /* Wait loop iterations, all told */
+    uint64_t max_hold_cycles;   /* TSC cycles */
+    uint64_t acquired_at;       /* TSC at the current holder's acquisition */
+} lock_stat_t;
+
+typedef struct {
+    union {
+        volatile uint32_t word;
+        struct {
+            volatile uint16_t owner;    /* Ticket now being served */
+            volatile uint16_t next;     /* Next ticket to hand out */
+        };
+    };
+    lock_stat_t* stat;
+} spinlock_t;
+
+#define SPINLOCK_INIT { { 0 }, NULL }
 
 static inline void spinlock_init(spinlock_t* lock) {
-    *lock = 0;
+    lock->word = 0;
+    lock->stat = NULL;
+}
+
+static inline uint64_t spinlock_tsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Called with the lock just taken */
+static inline void spinlock_account(spinlock_t* lock, uint64_t spins) {
+    lock_stat_t* stat = lock->stat;
+    stat->acquisitions++;
+    if (spins) {
+        stat->contended++;
+        stat->spins += spins;
+    }
+    stat->acquired_at = spinlock_tsc();
 }
 
 static inline void spinlock_lock(spinlock_t* lock) {
-    while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
-        while (*lock) { 
-            __asm__ volatile("pause");
-        }
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        __asm__ volatile("pause");
+        spins++;
+    }
+    if (lock->stat) spinlock_account(lock, spins);
+}
+
+/* Take the lock only if nobody holds or waits for it */
+static inline bool spinlock_trylock(spinlock_t* lock) {
+    uint32_t word = lock->word;
+    if ((uint16_t)word != (uint16_t)(word >> 16)) return false;
+    if (!__atomic_compare_exchange_n(&lock->word, &word, word + 0x10000, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
     }
+    if (lock->stat) spinlock_account(lock, 0);
+    return true;
 }
 
 static inline void spinlock_unlock(spinlock_t* lock) {
-    __atomic_clear(lock, __ATOMIC_RELEASE);
+    lock_stat_t* stat = lock->stat;
+    if (stat) {
+        uint64_t held = spinlock_tsc() - stat->acquired_at;
+        if (held > stat->max_hold_cycles) stat->max_hold_cycles = held;
+    }
+    // Only the holder writes owner
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
+}
+
+/* Disable interrupts on this CPU, returning the previous RFLAGS */
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & 0x200) {
+        __asm__ volatile("sti" : : : "memory");
+    }
 }
 
+/* For locks also taken from interrupt handlers: interrupts stay off on
+   this CPU while it holds the lock, so a handler can't spin on it */
+static inline uint64_t spinlock_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags = irq_save();
+    spinlock_lock(lock);
+    return flags;
+}
+
+static inline void spinlock_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spinlock_unlock(lock);
+    irq_restore(flags);
+}
+
+/* Start collecting statistics for lock under name, shown by lockstat.
+   Call before the lock is in use. Returns -1 once LOCKSTAT_MAX locks
+   are tracked. */
+#define LOCKSTAT_MAX 64
+int spinlock_track(spinlock_t* lock, const char* name);
+
+/* For lockstat: copy up to max tracked locks' statistics into out and
+   return how many were copied; zero every tracked lock's counters */
+int spinlock_stats(lock_stat_t* out, int max);
+void spinlock_stats_reset(void);
+
 #endif
@@ -4,13 +4,21 @@
 #include "../lib/printf.h"
 #include "isr.h"
 #include "process.h"
+#include "gdt.h"
+#include "io.h"
 #include "../gui/window_manager.h"
 #include "../gui/graphics.h"
-
-struct registers* scheduler_schedule(struct registers* regs);
+#include "../gui/gui_cmd.h"
+#include "paging.h"
+#include "vmm.h"
+#include "../lib/memory.h"
 
 void sys_exit(int code) {
-    kprintf("syscall: exit(%d)\n", code);
+    if (current_process && current_process->vm) {
+        process_exit(current_process, code);
+    } else {
+        kprintf("syscall: exit(%d)\n", code);
+    }
 }
 
 int sys_write(int fd, const char* buf, int count) {
@@ -35,28 +43,35 @@ static void* sys_exit_wrapper(uint64_t code, uint64_t b, uint64_t c, uint64_t d,
     return NULL;
 }
 
+/* The GUI calls hold the WM lock throughout, and look the handle up
+   under it: the window may be closed by the GUI loop on another CPU */
 static void* sys_gui_window_open_wrapper(uint64_t x, uint64_t y, uint64_t w, uint64_t h, uint64_t title) {
+    uint64_t flags = wm_lock();
     window_t* win = wm_create_window((int)x, (int)y, (int)w, (int)h, (const char*)title);
     if (win) {
         win->is_userland = 1;
         win->bg_color = 0xFFFFFFFF;
     }
+    wm_unlock(flags);
     return (void*)win;
 }
 
 static void* sys_gui_draw_text_wrapper(uint64_t handle, uint64_t x, uint64_t y, uint64_t text, uint64_t color) {
-    window_t* win = (window_t*)handle;
-    if (win && win->magic == WM_MAGIC) {
+    uint64_t flags = wm_lock();
+    window_t* win = wm_lookup(handle);
+    if (win) {
         wm_prepare_window_drawing(win);
         wm_draw_string(win, (int)x, (int)y, (const char*)text, (uint32_t)color);
     }
+    wm_unlock(flags);
     return NULL;
 }
 
 static void* sys_gui_fill_rect_wrapper(uint64_t handle, uint64_t xy, uint64_t wh, uint64_t color, uint64_t unused) {
     (void)unused;
-    window_t* win = (window_t*)handle;
-    if (win && win->magic == WM_MAGIC) {
+    uint64_t flags = wm_lock();
+    window_t* win = wm_lookup(handle);
+    if (win) {
         int x = (int)(xy >> 16);
         int y = (int)(xy & 0xFFFF);
         int w = (int)(wh >> 16);
@@ -64,29 +79,83 @@ static void* sys_gui_fill_rect_wrapper(uint64_t handle, uint64_t xy, uint64_t wh
         wm_prepare_window_drawing(win);
         wm_fill_rect(win, x, y, w, h, (uint32_t)color);
     }
+    wm_unlock(flags);
+    return NULL;
+}
+
+static void* sys_gui_submit_wrapper(uint64_t handle, uint64_t buf, uint64_t len, uint64_t d, uint64_t e) {
+    (void)d; (void)e;
+    process_t* proc = current_process;
+    if (!proc || !proc->vm || len > GUI_CMD_MAX_BYTES) return (void*)-1;
+    if (len == 0) return (void*)0;
+
+    // Parse a private copy: the caller's other threads can still rewrite
+    // the buffer, and an unmapped page must fail the call, not the kernel
+    void* copy = kmalloc(len);
+    if (!copy) return (void*)-1;
+    if (vmm_copy_from_user(proc->vm, copy, buf, len) != 0) {
+        kfree(copy);
+        return (void*)-1;
+    }
+
+    uint64_t flags = wm_lock();
+    window_t* win = wm_lookup(handle);
+    int drawn = win ? wm_submit_commands(win, copy, (uint32_t)len) : -1;
+    wm_unlock(flags);
+    kfree(copy);
+    return (void*)(int64_t)drawn;
+}
+
+static void* sys_gui_map_surface_wrapper(uint64_t handle, uint64_t b, uint64_t c, uint64_t d, uint64_t e) {
+    (void)b; (void)c; (void)d; (void)e;
+    process_t* proc = current_process;
+    uint64_t addr = 0;
+    if (!proc || !proc->vm) return (void*)-1;
+    uint64_t flags = wm_lock();
+    window_t* win = wm_lookup(handle);
+    int ret = win ? wm_map_surface(win, proc->vm, &addr) : -1;
+    wm_unlock(flags);
+    return ret == 0 ? (void*)addr : (void*)-1;
+}
+
+/* Every frame already copies each whole surface to the back buffer, so
+   there is nothing to do for a damaged rectangle yet. The call stays so
+   programs written against it keep working if composition ever becomes
+   incremental. */
+static void* sys_gui_present_wrapper(uint64_t handle, uint64_t x, uint64_t y, uint64_t w, uint64_t h) {
+    (void)handle; (void)x; (void)y; (void)w; (void)h;
     return NULL;
 }
 
 static void* sys_gui_event_poll_wrapper(uint64_t handle, uint64_t ev_ptr, uint64_t c, uint64_t d, uint64_t e) {
     (void)c; (void)d; (void)e;
-    window_t* win = (window_t*)handle;
     hz_event_t* dest = (hz_event_t*)ev_ptr;
-
-    if (!win || !ev_ptr || win->magic != WM_MAGIC) {
-        if (dest) dest->type = HZ_EVENT_QUIT;
-        return (void*)0; 
+    hz_event_t ev;
+    if (!dest) return (void*)0;
+
+    uint64_t flags = wm_lock();
+    window_t* win = wm_lookup(handle);
+    int found = 0;
+    if (!win) {
+        ev.type = HZ_EVENT_QUIT;
+    } else if (win->event_head != win->event_tail) {
+        ev = win->event_queue[win->event_tail];
+        win->event_tail = (win->event_tail + 1) % EVENT_QUEUE_SIZE;
+        found = 1;
     }
+    wm_unlock(flags);
 
-    if (win->event_head == win->event_tail) return (void*)0;
-
-    *dest = win->event_queue[win->event_tail];
-    win->event_tail = (win->event_tail + 1) % EVENT_QUEUE_SIZE;
-
-    return (void*)1;
+    if (!win || found) *dest = ev;
+    return (void*)(uint64_t)found;
 }
 
 static void* sys_shell_exec_wrapper(uint64_t command, uint64_t b, uint64_t c, uint64_t d, uint64_t e) {
     (void)b; (void)c; (void)d; (void)e;
+    // Shell commands reach all over the kernel (filesystems, drivers,
+    // the shell's own state) and were written for the BSP, where the
+    // keyboard interrupt and the GUI loop run them too. Programs that
+    // use them stay there.
+    scheduler_pin_current(0);
     command_execute((const char*)command);
     return NULL;
 }
@@ -96,6 +165,11 @@ static void* sys_terminal_get_char_wrapper(uint64_t a, uint64_t b, uint64_t c, u
     return (void*)(uint64_t)terminal_get_char();
 }
 
+static void* sys_getpid_wrapper(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e) {
+    (void)a; (void)b; (void)c; (void)d; (void)e;
+    return (void*)(uint64_t)(current_process ? current_process->pid : 0);
+}
+
 typedef void* (*syscall_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
 static syscall_t syscalls[] = {
@@ -107,11 +181,16 @@ static syscall_t syscalls[] = {
     [SYS_GUI_EVENT_POLL]  = sys_gui_event_poll_wrapper,
     [SYS_SHELL_EXEC]      = sys_shell_exec_wrapper,
     [SYS_TERMINAL_GET_CHAR] = sys_terminal_get_char_wrapper,
+    [SYS_GETPID]          = sys_getpid_wrapper,
+    [SYS_GUI_SUBMIT]      = sys_gui_submit_wrapper,
+    [SYS_GUI_MAP_SURFACE] = sys_gui_map_surface_wrapper,
+    [SYS_GUI_PRESENT]     = sys_gui_present_wrapper,
 };
 
 static const int num_syscalls = sizeof(syscalls) / sizeof(syscalls[0]);
 
 struct registers* syscall_handler(struct registers* regs) {
+    percpu_inc(PERCPU_STAT_SYSCALLS);
     uint64_t num = regs->rax;
     if (num >= (uint64_t)num_syscalls) {
         kprintf("syscall: invalid syscall %ld\n", num);
@@ -123,9 +202,50 @@ struct registers* syscall_handler(struct registers* regs) {
         regs->rax = (uint64_t)func(regs->rbx, regs->rcx, regs->rdx, regs->rsi, regs->rdi);
     }
 
+    // The caller exited: switch away and never come back to this frame
+    if (current_process && current_process->state == PROC_ZOMBIE) {
+        return scheduler_schedule(regs);
+    }
+
+    // Programs wait for input by polling; let the scheduler see whether
+    // the poll found anything
+    if (num == SYS_GUI_EVENT_POLL) {
+        return scheduler_input_polled(regs, regs->rax != 0);
+    }
+    if (num == SYS_TERMINAL_GET_CHAR) {
+        return scheduler_input_polled(regs, (int)regs->rax != -1);
+    }
+
     return regs;
 }
 
+#define MSR_EFER   0xC0000080
+#define MSR_STAR   0xC0000081
+#define MSR_LSTAR  0xC0000082
+#define MSR_CSTAR  0xC0000083
+#define MSR_SFMASK 0xC0000084
+#define EFER_SCE   (1ULL << 0)
+
+/* RFLAGS bits SYSCALL clears: TF, IF, DF, IOPL, NT, AC. The entry runs
+   with interrupts off, like the int 0x80 gate. */
+#define SYSCALL_RFLAGS_MASK 0x47700ULL
+
+extern void syscall_entry(void);
+extern void syscall_entry_compat(void);
+
+void syscall_init_cpu(void) {
+    // SYSCALL loads CS from STAR[47:32] and SS from the entry after it;
+    // SYSRET takes 32-bit CS from STAR[63:48], SS 8 and 64-bit CS 16
+    // past it, which is the order of the user entries in the GDT
+    wrmsr(MSR_STAR, ((uint64_t)(GDT_USER_CODE32 | GDT_RPL_USER) << 48) |
+                    ((uint64_t)GDT_KERNEL_CODE << 32));
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
+    wrmsr(MSR_CSTAR, (uint64_t)syscall_entry_compat);
+    wrmsr(MSR_SFMASK, SYSCALL_RFLAGS_MASK);
+    wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_SCE);
+}
+
 void syscall_init(void) {
-    kprintf("syscall: initialized\n");
+    syscall_init_cpu();
+    kprintf("syscall: initialized (int 0x80, SYSCALL)\n");
 }
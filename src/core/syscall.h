@@ -13,11 +13,20 @@
 #define SYS_GUI_EVENT_POLL  13
 #define SYS_SHELL_EXEC        14
 #define SYS_TERMINAL_GET_CHAR 15
+#define SYS_GETPID            16
+#define SYS_GUI_SUBMIT        17    /* Command buffer, see gui/gui_cmd.h */
+#define SYS_GUI_MAP_SURFACE   18    /* Map the window's surface; returns its address */
+#define SYS_GUI_PRESENT       19    /* Damage hint for a mapped surface; no effect yet */
 
-/* Initialize syscall interface */
+/* Initialize syscall interface. Programs enter through int 0x80 (number
+   in RAX, arguments in RBX, RCX, RDX, RSI, RDI) or, 64-bit ones only,
+   through SYSCALL (arguments in RDI, RSI, RDX, R10, R8; see
+   syscall_entry in isr_stub.s). syscall_init_cpu programs the SYSCALL
+   MSRs of the calling CPU; syscall_init does it for the BSP. */
 #include "isr.h"
 struct registers* syscall_handler(struct registers* regs);
 void syscall_init(void);
+void syscall_init_cpu(void);
 
 /* System call handlers */
 void sys_exit(int code);
@@ -2,18 +2,358 @@
 #include "isr.h"
 #include "io.h"
 #include "printf.h"
+#include "timer.h"
+#include "apic.h"
+#include "clock.h"
+#include "smp.h"
+#include "process.h"
+#include "spinlock.h"
 
-static uint32_t tick = 0;
+/*
+   Scheduler tick.
 
-static void timer_callback(struct registers* regs) {
-    (void)regs;
-    tick++;
+   Every CPU runs its own LAPIC timer in one-shot (or TSC-deadline) mode
+   and re-arms it from the interrupt. A CPU with something to run asks
+   for the next tick one period ahead, or sooner if a kernel timer is due
+   first; a CPU with nothing to run stops ticking and programs only the
+   next kernel timer, if any. Work queued for a stopped CPU arrives with
+   a TIMER_RESCHED_VECTOR IPI.
+
+   Without a usable LAPIC timer the PIT drives the BSP alone at a fixed
+   rate, as before, and kernel timers fire at that granularity.
+
+   Kernel timers live on a hierarchical wheel of one-millisecond
+   resolution. Level 0 has a slot for each of the next 256 milliseconds;
+   each level above has 64 slots, each covering 64 times the span of a
+   whole slot below, so four levels reach about 18 hours ahead (later
+   deadlines wait in the last slot and are placed again from there).
+   Whenever level 0 wraps, the next slot of level 1 is cascaded, i.e.
+   its timers are placed again relative to the new time, and the same on
+   up. Adding and cancelling are O(1) list operations; an interrupt
+   walks level 0 only from the last millisecond it looked at, jumping
+   over runs of empty slots.
+*/
+
+#define TIMER_WHEEL_RES_NS  1000000ULL
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_L0_BITS       8
+#define TIMER_LN_BITS       6
+#define TIMER_L0_SLOTS      (1 << TIMER_L0_BITS)
+#define TIMER_LN_SLOTS      (1 << TIMER_LN_BITS)
+/* First bit of the millisecond count that indexes a level */
+#define TIMER_LEVEL_SHIFT(l) ((l) ? TIMER_L0_BITS + ((l) - 1) * TIMER_LN_BITS : 0)
+/* Furthest ahead the top level reaches */
+#define TIMER_WHEEL_SPAN_MS ((1ULL << TIMER_LEVEL_SHIFT(TIMER_WHEEL_LEVELS)) - 1)
+
+/* A timer interrupt this close to the next tick counts as the tick */
+#define TICK_SLACK_NS      50000ULL
+
+static uint64_t g_tick_ns = 0;      /* Period while busy; 0 on the PIT */
+static volatile int g_tick_stopped[SMP_MAX_CPUS];
+static uint64_t g_next_tick[SMP_MAX_CPUS];
+static uint64_t g_armed[SMP_MAX_CPUS];     /* Deadline the LAPIC timer is set for, 0 if none */
+static volatile int g_cpu_started[SMP_MAX_CPUS];
+
+static ktimer_t* g_wheel_l0[TIMER_L0_SLOTS];
+static ktimer_t* g_wheel_ln[TIMER_WHEEL_LEVELS - 1][TIMER_LN_SLOTS];
+static uint64_t g_wheel_ms = 0;     /* Millisecond level 0 has reached */
+static uint32_t g_wheel_count = 0;
+static uint32_t g_level_count[TIMER_WHEEL_LEVELS];
+static spinlock_t g_wheel_lock = SPINLOCK_INIT;
+
+void ktimer_init(ktimer_t* timer, void (*fn)(ktimer_t* timer), void* data) {
+    timer->deadline = 0;
+    timer->fn = fn;
+    timer->data = data;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->state = KTIMER_IDLE;
 }
 
-void timer_init(uint32_t frequency) {
-    // Register timer callback (redundant since scheduler handles IRQ 0, but good for counting ticks)
-    irq_register_handler(0, timer_callback);
+static ktimer_t** wheel_slot(int level, uint64_t ms) {
+    if (level == 0) return &g_wheel_l0[ms & (TIMER_L0_SLOTS - 1)];
+    return &g_wheel_ln[level - 1][(ms >> TIMER_LEVEL_SHIFT(level)) & (TIMER_LN_SLOTS - 1)];
+}
 
+/* Put a timer in the slot its deadline falls in, seen from g_wheel_ms.
+   Called with g_wheel_lock held, as are the two below. */
+static void wheel_insert(ktimer_t* timer) {
+    // Deadlines already passed go in the current slot, which the next
+    // interrupt looks at
+    uint64_t ms = timer->deadline / TIMER_WHEEL_RES_NS;
+    if (ms < g_wheel_ms) ms = g_wheel_ms;
+    if (ms - g_wheel_ms > TIMER_WHEEL_SPAN_MS) ms = g_wheel_ms + TIMER_WHEEL_SPAN_MS;
+
+    uint64_t delta = ms - g_wheel_ms;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << TIMER_LEVEL_SHIFT(level + 1))) {
+        level++;
+    }
+
+    ktimer_t** head = wheel_slot(level, ms);
+    timer->level = level;
+    timer->next = *head;
+    timer->pprev = head;
+    if (*head) (*head)->pprev = &timer->next;
+    *head = timer;
+    g_level_count[level]++;
+    g_wheel_count++;
+}
+
+static void wheel_unlink(ktimer_t* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next) timer->next->pprev = timer->pprev;
+    timer->next = NULL;
+    timer->pprev = NULL;
+    g_level_count[timer->level]--;
+    g_wheel_count--;
+}
+
+/* Level 0 moves on to the next millisecond; on wrapping, bring the
+   timers of the slot now current on each level above down a level */
+static void wheel_advance(void) {
+    g_wheel_ms++;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (g_wheel_ms & ((1ULL << TIMER_LEVEL_SHIFT(level)) - 1)) break;
+
+        ktimer_t** head = wheel_slot(level, g_wheel_ms);
+        ktimer_t* list = *head;
+        *head = NULL;
+        while (list) {
+            ktimer_t* timer = list;
+            list = timer->next;
+            g_level_count[level]--;
+            g_wheel_count--;
+            wheel_insert(timer);
+        }
+    }
+}
+
+static void program(int cpu, uint64_t now);
+
+void ktimer_add(ktimer_t* timer, uint64_t deadline_ns) {
+    uint64_t flags = spinlock_lock_irqsave(&g_wheel_lock);
+    if (timer->state == KTIMER_PENDING) wheel_unlink(timer);
+    timer->deadline = deadline_ns;
+    wheel_insert(timer);
+    timer->state = KTIMER_PENDING;
+    spinlock_unlock(&g_wheel_lock);
+
+    // This CPU's timer may be set for the next tick or a later deadline;
+    // bring it forward rather than leave the new one to wait for that
+    int cpu = smp_current_cpu();
+    if (g_tick_ns && g_cpu_started[cpu] && (!g_armed[cpu] || deadline_ns < g_armed[cpu])) {
+        program(cpu, clock_monotonic_ns());
+    }
+    irq_restore(flags);
+}
+
+void ktimer_cancel(ktimer_t* timer) {
+    uint64_t flags = spinlock_lock_irqsave(&g_wheel_lock);
+    if (timer->state == KTIMER_PENDING) {
+        wheel_unlink(timer);
+        timer->state = KTIMER_IDLE;
+    }
+    spinlock_unlock_irqrestore(&g_wheel_lock, flags);
+
+    while (timer->state == KTIMER_RUNNING) {
+        __asm__ volatile("pause");
+    }
+}
+
+/* Take one timer due by now off the wheel, moving g_wheel_ms up to now
+   on the way. Called with g_wheel_lock held. */
+static ktimer_t* wheel_take_due(uint64_t now) {
+    uint64_t now_ms = now / TIMER_WHEEL_RES_NS;
+    for (;;) {
+        // Everything in a slot behind now is due; in the current one,
+        // only what has reached its deadline
+        for (ktimer_t* t = g_wheel_l0[g_wheel_ms & (TIMER_L0_SLOTS - 1)]; t; t = t->next) {
+            if (g_wheel_ms < now_ms || t->deadline <= now) {
+                wheel_unlink(t);
+                return t;
+            }
+        }
+        if (g_wheel_ms >= now_ms) return NULL;
+
+        if (!g_wheel_count) {
+            g_wheel_ms = now_ms;
+            return NULL;
+        }
+        if (!g_level_count[0]) {
+            // Nothing on level 0: skip to the next cascade (or to now)
+            uint64_t wrap = (g_wheel_ms | (TIMER_L0_SLOTS - 1)) + 1;
+            if (wrap > now_ms) {
+                g_wheel_ms = now_ms;
+                continue;
+            }
+            g_wheel_ms = wrap - 1;
+        }
+        wheel_advance();
+    }
+}
+
+/* Fire every timer due by now. Each is taken off the wheel under the
+   lock and called without it, so callbacks may add timers. */
+static void ktimer_run(uint64_t now) {
+    if (!g_wheel_count) return;
+
+    for (;;) {
+        spinlock_lock(&g_wheel_lock);
+        ktimer_t* due = wheel_take_due(now);
+        if (due) due->state = KTIMER_RUNNING;
+        spinlock_unlock(&g_wheel_lock);
+
+        if (!due) return;
+        due->fn(due);
+        // It may have been re-added by its own callback
+        int running = KTIMER_RUNNING;
+        __atomic_compare_exchange_n(&due->state, &running, KTIMER_IDLE,
+                                    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+}
+
+/* Earliest deadline in a list, or best if that is earlier */
+static uint64_t list_earliest(ktimer_t* t, uint64_t best) {
+    for (; t; t = t->next) {
+        if (!best || t->deadline < best) best = t->deadline;
+    }
+    return best;
+}
+
+/* Earliest pending deadline, 0 if there is none */
+static uint64_t ktimer_next_deadline(void) {
+    if (!g_wheel_count) return 0;
+
+    uint64_t best = 0;
+    uint64_t flags = spinlock_lock_irqsave(&g_wheel_lock);
+    // A level 0 slot holds a single millisecond, so the first non-empty
+    // one from now has that level's earliest timers
+    for (uint64_t i = 0; i < TIMER_L0_SLOTS && g_level_count[0]; i++) {
+        ktimer_t* t = g_wheel_l0[(g_wheel_ms + i) & (TIMER_L0_SLOTS - 1)];
+        if (t) {
+            best = list_earliest(t, best);
+            break;
+        }
+    }
+    // Likewise above: slots in order from the next one to be cascaded,
+    // the last of them being the current one's next round
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        if (!g_level_count[level]) continue;
+        uint64_t block = g_wheel_ms >> TIMER_LEVEL_SHIFT(level);
+        for (uint64_t i = 1; i <= TIMER_LN_SLOTS; i++) {
+            ktimer_t* t = g_wheel_ln[level - 1][(block + i) & (TIMER_LN_SLOTS - 1)];
+            if (t) {
+                best = list_earliest(t, best);
+                break;
+            }
+        }
+    }
+    spinlock_unlock_irqrestore(&g_wheel_lock, flags);
+    return best;
+}
+
+/* Program the timer for the nearest of the next tick (if ticking) and
+   the next kernel timer */
+static void program(int cpu, uint64_t now) {
+    uint64_t deadline = g_tick_stopped[cpu] ? 0 : g_next_tick[cpu];
+    uint64_t next = ktimer_next_deadline();
+    if (next && (!deadline || next < deadline)) deadline = next;
+
+    g_armed[cpu] = deadline;
+    if (!deadline) {
+        lapic_timer_disarm();
+        return;
+    }
+    lapic_timer_arm(deadline > now ? deadline - now : 0);
+}
+
+static void start_tick(int cpu, uint64_t now) {
+    if (g_tick_stopped[cpu] || g_next_tick[cpu] <= now) {
+        g_next_tick[cpu] = now + g_tick_ns;
+    }
+    g_tick_stopped[cpu] = 0;
+    program(cpu, now);
+}
+
+/* Nothing to run here: program only the nearest deadline */
+static void stop_tick(int cpu, uint64_t now, uint64_t deadline) {
+    g_tick_stopped[cpu] = 1;
+    uint64_t next = ktimer_next_deadline();
+    if (!deadline || (next && next < deadline)) deadline = next;
+
+    g_armed[cpu] = deadline;
+    if (!deadline) {
+        lapic_timer_disarm();
+        return;
+    }
+    lapic_timer_arm(deadline > now ? deadline - now : 0);
+}
+
+/* Tick again if there is anything to run, else go quiet */
+static void rearm(int cpu, uint64_t now) {
+    if (!g_tick_ns) return;
+    if (scheduler_cpu_idle(cpu) && !scheduler_nr_queued(cpu)) stop_tick(cpu, now, 0);
+    else start_tick(cpu, now);
+}
+
+struct registers* timer_interrupt(struct registers* regs) {
+    int cpu = smp_current_cpu();
+    uint64_t now = clock_monotonic_ns();
+    ktimer_run(now);
+
+    // Only the periodic tick charges the running process; an early
+    // interrupt for a kernel timer just checks whether it woke anything
+    // that should run instead
+    struct registers* next;
+    if (!g_tick_ns || g_tick_stopped[cpu] || now + TICK_SLACK_NS >= g_next_tick[cpu]) {
+        g_next_tick[cpu] = now + g_tick_ns;
+        next = scheduler_tick(regs);
+    } else {
+        next = scheduler_preempt(regs);
+    }
+    rearm(cpu, clock_monotonic_ns());
+    return next;
+}
+
+struct registers* timer_resched_interrupt(struct registers* regs) {
+    struct registers* next = scheduler_preempt(regs);
+    rearm(smp_current_cpu(), clock_monotonic_ns());
+    return next;
+}
+
+void timer_idle(uint64_t deadline_ns) {
+    uint64_t flags = irq_save();
+    int cpu = smp_current_cpu();
+    if (g_tick_ns && !scheduler_nr_queued(cpu)) stop_tick(cpu, clock_monotonic_ns(), deadline_ns);
+    __asm__ __volatile__("sti; hlt; cli");
+
+    // Whatever woke us, the caller is running again
+    if (g_tick_ns && g_tick_stopped[cpu]) start_tick(cpu, clock_monotonic_ns());
+    irq_restore(flags);
+}
+
+int timer_tick_stopped(int cpu) {
+    return g_tick_ns && g_tick_stopped[cpu];
+}
+
+void timer_kick_cpu(int cpu) {
+    g_tick_stopped[cpu] = 0;
+    uint64_t flags = irq_save();
+    lapic_send_ipi(smp_cpu_apic_id(cpu), TIMER_RESCHED_VECTOR);
+    irq_restore(flags);
+}
+
+void timer_init_cpu(void) {
+    if (!g_tick_ns) return;
+    lapic_timer_init_cpu();
+    int cpu = smp_current_cpu();
+    g_tick_stopped[cpu] = 1;
+    g_cpu_started[cpu] = 1;
+    start_tick(cpu, clock_monotonic_ns());
+}
+
+static void pit_init(uint32_t frequency) {
     // The value we send to the PIT is the value to divide it's input clock
     // (1193180 Hz) by, to get our required frequency.
     uint32_t divisor = 1193180 / frequency;
@@ -28,6 +368,18 @@ void timer_init(uint32_t frequency) {
     // Send the frequency divisor.
     outb(0x40, l);
     outb(0x40, h);
-    
-    kprintf("timer: initialized at %d Hz\n", frequency);
+}
+
+void timer_init(uint32_t frequency) {
+    spinlock_track(&g_wheel_lock, "timer wheel");
+    if (lapic_timer_calibrate() == 0) {
+        g_tick_ns = 1000000000ULL / frequency;
+        timer_init_cpu();
+        kprintf("timer: LAPIC tick at %d Hz, tickless when idle\n", frequency);
+        return;
+    }
+
+    pit_init(frequency);
+    ioapic_route_isa(0, 32, 0);
+    kprintf("timer: initialized at %d Hz (PIT)\n", frequency);
 }
@@ -0,0 +1,58 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "common.h"
+#include "isr.h"
+
+/* IPI that makes a CPU whose tick is stopped look at its run queue */
+#define TIMER_RESCHED_VECTOR 0xF1
+
+/* Start the scheduler tick on the BSP: the LAPIC timer when it could be
+   calibrated, otherwise the PIT at the given rate */
+void timer_init(uint32_t frequency);
+/* Start the tick on an AP, once it can take interrupts */
+void timer_init_cpu(void);
+
+/* LAPIC_TIMER_VECTOR (or PIT) and TIMER_RESCHED_VECTOR handlers */
+struct registers* timer_interrupt(struct registers* regs);
+struct registers* timer_resched_interrupt(struct registers* regs);
+
+/* Halt until an interrupt, with interrupts enabled meanwhile. When
+   nothing else is queued on this CPU the tick is stopped first and only
+   the next real deadline is programmed: deadline_ns (absolute, 0 for
+   none) or the earliest kernel timer. The idle tasks loop on this. */
+void timer_idle(uint64_t deadline_ns);
+
+/* Whether cpu's tick is stopped, and restarting it from another CPU */
+int timer_tick_stopped(int cpu);
+void timer_kick_cpu(int cpu);
+
+/*
+   Kernel timers: call fn from the timer interrupt once clock_monotonic_ns()
+   reaches the deadline. Callbacks run with interrupts disabled on
+   whichever CPU notices first, and must not sleep.
+*/
+typedef struct ktimer {
+    uint64_t deadline;
+    void (*fn)(struct ktimer* timer);
+    void* data;
+    struct ktimer* next;        /* Wheel slot links */
+    struct ktimer** pprev;
+    int level;
+    volatile int state;         /* KTIMER_* */
+} ktimer_t;
+
+#define KTIMER_IDLE    0
+#define KTIMER_PENDING 1
+#define KTIMER_RUNNING 2
+
+void ktimer_init(ktimer_t* timer, void (*fn)(ktimer_t* timer), void* data);
+/* (Re)schedule. The calling CPU's timer is brought forward if it is set
+   for later, so the deadline is met to the LAPIC timer's precision; one
+   already past fires on the next interrupt. */
+void ktimer_add(ktimer_t* timer, uint64_t deadline_ns);
+/* Remove a pending timer. If its callback is running on another CPU,
+   wait for it to return, so the timer may be freed afterwards. */
+void ktimer_cancel(ktimer_t* timer);
+
+#endif
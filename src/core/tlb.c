@@ -0,0 +1,209 @@
+#include "tlb.h"
+#include "io.h"
+#include "isr.h"
+#include "apic.h"
+#include "smp.h"
+#include "paging.h"
+#include "spinlock.h"
+#include "../lib/memory.h"
+#include "../drivers/serial.h"
+
+/*
+   TLB management: PCID-tagged CR3 loads and cross-CPU shootdowns.
+
+   With PCIDs each user address space keeps its own tag, so a CR3 load
+   with bit 63 set leaves its translations (and everyone else's) cached.
+   Whoever owns the address space (vmm.c) decides when such a load is
+   safe; this file only provides the mechanism.
+
+   A shootdown is one request at a time: the sender publishes a batch
+   and a mask of target CPUs, sends them an IPI and spins until each has
+   cleared its bit. A CPU waiting to send its own request services the
+   current one meanwhile, so two senders can't deadlock on each other.
+*/
+
+#define CR4_PCIDE    (1ULL << 17)
+#define CR4_PGE      (1ULL << 7)
+#define CR3_NOFLUSH  (1ULL << 63)
+
+static int g_have_pcid = 0;
+static int g_pcid_enabled = 0;
+static int g_detected = 0;
+
+static uint64_t g_pcid_map[(TLB_MAX_PCID + 1) / 64];
+static spinlock_t g_pcid_lock = SPINLOCK_INIT;
+
+static struct {
+    spinlock_t lock;                /* Held by the CPU whose request is live */
+    const tlb_batch_t* batch;
+    volatile uint64_t targets;      /* CPUs that still have to flush */
+} g_shootdown;
+
+static inline void invlpg(uint64_t vaddr) {
+    __asm__ __volatile__("invlpg (%0)" : : "r"(vaddr) : "memory");
+}
+
+/* Drop everything, global pages and all PCIDs included */
+void tlb_flush_all(void) {
+    uint64_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    if (cr4 & CR4_PGE) {
+        __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4 & ~CR4_PGE) : "memory");
+        __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4) : "memory");
+    } else {
+        __asm__ __volatile__("mov %0, %%cr3" : : "r"(__asm_get_cr3() & ~CR3_NOFLUSH) : "memory");
+    }
+}
+
+static void flush_local(const tlb_batch_t* batch) {
+    if (batch->pml4 && batch->pml4 != (__asm_get_cr3() & PTE_ADDR_MASK)) {
+        return;  // Not loaded here; the owner's generation check covers it
+    }
+
+    if (batch->count > TLB_BATCH_MAX) {
+        if (batch->pml4) paging_flush_user();
+        else tlb_flush_all();
+        return;
+    }
+    for (uint32_t i = 0; i < batch->count; i++) {
+        invlpg(batch->addrs[i]);
+    }
+}
+
+/* Serve the live request if it names this CPU */
+static void shootdown_poll(void) {
+    uint64_t bit = 1ULL << smp_current_cpu();
+    if (!(__atomic_load_n(&g_shootdown.targets, __ATOMIC_ACQUIRE) & bit)) return;
+
+    flush_local(g_shootdown.batch);
+    __atomic_and_fetch(&g_shootdown.targets, ~bit, __ATOMIC_RELEASE);
+}
+
+static void shootdown_handler(struct registers* regs) {
+    (void)regs;
+    shootdown_poll();
+}
+
+void tlb_init_cpu(void) {
+    if (!g_detected) {
+        uint32_t a, b, c, d;
+        cpuid(1, 0, &a, &b, &c, &d);
+        g_have_pcid = (c >> 17) & 1;
+        g_pcid_enabled = g_have_pcid;
+        g_pcid_map[0] = 1;  // PCID 0 belongs to the kernel
+        g_detected = 1;
+    }
+    if (!g_have_pcid) return;
+
+    // CR4.PCIDE may only be set while the current PCID is 0
+    if (__asm_get_cr3() & 0xFFF) return;
+    uint64_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    __asm__ __volatile__("mov %0, %%cr4" : : "r"(cr4 | CR4_PCIDE));
+}
+
+void tlb_init(void) {
+    spinlock_track(&g_shootdown.lock, "tlb shootdown");
+    irq_register_handler(TLB_SHOOTDOWN_VECTOR - 32, shootdown_handler);
+    serial_printf("tlb: PCID %s, shootdown IPI on vector 0x%x\n",
+                  g_have_pcid ? "enabled" : "not supported", TLB_SHOOTDOWN_VECTOR);
+}
+
+int tlb_has_pcid(void) {
+    return g_have_pcid;
+}
+
+int tlb_pcid_enabled(void) {
+    return g_pcid_enabled;
+}
+
+void tlb_set_pcid_enabled(int enabled) {
+    g_pcid_enabled = enabled && g_have_pcid;
+}
+
+uint16_t tlb_alloc_pcid(void) {
+    uint16_t pcid = 0;
+    uint64_t flags = spinlock_lock_irqsave(&g_pcid_lock);
+    for (int i = 0; i < (TLB_MAX_PCID + 1) / 64 && !pcid; i++) {
+        if (g_pcid_map[i] == ~0ULL) continue;
+        int bit = __builtin_ctzll(~g_pcid_map[i]);
+        g_pcid_map[i] |= 1ULL << bit;
+        pcid = (uint16_t)(i * 64 + bit);
+    }
+    spinlock_unlock_irqrestore(&g_pcid_lock, flags);
+    return pcid;
+}
+
+void tlb_free_pcid(uint16_t pcid) {
+    if (pcid == 0 || pcid > TLB_MAX_PCID) return;
+    uint64_t flags = spinlock_lock_irqsave(&g_pcid_lock);
+    g_pcid_map[pcid / 64] &= ~(1ULL << (pcid % 64));
+    spinlock_unlock_irqrestore(&g_pcid_lock, flags);
+}
+
+void tlb_load_cr3(uint64_t pml4, uint16_t pcid, int keep) {
+    uint64_t cr3 = pml4 & PTE_ADDR_MASK;
+    if (g_have_pcid) {
+        cr3 |= pcid & 0xFFF;
+        if (keep && g_pcid_enabled) cr3 |= CR3_NOFLUSH;
+    }
+    __asm__ __volatile__("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+void tlb_batch_init(tlb_batch_t* batch, uint64_t pml4) {
+    batch->pml4 = pml4 & PTE_ADDR_MASK;
+    batch->count = 0;
+}
+
+void tlb_batch_add(tlb_batch_t* batch, uint64_t vaddr) {
+    if (batch->count < TLB_BATCH_MAX) {
+        batch->addrs[batch->count++] = vaddr & ~(uint64_t)(PAGE_SIZE - 1);
+    } else {
+        batch->count = TLB_BATCH_MAX + 1;
+    }
+}
+
+void tlb_batch_add_all(tlb_batch_t* batch) {
+    batch->count = TLB_BATCH_MAX + 1;
+}
+
+void tlb_batch_flush(tlb_batch_t* batch, uint64_t cpus) {
+    if (batch->count == 0) return;
+
+    uint64_t flags = irq_save();
+    flush_local(batch);
+
+    uint32_t online = smp_get_cpu_count();
+    if (online < 64) cpus &= (1ULL << online) - 1;
+    cpus &= ~(1ULL << smp_current_cpu());
+
+    if (cpus) {
+        while (!spinlock_trylock(&g_shootdown.lock)) {
+            shootdown_poll();
+            __asm__ volatile("pause");
+        }
+
+        g_shootdown.batch = batch;
+        __atomic_store_n(&g_shootdown.targets, cpus, __ATOMIC_RELEASE);
+        for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+            if (cpus & (1ULL << cpu)) lapic_send_ipi(smp_cpu_apic_id(cpu), TLB_SHOOTDOWN_VECTOR);
+        }
+        while (__atomic_load_n(&g_shootdown.targets, __ATOMIC_ACQUIRE)) {
+            __asm__ volatile("pause");
+        }
+
+        g_shootdown.batch = NULL;
+        spinlock_unlock(&g_shootdown.lock);
+    }
+    irq_restore(flags);
+}
+
+void tlb_shootdown_kernel(uint64_t vaddr, uint64_t size) {
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, 0);
+    uint64_t end = vaddr + size;
+    for (uint64_t va = vaddr & ~(uint64_t)(PAGE_SIZE - 1); va < end && batch.count <= TLB_BATCH_MAX; va += PAGE_SIZE) {
+        tlb_batch_add(&batch, va);
+    }
+    tlb_batch_flush(&batch, ~0ULL);
+}
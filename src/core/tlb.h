@@ -0,0 +1,52 @@
+#ifndef TLB_H
+#define TLB_H
+
+#include "common.h"
+
+/* IPI vector used to ask other CPUs to invalidate translations */
+#define TLB_SHOOTDOWN_VECTOR 0xF0
+
+/* Addresses carried per shootdown; more than this flushes everything */
+#define TLB_BATCH_MAX 32
+
+/* PCIDs 1..TLB_MAX_PCID tag user address spaces; 0 is the kernel's */
+#define TLB_MAX_PCID 4095
+
+/* Invalidations collected while editing page tables and sent as one IPI */
+typedef struct {
+    uint64_t pml4;      /* Address space, or 0 for kernel-half (global) pages */
+    uint32_t count;     /* > TLB_BATCH_MAX means flush the whole space */
+    uint64_t addrs[TLB_BATCH_MAX];
+} tlb_batch_t;
+
+void tlb_init(void);
+/* Per-CPU: turn on CR4.PCIDE when supported (paging_init_cpu calls this) */
+void tlb_init_cpu(void);
+
+int tlb_has_pcid(void);
+int tlb_pcid_enabled(void);
+/* Switch PCID tagging on or off at run time (for benchmarking) */
+void tlb_set_pcid_enabled(int enabled);
+
+uint16_t tlb_alloc_pcid(void);   /* 0 if none are left */
+void tlb_free_pcid(uint16_t pcid);
+
+/* Load CR3. With keep set and PCIDs enabled, translations already tagged
+   with pcid survive the switch. */
+void tlb_load_cr3(uint64_t pml4, uint16_t pcid, int keep);
+
+/* This CPU only: every translation, global pages and all PCIDs included */
+void tlb_flush_all(void);
+
+void tlb_batch_init(tlb_batch_t* batch, uint64_t pml4);
+void tlb_batch_add(tlb_batch_t* batch, uint64_t vaddr);
+void tlb_batch_add_all(tlb_batch_t* batch);
+
+/* Invalidate the batch on this CPU (if the space is loaded here) and on
+   every other CPU in the cpus mask, waiting until they have done so */
+void tlb_batch_flush(tlb_batch_t* batch, uint64_t cpus);
+
+/* Kernel-half range changed: invalidate it on every CPU */
+void tlb_shootdown_kernel(uint64_t vaddr, uint64_t size);
+
+#endif
@@ -0,0 +1,459 @@
+#include "vmm.h"
+#include "paging.h"
+#include "pmm.h"
+#include "tlb.h"
+#include "../lib/memory.h"
+#include "../drivers/serial.h"
+
+/*
+   Per-process virtual memory areas and the page-fault path behind them.
+
+   Nothing in the user half is mapped up front. A fault inside an area
+   allocates one frame, fills it (zeroes or bytes from the image) and maps
+   it; a write fault on a PTE_COW page copies the frame unless this space
+   holds the only reference. Frame sharing is counted in page_t.refcount,
+   so a frame goes back to the pmm when its last mapping is torn down.
+   Shared areas (window surfaces) are the exception to faulting in: their
+   frames belong to the kernel as well and are mapped whole up front.
+*/
+
+static inline uint64_t page_floor(uint64_t v) {
+    return v & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+static inline uint64_t page_ceil(uint64_t v) {
+    return (v + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+static void frame_get(uint64_t phys) {
+    page_t* pg = pmm_phys_to_page(phys);
+    if (pg) __atomic_add_fetch(&pg->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void frame_put(uint64_t phys) {
+    page_t* pg = pmm_phys_to_page(phys);
+    if (pg && __atomic_sub_fetch(&pg->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        pmm_free_pages(phys, 0);
+    }
+}
+
+vm_image_t* vmm_image_create(const void* data, size_t size) {
+    vm_image_t* image = (vm_image_t*)kmalloc(sizeof(vm_image_t) + size);
+    if (!image) return NULL;
+    image->refcount = 1;
+    image->size = size;
+    memcpy(image->data, data, size);
+    return image;
+}
+
+void vmm_image_put(vm_image_t* image) {
+    if (image && __atomic_sub_fetch(&image->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+        kfree(image);
+    }
+}
+
+vm_space_t* vmm_create_space(void) {
+    vm_space_t* space = (vm_space_t*)kmalloc_z(sizeof(vm_space_t));
+    if (!space) return NULL;
+
+    space->pcid = tlb_alloc_pcid();
+    space->pml4 = (uint64_t)paging_create_directory();
+    if (!space->pml4 || !space->pcid) {
+        if (space->pml4) paging_destroy_directory((page_directory_t*)space->pml4);
+        tlb_free_pcid(space->pcid);
+        kfree(space);
+        return NULL;
+    }
+    // A recycled PCID may still tag old translations: generation 1 is
+    // unseen by every CPU, so each one flushes on its first switch in
+    space->tlb_gen = 1;
+    return space;
+}
+
+void vmm_switch(vm_space_t* prev, vm_space_t* next) {
+    uint64_t bit = 1ULL << smp_current_cpu();
+    if (prev) __atomic_and_fetch(&prev->active_cpus, ~bit, __ATOMIC_SEQ_CST);
+
+    if (!next) {
+        // The kernel's user half is always empty, so PCID 0 never goes stale
+        page_directory_t* kdir = paging_kernel_directory();
+        if (kdir) tlb_load_cr3((uint64_t)kdir, 0, 1);
+        return;
+    }
+
+    // Publish ourselves before sampling the generation: a concurrent
+    // invalidation either sees this CPU as active or bumps tlb_gen first
+    __atomic_or_fetch(&next->active_cpus, bit, __ATOMIC_SEQ_CST);
+    int cpu = smp_current_cpu();
+    uint64_t gen = __atomic_load_n(&next->tlb_gen, __ATOMIC_SEQ_CST);
+    int keep = next->cpu_gen[cpu] == gen;
+    next->cpu_gen[cpu] = gen;
+    tlb_load_cr3(next->pml4, next->pcid, keep);
+}
+
+/* Translations in the batch were removed or downgraded: stale copies must
+   go from every CPU, now (loaded) or at the next switch in (cached) */
+static void space_flush(vm_space_t* space, tlb_batch_t* batch) {
+    uint64_t gen = __atomic_add_fetch(&space->tlb_gen, 1, __ATOMIC_SEQ_CST);
+    uint64_t active = __atomic_load_n(&space->active_cpus, __ATOMIC_SEQ_CST);
+    int cpu = smp_current_cpu();
+    if (active & (1ULL << cpu)) space->cpu_gen[cpu] = gen;  // Flushed locally below
+    tlb_batch_flush(batch, active);
+}
+
+static int add_vma(vm_space_t* space, uint64_t start, uint64_t size, uint32_t flags,
+                   vm_image_t* image, uint64_t file_vaddr, uint64_t file_offset, uint64_t file_size) {
+    uint64_t end = page_ceil(start + size);
+    start = page_floor(start);
+    if (!space || size == 0 || end <= start || end > KERNEL_HALF_BASE) return -1;
+    if (image && file_offset + file_size > image->size) return -1;
+
+    vma_t* vma = (vma_t*)kmalloc_z(sizeof(vma_t));
+    if (!vma) return -1;
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->image = image;
+    vma->file_vaddr = file_vaddr;
+    vma->file_offset = file_offset;
+    vma->file_size = file_size;
+    if (image) __atomic_add_fetch(&image->refcount, 1, __ATOMIC_RELAXED);
+
+    uint64_t irq = spinlock_lock_irqsave(&space->lock);
+    vma->next = space->vmas;
+    space->vmas = vma;
+    spinlock_unlock_irqrestore(&space->lock, irq);
+    return 0;
+}
+
+int vmm_map_anon(vm_space_t* space, uint64_t start, uint64_t size, uint32_t flags) {
+    return add_vma(space, start, size, flags, NULL, 0, 0, 0);
+}
+
+int vmm_map_file(vm_space_t* space, uint64_t start, uint64_t size, uint32_t flags,
+                 vm_image_t* image, uint64_t file_vaddr, uint64_t file_offset, uint64_t file_size) {
+    if (!image) return -1;
+    return add_vma(space, start, size, flags, image, file_vaddr, file_offset, file_size);
+}
+
+static vma_t* find_vma(vm_space_t* space, uint64_t addr) {
+    for (vma_t* vma = space->vmas; vma; vma = vma->next) {
+        if (addr >= vma->start && addr < vma->end) return vma;
+    }
+    return NULL;
+}
+
+/* Segments need not be page aligned, so two areas can share a page. Such a
+   page gets the union of their permissions and the bytes of both. */
+static uint32_t page_vma_flags(vm_space_t* space, uint64_t page) {
+    uint32_t flags = 0;
+    for (vma_t* vma = space->vmas; vma; vma = vma->next) {
+        if (page < vma->end && page + PAGE_SIZE > vma->start) flags |= vma->flags;
+    }
+    return flags;
+}
+
+static uint64_t pte_flags(uint32_t vma_flags) {
+    uint64_t flags = PTE_PRESENT | PTE_USER;
+    if (vma_flags & VMA_WRITE) flags |= PTE_WRITABLE;
+    if (!(vma_flags & VMA_EXEC)) flags |= PTE_NX;
+    return flags;
+}
+
+void* vmm_shared_alloc(size_t size) {
+    size_t npages = page_ceil(size) / PAGE_SIZE;
+    if (npages == 0) return NULL;
+    uintptr_t phys = pmm_alloc_contig(npages, 0);
+    if (!phys) return NULL;
+
+    for (size_t i = 0; i < npages; i++) {
+        pmm_phys_to_page(phys + i * PAGE_SIZE)->refcount = 1;
+    }
+    void* buf = (void*)PHYS_TO_VIRT(phys);
+    memset(buf, 0, npages * PAGE_SIZE);
+    return buf;
+}
+
+void vmm_shared_put(void* buf, size_t size) {
+    if (!buf) return;
+    uintptr_t phys = VIRT_TO_PHYS(buf);
+    size_t npages = page_ceil(size) / PAGE_SIZE;
+    for (size_t i = 0; i < npages; i++) frame_put(phys + i * PAGE_SIZE);
+}
+
+/* First gap of size bytes in [VMM_SHARED_BASE, VMM_SHARED_LIMIT), or 0.
+   Called with the space locked. */
+static uint64_t find_shared_gap(vm_space_t* space, uint64_t size) {
+    uint64_t start = VMM_SHARED_BASE;
+    int moved = 1;
+    while (moved) {
+        moved = 0;
+        for (vma_t* vma = space->vmas; vma; vma = vma->next) {
+            if (vma->start < start + size && vma->end > start) {
+                start = vma->end;
+                moved = 1;
+            }
+        }
+        if (start + size > VMM_SHARED_LIMIT) return 0;
+    }
+    return start;
+}
+
+int vmm_map_shared(vm_space_t* space, void* buf, size_t size, uint32_t flags, uint64_t* addr) {
+    if (!space || !buf || size == 0) return -1;
+    size = page_ceil(size);
+    uintptr_t phys = VIRT_TO_PHYS(buf);
+
+    vma_t* vma = (vma_t*)kmalloc_z(sizeof(vma_t));
+    if (!vma) return -1;
+
+    uint64_t irq = spinlock_lock_irqsave(&space->lock);
+    uint64_t start = find_shared_gap(space, size);
+    if (!start) {
+        spinlock_unlock_irqrestore(&space->lock, irq);
+        kfree(vma);
+        return -1;
+    }
+
+    // Map everything now: a fault inside the area has nothing to fill in
+    page_directory_t* dir = (page_directory_t*)space->pml4;
+    uint64_t pte = pte_flags(flags) | PTE_SHARED;
+    uint64_t off = 0;
+    for (; off < size; off += PAGE_SIZE) {
+        if (paging_map(dir, start + off, phys + off, pte) != 0) break;
+        frame_get(phys + off);
+    }
+    if (off < size) {
+        for (uint64_t undo = 0; undo < off; undo += PAGE_SIZE) frame_put(phys + undo);
+        paging_unmap(dir, start, off);
+        spinlock_unlock_irqrestore(&space->lock, irq);
+        kfree(vma);
+        return -1;
+    }
+    space->resident += size / PAGE_SIZE;
+
+    vma->start = start;
+    vma->end = start + size;
+    vma->flags = flags | VMA_SHARED;
+    vma->next = space->vmas;
+    space->vmas = vma;
+    spinlock_unlock_irqrestore(&space->lock, irq);
+
+    *addr = start;
+    return 0;
+}
+
+static void fill_page(vm_space_t* space, uint64_t page, uint8_t* dst) {
+    memset(dst, 0, PAGE_SIZE);
+    for (vma_t* vma = space->vmas; vma; vma = vma->next) {
+        if (!vma->image) continue;
+        uint64_t lo = vma->file_vaddr;
+        uint64_t hi = vma->file_vaddr + vma->file_size;
+        if (lo < page) lo = page;
+        if (hi > page + PAGE_SIZE) hi = page + PAGE_SIZE;
+        if (lo >= hi) continue;
+        memcpy(dst + (lo - page), vma->image->data + vma->file_offset + (lo - vma->file_vaddr), hi - lo);
+    }
+}
+
+static int fault_in(vm_space_t* space, uint64_t page) {
+    page_directory_t* dir = (page_directory_t*)space->pml4;
+    if (paging_get_entry(dir, page)) return 0;  // Raced with another CPU
+
+    uintptr_t frame = pmm_alloc_pages(0);
+    if (!frame) return -1;
+    fill_page(space, page, (uint8_t*)PHYS_TO_VIRT(frame));
+
+    if (paging_map(dir, page, frame, pte_flags(page_vma_flags(space, page))) != 0) {
+        pmm_free_pages(frame, 0);
+        return -1;
+    }
+    pmm_phys_to_page(frame)->refcount = 1;
+    space->resident++;
+    return 0;
+}
+
+static int fault_cow(vm_space_t* space, uint64_t page) {
+    page_directory_t* dir = (page_directory_t*)space->pml4;
+    uint64_t pte = paging_get_entry(dir, page);
+    if (pte & PTE_WRITABLE) return 0;  // Already resolved; stale TLB entry
+    if (!(pte & PTE_COW)) return -1;
+
+    uint64_t old = pte & PTE_ADDR_MASK;
+    uint64_t flags = (pte & ~PTE_ADDR_MASK & ~PTE_COW) | PTE_WRITABLE;
+    page_t* pg = pmm_phys_to_page(old);
+
+    // Last reference: take the frame over instead of copying it
+    if (pg && __atomic_load_n(&pg->refcount, __ATOMIC_ACQUIRE) == 1) {
+        return paging_map(dir, page, old, flags);
+    }
+
+    uintptr_t frame = pmm_alloc_pages(0);
+    if (!frame) return -1;
+    memcpy((void*)PHYS_TO_VIRT(frame), (const void*)PHYS_TO_VIRT(old), PAGE_SIZE);
+    if (paging_map(dir, page, frame, flags) != 0) {
+        pmm_free_pages(frame, 0);
+        return -1;
+    }
+    pmm_phys_to_page(frame)->refcount = 1;
+    frame_put(old);
+
+    // Other CPUs may still translate to the shared frame
+    tlb_batch_t batch;
+    tlb_batch_init(&batch, space->pml4);
+    tlb_batch_add(&batch, page);
+    space_flush(space, &batch);
+    return 0;
+}
+
+int vmm_handle_fault(vm_space_t* space, uint64_t addr, uint64_t err) {
+    if (!space || addr >= KERNEL_HALF_BASE) return -1;
+
+    uint64_t irq = spinlock_lock_irqsave(&space->lock);
+
+    int ret = -1;
+    vma_t* vma = find_vma(space, addr);
+    uint64_t page = page_floor(addr);
+    if (vma && !(vma->flags & VMA_SHARED)) {
+        uint32_t allowed = page_vma_flags(space, page);
+        if ((err & PFERR_WRITE) && !(allowed & VMA_WRITE)) {
+            ret = -1;
+        } else if ((err & PFERR_FETCH) && !(allowed & VMA_EXEC)) {
+            ret = -1;
+        } else if (!(err & PFERR_PRESENT)) {
+            ret = fault_in(space, page);
+        } else if (err & PFERR_WRITE) {
+            ret = fault_cow(space, page);
+        }
+    }
+
+    spinlock_unlock_irqrestore(&space->lock, irq);
+    return ret;
+}
+
+int vmm_copy_from_user(vm_space_t* space, void* dst, uint64_t src, size_t len) {
+    if (!space || src >= KERNEL_HALF_BASE || len > KERNEL_HALF_BASE - src) return -1;
+
+    // Copy through the direct map with the space locked, so nothing can be
+    // unmapped underneath and a bad address fails here instead of faulting
+    uint64_t irq = spinlock_lock_irqsave(&space->lock);
+    page_directory_t* dir = (page_directory_t*)space->pml4;
+    uint8_t* out = (uint8_t*)dst;
+    int ret = 0;
+    while (len > 0) {
+        uint64_t page = page_floor(src);
+        if (!find_vma(space, src) || !(page_vma_flags(space, page) & VMA_READ)) {
+            ret = -1;
+            break;
+        }
+        uint64_t pte = paging_get_entry(dir, page);
+        if (!pte) {
+            if (fault_in(space, page) != 0) {
+                ret = -1;
+                break;
+            }
+            pte = paging_get_entry(dir, page);
+        }
+        size_t chunk = PAGE_SIZE - (src - page);
+        if (chunk > len) chunk = len;
+        memcpy(out, (const uint8_t*)PHYS_TO_VIRT(pte & PTE_ADDR_MASK) + (src - page), chunk);
+        out += chunk;
+        src += chunk;
+        len -= chunk;
+    }
+    spinlock_unlock_irqrestore(&space->lock, irq);
+    return ret;
+}
+
+struct clone_ctx {
+    page_directory_t* dst;
+    int failed;
+};
+
+static void clone_leaf(uint64_t vaddr, uint64_t* pte, void* arg) {
+    struct clone_ctx* ctx = (struct clone_ctx*)arg;
+    if (ctx->failed) return;
+
+    // Shared frames stay shared, writable in both spaces
+    if ((*pte & PTE_WRITABLE) && !(*pte & PTE_SHARED)) {
+        *pte = (*pte & ~PTE_WRITABLE) | PTE_COW;
+    }
+    if (paging_map(ctx->dst, vaddr, *pte & PTE_ADDR_MASK, *pte & ~PTE_ADDR_MASK) != 0) {
+        ctx->failed = 1;
+        return;
+    }
+    frame_get(*pte & PTE_ADDR_MASK);
+}
+
+vm_space_t* vmm_clone_space(vm_space_t* src) {
+    if (!src) return NULL;
+    vm_space_t* dst = vmm_create_space();
+    if (!dst) return NULL;
+
+    uint64_t irq = spinlock_lock_irqsave(&src->lock);
+
+    // Duplicate the area list, keeping its order
+    vma_t** tail = &dst->vmas;
+    int failed = 0;
+    for (vma_t* vma = src->vmas; vma; vma = vma->next) {
+        vma_t* copy = (vma_t*)kmalloc(sizeof(vma_t));
+        if (!copy) {
+            failed = 1;
+            break;
+        }
+        *copy = *vma;
+        copy->next = NULL;
+        if (copy->image) __atomic_add_fetch(&copy->image->refcount, 1, __ATOMIC_RELAXED);
+        *tail = copy;
+        tail = &copy->next;
+    }
+
+    // Share every resident frame read-only
+    if (!failed) {
+        struct clone_ctx ctx = { (page_directory_t*)dst->pml4, 0 };
+        paging_walk_range((page_directory_t*)src->pml4, 0, KERNEL_HALF_BASE, clone_leaf, &ctx);
+        failed = ctx.failed;
+        dst->resident = src->resident;
+
+        tlb_batch_t batch;
+        tlb_batch_init(&batch, src->pml4);
+        tlb_batch_add_all(&batch);
+        space_flush(src, &batch);
+    }
+
+    spinlock_unlock_irqrestore(&src->lock, irq);
+
+    if (failed) {
+        vmm_destroy_space(dst);
+        return NULL;
+    }
+    return dst;
+}
+
+static void release_leaf(uint64_t vaddr, uint64_t* pte, void* arg) {
+    (void)vaddr;
+    (void)arg;
+    frame_put(*pte & PTE_ADDR_MASK);
+    *pte = 0;
+}
+
+void vmm_destroy_space(vm_space_t* space) {
+    if (!space) return;
+    if (space->active_cpus || (__asm_get_cr3() & PTE_ADDR_MASK) == space->pml4) {
+        serial_printf("vmm: refusing to destroy the active address space\n");
+        return;
+    }
+
+    paging_walk_range((page_directory_t*)space->pml4, 0, KERNEL_HALF_BASE, release_leaf, NULL);
+    paging_destroy_directory((page_directory_t*)space->pml4);
+    tlb_free_pcid(space->pcid);
+
+    vma_t* vma = space->vmas;
+    while (vma) {
+        vma_t* next = vma->next;
+        vmm_image_put(vma->image);
+        kfree(vma);
+        vma = next;
+    }
+    kfree(space);
+}
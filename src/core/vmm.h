@@ -0,0 +1,100 @@
+#ifndef VMM_H
+#define VMM_H
+
+#include "common.h"
+#include "spinlock.h"
+#include "smp.h"
+
+/* vma_t.flags */
+#define VMA_READ   0x1
+#define VMA_WRITE  0x2
+#define VMA_EXEC   0x4
+#define VMA_SHARED 0x8  /* Frames mapped up front, shared with the kernel (vmm_map_shared) */
+
+/* Where vmm_map_shared places areas: below 4 GiB, so compatibility-mode
+   programs reach them too, and clear of the stack */
+#define VMM_SHARED_BASE  0x80000000ULL
+#define VMM_SHARED_LIMIT 0xB0000000ULL
+
+/* Page-fault error code bits */
+#define PFERR_PRESENT 0x1
+#define PFERR_WRITE   0x2
+#define PFERR_USER    0x4
+#define PFERR_FETCH   0x10
+
+/* Private copy of an executable that file-backed areas fault pages in
+   from; shared by every address space cloned from the same process. */
+typedef struct vm_image {
+    uint32_t refcount;
+    size_t size;
+    uint8_t data[];
+} vm_image_t;
+
+/* A page-aligned range of user virtual memory. Pages are only allocated
+   when first touched: zero-filled for anonymous areas, or filled from
+   [file_vaddr, file_vaddr + file_size) of the image for file-backed ones. */
+typedef struct vma {
+    uint64_t start;
+    uint64_t end;
+    uint32_t flags;
+    vm_image_t* image;      /* NULL for anonymous memory */
+    uint64_t file_vaddr;    /* Where image byte file_offset is mapped */
+    uint64_t file_offset;
+    uint64_t file_size;
+    struct vma* next;
+} vma_t;
+
+/* TLB state: tlb_gen is bumped whenever a translation is removed or
+   downgraded. A CPU may only switch in with a non-flushing CR3 load if
+   its TLB has seen the current generation (cpu_gen). CPUs with the space
+   loaded (active_cpus) are flushed by IPI instead. */
+typedef struct vm_space {
+    uint64_t pml4;          /* Physical address, as loaded into CR3 */
+    vma_t* vmas;
+    size_t resident;        /* Frames currently mapped */
+    spinlock_t lock;        /* VMA list and page tables */
+    uint16_t pcid;
+    uint64_t active_cpus;
+    uint64_t tlb_gen;
+    uint64_t cpu_gen[SMP_MAX_CPUS];
+} vm_space_t;
+
+vm_space_t* vmm_create_space(void);
+void vmm_destroy_space(vm_space_t* space);
+
+/* Copy-on-write duplicate: writable pages become read-only in both spaces
+   and are copied on the first write by either side */
+vm_space_t* vmm_clone_space(vm_space_t* src);
+
+vm_image_t* vmm_image_create(const void* data, size_t size);
+void vmm_image_put(vm_image_t* image);
+
+/* Reserve an area; nothing is allocated until it is touched */
+int vmm_map_anon(vm_space_t* space, uint64_t start, uint64_t size, uint32_t flags);
+int vmm_map_file(vm_space_t* space, uint64_t start, uint64_t size, uint32_t flags,
+                 vm_image_t* image, uint64_t file_vaddr, uint64_t file_offset, uint64_t file_size);
+
+/* Memory the kernel and user programs both map, such as window surfaces.
+   vmm_shared_alloc returns size bytes (rounded up to pages) of zeroed,
+   physically contiguous memory in the direct map. Each frame is reference
+   counted like a user page: the kernel holds one reference, dropped with
+   vmm_shared_put, and every space it is mapped into holds another, so
+   the memory outlives whichever side lets go first. */
+void* vmm_shared_alloc(size_t size);
+void vmm_shared_put(void* buf, size_t size);
+
+/* Map a vmm_shared_alloc buffer into space at a free address, stored in
+   *addr. flags are VMA_* bits; the mapping is never copy-on-write. */
+int vmm_map_shared(vm_space_t* space, void* buf, size_t size, uint32_t flags, uint64_t* addr);
+
+/* Copy len bytes from user address src in space; -1 unless the whole
+   range lies in readable areas. Untouched pages are faulted in. */
+int vmm_copy_from_user(vm_space_t* space, void* dst, uint64_t src, size_t len);
+
+/* Load next (NULL = kernel only) in place of prev on this CPU */
+void vmm_switch(vm_space_t* prev, vm_space_t* next);
+
+/* Resolve a fault at addr; returns 0 if the access may be retried */
+int vmm_handle_fault(vm_space_t* space, uint64_t addr, uint64_t err);
+
+#endif
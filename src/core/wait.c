@@ -0,0 +1,140 @@
+#include "wait.h"
+#include "process.h"
+#include "timer.h"
+#include "clock.h"
+#include "io.h"
+
+/*
+   A sleeper links itself into the queue and goes PROC_WAITING under the
+   queue lock, then yields. Whoever takes it off the queue again - a
+   waker, or the timeout timer - hands it to scheduler_wake, so exactly
+   one of them does.
+*/
+
+void wait_queue_init(wait_queue_t* wq) {
+    spinlock_init(&wq->lock);
+    wq->head = NULL;
+    wq->seq = 0;
+}
+
+/* Called with the queue lock held; 1 if proc was queued */
+static int wq_unlink(wait_queue_t* wq, process_t* proc) {
+    process_t** link = &wq->head;
+    while (*link && *link != proc) link = &(*link)->wait_next;
+    if (!*link) return 0;
+    *link = proc->wait_next;
+    proc->wait_next = NULL;
+    return 1;
+}
+
+static void wait_timeout(ktimer_t* timer) {
+    process_t* proc = timer->data;
+    wait_queue_t* wq = proc->wait_queue;
+
+    spinlock_lock(&wq->lock);
+    int queued = wq_unlink(wq, proc);
+    if (queued) proc->wait_timed_out = 1;
+    spinlock_unlock(&wq->lock);
+
+    if (queued) scheduler_wake(proc);
+}
+
+static int spin_wait(wait_queue_t* wq, uint32_t seq, uint64_t deadline_ns) {
+    while (wait_queue_seq(wq) == seq) {
+        if (deadline_ns && clock_monotonic_ns() >= deadline_ns) return -1;
+        __asm__ volatile("pause");
+    }
+    return 0;
+}
+
+int wait_queue_sleep(wait_queue_t* wq, uint32_t seq, uint64_t deadline_ns) {
+    if (!scheduler_can_sleep()) return spin_wait(wq, seq, deadline_ns);
+    if (deadline_ns && clock_monotonic_ns() >= deadline_ns) return -1;
+
+    process_t* self = current_process;
+    ktimer_t timer;
+    uint64_t flags = spinlock_lock_irqsave(&wq->lock);
+
+    // Queue first, then look at seq: a waker bumps seq before it looks
+    // for sleepers, so one of us sees the other
+    self->wait_next = NULL;
+    process_t** tail = &wq->head;
+    while (*tail) tail = &(*tail)->wait_next;
+    *tail = self;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (wait_queue_seq(wq) != seq) {
+        wq_unlink(wq, self);
+        spinlock_unlock_irqrestore(&wq->lock, flags);
+        return 0;
+    }
+
+    self->wait_queue = wq;
+    self->wait_timed_out = 0;
+    self->sleep_start = clock_monotonic_ns();
+    self->state = PROC_WAITING;
+    if (deadline_ns) {
+        ktimer_init(&timer, wait_timeout, self);
+        ktimer_add(&timer, deadline_ns);
+    }
+    spinlock_unlock(&wq->lock);
+
+    scheduler_sleep();
+    irq_restore(flags);
+
+    // The timer lives on this stack: make sure it is neither pending nor
+    // still running elsewhere before returning
+    if (deadline_ns) ktimer_cancel(&timer);
+    self->wait_queue = NULL;
+    return self->wait_timed_out ? -1 : 0;
+}
+
+static void wake(wait_queue_t* wq, int all) {
+    __atomic_add_fetch(&wq->seq, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&wq->head, __ATOMIC_SEQ_CST)) return;
+
+    process_t* woken = NULL;
+    uint64_t flags = spinlock_lock_irqsave(&wq->lock);
+    if (all) {
+        woken = wq->head;
+        wq->head = NULL;
+    } else if (wq->head) {
+        woken = wq->head;
+        wq->head = woken->wait_next;
+        woken->wait_next = NULL;
+    }
+    spinlock_unlock_irqrestore(&wq->lock, flags);
+
+    while (woken) {
+        process_t* p = woken;
+        woken = p->wait_next;
+        p->wait_next = NULL;
+        scheduler_wake(p);
+    }
+}
+
+void wait_queue_wake_one(wait_queue_t* wq) {
+    wake(wq, 0);
+}
+
+void wait_queue_wake_all(wait_queue_t* wq) {
+    wake(wq, 1);
+}
+
+void sleep_until(uint64_t deadline_ns) {
+    if (!clock_available()) {
+        // The deadline will never come; delay by port writes instead, at
+        // about a microsecond each
+        for (uint64_t us = deadline_ns / 1000; us > 0; us--) io_wait();
+        return;
+    }
+
+    // Nothing wakes this queue; only the deadline ends the sleep
+    wait_queue_t wq = WAIT_QUEUE_INIT;
+    while (clock_monotonic_ns() < deadline_ns) {
+        wait_queue_sleep(&wq, 0, deadline_ns);
+    }
+}
+
+void sleep_ms(uint64_t ms) {
+    sleep_until(clock_monotonic_ns() + ms * 1000000ULL);
+}
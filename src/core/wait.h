@@ -0,0 +1,47 @@
+#ifndef WAIT_H
+#define WAIT_H
+
+#include "common.h"
+#include "spinlock.h"
+
+struct process;
+
+/*
+   Wait queues: processes sleep on one until another process or an
+   interrupt handler wakes it. To wait for a condition without missing a
+   wakeup that races with the test, sample the sequence number first:
+
+       uint32_t seq = wait_queue_seq(&wq);
+       if (!condition) wait_queue_sleep(&wq, seq, deadline);
+
+   and have the waker make the condition true before waking the queue.
+*/
+typedef struct wait_queue {
+    spinlock_t lock;
+    struct process* head;       /* Linked through wait_next, oldest first */
+    volatile uint32_t seq;      /* Bumped by every wakeup */
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, NULL, 0 }
+
+void wait_queue_init(wait_queue_t* wq);
+
+static inline uint32_t wait_queue_seq(wait_queue_t* wq) {
+    return __atomic_load_n(&wq->seq, __ATOMIC_SEQ_CST);
+}
+
+/* Sleep until woken or until deadline_ns (clock_monotonic_ns clock, 0 for
+   none). Returns at once if the queue was woken since seq was sampled.
+   Returns 0 when woken, -1 on timeout. Where the caller cannot block
+   (early boot, the idle task) this spins instead. */
+int wait_queue_sleep(wait_queue_t* wq, uint32_t seq, uint64_t deadline_ns);
+
+/* Callable from interrupt handlers */
+void wait_queue_wake_one(wait_queue_t* wq);
+void wait_queue_wake_all(wait_queue_t* wq);
+
+/* Give the CPU away until deadline_ns / for ms milliseconds */
+void sleep_until(uint64_t deadline_ns);
+void sleep_ms(uint64_t ms);
+
+#endif
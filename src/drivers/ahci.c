@@ -5,6 +5,9 @@
 #include "memory.h"
 #include "io.h"
 #include "../core/paging.h"
+#include "../core/dma.h"
+#include "../core/clock.h"
+#include "../core/wait.h"
 #include "../fs/blockdev.h"
 #include "../lib/string.h" // for sprintf/strcpy
 
@@ -21,6 +24,11 @@ static int ahci_bd_write(block_device_t* dev, uint64_t lba, uint32_t count, cons
 static HBA_MEM* hba_mem = NULL;
 static HBA_PORT* sata_ports[32];
 static int sata_port_count = 0;
+static uint32_t ahci_dma_flags = 0;     // DMA_32BIT unless CAP.S64A
+static dma_pool_t* cmd_tbl_pool = NULL; // 256-byte command tables, 128-byte aligned
+
+#define AHCI_CAP_S64A (1u << 31)
+#define AHCI_CMD_TBL_SIZE 256 // Header + 8 PRDT entries
 
 static int check_type(HBA_PORT* port) {
     uint32_t ssts = port->ssts;
@@ -39,20 +47,49 @@ static int check_type(HBA_PORT* port) {
     }
 }
 
-static void start_cmd(HBA_PORT* port) {
+/* Timeouts from the AHCI spec where it gives one */
+#define AHCI_IDLE_TIMEOUT_NS   500000000ULL   /* CR, FR, BSY/DRQ to clear */
+#define AHCI_RESET_TIMEOUT_NS  1000000000ULL  /* GHC.HR to clear */
+#define AHCI_LINK_TIMEOUT_NS   1000000000ULL  /* PHY to come back after COMRESET */
+#define AHCI_CMD_TIMEOUT_NS    5000000000ULL  /* A command to complete */
+#define AHCI_COMRESET_NS       1000000ULL     /* DET=1 held at least 1 ms */
+#define AHCI_SETTLE_NS         1000000ULL     /* After GHC.AE changes */
+
+/* Spin until none of mask is set in the 32-bit register at reg; -1 if
+   timeout_ns passes first. (The HBA structs are packed, but every
+   register in them is naturally aligned.) */
+static int ahci_wait_clear(volatile void* reg, uint32_t mask, uint64_t timeout_ns) {
+    uint64_t deadline = clock_monotonic_ns() + timeout_ns;
+    uint64_t spins = 0;
+    while (*(volatile uint32_t*)reg & mask) {
+        if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(timeout_ns)) return -1;
+        __asm__ __volatile__("pause" : : : "memory");
+    }
+    return 0;
+}
+
+static void ahci_delay(uint64_t ns) {
+    sleep_until(clock_monotonic_ns() + ns);
+}
+
+/* Start the command engine; -1 if it is still running from before */
+static int start_cmd(HBA_PORT* port) {
     // Wait until CR is cleared
-    int spin = 0;
-    while ((port->cmd & HBA_PxCMD_CR) && spin < 1000000) spin++;
-    if (spin == 1000000) {
+    if (ahci_wait_clear((volatile void*)&port->cmd, HBA_PxCMD_CR, AHCI_IDLE_TIMEOUT_NS) != 0) {
         serial_printf("ahci: start_cmd timeout (CR not cleared)\n");
+        return -1;
     }
 
     // Set FRE and ST
     port->cmd |= HBA_PxCMD_FRE;
     port->cmd |= HBA_PxCMD_ST;
+    return 0;
 }
 
-static void stop_cmd(HBA_PORT* port) {
+/* Stop the command engine and FIS receive, resetting the link if they
+   will not stop. -1 if the port still is not idle afterwards, or its
+   device did not come back from the reset: it must not be used. */
+static int stop_cmd(HBA_PORT* port) {
     // Clear pending interrupts and errors
     port->is = (uint32_t)-1;
     port->serr = (uint32_t)-1;
@@ -62,32 +99,39 @@ static void stop_cmd(HBA_PORT* port) {
     __asm__ __volatile__("" : : : "memory");
     
     // 2. Wait for CR (Command List Running) to be cleared
-    int spin = 0;
-    while ((port->cmd & HBA_PxCMD_CR) && spin < 1000000) {
-        spin++;
-        __asm__ __volatile__("pause" : : : "memory");
-    }
+    ahci_wait_clear((volatile void*)&port->cmd, HBA_PxCMD_CR, AHCI_IDLE_TIMEOUT_NS);
 
     // 3. Clear FRE (FIS Receive Enable)
     port->cmd &= ~HBA_PxCMD_FRE;
     __asm__ __volatile__("" : : : "memory");
 
     // 4. Wait for FR (FIS Receive Running) to be cleared
-    spin = 0;
-    while ((port->cmd & HBA_PxCMD_FR) && spin < 1000000) {
-        spin++;
-        __asm__ __volatile__("pause" : : : "memory");
-    }
+    int fr_stuck = ahci_wait_clear((volatile void*)&port->cmd, HBA_PxCMD_FR, AHCI_IDLE_TIMEOUT_NS);
 
-    if (spin == 1000000 || (port->cmd & HBA_PxCMD_CR)) {
+    if (fr_stuck || (port->cmd & HBA_PxCMD_CR)) {
         serial_printf("ahci: stop_cmd failed to idle. Performing port reset...\n");
         // Port Reset (COMRESET)
         port->sctl = (port->sctl & ~0x0F) | 0x01; // DET = 1 (Perform interface reset)
-        for (int d = 0; d < 1000000; d++) __asm__ __volatile__("pause");
+        ahci_delay(AHCI_COMRESET_NS);
         port->sctl &= ~0x0F; // DET = 0 (Return to normal operation)
-        while ((port->ssts & 0x0F) != 0x03); // Wait for device present and communication established
+        // Wait for device present and communication established
+        uint64_t deadline = clock_monotonic_ns() + AHCI_LINK_TIMEOUT_NS;
+        uint64_t spins = 0;
+        while ((port->ssts & 0x0F) != HBA_PORT_DET_PRESENT) {
+            if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(AHCI_LINK_TIMEOUT_NS)) {
+                serial_printf("ahci: link did not come back after COMRESET\n");
+                return -1;
+            }
+            __asm__ __volatile__("pause" : : : "memory");
+        }
         port->serr = (uint32_t)-1; // Clear errors again
+
+        if (port->cmd & (HBA_PxCMD_CR | HBA_PxCMD_FR)) {
+            serial_printf("ahci: port still busy after COMRESET\n");
+            return -1;
+        }
     }
+    return 0;
 }
 
 static int find_cmd_slot(HBA_PORT* port) {
@@ -160,34 +204,28 @@ void ahci_init(void) {
         abar_phys |= ((uint64_t)bar5_upper << 32);
     }
 
-    extern uint64_t g_hhdm_offset;
-    abar_phys += g_hhdm_offset;
-    
-    // Map AHCI MMIO region (usually 1KB per port, but 4KB is safe for ABAR)
-    paging_map_mmio(abar_phys, 4096);
+    // Generic host control plus the register blocks of all 32 ports,
+    // which run past the first page
+    hba_mem = (HBA_MEM*)paging_map_mmio(abar_phys, sizeof(HBA_MEM));
     
-    hba_mem = (HBA_MEM*)abar_phys;
-    
-    serial_printf("ahci: MMIO at %lx\n", abar_phys);
+    serial_printf("ahci: MMIO at %lx\n", (uint64_t)(uintptr_t)hba_mem);
     
     // AE (AHCI Enable) must be 1 before HR or any other port registers
     hba_mem->ghc |= (1 << 31);
-    for (int d = 0; d < 1000000; d++) __asm__ __volatile__("pause");
+    ahci_delay(AHCI_SETTLE_NS);
 
     // HBA Reset
     serial_printf("ahci: performing HBA reset...\n");
     hba_mem->ghc |= (1 << 0); // HR (HBA Reset)
-    int spin = 0;
-    while ((hba_mem->ghc & 0x01) && spin < 20000000) spin++;
-    if (spin == 20000000) {
+    if (ahci_wait_clear((volatile void*)&hba_mem->ghc, 0x01, AHCI_RESET_TIMEOUT_NS) != 0) {
         serial_printf("ahci: HBA reset timeout!\n");
     }
 
     // AE must be re-enabled after reset as it clears
-    for (int d = 0; d < 1000000; d++) __asm__ __volatile__("pause");
+    ahci_delay(AHCI_SETTLE_NS);
     serial_printf("ahci: enabling AHCI mode (AE)...\n");
     hba_mem->ghc |= (1 << 31); // AE (AHCI Enable)
-    for (int d = 0; d < 1000000; d++) __asm__ __volatile__("pause");
+    ahci_delay(AHCI_SETTLE_NS);
     
     // Global Interrupt Enable
     hba_mem->ghc |= (1 << 1);  // IE (Interrupt Enable)
@@ -196,6 +234,16 @@ void ahci_init(void) {
     uint32_t vs = hba_mem->vs;
     serial_printf("ahci: version %d.%d\n", (vs >> 16), vs & 0xFFFF);
 
+    // Without 64-bit addressing every structure must sit below 4 GiB
+    ahci_dma_flags = (hba_mem->cap & AHCI_CAP_S64A) ? 0 : DMA_32BIT;
+    if (!cmd_tbl_pool) {
+        cmd_tbl_pool = dma_pool_create("ahci-cmdtbl", AHCI_CMD_TBL_SIZE, 128, ahci_dma_flags);
+    }
+    if (!cmd_tbl_pool) {
+        kprintf("ahci: failed to create command table pool\n");
+        return;
+    }
+
     // Check implemented ports
     uint32_t pi = hba_mem->pi;
     serial_printf("ahci: ports implemented mask: %x\n", pi);
@@ -208,41 +256,48 @@ void ahci_init(void) {
                 serial_printf("ahci: port %d: SATA drive found\n", i);
                 
                 HBA_PORT* port = &hba_mem->ports[i];
-                sata_ports[sata_port_count++] = port;
                 
                 // Set up port memory (rebase)
                 serial_printf("ahci: port %d: rebasing...\n", i);
-                stop_cmd(port);
+                if (stop_cmd(port) != 0) {
+                    kprintf("ahci: port %d: will not stop, not using it\n", i);
+                    continue;
+                }
                 
-                // Command list offset: 1K aligned
-                void* cl_addr = kmalloc_a(1024);
-                memset(cl_addr, 0, 1024);
-                port->clb = (uint32_t)VIRT_TO_PHYS(cl_addr);
-                port->clbu = (uint32_t)(VIRT_TO_PHYS(cl_addr) >> 32);
-
-                // FIS offset: 256 bytes aligned
-                void* fis_addr = kmalloc_a(256);
-                memset(fis_addr, 0, 256);
-                port->fb = (uint32_t)VIRT_TO_PHYS(fis_addr);
-                port->fbu = (uint32_t)(VIRT_TO_PHYS(fis_addr) >> 32);
+                // One page per port: command list (1K aligned) at 0, received FIS (256 aligned) at 1K
+                dma_buf_t port_mem;
+                if (dma_alloc(&port_mem, 4096, 1024, ahci_dma_flags) != 0) {
+                    kprintf("ahci: port %d: out of DMA memory\n", i);
+                    continue;
+                }
+                uint64_t cl_phys = port_mem.phys;
+                uint64_t fis_phys = port_mem.phys + 1024;
+                port->clb = (uint32_t)cl_phys;
+                port->clbu = (uint32_t)(cl_phys >> 32);
+                port->fb = (uint32_t)fis_phys;
+                port->fbu = (uint32_t)(fis_phys >> 32);
 
                 // Command table offset: 128 bytes aligned
-                HBA_CMD_HEADER* cmdhdr = (HBA_CMD_HEADER*)cl_addr;
+                HBA_CMD_HEADER* cmdhdr = (HBA_CMD_HEADER*)port_mem.virt;
                 for (int j = 0; j < 32; j++) {
+                    uint64_t ct_phys = 0;
+                    if (!dma_pool_alloc(cmd_tbl_pool, &ct_phys)) break;
                     cmdhdr[j].prdtl = 8; // 8 PRDT entries per command table
-                    void* ct_addr = kmalloc_a(256);
-                    memset(ct_addr, 0, 256);
-                    cmdhdr[j].ctba = (uint32_t)VIRT_TO_PHYS(ct_addr);
-                    cmdhdr[j].ctbau = (uint32_t)(VIRT_TO_PHYS(ct_addr) >> 32);
+                    cmdhdr[j].ctba = (uint32_t)ct_phys;
+                    cmdhdr[j].ctbau = (uint32_t)(ct_phys >> 32);
                 }
 
-                start_cmd(port);
+                if (start_cmd(port) != 0) {
+                    kprintf("ahci: port %d: will not start, not using it\n", i);
+                    continue;
+                }
+                sata_ports[sata_port_count++] = port;
                 serial_printf("ahci: port %d: ready\n", i);
                 
                 // Identify size
-                void* id_buf = kmalloc_raw_aligned(4096); // Use raw aligned to be safe with phys
-                if (ahci_identify(port, id_buf) == 0) {
-                    uint16_t* id = (uint16_t*)id_buf;
+                dma_buf_t id_buf;
+                if (dma_alloc(&id_buf, 512, 0, ahci_dma_flags) == 0 && ahci_identify(port, id_buf.virt) == 0) {
+                    uint16_t* id = (uint16_t*)id_buf.virt;
                     uint64_t sectors = 0;
                     if (id[83] & (1 << 10)) { // LBA48 supported
                         sectors = *(uint64_t*)&id[100];
@@ -271,7 +326,7 @@ void ahci_init(void) {
                 } else {
                      kprintf("ahci: port %d identify failed\n", i);
                 }
-                kfree(id_buf); 
+                dma_free(&id_buf);
             }
         }
     }
@@ -304,16 +359,17 @@ int ahci_identify(HBA_PORT* port, uint16_t* buf) {
     cmdfis->c = 1;
     cmdfis->command = 0xEC; // Identify Device
 
-    int spin = 0;
-    while ((port->tfd & (0x80 | 0x08)) && spin < 1000000) spin++;
-    if (spin == 1000000) return -1;
+    if (ahci_wait_clear((volatile void*)&port->tfd, 0x80 | 0x08, AHCI_IDLE_TIMEOUT_NS) != 0) return -1;
 
     port->ci = (1 << slot);
     __asm__ __volatile__("" : : : "memory");
 
+    uint64_t deadline = clock_monotonic_ns() + AHCI_CMD_TIMEOUT_NS;
+    uint64_t spins = 0;
     while (1) {
         if ((port->ci & (1 << slot)) == 0) break;
         if (port->is & (1 << 30)) return -1;
+        if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(AHCI_CMD_TIMEOUT_NS)) return -1;
         __asm__ __volatile__("pause" : : : "memory");
     }
 
@@ -391,12 +447,7 @@ int ahci_read(HBA_PORT* port, uint32_t startl, uint32_t starth, uint32_t count,
     cmdfis->countl = (uint8_t)count;
     cmdfis->counth = (uint8_t)(count >> 8);
 
-    int spin = 0;
-    while ((port->tfd & (0x80 | 0x08)) && spin < 1000000) {
-        spin++;
-        __asm__ __volatile__("pause" : : : "memory");
-    }
-    if (spin == 1000000) {
+    if (ahci_wait_clear((volatile void*)&port->tfd, 0x80 | 0x08, AHCI_IDLE_TIMEOUT_NS) != 0) {
         serial_printf("ahci: port is hung before issue. TFD=%x\n", port->tfd);
         return -1;
     }
@@ -405,7 +456,8 @@ int ahci_read(HBA_PORT* port, uint32_t startl, uint32_t starth, uint32_t count,
     __asm__ __volatile__("" : : : "memory");
 
     // Wait for completion
-    spin = 0;
+    uint64_t start = clock_monotonic_ns();
+    uint64_t spins = 0;
     while (1) {
         if ((port->ci & (1 << slot)) == 0) break;
         
@@ -414,8 +466,8 @@ int ahci_read(HBA_PORT* port, uint32_t startl, uint32_t starth, uint32_t count,
                           port->tfd, port->is, port->serr);
             return -1;
         }
-        spin++;
-        if (spin > 20000000) {
+        if (clock_monotonic_ns() - start >= AHCI_CMD_TIMEOUT_NS ||
+            ++spins >= CLOCK_POLL_LIMIT(AHCI_CMD_TIMEOUT_NS)) {
             serial_printf("ahci: timeout. CI=%x, TFD=%x, IS=%x, SERR=%x\n", 
                           port->ci, port->tfd, port->is, port->serr);
             return -1;
@@ -423,7 +475,7 @@ int ahci_read(HBA_PORT* port, uint32_t startl, uint32_t starth, uint32_t count,
         __asm__ __volatile__("pause" : : : "memory");
     }
 
-    serial_printf("ahci: read successful after %d spins\n", spin);
+    serial_printf("ahci: read successful after %d us\n", (int)((clock_monotonic_ns() - start) / 1000));
     return 0;
 }
 
@@ -2,10 +2,26 @@
 #include "pci.h"
 #include "../lib/printf.h"
 #include "../lib/memory.h"
-#include "../core/hpet.h"
+#include "../core/clock.h"
+#include "../core/wait.h"
+#include "../core/paging.h"
+#include "../core/dma.h"
 
 static hda_controller_t g_hda;
 
+/* Register polls sleep between reads rather than spin; codecs answer
+   verbs within microseconds, so the interval is short */
+#define HDA_POLL_NS          50000ULL
+#define HDA_RESET_TIMEOUT_NS 1000000000ULL
+#define HDA_VERB_TIMEOUT_NS  1000000000ULL
+/* Each poll sleeps at least HDA_POLL_NS, so this many polls cannot end a
+   wait early; they end it when the clock does not run */
+#define HDA_POLLS(ns)        ((ns) / HDA_POLL_NS)
+
+static void hda_poll_sleep(void) {
+    sleep_until(clock_monotonic_ns() + HDA_POLL_NS);
+}
+
 static uint32_t hda_read32(hda_controller_t* hda, uint32_t reg) {
     return *(volatile uint32_t*)(hda->bar + reg);
 }
@@ -73,8 +89,7 @@ void hda_init(void) {
         return;
     }
 
-    extern uint64_t g_hhdm_offset;
-    g_hda.bar = mmio_base + g_hhdm_offset;
+    g_hda.bar = (uintptr_t)paging_map_mmio(mmio_base, 0x4000);
     
     // Sanity check: try to read a register and verify it's not all 1s
     kprintf("HDA: Checking MMIO at %lx (Phys: %lx)\n", g_hda.bar, mmio_base);
@@ -91,16 +106,20 @@ void hda_init(void) {
     hda_write32(&g_hda, HDA_REG_GCTL, gctl & ~1); // CRST = 0 (Reset)
     
     // Wait for CRST to become 0
-    int timeout = 1000;
-    while ((hda_read32(&g_hda, HDA_REG_GCTL) & 1) && timeout--) hpet_sleep(1);
+    uint64_t deadline = clock_monotonic_ns() + HDA_RESET_TIMEOUT_NS;
+    uint64_t polls = 0;
+    while ((hda_read32(&g_hda, HDA_REG_GCTL) & 1) && clock_monotonic_ns() < deadline &&
+           polls++ < HDA_POLLS(HDA_RESET_TIMEOUT_NS)) hda_poll_sleep();
     
-    hpet_sleep(10);
+    sleep_ms(10);
 
     hda_write32(&g_hda, HDA_REG_GCTL, hda_read32(&g_hda, HDA_REG_GCTL) | 1); // CRST = 1 (Ready)
     
     // Wait for CRST to become 1
-    timeout = 1000;
-    while (!(hda_read32(&g_hda, HDA_REG_GCTL) & 1) && timeout--) hpet_sleep(1);
+    deadline = clock_monotonic_ns() + HDA_RESET_TIMEOUT_NS;
+    polls = 0;
+    while (!(hda_read32(&g_hda, HDA_REG_GCTL) & 1) && clock_monotonic_ns() < deadline &&
+           polls++ < HDA_POLLS(HDA_RESET_TIMEOUT_NS)) hda_poll_sleep();
 
     if (!(hda_read32(&g_hda, HDA_REG_GCTL) & 1)) {
         kprintf("HDA: Controller reset timed out\n");
@@ -111,13 +130,17 @@ void hda_init(void) {
             hda_read8(&g_hda, HDA_REG_VMAJ), hda_read8(&g_hda, HDA_REG_VMIN));
 
     // 2. Setup CORB/RIRB
-    g_hda.corb = kmalloc_raw_aligned(1024); // 256 * 4 bytes
-    g_hda.rirb = kmalloc_raw_aligned(2048); // 256 * 8 bytes
-    
-    if (!g_hda.corb || !g_hda.rirb) {
+    // One page: CORB (256 * 4 bytes) at 0, RIRB (256 * 8 bytes) at 2K, both 128-byte aligned
+    g_hda.dma_flags = (hda_read16(&g_hda, HDA_REG_GCAP) & 1) ? 0 : DMA_32BIT; // 64OK
+    dma_buf_t rings;
+    if (dma_alloc(&rings, 4096, 128, g_hda.dma_flags) != 0) {
         kprintf("HDA: Failed to allocate CORB/RIRB buffers\n");
         return;
     }
+    g_hda.corb = (uint32_t*)rings.virt;
+    g_hda.rirb = (uint64_t*)((uint8_t*)rings.virt + 2048);
+    uint64_t corb_phys = rings.phys;
+    uint64_t rirb_phys = rings.phys + 2048;
     
     g_hda.corb_size_entries = 256;
     g_hda.rirb_size_entries = 256;
@@ -129,17 +152,19 @@ void hda_init(void) {
     hda_write8(&g_hda, HDA_REG_RIRBCTL, 0);
 
     // Set Base Addresses
-    hda_write32(&g_hda, HDA_REG_CORBLBASE, (uint32_t)VIRT_TO_PHYS(g_hda.corb));
-    hda_write32(&g_hda, HDA_REG_CORBUBASE, (uint32_t)(VIRT_TO_PHYS(g_hda.corb) >> 32));
-    hda_write32(&g_hda, HDA_REG_RIRBLBASE, (uint32_t)VIRT_TO_PHYS(g_hda.rirb));
-    hda_write32(&g_hda, HDA_REG_RIRBUBASE, (uint32_t)(VIRT_TO_PHYS(g_hda.rirb) >> 32));
+    hda_write32(&g_hda, HDA_REG_CORBLBASE, (uint32_t)corb_phys);
+    hda_write32(&g_hda, HDA_REG_CORBUBASE, (uint32_t)(corb_phys >> 32));
+    hda_write32(&g_hda, HDA_REG_RIRBLBASE, (uint32_t)rirb_phys);
+    hda_write32(&g_hda, HDA_REG_RIRBUBASE, (uint32_t)(rirb_phys >> 32));
 
     // Set Write Pointer (CORB) and Read Pointer (RIRB) reset to 0
     hda_write16(&g_hda, HDA_REG_CORBWP, 0);
     // Read Pointer is set by Hardware, usually we write 1 to Reset bit in CORBRP if supported
     hda_write16(&g_hda, HDA_REG_CORBRP, 0x8000); // Bit 15 is CORBRP Reset
-    timeout = 1000;
-    while ((hda_read16(&g_hda, HDA_REG_CORBRP) & 0x8000) && timeout--) hpet_sleep(1);
+    deadline = clock_monotonic_ns() + HDA_RESET_TIMEOUT_NS;
+    polls = 0;
+    while ((hda_read16(&g_hda, HDA_REG_CORBRP) & 0x8000) && clock_monotonic_ns() < deadline &&
+           polls++ < HDA_POLLS(HDA_RESET_TIMEOUT_NS)) hda_poll_sleep();
 
     // Set RIRB WP Reset
     hda_write16(&g_hda, HDA_REG_RIRBWP, 0x8000);
@@ -195,9 +220,13 @@ uint64_t hda_send_verb(uint8_t codec_addr, uint8_t node_id, uint32_t verb) {
     uint16_t next_wp = (g_hda.corb_wp + 1) % g_hda.corb_size_entries;
     
     // 1. Wait for space in CORB
-    int timeout = 10000;
-    while (next_wp == (hda_read16(&g_hda, HDA_REG_CORBRP) & 0xFF) && timeout--) hpet_sleep(1);
-    if (timeout < 0) {
+    uint64_t deadline = clock_monotonic_ns() + HDA_VERB_TIMEOUT_NS;
+    uint64_t polls = 0;
+    while (next_wp == (hda_read16(&g_hda, HDA_REG_CORBRP) & 0xFF)) {
+        if (clock_monotonic_ns() >= deadline || polls++ >= HDA_POLLS(HDA_VERB_TIMEOUT_NS)) break;
+        hda_poll_sleep();
+    }
+    if (next_wp == (hda_read16(&g_hda, HDA_REG_CORBRP) & 0xFF)) {
         kprintf("HDA: CORB stall\n");
         return 0xFFFFFFFFFFFFFFFFULL;
     }
@@ -208,14 +237,16 @@ uint64_t hda_send_verb(uint8_t codec_addr, uint8_t node_id, uint32_t verb) {
     hda_write16(&g_hda, HDA_REG_CORBWP, next_wp);
 
     // 3. Wait for response in RIRB
-    timeout = 10000;
-    while (timeout--) {
+    deadline = clock_monotonic_ns() + HDA_VERB_TIMEOUT_NS;
+    polls = 0;
+    for (;;) {
         uint16_t rirb_wp = hda_read16(&g_hda, HDA_REG_RIRBWP) & 0xFF;
         if (rirb_wp != g_hda.rirb_rp) {
             g_hda.rirb_rp = (g_hda.rirb_rp + 1) % g_hda.rirb_size_entries;
             return g_hda.rirb[g_hda.rirb_rp];
         }
-        hpet_sleep(1);
+        if (clock_monotonic_ns() >= deadline || polls++ >= HDA_POLLS(HDA_VERB_TIMEOUT_NS)) break;
+        hda_poll_sleep();
     }
 
     kprintf("HDA: Verb timeout (Codec %d, Node %d)\n", codec_addr, node_id);
@@ -242,7 +273,13 @@ void hda_play_sine(uint32_t freq_hz, uint32_t duration_ms) {
 
     // Allocate Buffer (1 second of stereo 16-bit 44.1kHz = 176400 bytes)
     uint32_t buf_size = 176400;
-    int16_t* pcm = kmalloc_raw_aligned(buf_size);
+    dma_buf_t pcm_buf, bdl_buf;
+    if (dma_alloc(&pcm_buf, buf_size, 128, g_hda.dma_flags) != 0) return;
+    if (dma_alloc(&bdl_buf, 16, 128, g_hda.dma_flags) != 0) {
+        dma_free(&pcm_buf);
+        return;
+    }
+    int16_t* pcm = (int16_t*)pcm_buf.virt;
     
     // Fill with sine wave
     for (uint32_t i = 0; i < buf_size / 4; i++) {
@@ -252,15 +289,15 @@ void hda_play_sine(uint32_t freq_hz, uint32_t duration_ms) {
         pcm[i*2 + 1] = pcm[i*2];
     }
 
-    // Setup BDL (Buffer Descriptor List)
-    uint64_t* bdl = kmalloc_raw_aligned(128);
-    bdl[0] = VIRT_TO_PHYS(pcm); // Address
-    bdl[1] = 0; // High Address (zero for now as pcm is in lower 4GB)
-    bdl[2] = buf_size & 0xFFFFFFFF; // Length
-    bdl[3] = 0x01;           // IOC = 1
+    // Setup BDL (Buffer Descriptor List): one 16-byte entry
+    uint32_t* bdl = (uint32_t*)bdl_buf.virt;
+    bdl[0] = (uint32_t)pcm_buf.phys;         // Address
+    bdl[1] = (uint32_t)(pcm_buf.phys >> 32); // High Address
+    bdl[2] = buf_size;                       // Length
+    bdl[3] = 0x01;                           // IOC = 1
 
-    hda_write32(&g_hda, stream_off + HDA_STREAM_BDPL, (uint32_t)VIRT_TO_PHYS(bdl));
-    hda_write32(&g_hda, stream_off + HDA_STREAM_BDPU, (uint32_t)(VIRT_TO_PHYS(bdl) >> 32));
+    hda_write32(&g_hda, stream_off + HDA_STREAM_BDPL, (uint32_t)bdl_buf.phys);
+    hda_write32(&g_hda, stream_off + HDA_STREAM_BDPU, (uint32_t)(bdl_buf.phys >> 32));
     hda_write32(&g_hda, stream_off + HDA_STREAM_CBL, buf_size);
     hda_write16(&g_hda, stream_off + HDA_STREAM_LVI, 0); // 1 fragment
     hda_write16(&g_hda, stream_off + HDA_STREAM_FMT, format);
@@ -270,8 +307,10 @@ void hda_play_sine(uint32_t freq_hz, uint32_t duration_ms) {
     hda_write8(&g_hda, stream_off + HDA_STREAM_CTRL, hda_read8(&g_hda, stream_off + HDA_STREAM_CTRL) | 2); // Run
 
     kprintf("HDA: Playing tone...\n");
-    hpet_sleep(duration_ms);
+    sleep_ms(duration_ms);
     
     // Stop stream
     hda_write8(&g_hda, stream_off + HDA_STREAM_CTRL, 0);
+    dma_free(&bdl_buf);
+    dma_free(&pcm_buf);
 }
@@ -47,6 +47,7 @@
 
 typedef struct hda_controller {
     uintptr_t bar;
+    uint32_t dma_flags; // DMA_32BIT unless GCAP.64OK
     uint32_t* corb;
     uint64_t* rirb;
     uint16_t corb_size_entries;
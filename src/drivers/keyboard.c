@@ -1,5 +1,6 @@
 #include "keyboard.h"
 #include "../core/io.h"
+#include "../core/apic.h"
 #include "isr.h"
 #include "terminal.h"
 #include "command.h"
@@ -212,8 +213,7 @@ static void keyboard_handle_command(void) {
 void keyboard_init(void) {
     irq_register_handler(1, keyboard_irq_handler);
     
-    extern void ioapic_set_irq(uint8_t irq, uint32_t apic_id, uint32_t flags_vector);
-    ioapic_set_irq(1, 0, 33); // IRQ 1 -> Vector 33 (0x21)
+    ioapic_route_isa(1, 33, 0); // IRQ 1 -> Vector 33 (0x21) on the BSP
     
     // Set initial LED state
     // keyboard_set_leds(); // Disabled to prevent hang
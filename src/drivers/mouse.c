@@ -1,6 +1,8 @@
 #include "mouse.h"
 #include "io.h"
 #include "isr.h"
+#include "apic.h"
+#include "clock.h"
 #include "terminal.h"
 #include "../lib/printf.h"
 
@@ -19,22 +21,19 @@ void mouse_set_bounds(int width, int height) {
     max_y = height - 1;
 }
 
+/* How long to wait on the controller before giving up on it, in time
+   and, should the clock not run, in port reads */
+#define MOUSE_WAIT_NS    100000000ULL
+#define MOUSE_WAIT_SPINS 100000
+
 static void mouse_wait(uint8_t type) {
-    int timeout = 100000;
-    if (type == 0) {
-        while (timeout--) { // data
-            if ((inb(0x64) & 1) == 1) {
-                return;
-            }
-        }
-        return;
-    } else {
-        while (timeout--) { // signal
-            if ((inb(0x64) & 2) == 0) {
-                return;
-            }
+    uint64_t deadline = clock_monotonic_ns() + MOUSE_WAIT_NS;
+    for (int spins = 0; spins < MOUSE_WAIT_SPINS && clock_monotonic_ns() < deadline; spins++) {
+        if (type == 0) {
+            if ((inb(0x64) & 1) == 1) return; // data
+        } else {
+            if ((inb(0x64) & 2) == 0) return; // signal
         }
-        return;
     }
 }
 
@@ -123,9 +122,7 @@ void mouse_init(void) {
 
     /* Route IRQ12 to BSP via IOAPIC */
     // Vector 32+12 = 44 (0x2C)
-    // Destination 0 (BSP)
-    extern void ioapic_set_irq(uint8_t irq, uint32_t apic_id, uint32_t flags_vector);
-    ioapic_set_irq(12, 0, 44);
+    ioapic_route_isa(12, 44, 0);
 
     mouse_initialized = 1;
     terminal_writeln("mouse: PS/2 mouse initialized with optimized driver");
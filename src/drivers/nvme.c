@@ -2,6 +2,10 @@
 #include "../lib/memory.h"
 #include "../lib/printf.h"
 #include "../core/io.h"
+#include "../core/paging.h"
+#include "../core/dma.h"
+#include "../core/clock.h"
+#include "../core/process.h"
 #include "../fs/blockdev.h"
 
 static int nvme_bd_read(block_device_t* dev, uint64_t lba, uint32_t count, void* buffer) {
@@ -16,6 +20,9 @@ static int nvme_bd_write(block_device_t* dev, uint64_t lba, uint32_t count, cons
 
 static nvme_controller_t g_nvme;
 
+#define NVME_TO_UNIT_NS      500000000ULL   /* CAP.TO granularity */
+#define NVME_CMD_TIMEOUT_NS  5000000000ULL  /* A command to complete */
+
 static void nvme_write_reg32(nvme_controller_t* nvme, uint32_t reg, uint32_t val) {
     *(volatile uint32_t*)(nvme->bar0 + reg) = val;
 }
@@ -33,22 +40,73 @@ static void nvme_write_reg64(nvme_controller_t* nvme, uint32_t reg, uint64_t val
 }
 
 static void nvme_write_doorbell(nvme_controller_t* nvme, uint32_t index, int is_cq, uint16_t val) {
-    uint32_t offset = 0x1000 + (index * 2 + (is_cq ? 1 : 0)) * (4 << nvme->db_stride);
+    uint32_t offset = NVME_DOORBELL_BASE + (index * 2 + (is_cq ? 1 : 0)) * (4 << nvme->db_stride);
     nvme_write_reg32(nvme, offset, val);
 }
 
+static void nvme_irq(struct registers* regs) {
+    nvme_controller_t* nvme = &g_nvme;
+    if (nvme->irq_count > 1 && (int)regs->int_no == pci_irq_vector(nvme->pci, 1)) {
+        wait_queue_wake_all(&nvme->io_wait);
+        return;
+    }
+    wait_queue_wake_all(&nvme->admin_wait);
+    if (nvme->irq_count == 1) wait_queue_wake_all(&nvme->io_wait);
+}
+
+/* Wait for the completion queue entry cq to reach phase. With interrupts
+   a process sleeps on wq until the queue's vector fires; during boot, or
+   without interrupts, this polls. Every caller allows NVME_CMD_TIMEOUT_NS,
+   which also caps the number of polls. */
+static int nvme_wait_cq(nvme_controller_t* nvme, volatile nvme_cq_entry_t* cq, uint8_t phase,
+                        wait_queue_t* wq, uint64_t deadline) {
+    uint64_t spins = 0;
+    while ((cq->status & 1) != phase) {
+        if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(NVME_CMD_TIMEOUT_NS)) return -1;
+        if (nvme->irq_count && scheduler_can_sleep()) {
+            uint32_t seq = wait_queue_seq(wq);
+            if ((cq->status & 1) == phase) break;
+            wait_queue_sleep(wq, seq, deadline);
+        } else {
+            io_wait(); // The queue is in RAM; pace the polls like a register read
+        }
+    }
+    return 0;
+}
+
+/* The I/O queue pair serves one command at a time; -1 once it has
+   been retired */
+static int nvme_io_begin(nvme_controller_t* nvme) {
+    while (__atomic_exchange_n(&nvme->io_busy, 1, __ATOMIC_ACQUIRE)) {
+        uint32_t seq = wait_queue_seq(&nvme->io_idle);
+        if (__atomic_load_n(&nvme->io_dead, __ATOMIC_ACQUIRE)) return -1;
+        if (!__atomic_load_n(&nvme->io_busy, __ATOMIC_RELAXED)) continue;
+        wait_queue_sleep(&nvme->io_idle, seq, 0);
+    }
+    return 0;
+}
+
+static void nvme_io_end(nvme_controller_t* nvme) {
+    __atomic_store_n(&nvme->io_busy, 0, __ATOMIC_RELEASE);
+    wait_queue_wake_one(&nvme->io_idle);
+}
+
 static int nvme_controller_init(nvme_controller_t* nvme, pci_device_t* pci) {
     uint64_t full_bar = pci->bar0 & ~0xF;
     if ((pci->bar0 & 0x6) == 0x4) { // 64-bit BAR
         full_bar |= ((uint64_t)pci->bar1 << 32);
     }
-    extern uint64_t g_hhdm_offset;
-    nvme->bar0 = full_bar + g_hhdm_offset;
+    // Registers first; CAP.DSTRD then says how far apart the doorbells
+    // of the queue pairs we use are
+    nvme->bar0 = (uintptr_t)paging_map_mmio(full_bar, NVME_DOORBELL_BASE);
     
     // 1. Get Capabilities
     uint64_t cap = nvme_read_reg64(nvme, NVME_REG_CAP);
     nvme->db_stride = (cap >> 32) & 0xF;
+    paging_map_mmio(full_bar, NVME_DOORBELL_BASE + NVME_QUEUE_PAIRS * 2 * (4 << nvme->db_stride));
     nvme->max_entries = (cap & 0xFFFF) + 1;
+    // CAP.TO: worst case for CSTS.RDY to follow CC.EN, in 500 ms units
+    uint64_t ready_timeout = (((cap >> 24) & 0xFF) + 1) * NVME_TO_UNIT_NS;
     
     kprintf("NVMe: BAR=%lx CAP=%lx Stride=%d MaxEntries=%d\n", nvme->bar0, cap, nvme->db_stride, nvme->max_entries);
     
@@ -57,9 +115,10 @@ static int nvme_controller_init(nvme_controller_t* nvme, pci_device_t* pci) {
     if (cc & 1) { // If already enabled, disable first
         nvme_write_reg32(nvme, NVME_REG_CC, cc & ~1);
         // Wait for Ready=0 in CSTS
-        int timeout = 1000000;
+        uint64_t deadline = clock_monotonic_ns() + ready_timeout;
+        uint64_t spins = 0;
         while (nvme_read_reg32(nvme, NVME_REG_CSTS) & 1) {
-            if (--timeout == 0) {
+            if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(ready_timeout)) {
                 kprintf("NVMe: Timeout waiting for Ready=0\n");
                 return -1;
             }
@@ -69,10 +128,14 @@ static int nvme_controller_init(nvme_controller_t* nvme, pci_device_t* pci) {
     // 3. Setup Admin Queues
     // For simplicity, use 64 entries for Admin Queues
     uint16_t admin_q_size = 64;
-    nvme->admin_sq = (nvme_sq_entry_t*)kmalloc_raw_aligned(4096);
-    nvme->admin_cq = (nvme_cq_entry_t*)kmalloc_raw_aligned(4096);
-    memset(nvme->admin_sq, 0, 4096);
-    memset(nvme->admin_cq, 0, 4096);
+    dma_buf_t asq, acq;
+    if (dma_alloc(&asq, admin_q_size * sizeof(nvme_sq_entry_t), 0, 0) != 0 ||
+        dma_alloc(&acq, admin_q_size * sizeof(nvme_cq_entry_t), 0, 0) != 0) {
+        kprintf("NVMe: Failed to allocate admin queues\n");
+        return -1;
+    }
+    nvme->admin_sq = (nvme_sq_entry_t*)asq.virt;
+    nvme->admin_cq = (nvme_cq_entry_t*)acq.virt;
     
     // CC.CSS (Command Set Selected) = 0 for NVM
     // CC.MPS (Memory Page Size) = 0 for 4KB (2^(12+0))
@@ -86,16 +149,17 @@ static int nvme_controller_init(nvme_controller_t* nvme, pci_device_t* pci) {
     uint32_t aqa = ((admin_q_size - 1) << 16) | (admin_q_size - 1);
     nvme_write_reg32(nvme, NVME_REG_AQA, aqa);
     
-    nvme_write_reg64(nvme, NVME_REG_ASQ, VIRT_TO_PHYS(nvme->admin_sq));
-    nvme_write_reg64(nvme, NVME_REG_ACQ, VIRT_TO_PHYS(nvme->admin_cq));
+    nvme_write_reg64(nvme, NVME_REG_ASQ, asq.phys);
+    nvme_write_reg64(nvme, NVME_REG_ACQ, acq.phys);
     
     // 4. Enable Controller
     nvme_write_reg32(nvme, NVME_REG_CC, cc | 1);
     
     // Wait for Ready=1 in CSTS
-    int timeout = 1000000;
+    uint64_t deadline = clock_monotonic_ns() + ready_timeout;
+    uint64_t spins = 0;
     while (!(nvme_read_reg32(nvme, NVME_REG_CSTS) & 1)) {
-        if (--timeout == 0) {
+        if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(ready_timeout)) {
             kprintf("NVMe: Timeout waiting for Ready=1\n");
             return -1;
         }
@@ -110,6 +174,8 @@ static int nvme_controller_init(nvme_controller_t* nvme, pci_device_t* pci) {
 }
 
 static int nvme_submit_admin_cmd(nvme_controller_t* nvme, nvme_sq_entry_t* cmd, nvme_cq_entry_t* res) {
+    if (nvme->admin_dead) return -1;
+
     // 1. Copy command to SQ
     memcpy(&nvme->admin_sq[nvme->admin_sq_tail], cmd, sizeof(nvme_sq_entry_t));
     
@@ -121,12 +187,13 @@ static int nvme_submit_admin_cmd(nvme_controller_t* nvme, nvme_sq_entry_t* cmd,
     
     // 4. Wait for Completion
     volatile nvme_cq_entry_t* cq = &nvme->admin_cq[nvme->admin_cq_head];
-    int timeout = 10000000;
-    while ((cq->status & 1) != nvme->admin_phase) {
-        if (--timeout == 0) {
-             kprintf("NVMe: Admin Cmd Timeout\n");
-             return -1;
-        }
+    uint64_t deadline = clock_monotonic_ns() + NVME_CMD_TIMEOUT_NS;
+    if (nvme_wait_cq(nvme, cq, nvme->admin_phase, &nvme->admin_wait, deadline) != 0) {
+        // Nothing reclaims an admin command; a late completion would be
+        // taken for the next one's
+        kprintf("NVMe: Admin Cmd Timeout, admin queue retired\n");
+        nvme->admin_dead = 1;
+        return -1;
     }
     
     // 5. Copy result
@@ -146,17 +213,19 @@ static int nvme_identify(nvme_controller_t* nvme) {
     nvme_sq_entry_t cmd;
     memset(&cmd, 0, sizeof(cmd));
     
-    void* buffer = kmalloc_raw_aligned(4096);
-    memset(buffer, 0, 4096);
+    dma_buf_t id_buf;
+    if (dma_alloc(&id_buf, 4096, 0, 0) != 0) return -1;
+    void* buffer = id_buf.virt;
     
     cmd.cdw0 = NVME_OP_ADMIN_IDENTIFY;
-    cmd.prp1 = VIRT_TO_PHYS(buffer);
+    cmd.prp1 = id_buf.phys;
     cmd.cdw10 = 1; // Identify Controller
     
     nvme_cq_entry_t res;
     int status = nvme_submit_admin_cmd(nvme, &cmd, &res);
     if (status != 0) {
         kprintf("NVMe: Identify Controller failed status=%x\n", status);
+        dma_free(&id_buf);
         return -1;
     }
     
@@ -175,7 +244,7 @@ static int nvme_identify(nvme_controller_t* nvme) {
         // Identify Namespace 1
         memset(&cmd, 0, sizeof(cmd));
         cmd.cdw0 = NVME_OP_ADMIN_IDENTIFY;
-        cmd.prp1 = VIRT_TO_PHYS(buffer);
+        cmd.prp1 = id_buf.phys;
         cmd.nsid = 1;
         cmd.cdw10 = 0; // Identify Namespace
         
@@ -193,6 +262,7 @@ static int nvme_identify(nvme_controller_t* nvme) {
         }
     }
     
+    dma_free(&id_buf);
     return 0;
 }
 
@@ -201,39 +271,49 @@ static int nvme_create_io_queues(nvme_controller_t* nvme) {
     nvme_sq_entry_t cmd;
     memset(&cmd, 0, sizeof(cmd));
     
-    nvme->io_cq = (nvme_cq_entry_t*)kmalloc_raw_aligned(4096);
-    memset(nvme->io_cq, 0, 4096);
+    // 512 entries: 8 KiB of completions, 32 KiB of submissions (PC=1, so contiguous)
+    dma_buf_t iocq;
+    if (dma_alloc(&iocq, 512 * sizeof(nvme_cq_entry_t), 0, 0) != 0) return -1;
+    nvme->io_cq = (nvme_cq_entry_t*)iocq.virt;
     
     // Create I/O CQ (ID 1)
     /* CDW10: QID=1, QSIZE=511 (512 entries) */
     cmd.cdw0 = NVME_OP_ADMIN_CREATE_IO_CQ;
-    cmd.prp1 = VIRT_TO_PHYS(nvme->io_cq);
+    cmd.prp1 = iocq.phys;
     cmd.cdw10 = (511 << 16) | 1; 
     cmd.cdw11 = 1; // PC (Physically Contiguous) = 1
+    if (nvme->irq_count) {
+        // IEN, and IV: its own vector when there is a second one
+        cmd.cdw11 |= (1 << 1) | ((nvme->irq_count > 1 ? 1 : 0) << 16);
+    }
     
     int status = nvme_submit_admin_cmd(nvme, &cmd, NULL);
     if (status != 0) {
         kprintf("NVMe: Create I/O CQ failed status=%x\n", status);
+        dma_free(&iocq);
+        nvme->io_cq = NULL;
         return -1;
     }
     
     // 2. Create I/O Submission Queue
     memset(&cmd, 0, sizeof(cmd));
-    nvme->io_sq = (nvme_sq_entry_t*)kmalloc_raw_aligned(4096);
-    memset(nvme->io_sq, 0, 4096);
+    dma_buf_t iosq;
+    if (dma_alloc(&iosq, 512 * sizeof(nvme_sq_entry_t), 0, 0) != 0) return -1;
     
     /* CDW10: QID=1, QSIZE=511 */
     cmd.cdw0 = NVME_OP_ADMIN_CREATE_IO_SQ;
-    cmd.prp1 = VIRT_TO_PHYS(nvme->io_sq);
+    cmd.prp1 = iosq.phys;
     cmd.cdw10 = (511 << 16) | 1;
     cmd.cdw11 = (1 << 16) | 1; // CQID=1, PC=1
     
     status = nvme_submit_admin_cmd(nvme, &cmd, NULL);
     if (status != 0) {
         kprintf("NVMe: Create I/O SQ failed status=%x\n", status);
+        dma_free(&iosq);
         return -1;
     }
     
+    nvme->io_sq = (nvme_sq_entry_t*)iosq.virt;
     nvme->io_sq_tail = 0;
     nvme->io_cq_head = 0;
     nvme->io_phase = 1;
@@ -259,7 +339,16 @@ void nvme_init(void) {
     
     kprintf("NVMe: Found controller at %d:%d:%d\n", pci->bus, pci->device, pci->function);
     
+    wait_queue_init(&g_nvme.admin_wait);
+    wait_queue_init(&g_nvme.io_wait);
+    wait_queue_init(&g_nvme.io_idle);
     if (nvme_controller_init(&g_nvme, pci) == 0) {
+        // Message-signalled only: a level-triggered line would keep
+        // firing until the woken process gets round to the CQ doorbell
+        g_nvme.pci = pci;
+        g_nvme.irq_count = pci_alloc_irq_vectors(pci, 2, PCI_IRQ_MSI | PCI_IRQ_MSIX, nvme_irq);
+        if (g_nvme.irq_count < 0) g_nvme.irq_count = 0;
+
         if (nvme_identify(&g_nvme) == 0) {
             if (nvme_create_io_queues(&g_nvme) == 0) {
                 kprintf("NVMe: Ready for I/O\n");
@@ -285,75 +374,90 @@ void nvme_init(void) {
 
 static uint16_t g_cid = 0;
 
-int nvme_read(uint64_t lba, uint32_t count, void* buffer) {
-    if (!g_nvme.io_sq) return -1;
+/* Retire the I/O CQ entry at the head */
+static void nvme_io_cq_advance(nvme_controller_t* nvme) {
+    nvme->io_cq_head = (nvme->io_cq_head + 1) % 512;
+    if (nvme->io_cq_head == 0) nvme->io_phase ^= 1;
+    nvme_write_doorbell(nvme, 1, 1, nvme->io_cq_head);
+}
 
+/* The command cid timed out but is still the controller's, and its
+   completion would be taken for the next command's if it turned up
+   later. Have the controller abort it and wait for that completion,
+   which leaves the queue as if the command had finished. -1 if it
+   never comes. */
+static int nvme_io_reclaim(nvme_controller_t* nvme, uint16_t cid, volatile nvme_cq_entry_t* cq) {
     nvme_sq_entry_t cmd;
     memset(&cmd, 0, sizeof(cmd));
-    cmd.cdw0 = NVME_OP_IO_READ | (g_cid << 16);
-    cmd.nsid = g_nvme.nsid;
-    cmd.prp1 = VIRT_TO_PHYS(buffer);
-    cmd.cdw10 = (uint32_t)(lba & 0xFFFFFFFF);
-    cmd.cdw11 = (uint32_t)(lba >> 32);
-    cmd.cdw12 = (count - 1) & 0xFFFF; // 0-based
+    cmd.cdw0 = NVME_OP_ADMIN_ABORT;
+    cmd.cdw10 = ((uint32_t)cid << 16) | 1; // CID, SQID 1
+    if (nvme_submit_admin_cmd(nvme, &cmd, NULL) < 0) return -1;
+
+    uint64_t deadline = clock_monotonic_ns() + NVME_CMD_TIMEOUT_NS;
+    if (nvme_wait_cq(nvme, cq, nvme->io_phase, &nvme->io_wait, deadline) != 0) return -1;
+    nvme_io_cq_advance(nvme);
+    return 0;
+}
+
+/* Run one I/O command; its status, or -1 */
+static int nvme_io_submit(nvme_controller_t* nvme, nvme_sq_entry_t* cmd, const char* what) {
+    if (nvme_io_begin(nvme) != 0) return -1;
 
     // 1. Submit to I/O SQ
-    memcpy(&g_nvme.io_sq[g_nvme.io_sq_tail], &cmd, sizeof(nvme_sq_entry_t));
-    g_nvme.io_sq_tail = (g_nvme.io_sq_tail + 1) % 512;
-    nvme_write_doorbell(&g_nvme, 1, 0, g_nvme.io_sq_tail);
+    uint16_t cid = g_cid++;
+    cmd->cdw0 |= (uint32_t)cid << 16;
+    memcpy(&nvme->io_sq[nvme->io_sq_tail], cmd, sizeof(nvme_sq_entry_t));
+    nvme->io_sq_tail = (nvme->io_sq_tail + 1) % 512;
+    nvme_write_doorbell(nvme, 1, 0, nvme->io_sq_tail);
 
     // 2. Wait for Completion on I/O CQ
-    volatile nvme_cq_entry_t* cq = &g_nvme.io_cq[g_nvme.io_cq_head];
-    int timeout = 10000000;
-    while ((cq->status & 1) != g_nvme.io_phase) {
-        if (--timeout == 0) {
-            kprintf("NVMe: I/O Read Timeout\n");
+    volatile nvme_cq_entry_t* cq = &nvme->io_cq[nvme->io_cq_head];
+    uint64_t deadline = clock_monotonic_ns() + NVME_CMD_TIMEOUT_NS;
+    if (nvme_wait_cq(nvme, cq, nvme->io_phase, &nvme->io_wait, deadline) != 0) {
+        kprintf("NVMe: I/O %s Timeout\n", what);
+        if (nvme_io_reclaim(nvme, cid, cq) != 0) {
+            // Stays busy for good; anyone waiting for it gives up
+            kprintf("NVMe: command not reclaimed, I/O queue retired\n");
+            __atomic_store_n(&nvme->io_dead, 1, __ATOMIC_RELEASE);
+            wait_queue_wake_all(&nvme->io_idle);
             return -1;
         }
+        nvme_io_end(nvme);
+        return -1;
     }
 
     int status = cq->status >> 1;
-    
-    // 3. Move Head
-    g_nvme.io_cq_head = (g_nvme.io_cq_head + 1) % 512;
-    if (g_nvme.io_cq_head == 0) g_nvme.io_phase ^= 1;
-    nvme_write_doorbell(&g_nvme, 1, 1, g_nvme.io_cq_head);
 
-    g_cid++;
+    // 3. Move Head
+    nvme_io_cq_advance(nvme);
+    nvme_io_end(nvme);
     return status;
 }
 
+int nvme_read(uint64_t lba, uint32_t count, void* buffer) {
+    if (!g_nvme.io_sq) return -1;
+
+    nvme_sq_entry_t cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.cdw0 = NVME_OP_IO_READ;
+    cmd.nsid = g_nvme.nsid;
+    cmd.prp1 = VIRT_TO_PHYS(buffer);
+    cmd.cdw10 = (uint32_t)(lba & 0xFFFFFFFF);
+    cmd.cdw11 = (uint32_t)(lba >> 32);
+    cmd.cdw12 = (count - 1) & 0xFFFF; // 0-based
+    return nvme_io_submit(&g_nvme, &cmd, "Read");
+}
+
 int nvme_write(uint64_t lba, uint32_t count, const void* buffer) {
     if (!g_nvme.io_sq) return -1;
     
     nvme_sq_entry_t cmd;
     memset(&cmd, 0, sizeof(cmd));
-    cmd.cdw0 = NVME_OP_IO_WRITE | (g_cid << 16);
+    cmd.cdw0 = NVME_OP_IO_WRITE;
     cmd.nsid = g_nvme.nsid;
     cmd.prp1 = VIRT_TO_PHYS(buffer);
     cmd.cdw10 = (uint32_t)(lba & 0xFFFFFFFF);
     cmd.cdw11 = (uint32_t)(lba >> 32);
     cmd.cdw12 = (count - 1) & 0xFFFF;
-
-    memcpy(&g_nvme.io_sq[g_nvme.io_sq_tail], &cmd, sizeof(nvme_sq_entry_t));
-    g_nvme.io_sq_tail = (g_nvme.io_sq_tail + 1) % 512;
-    nvme_write_doorbell(&g_nvme, 1, 0, g_nvme.io_sq_tail);
-
-    volatile nvme_cq_entry_t* cq = &g_nvme.io_cq[g_nvme.io_cq_head];
-    int timeout = 10000000;
-    while ((cq->status & 1) != g_nvme.io_phase) {
-        if (--timeout == 0) {
-            kprintf("NVMe: I/O Write Timeout\n");
-            return -1;
-        }
-    }
-
-    int status = cq->status >> 1;
-
-    g_nvme.io_cq_head = (g_nvme.io_cq_head + 1) % 512;
-    if (g_nvme.io_cq_head == 0) g_nvme.io_phase ^= 1;
-    nvme_write_doorbell(&g_nvme, 1, 1, g_nvme.io_cq_head);
-
-    g_cid++;
-    return status;
+    return nvme_io_submit(&g_nvme, &cmd, "Write");
 }
@@ -3,6 +3,7 @@
 
 #include "../core/common.h"
 #include "pci.h"
+#include "../core/wait.h"
 
 /* NVMe Controller Registers (Offsets from BAR0) */
 #define NVME_REG_CAP      0x00  /* Controller Capabilities (8 bytes) */
@@ -15,6 +16,9 @@
 #define NVME_REG_AQA      0x24  /* Admin Queue Attributes (4 bytes) */
 #define NVME_REG_ASQ      0x28  /* Admin Submission Queue Base Address (8 bytes) */
 #define NVME_REG_ACQ      0x30  /* Admin Completion Queue Base Address (8 bytes) */
+#define NVME_DOORBELL_BASE 0x1000 /* SQ/CQ doorbell pairs, CAP.DSTRD apart */
+
+#define NVME_QUEUE_PAIRS  2     /* Admin and one I/O pair */
 
 /* NVMe Submission Queue Entry (64 bytes) */
 typedef struct {
@@ -46,6 +50,7 @@ typedef struct {
 #define NVME_OP_ADMIN_IDENTIFY 0x06
 #define NVME_OP_ADMIN_CREATE_IO_CQ 0x05
 #define NVME_OP_ADMIN_CREATE_IO_SQ 0x01
+#define NVME_OP_ADMIN_ABORT        0x08
 
 #define NVME_OP_IO_WRITE 0x01
 #define NVME_OP_IO_READ  0x02
@@ -70,6 +75,22 @@ typedef struct {
     uint32_t nsid;
     uint64_t sector_count;
     uint32_t sector_size;
+
+    // Completion interrupts: vector 0 is the admin queue's, vector 1 the
+    // I/O queue's when there are two. Without any, completions are polled.
+    pci_device_t* pci;
+    int irq_count;
+    wait_queue_t admin_wait;
+    wait_queue_t io_wait;
+
+    // One I/O command is in flight at a time; waiters for it sleep here
+    volatile int io_busy;
+    wait_queue_t io_idle;
+
+    // A queue whose timed-out command could not be reclaimed: its CQ may
+    // still get that completion, so it is never used again
+    int admin_dead;
+    volatile int io_dead;
 } nvme_controller_t;
 
 void nvme_init(void);
@@ -2,6 +2,11 @@
 #include "../core/io.h"
 #include "serial.h"
 #include "../lib/memory.h"
+#include "../lib/printf.h"
+#include "../core/apic.h"
+#include "../core/paging.h"
+#include "../core/smp.h"
+#include "../core/acpi.h"
 
 #define MAX_PCI_DEVICES 256
 
@@ -53,6 +58,16 @@ uint8_t pci_config_read_byte(uint8_t bus, uint8_t device, uint8_t func, uint8_t
 
 static void pci_scan_bus(uint8_t bus);
 
+/* Interrupt line and the capabilities the interrupt code looks for */
+static void pci_probe_irq(pci_device_t* dev) {
+    dev->irq_line = pci_config_read_byte(dev->bus, dev->device, dev->function, PCI_INTERRUPT_LINE);
+    dev->msi_cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+    dev->msix_cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+    dev->irq_type = 0;
+    dev->irq_count = 0;
+    dev->msix_table = NULL;
+}
+
 static void pci_check_device(uint8_t bus, uint8_t device) {
     uint16_t vendor_id = pci_config_read_word(bus, device, 0, PCI_VENDOR_ID);
     
@@ -85,6 +100,7 @@ static void pci_check_device(uint8_t bus, uint8_t device) {
         pci_devices[pci_device_count].bar3 = pci_config_read_dword(bus, device, 0, PCI_BAR3);
         pci_devices[pci_device_count].bar4 = pci_config_read_dword(bus, device, 0, PCI_BAR4);
         pci_devices[pci_device_count].bar5 = pci_config_read_dword(bus, device, 0, PCI_BAR5);
+        pci_probe_irq(&pci_devices[pci_device_count]);
         pci_device_count++;
     }
     
@@ -115,6 +131,7 @@ static void pci_check_device(uint8_t bus, uint8_t device) {
                     pci_devices[pci_device_count].bar3 = pci_config_read_dword(bus, device, func, PCI_BAR3);
                     pci_devices[pci_device_count].bar4 = pci_config_read_dword(bus, device, func, PCI_BAR4);
                     pci_devices[pci_device_count].bar5 = pci_config_read_dword(bus, device, func, PCI_BAR5);
+                    pci_probe_irq(&pci_devices[pci_device_count]);
                     pci_device_count++;
                 }
             }
@@ -159,3 +176,188 @@ pci_device_t* pci_find_device(uint16_t vendor_id, uint16_t device_id) {
     }
     return 0;
 }
+
+uint8_t pci_find_capability(pci_device_t* dev, uint8_t id) {
+    uint16_t status = pci_config_read_word(dev->bus, dev->device, dev->function, PCI_STATUS);
+    if (!(status & PCI_STATUS_CAP_LIST)) return 0;
+
+    uint8_t offset = pci_config_read_byte(dev->bus, dev->device, dev->function, PCI_CAPABILITY_LIST) & 0xFC;
+    // 48 capabilities fit in config space; more means the list loops
+    for (int i = 0; offset && i < 48; i++) {
+        uint16_t header = pci_config_read_word(dev->bus, dev->device, dev->function, offset);
+        if ((header & 0xFF) == id) return offset;
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+/* Interrupts */
+
+static uint32_t msi_address(int cpu) {
+    return MSI_ADDRESS_BASE | (smp_cpu_apic_id(cpu) << 12);
+}
+
+static void pci_set_command(pci_device_t* dev, uint16_t set, uint16_t clear) {
+    uint16_t cmd = pci_config_read_word(dev->bus, dev->device, dev->function, PCI_COMMAND);
+    cmd = (cmd | set) & ~clear;
+    pci_config_write_word(dev->bus, dev->device, dev->function, PCI_COMMAND, cmd);
+}
+
+/* Physical address of a memory BAR */
+static uint64_t pci_bar_address(pci_device_t* dev, int bar) {
+    uint8_t reg = PCI_BAR0 + bar * 4;
+    uint32_t lo = pci_config_read_dword(dev->bus, dev->device, dev->function, reg);
+    uint64_t addr = lo & ~0xFULL;
+    if ((lo & 0x6) == 0x4 && bar < 5) {
+        addr |= (uint64_t)pci_config_read_dword(dev->bus, dev->device, dev->function, reg + 4) << 32;
+    }
+    return addr;
+}
+
+static void msix_write_entry(pci_device_t* dev, int index, int cpu, uint8_t vector, int masked) {
+    volatile uint32_t* entry = dev->msix_table + index * (PCI_MSIX_ENTRY_SIZE / 4);
+    entry[3] |= PCI_MSIX_ENTRY_CTRL_MASK;   // No half-written message goes out
+    entry[0] = msi_address(cpu);
+    entry[1] = 0;
+    entry[2] = vector;                      // Fixed delivery, edge
+    if (!masked) entry[3] &= ~PCI_MSIX_ENTRY_CTRL_MASK;
+}
+
+static int pci_setup_msix(pci_device_t* dev, int n) {
+    uint8_t cap = dev->msix_cap;
+    uint16_t ctrl = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_FLAGS);
+    int table_size = (ctrl & PCI_MSIX_FLAGS_QSIZE) + 1;
+    if (n > table_size) n = table_size;
+
+    uint32_t table = pci_config_read_dword(dev->bus, dev->device, dev->function, cap + PCI_MSIX_TABLE);
+    uint64_t bar = pci_bar_address(dev, table & PCI_MSIX_TABLE_BIR);
+    if (!bar) return -1;
+    uint64_t phys = bar + (table & ~PCI_MSIX_TABLE_BIR);
+    dev->msix_table = (volatile uint32_t*)paging_map_mmio(phys, table_size * PCI_MSIX_ENTRY_SIZE);
+
+    // Function-masked while the table is written, then enabled with
+    // every entry not handed out left masked
+    pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_FLAGS,
+                          ctrl | PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL);
+    for (int i = 0; i < table_size; i++) {
+        if (i < n) {
+            msix_write_entry(dev, i, irq_target_cpu(IRQ_CPU_ANY), dev->irq_vectors[i], 0);
+        } else {
+            dev->msix_table[i * (PCI_MSIX_ENTRY_SIZE / 4) + 3] |= PCI_MSIX_ENTRY_CTRL_MASK;
+        }
+    }
+    pci_set_command(dev, PCI_COMMAND_INTX_DISABLE, 0);
+    pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_FLAGS,
+                          (ctrl | PCI_MSIX_FLAGS_ENABLE) & ~PCI_MSIX_FLAGS_MASKALL);
+    return n;
+}
+
+static void msi_write(pci_device_t* dev, int cpu, uint8_t vector) {
+    uint8_t cap = dev->msi_cap;
+    uint16_t ctrl = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_FLAGS);
+    pci_config_write_dword(dev->bus, dev->device, dev->function, cap + PCI_MSI_ADDRESS_LO, msi_address(cpu));
+    if (ctrl & PCI_MSI_FLAGS_64BIT) {
+        pci_config_write_dword(dev->bus, dev->device, dev->function, cap + PCI_MSI_ADDRESS_HI, 0);
+        pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_DATA_64, vector);
+    } else {
+        pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_DATA_32, vector);
+    }
+}
+
+/* One message only: more would need a block of aligned, consecutive
+   vectors, and MSI-X devices give per-queue vectors anyway */
+static int pci_setup_msi(pci_device_t* dev) {
+    uint8_t cap = dev->msi_cap;
+    uint16_t ctrl = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_FLAGS);
+    msi_write(dev, irq_target_cpu(IRQ_CPU_ANY), dev->irq_vectors[0]);
+    pci_set_command(dev, PCI_COMMAND_INTX_DISABLE, 0);
+    pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_FLAGS,
+                          (ctrl & ~PCI_MSI_FLAGS_QSIZE) | PCI_MSI_FLAGS_ENABLE);
+    return 1;
+}
+
+int pci_alloc_irq_vectors(pci_device_t* dev, int n, int types, irq_handler_t handler) {
+    if (!dev || n < 1 || dev->irq_count) return -1;
+    if (n > PCI_MAX_IRQ_VECTORS) n = PCI_MAX_IRQ_VECTORS;
+
+    int type = 0;
+    if ((types & PCI_IRQ_MSIX) && dev->msix_cap) type = PCI_IRQ_MSIX;
+    else if ((types & PCI_IRQ_MSI) && dev->msi_cap) type = PCI_IRQ_MSI;
+    else if ((types & PCI_IRQ_LEGACY) && dev->irq_line && dev->irq_line != 0xFF) type = PCI_IRQ_LEGACY;
+    if (!type) return -1;
+    if (type != PCI_IRQ_MSIX) n = 1;
+
+    int got = 0;
+    while (got < n) {
+        int vector = irq_alloc_vector(handler);
+        if (vector < 0) break;
+        dev->irq_vectors[got++] = (uint8_t)vector;
+    }
+    if (!got) return -1;
+
+    int count = -1;
+    if (type == PCI_IRQ_MSIX) {
+        count = pci_setup_msix(dev, got);
+    } else if (type == PCI_IRQ_MSI) {
+        count = pci_setup_msi(dev);
+    } else if (ioapic_route_pci(dev->irq_line, dev->irq_vectors[0], IRQ_CPU_ANY) >= 0) {
+        count = 1;
+    }
+
+    // Give back what the device could not use
+    for (int i = (count < 0 ? 0 : count); i < got; i++) irq_free_vector(dev->irq_vectors[i]);
+    if (count < 0) return -1;
+
+    dev->irq_type = (uint8_t)type;
+    dev->irq_count = (uint8_t)count;
+    kprintf("pci: %d:%d:%d has %d %s vector(s) from %x\n", dev->bus, dev->device, dev->function,
+            count, type == PCI_IRQ_MSIX ? "MSI-X" : type == PCI_IRQ_MSI ? "MSI" : "INTx",
+            dev->irq_vectors[0]);
+    return count;
+}
+
+void pci_free_irq_vectors(pci_device_t* dev) {
+    if (!dev || !dev->irq_count) return;
+
+    if (dev->irq_type == PCI_IRQ_MSIX) {
+        uint8_t cap = dev->msix_cap;
+        uint16_t ctrl = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_FLAGS);
+        pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSIX_FLAGS,
+                              ctrl & ~PCI_MSIX_FLAGS_ENABLE);
+        // The table stays mapped: MMIO lives in the shared direct map, where
+        // its pages may also hold registers the driver still uses (NVMe
+        // puts it in BAR0). Only the device's pointer to it is dropped.
+        dev->msix_table = NULL;
+    } else if (dev->irq_type == PCI_IRQ_MSI) {
+        uint8_t cap = dev->msi_cap;
+        uint16_t ctrl = pci_config_read_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_FLAGS);
+        pci_config_write_word(dev->bus, dev->device, dev->function, cap + PCI_MSI_FLAGS,
+                              ctrl & ~PCI_MSI_FLAGS_ENABLE);
+    } else {
+        uint16_t flags;
+        ioapic_mask(acpi_get_isa_irq(dev->irq_line, &flags));
+    }
+
+    for (int i = 0; i < dev->irq_count; i++) irq_free_vector(dev->irq_vectors[i]);
+    dev->irq_type = 0;
+    dev->irq_count = 0;
+}
+
+int pci_irq_vector(pci_device_t* dev, int index) {
+    if (!dev || index < 0 || index >= dev->irq_count) return -1;
+    return dev->irq_vectors[index];
+}
+
+int pci_set_irq_affinity(pci_device_t* dev, int index, int cpu) {
+    if (!dev || index < 0 || index >= dev->irq_count) return -1;
+    if (dev->irq_type == PCI_IRQ_MSIX) {
+        msix_write_entry(dev, index, irq_target_cpu(cpu), dev->irq_vectors[index], 0);
+        return 0;
+    }
+    if (dev->irq_type == PCI_IRQ_MSI) {
+        msi_write(dev, irq_target_cpu(cpu), dev->irq_vectors[index]);
+        return 0;
+    }
+    uint16_t flags;
+    return ioapic_set_affinity(acpi_get_isa_irq(dev->irq_line, &flags), cpu);
+}
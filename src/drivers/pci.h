@@ -2,6 +2,7 @@
 #define PCI_H
 
 #include "../core/common.h"
+#include "../core/isr.h"
 
 /* PCI Configuration Space Registers */
 #define PCI_VENDOR_ID            0x00
@@ -19,6 +20,47 @@
 #define PCI_BAR3                 0x1C
 #define PCI_BAR4                 0x20
 #define PCI_BAR5                 0x24
+#define PCI_CAPABILITY_LIST      0x34
+#define PCI_INTERRUPT_LINE       0x3C
+
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+#define PCI_STATUS_CAP_LIST      (1 << 4)
+
+/* Capability IDs */
+#define PCI_CAP_ID_MSI           0x05
+#define PCI_CAP_ID_MSIX          0x11
+
+/* MSI capability: message control at +2, then the address and data */
+#define PCI_MSI_FLAGS            2
+#define PCI_MSI_FLAGS_ENABLE     (1 << 0)
+#define PCI_MSI_FLAGS_64BIT      (1 << 7)
+#define PCI_MSI_FLAGS_QSIZE      (7 << 4)   /* Multiple Message Enable */
+#define PCI_MSI_ADDRESS_LO       4
+#define PCI_MSI_ADDRESS_HI       8
+#define PCI_MSI_DATA_32          8
+#define PCI_MSI_DATA_64          12
+
+/* MSI-X capability: table size in message control, table BAR/offset */
+#define PCI_MSIX_FLAGS           2
+#define PCI_MSIX_FLAGS_QSIZE     0x7FF
+#define PCI_MSIX_FLAGS_MASKALL   (1 << 14)
+#define PCI_MSIX_FLAGS_ENABLE    (1 << 15)
+#define PCI_MSIX_TABLE           4
+#define PCI_MSIX_TABLE_BIR       0x7
+#define PCI_MSIX_ENTRY_SIZE      16
+#define PCI_MSIX_ENTRY_CTRL_MASK 1
+
+/* Messages go to the LAPIC of the CPU in address bits 19:12 */
+#define MSI_ADDRESS_BASE         0xFEE00000
+
+/* Most vectors one device gets */
+#define PCI_MAX_IRQ_VECTORS      8
+
+/* Interrupt kinds for pci_alloc_irq_vectors */
+#define PCI_IRQ_LEGACY           (1 << 0)
+#define PCI_IRQ_MSI              (1 << 1)
+#define PCI_IRQ_MSIX             (1 << 2)
+#define PCI_IRQ_ALL_TYPES        (PCI_IRQ_LEGACY | PCI_IRQ_MSI | PCI_IRQ_MSIX)
 
 /* PCI I/O Ports */
 #define PCI_CONFIG_ADDRESS       0xCF8
@@ -40,6 +82,15 @@ typedef struct {
     uint32_t bar3;
     uint32_t bar4;
     uint32_t bar5;
+    uint8_t irq_line;           /* Legacy INTx line firmware assigned */
+    uint8_t msi_cap;            /* Capability offsets, 0 if absent */
+    uint8_t msix_cap;
+
+    /* Set by pci_alloc_irq_vectors */
+    uint8_t irq_type;           /* PCI_IRQ_*, 0 for none */
+    uint8_t irq_count;
+    uint8_t irq_vectors[PCI_MAX_IRQ_VECTORS];
+    volatile uint32_t* msix_table;
 } pci_device_t;
 
 /* Initialize PCI subsystem and enumerate devices */
@@ -66,4 +117,22 @@ uint8_t pci_config_read_byte(uint8_t bus, uint8_t device, uint8_t func, uint8_t
 /* Find device by vendor and device ID */
 pci_device_t* pci_find_device(uint16_t vendor_id, uint16_t device_id);
 
+/* Config space offset of capability id, or 0 */
+uint8_t pci_find_capability(pci_device_t* dev, uint8_t id);
+
+/* Give dev up to n interrupt vectors (at most PCI_MAX_IRQ_VECTORS), each
+   delivered to handler, which can tell them apart by regs->int_no. MSI-X
+   is tried first and gives one vector per table entry, so each queue can
+   have its own; MSI and the legacy line give one. types limits which of
+   the three may be used. Vectors are spread over the online CPUs.
+   Returns how many vectors were set up, or -1. */
+int pci_alloc_irq_vectors(pci_device_t* dev, int n, int types, irq_handler_t handler);
+void pci_free_irq_vectors(pci_device_t* dev);
+
+/* Vector of the index-th interrupt, or -1 */
+int pci_irq_vector(pci_device_t* dev, int index);
+
+/* Steer the index-th interrupt to cpu (or IRQ_CPU_ANY); 0 or -1 */
+int pci_set_irq_affinity(pci_device_t* dev, int index, int cpu);
+
 #endif
@@ -2,6 +2,10 @@
 #include "pci.h"
 #include "../core/io.h"
 #include "../core/isr.h"
+#include "../core/spinlock.h"
+#include "../core/dma.h"
+#include "../core/percpu.h"
+#include "../core/softirq.h"
 #include "../lib/memory.h"
 #include "../lib/printf.h"
 
@@ -13,25 +17,41 @@ static uint8_t* rx_buffer = 0;
 static uint32_t rx_offset = 0;
 static uint32_t current_tsad_index = 0;
 
+// The chip only takes 32-bit bus addresses. Outgoing frames are copied
+// into one of four fixed TX buffers so callers may free theirs at once.
+#define TX_BUF_SIZE 2048
+static dma_pool_t* tx_pool = NULL;
+static uint8_t* tx_buffers[4];
+static uint32_t tx_phys[4];
+static spinlock_t tx_lock = SPINLOCK_INIT;
+
+// Received frames are handed to the network stack from a tasklet, with
+// interrupts on; the handler itself only acknowledges the chip
+static tasklet_t rx_tasklet;
+
+static void rtl8139_rx(void* data) {
+    UNUSED(data);
+    while ((inb(io_base + RTL_REG_CMD) & RTL_CMD_BUFE) == 0) {
+        uint8_t* packet_ptr = rx_buffer + rx_offset;
+        uint32_t header = *(uint32_t*)packet_ptr;
+        uint16_t len = header >> 16;
+        
+        // Packet data starts after 4-byte header
+        net_receive(packet_ptr + 4, len - 4); // len includes CRC (4 bytes)
+        percpu_inc(PERCPU_STAT_NET_RX);
+
+        rx_offset = (rx_offset + len + 4 + 3) & ~3; // Align to 4 bytes
+        rx_offset %= RX_BUF_SIZE;
+        outw(io_base + RTL_REG_CAPR, rx_offset - 16);
+    }
+}
+
 static void rtl8139_handler(struct registers* regs) {
     UNUSED(regs);
     uint16_t status = inw(io_base + RTL_REG_ISR);
     outw(io_base + RTL_REG_ISR, status); 
 
-    if (status & RTL_INT_ROK) {
-        while ((inb(io_base + RTL_REG_CMD) & RTL_CMD_BUFE) == 0) {
-            uint8_t* packet_ptr = rx_buffer + rx_offset;
-            uint32_t header = *(uint32_t*)packet_ptr;
-            uint16_t len = header >> 16;
-            
-            // Packet data starts after 4-byte header
-            net_receive(packet_ptr + 4, len - 4); // len includes CRC (4 bytes)
-
-            rx_offset = (rx_offset + len + 4 + 3) & ~3; // Align to 4 bytes
-            rx_offset %= RX_BUF_SIZE;
-            outw(io_base + RTL_REG_CAPR, rx_offset - 16);
-        }
-    }
+    if (status & RTL_INT_ROK) tasklet_schedule(&rx_tasklet);
 }
 
 void rtl8139_init(void) {
@@ -71,12 +91,32 @@ void rtl8139_init(void) {
             mac_address[3], mac_address[4], mac_address[5]);
 
     // Initialize RX Buffer
-    rx_buffer = (uint8_t*)kmalloc_a(RX_BUF_TOTAL);
-    memset(rx_buffer, 0, RX_BUF_TOTAL);
-    outl(io_base + RTL_REG_RBSTART, (uint32_t)VIRT_TO_PHYS(rx_buffer));
+    dma_buf_t rx;
+    if (dma_alloc(&rx, RX_BUF_TOTAL, 0, DMA_32BIT) != 0) {
+        kprintf("rtl8139: failed to allocate RX buffer\n");
+        return;
+    }
+    rx_buffer = (uint8_t*)rx.virt;
+    outl(io_base + RTL_REG_RBSTART, (uint32_t)rx.phys);
+
+    // Initialize TX Buffers
+    tx_pool = dma_pool_create("rtl8139-tx", TX_BUF_SIZE, 16, DMA_32BIT);
+    for (int i = 0; i < 4; i++) {
+        uint64_t phys = 0;
+        tx_buffers[i] = tx_pool ? (uint8_t*)dma_pool_alloc(tx_pool, &phys) : NULL;
+        if (!tx_buffers[i]) {
+            kprintf("rtl8139: failed to allocate TX buffers\n");
+            return;
+        }
+        tx_phys[i] = (uint32_t)phys;
+    }
 
-    // Initialize Interrupts
-    irq_register_handler(irq, rtl8139_handler);
+    tasklet_init(&rx_tasklet, rtl8139_rx, NULL);
+
+    // Initialize Interrupts: a vector of our own, on whichever CPU is next
+    if (pci_alloc_irq_vectors(dev, 1, PCI_IRQ_ALL_TYPES, rtl8139_handler) < 0) {
+        kprintf("rtl8139: no interrupt route for IRQ line %d\n", irq);
+    }
     outw(io_base + RTL_REG_IMR, RTL_INT_ROK | RTL_INT_TER | RTL_INT_RER | RTL_INT_TUV | RTL_INT_RXOVW | RTL_INT_PUN);
 
     // Receive Configuration
@@ -94,9 +134,14 @@ void rtl8139_init(void) {
 
 void rtl8139_send_packet(void* data, uint32_t len) {
     if (len > 1792) return; // Limit for RTL8139
+    if (!tx_buffers[current_tsad_index]) return;
+
+    // Replies can be sent from the receive interrupt on another CPU
+    uint64_t flags = spinlock_lock_irqsave(&tx_lock);
 
     // Set TX Address
-    outl(io_base + RTL_REG_TSAD0 + current_tsad_index * 4, (uint32_t)VIRT_TO_PHYS(data));
+    memcpy(tx_buffers[current_tsad_index], data, len);
+    outl(io_base + RTL_REG_TSAD0 + current_tsad_index * 4, tx_phys[current_tsad_index]);
     
     // Set TX Status (this triggers the send)
     // Bit 0-12 is length, rest is flags (0x0000 means "start transmission")
@@ -104,4 +149,6 @@ void rtl8139_send_packet(void* data, uint32_t len) {
 
     current_tsad_index++;
     if (current_tsad_index > 3) current_tsad_index = 0;
+    spinlock_unlock_irqrestore(&tx_lock, flags);
+    percpu_inc(PERCPU_STAT_NET_TX);
 }
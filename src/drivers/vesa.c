@@ -1,12 +1,16 @@
 #include "vesa.h"
 #include "multiboot.h"
 #include "serial.h"
+#include "../core/common.h"
+#include "../core/paging.h"
+#include "../lib/memory.h"
 
 uint32_t* vesa_video_memory = 0;
 int vesa_width = 0;
 int vesa_height = 0;
 int vesa_pitch = 0;
 int vesa_bpp = 0;
+static int vesa_wc = 0;
 
 void vesa_init_limine(struct limine_framebuffer* fb) {
     if (!fb) {
@@ -34,6 +38,9 @@ void vesa_init_limine(struct limine_framebuffer* fb) {
     vesa_bpp = fb->bpp;
 
     serial_printf("VESA (Limine): %dx%dx%d at %p P=%d\n", vesa_width, vesa_height, vesa_bpp, (void*)vesa_video_memory, vesa_pitch);
+
+    // Scanout memory is only ever written: let stores combine into bursts
+    vesa_set_write_combining(1);
     
     /* Immediate visual feedback: Blue Screen */
     vesa_clear(0xFF0000FF);
@@ -81,3 +88,35 @@ void vesa_fill_rect(int x, int y, int w, int h, uint32_t color) {
 void vesa_clear(uint32_t color) {
     vesa_fill_rect(0, 0, vesa_width, vesa_height, color);
 }
+
+void vesa_set_write_combining(int enable) {
+    if (!vesa_video_memory) return;
+    uint64_t phys = VIRT_TO_PHYS(vesa_video_memory);
+    paging_map_cached(phys, (uint64_t)vesa_pitch * vesa_height, enable ? PAGE_CACHE_WC : PAGE_CACHE_WB);
+    vesa_wc = enable;
+}
+
+int vesa_is_write_combining(void) {
+    return vesa_wc;
+}
+
+void vesa_blit_rows(const uint32_t* src, int src_stride, int y, int rows) {
+    if (!vesa_video_memory || !src) return;
+    if (y < 0) { src += (size_t)(-y) * src_stride; rows += y; y = 0; }
+    if (y + rows > vesa_height) rows = vesa_height - y;
+    if (rows <= 0) return;
+
+    size_t row_bytes = (size_t)vesa_width * 4;
+    uint8_t* dst = (uint8_t*)vesa_video_memory + (size_t)y * vesa_pitch;
+
+    // Tightly packed rows: one long streaming copy
+    if ((size_t)vesa_pitch == row_bytes && src_stride == vesa_width) {
+        memcpy(dst, src, row_bytes * rows);
+        return;
+    }
+    for (int r = 0; r < rows; r++) {
+        memcpy(dst, src, row_bytes);
+        dst += vesa_pitch;
+        src += src_stride;
+    }
+}
@@ -17,4 +17,11 @@ void vesa_put_pixel(int x, int y, uint32_t color);
 void vesa_fill_rect(int x, int y, int w, int h, uint32_t color);
 void vesa_clear(uint32_t color);
 
+/* Copy whole rows (src_stride in pixels) to the framebuffer starting at line y */
+void vesa_blit_rows(const uint32_t* src, int src_stride, int y, int rows);
+
+/* Switch the framebuffer mapping between write-combining and write-back */
+void vesa_set_write_combining(int enable);
+int vesa_is_write_combining(void);
+
 #endif
@@ -2,9 +2,15 @@
 #include "../lib/memory.h"
 #include "../lib/printf.h"
 #include "../core/io.h"
+#include "../core/paging.h"
+#include "../core/dma.h"
+#include "../core/clock.h"
 
 static xhci_controller_t g_xhci;
 
+#define XHCI_REG_TIMEOUT_NS 1000000000ULL   /* Halt, reset, port state changes */
+#define XHCI_CMD_TIMEOUT_NS 5000000000ULL   /* Command ring completion */
+
 static inline void xhci_write_op32(xhci_controller_t* xhci, uint32_t reg, uint32_t val) {
     *(volatile uint32_t*)(xhci->op_base + reg) = val;
 }
@@ -13,6 +19,17 @@ static inline uint32_t xhci_read_op32(xhci_controller_t* xhci, uint32_t reg) {
     return *(volatile uint32_t*)(xhci->op_base + reg);
 }
 
+/* Wait for (reg & mask) == want; -1 if XHCI_REG_TIMEOUT_NS passes first */
+static int xhci_wait_op32(xhci_controller_t* xhci, uint32_t reg, uint32_t mask, uint32_t want) {
+    uint64_t deadline = clock_monotonic_ns() + XHCI_REG_TIMEOUT_NS;
+    uint64_t spins = 0;
+    while ((xhci_read_op32(xhci, reg) & mask) != want) {
+        if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(XHCI_REG_TIMEOUT_NS)) return -1;
+        __asm__ volatile("pause");
+    }
+    return 0;
+}
+
 static void xhci_ring_doorbell(xhci_controller_t* xhci, uint32_t target, uint32_t stream_id) {
     *(volatile uint32_t*)(xhci->db_base + target * 4) = stream_id;
 }
@@ -32,7 +49,7 @@ static int xhci_submit_cmd(xhci_controller_t* xhci, xhci_trb_t* cmd) {
     xhci->cmd_ring_index++;
     if (xhci->cmd_ring_index >= 63) { // 64th is Link TRB
         xhci_trb_t* link = &xhci->cmd_ring[63];
-        link->parameter = VIRT_TO_PHYS(xhci->cmd_ring);
+        link->parameter = xhci->cmd_ring_phys;
         link->status = 0;
         link->control = (6 << 10) | (1 << 1) | xhci->cmd_cycle; // Link type, TC=1
         
@@ -45,70 +62,91 @@ static int xhci_submit_cmd(xhci_controller_t* xhci, xhci_trb_t* cmd) {
 }
 
 static int xhci_controller_init(xhci_controller_t* xhci, pci_device_t* pci) {
-    extern uint64_t g_hhdm_offset;
-    xhci->bar = (pci->bar0 & ~0xF) + g_hhdm_offset;
+    uint64_t bar_phys = pci->bar0 & ~0xF;
     if ((pci->bar0 & 0x6) == 0x4) {
-        xhci->bar += ((uint64_t)pci->bar1 << 32);
+        bar_phys |= ((uint64_t)pci->bar1 << 32);
     }
+    // The capability registers say where the others are and how many of
+    // each there are; map those first, then everything up to the end of
+    // the last block
+    xhci->bar = (uintptr_t)paging_map_mmio(bar_phys, XHCI_CAP_SIZE);
 
     xhci->cap_length = *(volatile uint8_t*)(xhci->bar + XHCI_CAP_CAPLENGTH);
-    xhci->op_base = xhci->bar + xhci->cap_length;
-    
-    uint32_t rt_offset = *(volatile uint32_t*)(xhci->bar + XHCI_CAP_RTS_OFFSET);
-    xhci->rt_base = xhci->bar + rt_offset;
-
-    uint32_t db_offset = *(volatile uint32_t*)(xhci->bar + XHCI_CAP_DB_OFFSET);
-    xhci->db_base = xhci->bar + db_offset;
-
+    uint32_t rt_offset = *(volatile uint32_t*)(xhci->bar + XHCI_CAP_RTS_OFFSET) & ~0x1Fu;
+    uint32_t db_offset = *(volatile uint32_t*)(xhci->bar + XHCI_CAP_DB_OFFSET) & ~0x3u;
     uint32_t hcs1 = *(volatile uint32_t*)(xhci->bar + XHCI_CAP_HCSPARAMS1);
     xhci->max_slots = hcs1 & 0xFF;
     xhci->max_ports = (hcs1 >> 24) & 0xFF;
+    uint32_t max_intrs = (hcs1 >> 8) & 0x7FF;
+
+    uint64_t size = xhci->cap_length + XHCI_OP_PORTSC_BASE + XHCI_PORT_REGS_SIZE * xhci->max_ports;
+    uint64_t rt_end = rt_offset + XHCI_RT_IR_BASE + XHCI_RT_IR_SIZE * max_intrs;
+    uint64_t db_end = db_offset + 4 * ((uint64_t)xhci->max_slots + 1);
+    if (rt_end > size) size = rt_end;
+    if (db_end > size) size = db_end;
+    paging_map_mmio(bar_phys, size);
+
+    xhci->op_base = xhci->bar + xhci->cap_length;
+    xhci->rt_base = xhci->bar + rt_offset;
+    xhci->db_base = xhci->bar + db_offset;
 
     kprintf("xHCI: BAR=%lx Slots=%d Ports=%d\n", xhci->bar, xhci->max_slots, xhci->max_ports);
 
+    uint32_t hcc1 = *(volatile uint32_t*)(xhci->bar + XHCI_CAP_HCCPARAMS1);
+    xhci->dma_flags = (hcc1 & 1) ? 0 : DMA_32BIT; // AC64
+
     // 1. Reset Controller
     xhci_write_op32(xhci, XHCI_OP_USBCMD, 0); // Stop
-    while (!(xhci_read_op32(xhci, XHCI_OP_USBSTS) & 1)); // Wait for HCHalted
+    if (xhci_wait_op32(xhci, XHCI_OP_USBSTS, 1, 1) != 0) { // Wait for HCHalted
+        kprintf("xHCI: Timeout waiting for halt\n");
+        return -1;
+    }
 
     xhci_write_op32(xhci, XHCI_OP_USBCMD, (1 << 1)); // HCRST
-    while (xhci_read_op32(xhci, XHCI_OP_USBCMD) & (1 << 1));
+    if (xhci_wait_op32(xhci, XHCI_OP_USBCMD, 1 << 1, 0) != 0) {
+        kprintf("xHCI: Timeout waiting for reset\n");
+        return -1;
+    }
 
     kprintf("xHCI: Reset Successful\n");
 
     // 2. Setup Device Context Base Address Array Pointer (DCBAAP)
-    xhci->dcbaap = (uint64_t*)kmalloc_raw_aligned(4096);
-    memset(xhci->dcbaap, 0, 4096);
-    *(volatile uint64_t*)(xhci->op_base + XHCI_OP_DCBAAP) = VIRT_TO_PHYS(xhci->dcbaap);
+    dma_buf_t dcbaa, cmd_ring, erst, event_ring;
+    if (dma_alloc(&dcbaa, 4096, 64, xhci->dma_flags) != 0 ||
+        dma_alloc(&cmd_ring, 64 * sizeof(xhci_trb_t), 64, xhci->dma_flags) != 0 ||
+        dma_alloc(&erst, 64, 64, xhci->dma_flags) != 0 ||
+        dma_alloc(&event_ring, 256 * sizeof(xhci_trb_t), 64, xhci->dma_flags) != 0) {
+        kprintf("xHCI: Failed to allocate DMA memory\n");
+        return -1;
+    }
+    xhci->dcbaap = (uint64_t*)dcbaa.virt;
+    *(volatile uint64_t*)(xhci->op_base + XHCI_OP_DCBAAP) = dcbaa.phys;
 
     // 3. Setup Command Ring (64 entries)
-    xhci->cmd_ring = (xhci_trb_t*)kmalloc_raw_aligned(4096);
-    memset(xhci->cmd_ring, 0, 4096);
+    xhci->cmd_ring = (xhci_trb_t*)cmd_ring.virt;
+    xhci->cmd_ring_phys = cmd_ring.phys;
     xhci->cmd_ring_index = 0;
     xhci->cmd_cycle = 1;
 
     // CRCR: Command Ring Control Register
-    *(volatile uint64_t*)(xhci->op_base + XHCI_OP_CRCR) = VIRT_TO_PHYS(xhci->cmd_ring) | 1;
+    *(volatile uint64_t*)(xhci->op_base + XHCI_OP_CRCR) = xhci->cmd_ring_phys | 1;
 
     // 4. Setup Event Ring (simplified: 1 segment)
     // Actually needs Event Ring Segment Table (ERST)
-    void* erst = kmalloc_raw_aligned(4096);
-    void* event_ring = kmalloc_raw_aligned(4096);
-    memset(erst, 0, 4096);
-    memset(event_ring, 0, 4096);
-
-    xhci->event_ring = (xhci_trb_t*)event_ring;
+    xhci->event_ring = (xhci_trb_t*)event_ring.virt;
+    xhci->event_ring_phys = event_ring.phys;
     xhci->event_ring_index = 0;
     xhci->event_cycle = 1;
 
     // ERST Entry 0: Base Address, Size
-    *(uint64_t*)erst = VIRT_TO_PHYS(event_ring);
-    *(uint32_t*)((uint8_t*)erst + 8) = 256; // 256 entries
+    *(uint64_t*)erst.virt = event_ring.phys;
+    *(uint32_t*)((uint8_t*)erst.virt + 8) = 256; // 256 entries
 
     // Runtime Registers: IMAN, IMOD, ERSTSZ, ERSTBA, ERDP
     // Interrupter 0
     *(volatile uint32_t*)(xhci->rt_base + 0x20 + 0x08) = 1; // ERSTSZ = 1
-    *(volatile uint64_t*)(xhci->rt_base + 0x20 + 0x10) = VIRT_TO_PHYS(erst); // ERSTBA
-    *(volatile uint64_t*)(xhci->rt_base + 0x20 + 0x18) = VIRT_TO_PHYS(event_ring) | (1 << 3); // ERDP + EHB
+    *(volatile uint64_t*)(xhci->rt_base + 0x20 + 0x10) = erst.phys; // ERSTBA
+    *(volatile uint64_t*)(xhci->rt_base + 0x20 + 0x18) = event_ring.phys | (1 << 3); // ERDP + EHB
 
     // 5. Enable Slots
     uint32_t config = xhci_read_op32(xhci, XHCI_OP_CONFIG);
@@ -118,7 +156,10 @@ static int xhci_controller_init(xhci_controller_t* xhci, pci_device_t* pci) {
 
     // 6. Start Controller
     xhci_write_op32(xhci, XHCI_OP_USBCMD, 1); // Run
-    while (xhci_read_op32(xhci, XHCI_OP_USBSTS) & 1); // Wait for HCHalted to clear
+    if (xhci_wait_op32(xhci, XHCI_OP_USBSTS, 1, 0) != 0) { // Wait for HCHalted to clear
+        kprintf("xHCI: Timeout waiting for the controller to run\n");
+        return -1;
+    }
 
     kprintf("xHCI: Controller Started\n");
     return 0;
@@ -140,7 +181,7 @@ static int xhci_poll_event(xhci_controller_t* xhci, xhci_trb_t* event) {
         xhci->event_cycle ^= 1;
     }
     
-    *(volatile uint64_t*)(xhci->rt_base + 0x20 + 0x18) = VIRT_TO_PHYS(&xhci->event_ring[xhci->event_ring_index]) | (1 << 3); // Dequeue pointer + EHB
+    *(volatile uint64_t*)(xhci->rt_base + 0x20 + 0x18) = (xhci->event_ring_phys + xhci->event_ring_index * sizeof(xhci_trb_t)) | (1 << 3); // Dequeue pointer + EHB
     
     return 0;
 }
@@ -154,9 +195,11 @@ static int xhci_enable_slot(xhci_controller_t* xhci) {
     
     // Poll for Command Completion Event
     xhci_trb_t event;
-    int timeout = 100000;
+    uint64_t deadline = clock_monotonic_ns() + XHCI_CMD_TIMEOUT_NS;
+    uint64_t spins = 0;
     while (xhci_poll_event(xhci, &event) == -1) {
-        if (--timeout == 0) return -1;
+        if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(XHCI_CMD_TIMEOUT_NS)) return -1;
+        io_wait(); // The ring is in RAM; pace the polls like a register read
     }
     
     uint32_t slot_id = (event.control >> 24) & 0xFF;
@@ -165,28 +208,35 @@ static int xhci_enable_slot(xhci_controller_t* xhci) {
 
 static int xhci_address_device(xhci_controller_t* xhci, uint32_t slot_id) {
     // 1. Setup Input Context (Simplified: just enough for Address Device)
-    void* input_context = kmalloc_raw_aligned(4096);
-    memset(input_context, 0, 4096);
+    dma_buf_t input_context;
+    if (dma_alloc(&input_context, 4096, 64, xhci->dma_flags) != 0) return -1;
     
-    // 2. Setup Device Context for the slot
-    void* device_context = kmalloc_raw_aligned(4096);
-    memset(device_context, 0, 4096);
-    xhci->dcbaap[slot_id] = VIRT_TO_PHYS(device_context);
+    // 2. Setup Device Context for the slot (owned by the controller from now on)
+    dma_buf_t device_context;
+    if (dma_alloc(&device_context, 4096, 64, xhci->dma_flags) != 0) {
+        dma_free(&input_context);
+        return -1;
+    }
+    xhci->dcbaap[slot_id] = device_context.phys;
     
     // 3. Submit Address Device Command
     xhci_trb_t cmd;
     memset(&cmd, 0, sizeof(cmd));
-    cmd.parameter = VIRT_TO_PHYS(input_context);
+    cmd.parameter = input_context.phys;
     cmd.control = (TRB_TYPE_ADDRESS_DEVICE << 10) | (slot_id << 24) | xhci->cmd_cycle;
     
     xhci_submit_cmd(xhci, &cmd);
     
     // Poll for completion
     xhci_trb_t event;
-    int timeout = 100000;
+    uint64_t deadline = clock_monotonic_ns() + XHCI_CMD_TIMEOUT_NS;
+    uint64_t spins = 0;
     while (xhci_poll_event(xhci, &event) == -1) {
-        if (--timeout == 0) return -1;
+        // Controller may still read the input context
+        if (clock_monotonic_ns() >= deadline || ++spins >= CLOCK_POLL_LIMIT(XHCI_CMD_TIMEOUT_NS)) return -1;
+        io_wait();
     }
+    dma_free(&input_context);
     
     kprintf("xHCI: Device addressed on slot %d\n", slot_id);
     return 0;
@@ -202,10 +252,12 @@ void xhci_check_ports(xhci_controller_t* xhci) {
             
             // Trigger Port Reset
             xhci_write_op32(xhci, offset, portsc | (1 << 4)); // Port Reset
-            while (xhci_read_op32(xhci, offset) & (1 << 4));
-            
-            // Wait for port to become enabled
-            while (!(xhci_read_op32(xhci, offset) & (1 << 1)));
+            // Wait for the reset to finish and the port to become enabled
+            if (xhci_wait_op32(xhci, offset, 1 << 4, 0) != 0 ||
+                xhci_wait_op32(xhci, offset, 1 << 1, 1 << 1) != 0) {
+                kprintf("xHCI: Port %d did not come out of reset\n", i);
+                continue;
+            }
             
             kprintf("xHCI: Port %d enabled, speed=%d. Enabling slot...\n", i, (portsc >> 10) & 0xF);
             
@@ -11,6 +11,13 @@
 #define XHCI_CAP_HCCPARAMS1   0x10
 #define XHCI_CAP_DB_OFFSET    0x14
 #define XHCI_CAP_RTS_OFFSET    0x18
+#define XHCI_CAP_SIZE         0x20
+
+/* Register block sizes, for mapping the BAR */
+#define XHCI_OP_PORTSC_BASE   0x400  /* Port registers, from the operational base */
+#define XHCI_PORT_REGS_SIZE   0x10
+#define XHCI_RT_IR_BASE       0x20   /* Interrupters, from the runtime base */
+#define XHCI_RT_IR_SIZE       0x20
 
 /* xHCI Operational Registers (Offsets from BAR0 + CAPLENGTH) */
 #define XHCI_OP_USBCMD        0x00
@@ -49,11 +56,15 @@ typedef struct {
     uint16_t max_slots;
     uint16_t max_ports;
 
+    uint32_t dma_flags;     /* DMA_32BIT unless HCCPARAMS1.AC64 */
+
     xhci_trb_t* cmd_ring;
+    uint64_t cmd_ring_phys;
     uint32_t cmd_ring_index;
     uint8_t cmd_cycle;
 
     xhci_trb_t* event_ring;
+    uint64_t event_ring_phys;
     uint32_t event_ring_index;
     uint8_t event_cycle;
 
@@ -1,5 +1,10 @@
 #include "terminal.h"
 #include "window_manager.h"
+#include "../core/timer.h"
+#include "../core/clock.h"
+
+/* Frames are paced to this rate; input wakes the loop straight away */
+#define GUI_FRAME_HZ 60
 
 
 void gui_start(void) {
@@ -10,11 +15,16 @@ void gui_start(void) {
   // Desktop icons are rendered by window_manager.
   // No apps open on startup.
 
+  uint64_t next_frame = clock_monotonic_ns();
   while (wm_is_running()) {
     wm_update();
     wm_draw();
 
-    /* Yield to allow QEMU display thread to catch up */
-    __asm__ __volatile__("hlt");
+    /* Sleep until the next frame is due or an interrupt (input) arrives;
+       with nothing else to run the CPU stops ticking meanwhile */
+    next_frame += 1000000000ULL / GUI_FRAME_HZ;
+    uint64_t now = clock_monotonic_ns();
+    if (next_frame < now) next_frame = now;
+    timer_idle(next_frame);
   }
 }
@@ -0,0 +1,60 @@
+#ifndef GUI_CMD_H
+#define GUI_CMD_H
+
+#include <stdint.h>
+
+/*
+   Command buffers for userland drawing (SYS_GUI_SUBMIT). A program
+   writes a frame's worth of draw commands into a buffer of its own and
+   submits it with one syscall; the window manager replays them against
+   the window's surface in order.
+
+   Each command starts with a gui_cmd_t header whose size covers the
+   whole command, header included, rounded up to a multiple of 4.
+   Coordinates are relative to the window's client area and may fall
+   partly or wholly outside it; drawing is clipped. Colors are
+   0xAARRGGBB.
+*/
+
+#define GUI_CMD_MAX_BYTES (4 * 1024 * 1024)   /* Per submission */
+
+enum {
+  GUI_CMD_RECT = 1, /* gui_cmd_rect_t */
+  GUI_CMD_TEXT,     /* gui_cmd_text_t, then len characters */
+  GUI_CMD_BLIT,     /* gui_cmd_blit_t, then w * h pixels, row by row */
+  GUI_CMD_LINE      /* gui_cmd_line_t */
+};
+
+typedef struct {
+  uint16_t op;
+  uint16_t reserved;
+  uint32_t size;
+} gui_cmd_t;
+
+typedef struct {
+  gui_cmd_t hdr;
+  int32_t x, y, w, h;
+  uint32_t color;
+} gui_cmd_rect_t;
+
+typedef struct {
+  gui_cmd_t hdr;
+  int32_t x, y;
+  uint32_t color;
+  uint32_t len;
+  /* char text[len], not terminated */
+} gui_cmd_text_t;
+
+typedef struct {
+  gui_cmd_t hdr;
+  int32_t x, y, w, h;
+  /* uint32_t pixels[w * h] */
+} gui_cmd_blit_t;
+
+typedef struct {
+  gui_cmd_t hdr;
+  int32_t x0, y0, x1, y1;
+  uint32_t color;
+} gui_cmd_line_t;
+
+#endif
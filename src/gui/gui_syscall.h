@@ -0,0 +1,47 @@
+#ifndef GUI_SYSCALL_H
+#define GUI_SYSCALL_H
+
+#include <stdint.h>
+#include "gui_cmd.h"
+#include "../core/syscall.h"
+
+/*
+   Wrappers for user programs around the GUI syscalls that take more
+   than plain values: command buffers and mapped surfaces. They trap
+   through int 0x80 and are for 64-bit programs: a window handle is what
+   SYS_GUI_WINDOW_OPEN returned, a 64-bit value.
+*/
+
+static inline uint64_t gui_syscall(uint64_t num, uint64_t a, uint64_t b,
+                                   uint64_t c, uint64_t d, uint64_t e) {
+  uint64_t ret;
+  __asm__ volatile("int $0x80"
+                   : "=a"(ret)
+                   : "a"(num), "b"(a), "c"(b), "d"(c), "S"(d), "D"(e)
+                   : "memory");
+  return ret;
+}
+
+/* Replay len bytes of commands (gui_cmd.h); the number drawn, or -1 */
+static inline int gui_submit(uint64_t win, const void *buf, uint32_t len) {
+  return (int)gui_syscall(SYS_GUI_SUBMIT, win, (uint64_t)(uintptr_t)buf,
+                          len, 0, 0);
+}
+
+/* The window's surface, width * height pixels (0xAARRGGBB) in rows of
+   width, mapped read-write into this program; NULL on failure. What is
+   written there is on screen from the next frame on. */
+static inline uint32_t *gui_map_surface(uint64_t win) {
+  uint64_t addr = gui_syscall(SYS_GUI_MAP_SURFACE, win, 0, 0, 0, 0);
+  return addr == (uint64_t)-1 ? 0 : (uint32_t *)(uintptr_t)addr;
+}
+
+/* Report that (x, y, w, h) of the mapped surface has changed. Only a
+   hint for now: every frame shows the whole surface anyway. */
+static inline void gui_present(uint64_t win, int x, int y, int w, int h) {
+  gui_syscall(SYS_GUI_PRESENT, win, (uint64_t)(int64_t)x,
+              (uint64_t)(int64_t)y, (uint64_t)(int64_t)w,
+              (uint64_t)(int64_t)h);
+}
+
+#endif
@@ -5,8 +5,13 @@
 #include "../drivers/rtc.h"
 #include "../drivers/vesa.h"
 #include "../lib/memory.h"
+#include "../core/process.h"
+#include "../core/vmm.h"
+#include "../core/smp.h"
+#include "../core/spinlock.h"
 #include "font.h"
 #include "graphics.h"
+#include "gui_cmd.h"
 
 /* Binary/process loading commented out for now
 #include "../core/process.h"
@@ -44,6 +49,46 @@ static int clip_x, clip_y, clip_w, clip_h;
 static uint32_t *clip_buf;
 static int clip_stride;
 
+/* The window list and everything the windows own (surfaces, event
+   queues), and the drawing state above, belong to whoever holds the WM
+   lock: the GUI loop, the keyboard interrupt, and programs' GUI syscalls
+   on any CPU. Syscalls run with interrupts off, so the lock is always
+   taken with them off, or a syscall on this CPU could find it held by
+   the code it preempted. It nests on the holding CPU because kernel apps
+   open windows from callbacks that already run under it. */
+static spinlock_t wm_lock_word = SPINLOCK_INIT;
+static volatile int wm_lock_owner = -1;
+static int wm_lock_depth = 0;
+
+uint64_t wm_lock(void) {
+  uint64_t flags = irq_save();
+  int cpu = smp_current_cpu();
+  if (wm_lock_owner == cpu) {
+    wm_lock_depth++;
+    return flags;
+  }
+  spinlock_lock(&wm_lock_word);
+  wm_lock_owner = cpu;
+  wm_lock_depth = 1;
+  return flags;
+}
+
+void wm_unlock(uint64_t flags) {
+  if (--wm_lock_depth == 0) {
+    wm_lock_owner = -1;
+    spinlock_unlock(&wm_lock_word);
+  }
+  irq_restore(flags);
+}
+
+window_t *wm_lookup(uint64_t handle) {
+  for (window_t *w = windows; w; w = w->next) {
+    if ((uint64_t)w == handle)
+      return w;
+  }
+  return NULL;
+}
+
 int wm_is_running() { return wm_running; }
 
 void wm_shutdown() { wm_running = 0; }
@@ -61,6 +106,7 @@ void wm_init() {
   // Reset mouse driver to match our initial position
   mouse_reset_position(mouse_x, mouse_y);
 
+  spinlock_track(&wm_lock_word, "window manager");
   wm_running = 1;
 }
 
@@ -83,11 +129,14 @@ window_t *wm_create_window(int x, int y, int w, int h, const char *title) {
     *d++ = *s++;
   *d = 0;
 
+  // Allocate surface for window (required for persistent userland drawing).
+  // Shared memory, so wm_map_surface can hand the same frames to a program.
+  win->surface = (uint32_t *)vmm_shared_alloc((size_t)w * h * 4);
+
+  uint64_t flags = wm_lock();
   win->next = windows;
   windows = win;
-
-  // Allocate surface for window (required for persistent userland drawing)
-  win->surface = (uint32_t *)kmalloc_z(w * h * 4);
+  wm_unlock(flags);
 
   return win;
 }
@@ -99,7 +148,7 @@ void wm_launch_app(const char* path) {
     if (!data) return;
 
     if (elf_validate(data) != 0) return;
-    uint32_t entry = elf_get_entry(data);
+    uint64_t entry = elf_get_entry(data);
 
     process_t* p = process_create(path, entry);
     if (!p) return;
@@ -108,25 +157,30 @@ void wm_launch_app(const char* path) {
 }
 */
 
+/* Called with the WM lock held, so no syscall is using win: once it is
+   off the list, wm_lookup no longer finds it */
 static void wm_remove_window(window_t *win) {
   if (!win)
     return;
   if (windows == win) {
     windows = win->next;
-    return;
-  }
-  window_t *curr = windows;
-  while (curr && curr->next != win) {
-    curr = curr->next;
-  }
-  if (curr) {
+  } else {
+    window_t *curr = windows;
+    while (curr && curr->next != win) {
+      curr = curr->next;
+    }
+    if (!curr)
+      return;
     curr->next = win->next;
   }
+  if (dragging_window == win)
+    dragging_window = 0;
 
   // Reclaim memory
-  win->magic = 0; // Invalidate handle for any ongoing syscalls
+  win->magic = 0;
+  // Programs that mapped the surface keep it until they exit
   if (win->surface) {
-    kfree(win->surface);
+    vmm_shared_put(win->surface, (size_t)win->width * win->height * 4);
     win->surface = NULL;
   }
   kfree(win);
@@ -140,6 +194,7 @@ void wm_push_event(window_t *win, hz_event_t ev) {
     return; // Drop if full
   win->event_queue[win->event_head] = ev;
   win->event_head = next;
+  scheduler_wake_input();
 }
 
 static void wm_focus_window(window_t *win) {
@@ -233,6 +288,187 @@ void wm_draw_string(window_t *win, int x, int y, const char *str,
   }
 }
 
+/* Command buffers. The caller hands over a kernel copy, so fields read
+   here cannot change between checks and use. The replay clips against
+   its own target instead of the clip_* globals, which would leave them
+   pointing at this window for whatever the WM draws next. */
+typedef struct {
+  uint32_t *buf;
+  int w, h; /* Also the stride: surfaces are packed */
+} cmd_target_t;
+
+/* Clip the rectangle (x, y, w, h) against the target, in 64 bits so no
+   int32_t input can overflow. The visible part starts (*sx, *sy) into
+   the rectangle; returns 0 if nothing is left. */
+static int cmd_clip(cmd_target_t *t, int64_t x, int64_t y, int64_t w,
+                    int64_t h, int *cx, int *cy, int *cw, int *ch, int *sx,
+                    int *sy) {
+  int64_t x0 = x < 0 ? 0 : x, y0 = y < 0 ? 0 : y;
+  int64_t x1 = x + w > t->w ? t->w : x + w;
+  int64_t y1 = y + h > t->h ? t->h : y + h;
+  if (x1 <= x0 || y1 <= y0)
+    return 0;
+  *cx = (int)x0;
+  *cy = (int)y0;
+  *cw = (int)(x1 - x0);
+  *ch = (int)(y1 - y0);
+  *sx = (int)(x0 - x);
+  *sy = (int)(y0 - y);
+  return 1;
+}
+
+static void cmd_fill(cmd_target_t *t, int32_t x, int32_t y, int32_t w,
+                     int32_t h, uint32_t color) {
+  int cx, cy, cw, ch, sx, sy;
+  if (!cmd_clip(t, x, y, w, h, &cx, &cy, &cw, &ch, &sx, &sy))
+    return;
+
+  for (int j = 0; j < ch; j++) {
+    uint32_t *row = t->buf + (cy + j) * t->w + cx;
+    for (int i = 0; i < cw; i++)
+      row[i] = color;
+  }
+}
+
+static void cmd_text(cmd_target_t *t, int x, int y, const char *text,
+                     uint32_t len, uint32_t color) {
+  for (uint32_t n = 0; n < len; n++, x += 8) {
+    char c = text[n];
+    if (x >= t->w)
+      break;
+    if (c < 0 || x + 8 <= 0)
+      continue;
+    const uint8_t *glyph = font8x8_basic[(int)c];
+    for (int row = 0; row < 8; row++) {
+      int py = y + row;
+      if (py < 0 || py >= t->h)
+        continue;
+      uint8_t bits = glyph[row];
+      for (int col = 0; col < 8; col++) {
+        int px = x + col;
+        if (((bits >> (7 - col)) & 1) && px >= 0 && px < t->w)
+          t->buf[py * t->w + px] = color;
+      }
+    }
+  }
+}
+
+/* pixels is w * h packed pixels; the clipped-off rows and columns are
+   skipped by offsetting into it */
+static void cmd_blit(cmd_target_t *t, int32_t x, int32_t y, int32_t w,
+                     int32_t h, const uint32_t *pixels) {
+  int cx, cy, cw, ch, sx, sy;
+  if (!cmd_clip(t, x, y, w, h, &cx, &cy, &cw, &ch, &sx, &sy))
+    return;
+
+  for (int j = 0; j < ch; j++)
+    memcpy(t->buf + (cy + j) * t->w + cx,
+           pixels + (size_t)(sy + j) * w + sx, (size_t)cw * 4);
+}
+
+static void cmd_line(cmd_target_t *t, int x0, int y0, int x1, int y1,
+                     uint32_t color) {
+  int dx = x1 > x0 ? x1 - x0 : x0 - x1, sx = x0 < x1 ? 1 : -1;
+  int dy = y1 > y0 ? y0 - y1 : y1 - y0, sy = y0 < y1 ? 1 : -1;
+  int err = dx + dy;
+
+  for (;;) {
+    if (x0 >= 0 && x0 < t->w && y0 >= 0 && y0 < t->h)
+      t->buf[y0 * t->w + x0] = color;
+    if (x0 == x1 && y0 == y1)
+      break;
+    int e2 = 2 * err;
+    if (e2 >= dy) {
+      err += dy;
+      x0 += sx;
+    }
+    if (e2 <= dx) {
+      err += dx;
+      y0 += sy;
+    }
+  }
+}
+
+/* Text and line coordinates beyond this are clamped, so stepping along
+   them cannot overflow and a line cannot run for billions of steps.
+   Rectangles are clipped exactly instead (cmd_clip). */
+#define CMD_COORD_LIMIT 16384
+
+static int cmd_clamp(int32_t v) {
+  if (v < -CMD_COORD_LIMIT)
+    return -CMD_COORD_LIMIT;
+  if (v > CMD_COORD_LIMIT)
+    return CMD_COORD_LIMIT;
+  return v;
+}
+
+int wm_submit_commands(window_t *win, const void *buf, uint32_t len) {
+  if (!win || !win->surface || !buf || len > GUI_CMD_MAX_BYTES)
+    return -1;
+
+  cmd_target_t t = {win->surface, win->width, win->height};
+  const uint8_t *p = (const uint8_t *)buf;
+  int drawn = 0;
+
+  while (len > 0) {
+    if (len < sizeof(gui_cmd_t))
+      return -1;
+    const gui_cmd_t *cmd = (const gui_cmd_t *)p;
+    uint32_t size = cmd->size;
+    if (size < sizeof(gui_cmd_t) || size > len || (size & 3))
+      return -1;
+
+    switch (cmd->op) {
+    case GUI_CMD_RECT: {
+      const gui_cmd_rect_t *c = (const gui_cmd_rect_t *)cmd;
+      if (size < sizeof(*c))
+        return -1;
+      cmd_fill(&t, c->x, c->y, c->w, c->h, c->color);
+      break;
+    }
+    case GUI_CMD_TEXT: {
+      const gui_cmd_text_t *c = (const gui_cmd_text_t *)cmd;
+      if (size < sizeof(*c) || c->len > size - sizeof(*c))
+        return -1;
+      cmd_text(&t, cmd_clamp(c->x), cmd_clamp(c->y), (const char *)(c + 1),
+               c->len, c->color);
+      break;
+    }
+    case GUI_CMD_BLIT: {
+      const gui_cmd_blit_t *c = (const gui_cmd_blit_t *)cmd;
+      if (size < sizeof(*c) || c->w < 0 || c->h < 0 ||
+          (uint64_t)c->w * c->h > (size - sizeof(*c)) / 4)
+        return -1;
+      cmd_blit(&t, c->x, c->y, c->w, c->h, (const uint32_t *)(c + 1));
+      break;
+    }
+    case GUI_CMD_LINE: {
+      const gui_cmd_line_t *c = (const gui_cmd_line_t *)cmd;
+      if (size < sizeof(*c))
+        return -1;
+      cmd_line(&t, cmd_clamp(c->x0), cmd_clamp(c->y0), cmd_clamp(c->x1),
+               cmd_clamp(c->y1), c->color);
+      break;
+    }
+    default:
+      return -1;
+    }
+
+    drawn++;
+    p += size;
+    len -= size;
+  }
+  return drawn;
+}
+
+int wm_map_surface(window_t *win, struct vm_space *space, uint64_t *addr) {
+  if (!win || !win->surface || !space)
+    return -1;
+  return vmm_map_shared(space, win->surface,
+                        (size_t)win->width * win->height * 4,
+                        VMA_READ | VMA_WRITE, addr);
+}
+
 static void buf_draw_char(uint32_t *buf, int x, int y, char c, uint32_t color) {
   gfx_draw_char_to_buffer(buf, x, y, vesa_width, vesa_height, c, color);
 }
@@ -425,6 +661,9 @@ static void draw_cursor(uint32_t *buf, int mx, int my) {
 void wm_draw() {
   if (!backbuffer)
     return;
+  // Compose under the lock; the blit to the screen needs only backbuffer,
+  // which nobody else draws into
+  uint64_t flags = wm_lock();
   draw_desktop_elements(backbuffer);
 
   void draw_rec(window_t * n) {
@@ -452,19 +691,11 @@ void wm_draw() {
   }
 
   draw_cursor(backbuffer, mouse_x, mouse_y);
-  if (vesa_video_memory) {
-    uint8_t *dst_base = (uint8_t *)vesa_video_memory;
-    uint32_t *src = backbuffer;
-    for (int y = 0; y < vesa_height; y++) {
-      uint32_t *dst_row = (uint32_t *)(dst_base + y * vesa_pitch);
-      for (int x = 0; x < vesa_width; x++) {
-        dst_row[x] = src[y * vesa_width + x];
-      }
-    }
-  }
+  wm_unlock(flags);
+  vesa_blit_rows(backbuffer, vesa_width, 0, vesa_height);
 }
 
-void wm_update() {
+static void update(void) {
   mouse_state_t s = mouse_get_state();
   mouse_x = s.x;
   mouse_y = s.y;
@@ -696,9 +927,16 @@ void wm_update() {
   prev_mouse_l = mouse_l;
 }
 
+void wm_update() {
+  uint64_t flags = wm_lock();
+  update();
+  wm_unlock(flags);
+}
+
 void wm_handle_mouse(mouse_state_t state) { (void)state; }
 
 void wm_handle_key(char c) {
+  uint64_t flags = wm_lock();
   if (windows && !(windows->flags & 1)) {
     if (windows->is_userland) {
       hz_event_t ev;
@@ -709,4 +947,5 @@ void wm_handle_key(char c) {
       windows->on_key(windows, c);
     }
   }
+  wm_unlock(flags);
 }
@@ -56,6 +56,16 @@ struct window {
   click_callback_t on_click;
 };
 
+/* The WM lock, held around anything that touches windows from outside
+   the GUI loop (syscalls). It disables interrupts and nests; pass
+   wm_unlock what wm_lock returned. */
+uint64_t wm_lock(void);
+void wm_unlock(uint64_t flags);
+
+/* The open window whose handle (address) this is, or NULL once it has
+   been closed. Call with the WM lock held. */
+window_t *wm_lookup(uint64_t handle);
+
 /* Initialize Window Manager and allocate backbuffers */
 void wm_init(void);
 
@@ -78,6 +88,22 @@ void wm_draw_char(window_t *win, int x, int y, char c, uint32_t color);
 void wm_draw_string(window_t *win, int x, int y, const char *str,
                     uint32_t color);
 
+/* Replay a command buffer (gui_cmd.h) of len bytes against the window's
+   surface. Returns the number of commands drawn, or -1 if one is
+   malformed; those before it are still drawn. buf must be kernel memory
+   nobody else writes to while this runs. */
+int wm_submit_commands(window_t *win, const void *buf, uint32_t len);
+
+/* Map the window's surface into space (the calling program's), width *
+   height pixels in rows of width, and store its user address in *addr.
+   These are the frames the compositor reads, so nothing is copied;
+   mapping again maps the same frames at another address. The
+   compositor rebuilds the back buffer from every surface each frame, so
+   what a program writes there shows from the next frame on; there is no
+   present step to wait for. */
+struct vm_space;
+int wm_map_surface(window_t *win, struct vm_space *space, uint64_t *addr);
+
 /* Binary app launching commented out - using integrated apps instead
 void wm_launch_app(const char* path);
 */
@@ -0,0 +1,148 @@
+#include "alloc_trace.h"
+#include "memory.h"
+#include "../core/spinlock.h"
+#include "../core/clock.h"
+
+/*
+   Two fixed tables, so tracing never allocates: call sites, and live
+   pointers mapping back to their site and size. Both use open addressing
+   with linear probing; pointers are removed with backward-shift deletion
+   so lookups never need tombstones.
+*/
+
+typedef struct {
+    uintptr_t ptr;
+    size_t size;
+    uint32_t site;        /* Index into g_sites */
+} trace_ptr_t;
+
+volatile int g_alloc_trace_on = 0;
+
+static alloc_site_stats_t g_sites[ALLOC_TRACE_SITES];
+static trace_ptr_t g_ptrs[ALLOC_TRACE_PTRS];
+static size_t g_site_count = 0;
+static size_t g_ptr_count = 0;
+static uint64_t g_dropped = 0;
+static uint64_t g_since_ns = 0;
+static spinlock_t g_trace_lock = SPINLOCK_INIT;
+
+static inline uint32_t hash_addr(uintptr_t v, uint32_t mask) {
+    return (uint32_t)(((v >> 4) * 0x9E3779B97F4A7C15ULL) >> 40) & mask;
+}
+
+void alloc_trace_enable(int on) {
+    uint64_t flags = spinlock_lock_irqsave(&g_trace_lock);
+    if (on && !g_alloc_trace_on) {
+        memset(g_sites, 0, sizeof(g_sites));
+        memset(g_ptrs, 0, sizeof(g_ptrs));
+        g_site_count = 0;
+        g_ptr_count = 0;
+        g_dropped = 0;
+        g_since_ns = clock_monotonic_ns();
+    }
+    g_alloc_trace_on = on;
+    spinlock_unlock_irqrestore(&g_trace_lock, flags);
+}
+
+static int site_index(uintptr_t site) {
+    uint32_t i = hash_addr(site, ALLOC_TRACE_SITES - 1);
+    for (int n = 0; n < ALLOC_TRACE_SITES; n++) {
+        if (g_sites[i].site == site) return (int)i;
+        if (g_sites[i].site == 0) {
+            // Keep a slot spare so probing for an unknown site terminates
+            if (g_site_count + 1 >= ALLOC_TRACE_SITES) return -1;
+            g_sites[i].site = site;
+            g_site_count++;
+            return (int)i;
+        }
+        i = (i + 1) & (ALLOC_TRACE_SITES - 1);
+    }
+    return -1;
+}
+
+void alloc_trace_alloc(void* ptr, size_t size, uintptr_t site) {
+    uint64_t flags = spinlock_lock_irqsave(&g_trace_lock);
+
+    int s = g_alloc_trace_on ? site_index(site) : -1;
+    if (s >= 0 && g_ptr_count + 1 < ALLOC_TRACE_PTRS) {
+        uint32_t i = hash_addr((uintptr_t)ptr, ALLOC_TRACE_PTRS - 1);
+        while (g_ptrs[i].ptr) i = (i + 1) & (ALLOC_TRACE_PTRS - 1);
+        g_ptrs[i].ptr = (uintptr_t)ptr;
+        g_ptrs[i].size = size;
+        g_ptrs[i].site = (uint32_t)s;
+        g_ptr_count++;
+
+        alloc_site_stats_t* st = &g_sites[s];
+        st->allocs++;
+        st->alloc_bytes += size;
+        st->live_objs++;
+        st->live_bytes += size;
+        if (st->live_bytes > st->peak_bytes) st->peak_bytes = st->live_bytes;
+    } else if (g_alloc_trace_on) {
+        g_dropped++;
+    }
+
+    spinlock_unlock_irqrestore(&g_trace_lock, flags);
+}
+
+void alloc_trace_free(void* ptr) {
+    uint64_t flags = spinlock_lock_irqsave(&g_trace_lock);
+
+    uint32_t mask = ALLOC_TRACE_PTRS - 1;
+    uint32_t i = hash_addr((uintptr_t)ptr, mask);
+    while (g_ptrs[i].ptr && g_ptrs[i].ptr != (uintptr_t)ptr) i = (i + 1) & mask;
+
+    // Allocations from before tracing was enabled are simply not found
+    if (g_ptrs[i].ptr) {
+        alloc_site_stats_t* st = &g_sites[g_ptrs[i].site];
+        st->frees++;
+        st->live_objs--;
+        st->live_bytes -= g_ptrs[i].size;
+        g_ptr_count--;
+
+        // Backward-shift: pull later entries of the probe run into the hole
+        uint32_t hole = i;
+        uint32_t j = (i + 1) & mask;
+        while (g_ptrs[j].ptr) {
+            uint32_t home = hash_addr(g_ptrs[j].ptr, mask);
+            if (((j - home) & mask) >= ((j - hole) & mask)) {
+                g_ptrs[hole] = g_ptrs[j];
+                hole = j;
+            }
+            j = (j + 1) & mask;
+        }
+        g_ptrs[hole].ptr = 0;
+    }
+
+    spinlock_unlock_irqrestore(&g_trace_lock, flags);
+}
+
+int alloc_trace_top(alloc_site_stats_t* out, int max) {
+    if (!out || max <= 0) return 0;
+    int n = 0;
+
+    uint64_t flags = spinlock_lock_irqsave(&g_trace_lock);
+    for (int i = 0; i < ALLOC_TRACE_SITES; i++) {
+        if (!g_sites[i].site) continue;
+
+        // Insertion into the sorted output, dropping the smallest
+        int pos = n < max ? n : max - 1;
+        if (n == max && g_sites[i].live_bytes <= out[pos].live_bytes) continue;
+        while (pos > 0 && out[pos - 1].live_bytes < g_sites[i].live_bytes) {
+            out[pos] = out[pos - 1];
+            pos--;
+        }
+        out[pos] = g_sites[i];
+        if (n < max) n++;
+    }
+    spinlock_unlock_irqrestore(&g_trace_lock, flags);
+    return n;
+}
+
+void alloc_trace_get_summary(alloc_trace_summary_t* out) {
+    if (!out) return;
+    out->since_ns = g_since_ns;
+    out->sites = g_site_count;
+    out->live_objs = g_ptr_count;
+    out->dropped = g_dropped;
+}
@@ -0,0 +1,50 @@
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+   Optional kmalloc call-site accounting. While enabled, every allocation
+   is attributed to the address kmalloc returns to, so live bytes, rate
+   and peak can be read per call site (addr2line -e build/kernel.elf
+   turns a site into a file and line). Off by default; costs one branch.
+*/
+
+#define ALLOC_TRACE_SITES 256     /* Distinct call sites tracked */
+#define ALLOC_TRACE_PTRS  16384   /* Live allocations tracked (power of two) */
+
+typedef struct {
+    uintptr_t site;       /* Return address of the kmalloc call */
+    size_t live_bytes;
+    size_t live_objs;
+    size_t peak_bytes;    /* Highest live_bytes seen */
+    uint64_t allocs;      /* Since tracing was enabled */
+    uint64_t frees;
+    uint64_t alloc_bytes;
+} alloc_site_stats_t;
+
+typedef struct {
+    uint64_t since_ns;    /* When tracing was (re)enabled */
+    size_t sites;         /* Call sites seen */
+    size_t live_objs;     /* Allocations currently tracked */
+    uint64_t dropped;     /* Allocations not recorded: a table was full */
+} alloc_trace_summary_t;
+
+extern volatile int g_alloc_trace_on;
+
+static inline int alloc_trace_enabled(void) {
+    return g_alloc_trace_on;
+}
+
+/* Enabling starts from empty tables; earlier allocations are not counted */
+void alloc_trace_enable(int on);
+
+void alloc_trace_alloc(void* ptr, size_t size, uintptr_t site);
+void alloc_trace_free(void* ptr);
+
+/* Copy up to max sites, largest live_bytes first; returns how many */
+int alloc_trace_top(alloc_site_stats_t* out, int max);
+void alloc_trace_get_summary(alloc_trace_summary_t* out);
+
+#endif
@@ -1,56 +1,161 @@
 #include "memory.h"
 
-extern uint32_t _end;
-static uintptr_t placement_addr = (uintptr_t)&_end;
+#include "../core/pmm.h"
+#include "../core/smp.h"
+#include "../core/spinlock.h"
+#include "../core/io.h"
+#include "alloc_trace.h"
 
-uintptr_t get_heap_base(void) {
-    return placement_addr;
+/*
+   Kernel heap: a slab layer for small objects on top of the physical
+   page allocator (core/pmm.c).
+
+   Slab pages and large runs come straight from the buddy allocator and
+   are addressed through the HHDM. The frame database doubles as the slab
+   descriptor table, so kfree() finds the owner of any pointer in O(1)
+   without per-object headers. Requests up to 4 KiB are served from
+   per-class slabs (one page each); anything bigger is a run of whole pages.
+
+   Small objects go through per-CPU magazines first: each CPU keeps a
+   private stash per size class that only it touches (with interrupts
+   off), and refills or drains it in batches against the slab layer,
+   which acts as the spinlocked central depot.
+*/
+
+#define KMALLOC_MAG_SIZE  16  /* Objects a CPU may stash per size class */
+#define KMALLOC_MAG_BATCH 8   /* Objects moved to/from the depot at once */
+
+typedef struct {
+    spinlock_t lock;          /* Depot lock: partial list and counters */
+    uint32_t partial;         /* PFN of first slab with a free object */
+    size_t slabs;
+    size_t total_objs;
+    size_t used_objs;         /* Includes objects stashed in magazines */
+} kmalloc_class_t;
+
+typedef struct {
+    uint32_t count;
+    void* objs[KMALLOC_MAG_SIZE];
+} kmalloc_mag_t;
+
+/* One cache line aligned block per CPU so magazines never share lines */
+typedef struct {
+    kmalloc_mag_t mags[KMALLOC_NUM_CLASSES];
+} __attribute__((aligned(64))) kmalloc_cpu_cache_t;
+
+static size_t g_large_pages = 0;
+static int g_heap_ready = 0;
+static kmalloc_class_t g_classes[KMALLOC_NUM_CLASSES];
+static const char* const g_class_names[KMALLOC_NUM_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256",
+    "kmalloc-512", "kmalloc-1024", "kmalloc-2048", "kmalloc-4096"
+};
+static kmalloc_cpu_cache_t g_cpu_caches[SMP_MAX_CPUS];
+
+/* --- String primitives --- */
+
+/* Below this, the startup cost of rep movs/stos outweighs its throughput */
+#define MEM_REP_THRESHOLD 256
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) mem_word_t;
+
+static int g_mem_erms = 0;  /* CPUID.7.0:EBX[9] Enhanced REP MOVSB/STOSB */
+
+static void memory_detect_features(void) {
+    uint32_t a, b, c, d;
+    cpuid(0, 0, &a, &b, &c, &d);
+    if (a < 7) return;
+    cpuid(7, 0, &a, &b, &c, &d);
+    g_mem_erms = (b >> 9) & 1;
 }
 
-static size_t g_total_mem_kb = 0;
-static uintptr_t g_heap_start = 0;
+int memory_has_erms(void) {
+    return g_mem_erms;
+}
 
-void memory_init(uintptr_t base, size_t total_kb) {
-    placement_addr = base;
-    g_heap_start = base;
-    g_total_mem_kb = total_kb;
+void memory_init(void) {
+    memory_detect_features();
+    for (int i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        spinlock_init(&g_classes[i].lock);
+        spinlock_track(&g_classes[i].lock, g_class_names[i]);
+        g_classes[i].partial = PMM_NO_PAGE;
+        g_classes[i].slabs = 0;
+        g_classes[i].total_objs = 0;
+        g_classes[i].used_objs = 0;
+    }
+    g_large_pages = 0;
+    g_heap_ready = pmm_get_total_pages() != 0;
 }
 
 size_t memory_get_total_kb(void) {
-    return g_total_mem_kb;
+    return pmm_get_total_pages() * (PAGE_SIZE / 1024);
 }
 
 size_t memory_get_used_kb(void) {
-    if (g_heap_start == 0) return 0;
-    return (placement_addr - g_heap_start) / 1024;
+    return (pmm_get_total_pages() - pmm_get_free_pages()) * (PAGE_SIZE / 1024);
 }
 
-typedef struct malloc_block {
-    size_t size;
-    int free;
-    struct malloc_block* next;
-} malloc_block_t;
+/* The byte loops below must not be turned back into calls to themselves */
+#define MEM_NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
 
-static malloc_block_t* free_list = NULL;
+MEM_NO_LIBCALL void* memset(void* ptr, int value, size_t num) {
+    uint8_t* p = ptr;
+    uint64_t pattern = 0x0101010101010101ULL * (uint8_t)value;
+
+    if (num >= MEM_REP_THRESHOLD) {
+        if (g_mem_erms) {
+            __asm__ volatile("rep stosb" : "+D"(p), "+c"(num) : "a"(value) : "memory");
+            return ptr;
+        }
+        // Align the destination, then store quadwords
+        while ((uintptr_t)p & 7) { *p++ = (uint8_t)value; num--; }
+        size_t words = num / 8;
+        __asm__ volatile("rep stosq" : "+D"(p), "+c"(words) : "a"(pattern) : "memory");
+        num &= 7;
+    } else if (num >= 16) {
+        while ((uintptr_t)p & 7) { *p++ = (uint8_t)value; num--; }
+        for (; num >= 8; num -= 8, p += 8) *(mem_word_t*)p = pattern;
+    }
 
-void* memset(void* ptr, int value, size_t num) {
-    unsigned char* p = ptr;
-    while(num--) *p++ = (unsigned char)value;
+    while (num--) *p++ = (uint8_t)value;
     return ptr;
 }
 
-void* memcpy(void* dest, const void* src, size_t count) {
-    char* dst8 = (char*)dest;
-    const char* src8 = (const char*)src;
-    while (count--) {
-        *dst8++ = *src8++;
+MEM_NO_LIBCALL void* memcpy(void* dest, const void* src, size_t count) {
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+
+    if (count >= MEM_REP_THRESHOLD) {
+        if (g_mem_erms) {
+            __asm__ volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(count) : : "memory");
+            return dest;
+        }
+        while ((uintptr_t)d & 7) { *d++ = *s++; count--; }
+        size_t words = count / 8;
+        __asm__ volatile("rep movsq" : "+D"(d), "+S"(s), "+c"(words) : : "memory");
+        count &= 7;
+    } else if (count >= 16) {
+        while ((uintptr_t)d & 7) { *d++ = *s++; count--; }
+        for (; count >= 8; count -= 8, d += 8, s += 8) {
+            *(mem_word_t*)d = *(const mem_word_t*)s;
+        }
     }
+
+    while (count--) *d++ = *s++;
     return dest;
 }
 
-int memcmp(const void* s1, const void* s2, size_t n) {
-    const unsigned char* p1 = s1;
-    const unsigned char* p2 = s2;
+MEM_NO_LIBCALL int memcmp(const void* s1, const void* s2, size_t n) {
+    const uint8_t* p1 = s1;
+    const uint8_t* p2 = s2;
+
+    // Skip equal words; the byte loop then locates the first difference
+    while (n >= 8 && *(const mem_word_t*)p1 == *(const mem_word_t*)p2) {
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
+
     while (n--) {
         if (*p1 != *p2) return *p1 - *p2;
         p1++;
@@ -59,72 +164,244 @@ int memcmp(const void* s1, const void* s2, size_t n) {
     return 0;
 }
 
-static malloc_block_t* find_free_block(size_t size) {
-    malloc_block_t* curr = free_list;
-    while (curr) {
-        if (curr->free && curr->size >= size) return curr;
-        curr = curr->next;
+/* --- Slabs --- */
+
+static inline void* page_addr(page_t* pg) {
+    return (void*)PHYS_TO_VIRT(pmm_page_to_phys(pg));
+}
+
+static inline page_t* addr_to_page(const void* ptr) {
+    uintptr_t addr = (uintptr_t)ptr;
+    if (addr < g_hhdm_offset) return NULL;
+    return pmm_phys_to_page(VIRT_TO_PHYS(addr));
+}
+
+static inline uint32_t page_pfn(page_t* pg) {
+    return (uint32_t)(pmm_page_to_phys(pg) >> PAGE_SHIFT);
+}
+
+static void partial_push(kmalloc_class_t* c, page_t* pg) {
+    uint32_t pfn = page_pfn(pg);
+    pg->prev = PMM_NO_PAGE;
+    pg->next = c->partial;
+    if (c->partial != PMM_NO_PAGE) pmm_pfn_to_page(c->partial)->prev = pfn;
+    c->partial = pfn;
+}
+
+static void partial_remove(kmalloc_class_t* c, page_t* pg) {
+    if (pg->prev != PMM_NO_PAGE) pmm_pfn_to_page(pg->prev)->next = pg->next;
+    else c->partial = pg->next;
+    if (pg->next != PMM_NO_PAGE) pmm_pfn_to_page(pg->next)->prev = pg->prev;
+    pg->next = pg->prev = PMM_NO_PAGE;
+}
+
+static inline int size_to_class(size_t size) {
+    if (size <= (1u << KMALLOC_MIN_SHIFT)) return 0;
+    return (int)(64 - __builtin_clzl(size - 1)) - KMALLOC_MIN_SHIFT;
+}
+
+static page_t* slab_new(int cls) {
+    uintptr_t phys = pmm_alloc_pages(0);
+    if (!phys) return NULL;
+    page_t* pg = pmm_phys_to_page(phys);
+
+    size_t obj_size = (size_t)1 << (cls + KMALLOC_MIN_SHIFT);
+    size_t count = PAGE_SIZE / obj_size;
+    uint8_t* base = (uint8_t*)PHYS_TO_VIRT(phys);
+
+    // Thread the free list through the objects themselves
+    for (size_t i = 0; i < count - 1; i++) {
+        *(void**)(base + i * obj_size) = base + (i + 1) * obj_size;
     }
-    return NULL;
+    *(void**)(base + (count - 1) * obj_size) = NULL;
+
+    pg->type = PAGE_SLAB;
+    pg->slab_class = (uint8_t)cls;
+    pg->inuse = 0;
+    pg->freelist = base;
+
+    kmalloc_class_t* c = &g_classes[cls];
+    c->slabs++;
+    c->total_objs += count;
+    partial_push(c, pg);
+    return pg;
 }
 
-void* kmalloc(size_t size) {
-    // Round to 4 bytes
-    size = (size + 3) & ~3;
-    
-    malloc_block_t* block = find_free_block(size);
-    if (block) {
-        // Can we split this block?
-        if (block->size >= size + sizeof(malloc_block_t) + 4) {
-             malloc_block_t* new_block = (malloc_block_t*)((uint8_t*)(block + 1) + size);
-             new_block->size = block->size - size - sizeof(malloc_block_t);
-             new_block->free = 1;
-             new_block->next = block->next;
-             
-             block->size = size;
-             block->next = new_block;
-        }
-        block->free = 0;
-        return (void*)(block + 1);
+static void* slab_alloc(int cls) {
+    kmalloc_class_t* c = &g_classes[cls];
+    page_t* pg;
+    if (c->partial != PMM_NO_PAGE) {
+        pg = pmm_pfn_to_page(c->partial);
+    } else {
+        pg = slab_new(cls);
+        if (!pg) return NULL;
+    }
+
+    void* obj = pg->freelist;
+    pg->freelist = *(void**)obj;
+    pg->inuse++;
+    c->used_objs++;
+
+    if (!pg->freelist) {
+        partial_remove(c, pg);
+    }
+    return obj;
+}
+
+static void slab_free(page_t* pg, void* ptr) {
+    kmalloc_class_t* c = &g_classes[pg->slab_class];
+    int was_full = (pg->freelist == NULL);
+
+    *(void**)ptr = pg->freelist;
+    pg->freelist = ptr;
+    pg->inuse--;
+    c->used_objs--;
+
+    if (was_full) {
+        partial_push(c, pg);
+    }
+
+    // Keep one empty slab per class around to avoid page churn
+    if (pg->inuse == 0 && (pg->prev != PMM_NO_PAGE || pg->next != PMM_NO_PAGE)) {
+        partial_remove(c, pg);
+        c->slabs--;
+        c->total_objs -= PAGE_SIZE >> (pg->slab_class + KMALLOC_MIN_SHIFT);
+        pmm_free_pages(pmm_page_to_phys(pg), 0);
+    }
+}
+
+/* --- Per-CPU magazines --- */
+
+static void depot_refill(int cls, kmalloc_mag_t* m) {
+    kmalloc_class_t* c = &g_classes[cls];
+    spinlock_lock(&c->lock);
+    for (int i = 0; i < KMALLOC_MAG_BATCH; i++) {
+        void* obj = slab_alloc(cls);
+        if (!obj) break;
+        m->objs[m->count++] = obj;
+    }
+    spinlock_unlock(&c->lock);
+}
+
+static void depot_drain(int cls, kmalloc_mag_t* m) {
+    // Return the oldest objects; the most recently freed stay cache-hot
+    kmalloc_class_t* c = &g_classes[cls];
+    spinlock_lock(&c->lock);
+    for (int i = 0; i < KMALLOC_MAG_BATCH; i++) {
+        slab_free(addr_to_page(m->objs[i]), m->objs[i]);
     }
+    spinlock_unlock(&c->lock);
+
+    m->count -= KMALLOC_MAG_BATCH;
+    for (uint32_t i = 0; i < m->count; i++) {
+        m->objs[i] = m->objs[i + KMALLOC_MAG_BATCH];
+    }
+}
+
+static void* mag_alloc(int cls) {
+    uint64_t flags = irq_save();
+    kmalloc_mag_t* m = &g_cpu_caches[smp_current_cpu()].mags[cls];
+    if (m->count == 0) depot_refill(cls, m);
+    void* obj = m->count ? m->objs[--m->count] : NULL;
+    irq_restore(flags);
+    return obj;
+}
+
+static void mag_free(int cls, void* ptr) {
+    uint64_t flags = irq_save();
+    kmalloc_mag_t* m = &g_cpu_caches[smp_current_cpu()].mags[cls];
+    if (m->count == KMALLOC_MAG_SIZE) depot_drain(cls, m);
+    m->objs[m->count++] = ptr;
+    irq_restore(flags);
+}
+
+/* --- Public API --- */
+
+static void* large_alloc(size_t size, int dma32) {
+    size_t npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uintptr_t phys = pmm_alloc_contig(npages, dma32);
+    if (!phys) return NULL;
 
-    // Allocate new block
-    uintptr_t addr = placement_addr;
-    block = (malloc_block_t*)addr;
-    block->size = size;
-    block->free = 0;
-    block->next = free_list;
-    free_list = block;
+    page_t* pg = pmm_phys_to_page(phys);
+    pg->type = PAGE_LARGE;
+    pg->npages = npages;
+    __atomic_add_fetch(&g_large_pages, npages, __ATOMIC_RELAXED);
+    return (void*)PHYS_TO_VIRT(phys);
+}
+
+static void* heap_alloc(size_t size) {
+    if (!g_heap_ready) return NULL;
+    if (size > PAGE_SIZE) return large_alloc(size, 0);
+    return mag_alloc(size_to_class(size));
+}
+
+/* Page-aligned buffers are mostly handed to devices: keep them below
+   4 GiB so 32-bit DMA engines can reach them. Exact-size runs, so the
+   rest of the page block goes back to the allocator. */
+static void* heap_alloc_aligned(size_t size) {
+    if (!g_heap_ready) return NULL;
+    return large_alloc(size ? size : 1, 1);
+}
+
+/* Every public entry point records its own caller, so the call site
+   (not a wrapper such as kmalloc_z) is what the tracker sees */
+static inline void* traced(void* ptr, size_t size, void* site) {
+    if (ptr && alloc_trace_enabled()) alloc_trace_alloc(ptr, size, (uintptr_t)site);
+    return ptr;
+}
 
-    placement_addr += sizeof(malloc_block_t) + size;
-    return (void*)(block + 1);
+void* kmalloc(size_t size) {
+    return traced(heap_alloc(size), size, __builtin_return_address(0));
 }
 
 void kfree(void* ptr) {
     if (!ptr) return;
-    malloc_block_t* block = (malloc_block_t*)ptr - 1;
-    block->free = 1;
+    if (alloc_trace_enabled()) alloc_trace_free(ptr);
+
+    page_t* pg = addr_to_page(ptr);
+    if (!pg) return;
+
+    if (pg->type == PAGE_SLAB) {
+        mag_free(pg->slab_class, ptr);
+    } else if (pg->type == PAGE_LARGE && page_addr(pg) == ptr) {
+        size_t npages = pg->npages;
+        __atomic_sub_fetch(&g_large_pages, npages, __ATOMIC_RELAXED);
+        pmm_free_contig(pmm_page_to_phys(pg), npages);
+    }
 }
 
 void* kmalloc_z(size_t size) {
-    void* ptr = kmalloc(size);
+    void* ptr = heap_alloc(size);
     if (ptr) memset(ptr, 0, size);
-    return ptr;
+    return traced(ptr, size, __builtin_return_address(0));
 }
 
 void* kmalloc_a(size_t size) {
-    // Minimal alignment support for now (simplified)
-    if ((placement_addr & 0xFFF) != 0) {
-        placement_addr = (placement_addr & ~0xFFF) + 0x1000;
-    }
-    return kmalloc(size);
+    return traced(heap_alloc_aligned(size), size, __builtin_return_address(0));
 }
 
 void* kmalloc_raw_aligned(size_t size) {
-    if ((placement_addr & 0xFFF) != 0) {
-        placement_addr = (placement_addr & ~0xFFF) + 0x1000;
+    return traced(heap_alloc_aligned(size), size, __builtin_return_address(0));
+}
+void kmalloc_get_class_stats(int cls, kmalloc_class_stats_t* out) {
+    if (!out) return;
+    memset(out, 0, sizeof(*out));
+    if (cls < 0 || cls >= KMALLOC_NUM_CLASSES) return;
+
+    out->obj_size = (size_t)1 << (cls + KMALLOC_MIN_SHIFT);
+    out->slabs = g_classes[cls].slabs;
+    out->total_objs = g_classes[cls].total_objs;
+
+    // Magazine contents are free from the caller's point of view
+    size_t cached = 0;
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        cached += g_cpu_caches[cpu].mags[cls].count;
     }
-    void* addr = (void*)placement_addr;
-    placement_addr += size;
-    return addr;
+    size_t used = g_classes[cls].used_objs;
+    out->cached_objs = cached;
+    out->used_objs = used > cached ? used - cached : 0;
+}
+
+size_t kmalloc_get_large_pages(void) {
+    return g_large_pages;
 }
@@ -4,19 +4,41 @@
 #include <stddef.h>
 #include <stdint.h>
 
-void memory_init(uintptr_t base, size_t total_kb);
+#define PAGE_SIZE  4096
+#define PAGE_SHIFT 12
+
+/* kmalloc size classes: powers of two from 16 B up to one page */
+#define KMALLOC_MIN_SHIFT   4
+#define KMALLOC_MAX_SHIFT   PAGE_SHIFT
+#define KMALLOC_NUM_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+typedef struct {
+    size_t obj_size;    /* Object size of this class in bytes */
+    size_t slabs;       /* Slab pages currently owned by the class */
+    size_t total_objs;  /* Object slots across all slabs */
+    size_t used_objs;   /* Slots handed out to callers */
+    size_t cached_objs; /* Free slots parked in per-CPU magazines */
+} kmalloc_class_stats_t;
+
+/* Call after pmm_init() */
+void memory_init(void);
 size_t memory_get_total_kb(void);
 size_t memory_get_used_kb(void);
 
 void* memset(void* ptr, int value, size_t num);
 void* memcpy(void* dest, const void* src, size_t count);
 int memcmp(const void* s1, const void* s2, size_t n);
+int memory_has_erms(void);  /* memcpy/memset use rep movsb/stosb */
 
 /* Memory allocation */
 void* kmalloc(size_t size);
 void* kmalloc_z(size_t size); /* Allocate and zero */
 void* kmalloc_a(size_t size); /* Allocate page-aligned */
-void* kmalloc_raw_aligned(size_t size); 
+void* kmalloc_raw_aligned(size_t size);
 void  kfree(void* ptr);
 
+/* Allocator statistics (cls in [0, KMALLOC_NUM_CLASSES)) */
+void kmalloc_get_class_stats(int cls, kmalloc_class_stats_t* out);
+size_t kmalloc_get_large_pages(void);
+
 #endif
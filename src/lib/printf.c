@@ -4,7 +4,7 @@
 
 #include <stdarg.h>
 
-static spinlock_t g_printf_lock = 0;
+static spinlock_t g_printf_lock = SPINLOCK_INIT;
 
 static void print_dec(int value) {
   char buf[16];
@@ -44,8 +44,14 @@ static void print_hex(uint32_t value) {
   }
 }
 
+void printf_init(void) {
+  spinlock_track(&g_printf_lock, "printf");
+}
+
 void kprintf(const char *fmt, ...) {
-  spinlock_lock(&g_printf_lock);
+  // Interrupt handlers print too; one arriving while this CPU holds the
+  // lock would spin on it forever
+  uint64_t flags = spinlock_lock_irqsave(&g_printf_lock);
 
   va_list args;
   va_start(args, fmt);
@@ -117,5 +123,5 @@ void kprintf(const char *fmt, ...) {
   }
 
   va_end(args);
-  spinlock_unlock(&g_printf_lock);
+  spinlock_unlock_irqrestore(&g_printf_lock, flags);
 }
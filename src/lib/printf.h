@@ -5,4 +5,7 @@
 
 void kprintf(const char *fmt, ...);
 
+/* Register the output lock with lockstat */
+void printf_init(void);
+
 #endif
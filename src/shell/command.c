@@ -7,10 +7,21 @@
 #include "../core/io.h"
 #include "../core/elf.h"
 #include "../core/process.h"
+#include "../core/hpet.h"
+#include "../core/clock.h"
+#include "../core/smp.h"
+#include "../core/percpu.h"
+#include "../core/apic.h"
+#include "../core/tlb.h"
+#include "../core/wait.h"
+#include "../core/syscall.h"
 #include "../drivers/ahci.h"
 #include "../drivers/hda.h"
 #include "memory.h"
+#include "alloc_trace.h"
 #include "../net/net.h"
+#include "../drivers/vesa.h"
+#include "../gui/window_manager.h"
 
 typedef struct {
     const char* name;
@@ -45,6 +56,17 @@ static void cmd_diskinfo(const char* args);
 static void cmd_netinfo(const char* args);
 static void cmd_ping(const char* args);
 static void cmd_soundtest(const char* args);
+static void cmd_allocbench(const char* args);
+static void cmd_membench(const char* args);
+static void cmd_fbbench(const char* args);
+static void cmd_cswbench(const char* args);
+static void cmd_clockbench(const char* args);
+static void cmd_syscallbench(const char* args);
+static void cmd_surfacedemo(const char* args);
+static void cmd_memstat(const char* args);
+static void cmd_lockstat(const char* args);
+static void cmd_cpustat(const char* args);
+static void cmd_irqs(const char* args);
 
 static command_entry_t commands[] = {
     { "help",        "Show available commands",       cmd_help        },
@@ -74,6 +96,17 @@ static command_entry_t commands[] = {
     { "netinfo",    "Show network interface info",   cmd_netinfo    },
     { "ping",       "Send ARP request to test reachability", cmd_ping },
     { "soundtest",  "Test audio playback (freq duration)", cmd_soundtest },
+    { "allocbench", "Measure kmalloc/kfree throughput on 1..N CPUs (size)", cmd_allocbench },
+    { "membench",   "Measure memcpy/memset bandwidth", cmd_membench },
+    { "fbbench",    "Measure framebuffer frame time (WB vs WC)", cmd_fbbench },
+    { "cswbench",   "Measure address-space switch round trip (pages)", cmd_cswbench },
+    { "clockbench", "Measure the cost of reading the clock", cmd_clockbench },
+    { "syscallbench", "Measure int 0x80 vs SYSCALL round trip (count)", cmd_syscallbench },
+    { "surfacedemo", "Run a program that draws into its mapped window surface", cmd_surfacedemo },
+    { "memstat",    "kmalloc usage by call site (on|off)", cmd_memstat },
+    { "lockstat",   "Spinlock contention statistics (reset)", cmd_lockstat },
+    { "cpustat",    "Per-CPU interrupt, syscall and switch counters", cmd_cpustat },
+    { "irqs",       "IOAPIC routes (gsi cpu: move one)", cmd_irqs },
 };
 
 static const size_t command_count = sizeof(commands) / sizeof(commands[0]);
@@ -468,14 +501,8 @@ static void cmd_exec(const char* args) {
         return;
     }
     
-    // Load ELF into memory
-    if (elf_load(data, size) != 0) {
-        kprintf("exec: failed to load ELF\n");
-        return;
-    }
-    
     // Get entry point
-    uint32_t entry = elf_get_entry(data);
+    uint64_t entry = elf_get_entry(data);
     
     // Create process
     process_t* proc = process_create(path, entry);
@@ -484,8 +511,8 @@ static void cmd_exec(const char* args) {
         return;
     }
     
-    // Execute
-    process_execute(proc);
+    // Load ELF into the process's own address space and queue it
+    process_load_and_execute(proc, data, size);
 }
 
 static void cmd_disktest(const char* args) {
@@ -603,3 +630,662 @@ static void cmd_soundtest(const char* args) {
     hda_play_sine(freq, duration);
 }
 
+static uint32_t parse_uint(const char* p, uint32_t def) {
+    while (p && (*p == ' ' || *p == '\t')) p++;
+    if (!p || *p < '0' || *p > '9') return def;
+    uint32_t v = 0;
+    while (*p >= '0' && *p <= '9') v = v * 10 + (*p++ - '0');
+    return v;
+}
+
+static uint32_t ops_per_sec(uint64_t ops, uint64_t ns) {
+    if (ns == 0) ns = 1;
+    return (uint32_t)(ops * 1000000000ULL / ns);
+}
+
+#define ALLOCBENCH_ITERS      200000    /* Per thread and pattern */
+#define ALLOCBENCH_BATCH      64
+#define ALLOCBENCH_TIMEOUT_NS 10000000000ULL
+
+/* One run: every worker waits for go, does its share, then pushes
+   end_ns up to when it finished. Static, like syscallbench's: workers of
+   a run that timed out may still finish later. */
+static wait_queue_t allocbench_wait = WAIT_QUEUE_INIT;
+static uint32_t allocbench_size;
+static int allocbench_bursts;
+static volatile int allocbench_go;
+static volatile int allocbench_done;
+static volatile int allocbench_failed;
+static uint64_t allocbench_end_ns;
+
+static void allocbench_worker(void* arg) {
+    (void)arg;
+    void* batch[ALLOCBENCH_BATCH];
+    while (!__atomic_load_n(&allocbench_go, __ATOMIC_ACQUIRE)) __asm__ volatile("pause");
+
+    uint32_t size = allocbench_size;
+    if (!allocbench_bursts) {
+        // Alloc/free pairs: served entirely from this CPU's magazine
+        for (uint32_t i = 0; i < ALLOCBENCH_ITERS; i++) {
+            void* p = kmalloc(size);
+            if (!p) allocbench_failed = 1;
+            kfree(p);
+        }
+    } else {
+        // Bursts larger than a magazine: exercises depot refill and drain
+        for (uint32_t i = 0; i < ALLOCBENCH_ITERS / ALLOCBENCH_BATCH; i++) {
+            for (int j = 0; j < ALLOCBENCH_BATCH; j++) batch[j] = kmalloc(size);
+            for (int j = 0; j < ALLOCBENCH_BATCH; j++) {
+                if (!batch[j]) allocbench_failed = 1;
+                kfree(batch[j]);
+            }
+        }
+    }
+
+    uint64_t now = clock_monotonic_ns();
+    uint64_t end = __atomic_load_n(&allocbench_end_ns, __ATOMIC_RELAXED);
+    while (now > end && !__atomic_compare_exchange_n(&allocbench_end_ns, &end, now, 0,
+                                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&allocbench_done, 1, __ATOMIC_RELEASE);
+    wait_queue_wake_all(&allocbench_wait);
+    kthread_exit();
+}
+
+/* Run threads workers pinned to cpus[0..threads); allocs/sec over the
+   wall time from go to the last one finishing, or 0 */
+static uint32_t allocbench_run(const int* cpus, int threads, int bursts) {
+    allocbench_bursts = bursts;
+    allocbench_go = 0;
+    allocbench_done = 0;
+    allocbench_end_ns = 0;
+
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        if (kthread_create("allocbench", allocbench_worker, NULL, cpus[i])) started++;
+    }
+
+    uint64_t start = clock_monotonic_ns();
+    __atomic_store_n(&allocbench_go, 1, __ATOMIC_RELEASE);
+    uint64_t deadline = start + ALLOCBENCH_TIMEOUT_NS;
+    for (;;) {
+        uint32_t seq = wait_queue_seq(&allocbench_wait);
+        if (__atomic_load_n(&allocbench_done, __ATOMIC_ACQUIRE) == started) break;
+        if (wait_queue_sleep(&allocbench_wait, seq, deadline) != 0) return 0;
+    }
+    if (started < threads) return 0;
+
+    uint64_t ops = (uint64_t)started * (bursts ? (ALLOCBENCH_ITERS / ALLOCBENCH_BATCH) * ALLOCBENCH_BATCH
+                                               : ALLOCBENCH_ITERS);
+    return ops_per_sec(ops, allocbench_end_ns - start);
+}
+
+static void cmd_allocbench(const char* args) {
+    uint32_t size = parse_uint(args, 64);
+    if (size == 0) size = 1;
+    allocbench_size = size;
+    allocbench_failed = 0;
+
+    // One worker per CPU. If this shell cannot sleep while it waits (it
+    // runs from the keyboard interrupt) it keeps its CPU busy, so that
+    // CPU gets no worker.
+    static int cpus[SMP_MAX_CPUS];
+    int self = smp_current_cpu();
+    int skip = scheduler_can_sleep() ? -1 : self;
+    int max = 0;
+    for (int cpu = 0; cpu < (int)smp_get_cpu_count(); cpu++) {
+        if (cpu != skip) cpus[max++] = cpu;
+    }
+    if (max == 0) {
+        kprintf("allocbench: no CPU free to run on\n");
+        return;
+    }
+
+    kprintf("allocbench: %u-byte objects, %u per thread, up to %d threads (shell on CPU %d)\n",
+            size, ALLOCBENCH_ITERS, max, self);
+    for (int threads = 1; threads <= max; threads++) {
+        uint32_t pairs = allocbench_run(cpus, threads, 0);
+        uint32_t bursts = pairs ? allocbench_run(cpus, threads, 1) : 0;
+        if (!pairs || !bursts) {
+            kprintf("  %d threads: did not finish\n", threads);
+            return;
+        }
+        kprintf("  %d threads: pairs %u allocs/sec, bursts %u allocs/sec\n", threads, pairs, bursts);
+    }
+    if (allocbench_failed) kprintf("allocbench: some allocations failed\n");
+}
+
+/* Print bytes-per-nanosecond as "X.YY GB/s" */
+static void print_gbps(const char* label, uint64_t bytes, uint64_t ns) {
+    if (ns == 0) ns = 1;
+    uint32_t centi = (uint32_t)(bytes * 100 / ns);
+    kprintf("%s%u.%s%u GB/s\n", label, centi / 100, (centi % 100) < 10 ? "0" : "", centi % 100);
+}
+
+#define MEMBENCH_BYTES (256u * 1024 * 1024)  /* Data moved per measurement */
+
+static void cmd_membench(const char* args) {
+    (void)args;
+    static const uint32_t sizes[] = { 64, 4096, 4 * 1024 * 1024 };
+    static const char* names[] = { "64 B", "4 KiB", "4 MiB" };
+
+    uint8_t* src = kmalloc(4 * 1024 * 1024);
+    uint8_t* dst = kmalloc(4 * 1024 * 1024);
+    if (!src || !dst) {
+        kprintf("membench: out of memory\n");
+        kfree(src);
+        kfree(dst);
+        return;
+    }
+    memset(src, 0x5A, 4 * 1024 * 1024);
+
+    kprintf("membench: ERMS %s\n", memory_has_erms() ? "yes (rep movsb/stosb)" : "no (rep movsq/stosq)");
+
+    for (int i = 0; i < 3; i++) {
+        uint32_t iters = MEMBENCH_BYTES / sizes[i];
+        kprintf("  %s\n", names[i]);
+
+        uint64_t start = clock_monotonic_ns();
+        for (uint32_t n = 0; n < iters; n++) {
+            memcpy(dst, src, sizes[i]);
+            __asm__ volatile("" : : "r"(dst) : "memory");
+        }
+        print_gbps("    memcpy: ", (uint64_t)iters * sizes[i], clock_monotonic_ns() - start);
+
+        start = clock_monotonic_ns();
+        for (uint32_t n = 0; n < iters; n++) {
+            memset(dst, (int)n, sizes[i]);
+            __asm__ volatile("" : : "r"(dst) : "memory");
+        }
+        print_gbps("    memset: ", (uint64_t)iters * sizes[i], clock_monotonic_ns() - start);
+    }
+
+    kfree(src);
+    kfree(dst);
+}
+
+#define FBBENCH_FRAMES 30
+
+/* The compositor's pre-blit_rows path: one 32-bit store per pixel */
+static void fbbench_pixel_loop(const uint32_t* src) {
+    uint8_t* dst_base = (uint8_t*)vesa_video_memory;
+    for (int y = 0; y < vesa_height; y++) {
+        volatile uint32_t* dst_row = (volatile uint32_t*)(dst_base + y * vesa_pitch);
+        for (int x = 0; x < vesa_width; x++) {
+            dst_row[x] = src[y * vesa_width + x];
+        }
+    }
+}
+
+static void fbbench_run(const char* label, const uint32_t* src, int use_blit) {
+    uint64_t start = clock_monotonic_ns();
+    for (int f = 0; f < FBBENCH_FRAMES; f++) {
+        if (use_blit) vesa_blit_rows(src, vesa_width, 0, vesa_height);
+        else fbbench_pixel_loop(src);
+    }
+    uint64_t us = (clock_monotonic_ns() - start) / 1000 / FBBENCH_FRAMES;
+    uint32_t frac = (uint32_t)(us % 1000) / 10;
+    kprintf("  %s%u.%s%u ms/frame\n", label, (uint32_t)(us / 1000), frac < 10 ? "0" : "", frac);
+}
+
+static void cmd_fbbench(const char* args) {
+    (void)args;
+    if (!vesa_video_memory) {
+        kprintf("fbbench: no framebuffer\n");
+        return;
+    }
+
+    uint32_t* src = kmalloc((size_t)vesa_width * vesa_height * 4);
+    if (!src) {
+        kprintf("fbbench: out of memory\n");
+        return;
+    }
+    // Grab the current screen so the benchmark doesn't visibly disturb it
+    for (int y = 0; y < vesa_height; y++) {
+        memcpy(src + (size_t)y * vesa_width, (uint8_t*)vesa_video_memory + (size_t)y * vesa_pitch,
+               (size_t)vesa_width * 4);
+    }
+
+    int was_wc = vesa_is_write_combining();
+    kprintf("fbbench: %dx%d, %d frames per run\n", vesa_width, vesa_height, FBBENCH_FRAMES);
+
+    vesa_set_write_combining(0);
+    fbbench_run("WB pixel loop: ", src, 0);
+    fbbench_run("WB blit_rows:  ", src, 1);
+
+    vesa_set_write_combining(1);
+    fbbench_run("WC pixel loop: ", src, 0);
+    fbbench_run("WC blit_rows:  ", src, 1);
+
+    vesa_set_write_combining(was_wc);
+    kfree(src);
+}
+
+#define CSWBENCH_ROUNDS 10000
+#define CSWBENCH_BASE   0x40000000ULL
+
+/* An address space with `pages` resident pages at CSWBENCH_BASE */
+static vm_space_t* cswbench_space(uint32_t pages) {
+    vm_space_t* space = vmm_create_space();
+    if (!space) return NULL;
+    if (vmm_map_anon(space, CSWBENCH_BASE, (uint64_t)pages * PAGE_SIZE, VMA_READ | VMA_WRITE) != 0) {
+        vmm_destroy_space(space);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < pages; i++) {
+        if (vmm_handle_fault(space, CSWBENCH_BASE + (uint64_t)i * PAGE_SIZE, PFERR_WRITE) != 0) {
+            vmm_destroy_space(space);
+            return NULL;
+        }
+    }
+    return space;
+}
+
+static uint64_t cswbench_touch(uint32_t pages) {
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < pages; i++) {
+        sum += *(volatile uint64_t*)(uintptr_t)(CSWBENCH_BASE + (uint64_t)i * PAGE_SIZE);
+    }
+    return sum;
+}
+
+/* A -> B -> A, touching each side's working set, as a pair of processes
+   ping-ponging through the scheduler would. Interrupts stay off so the
+   scheduler can't switch CR3 underneath us. */
+static void cswbench_run(const char* label, vm_space_t* a, vm_space_t* b, uint32_t pages) {
+    uint64_t flags = irq_save();
+    vmm_switch(NULL, a);
+    cswbench_touch(pages);
+
+    uint64_t start = clock_monotonic_ns();
+    for (uint32_t r = 0; r < CSWBENCH_ROUNDS; r++) {
+        vmm_switch(a, b);
+        cswbench_touch(pages);
+        vmm_switch(b, a);
+        cswbench_touch(pages);
+    }
+    uint64_t ns = clock_monotonic_ns() - start;
+
+    vmm_switch(a, NULL);
+    irq_restore(flags);
+    kprintf("  %s%u ns/round trip\n", label, (uint32_t)(ns / CSWBENCH_ROUNDS));
+}
+
+static void cmd_cswbench(const char* args) {
+    uint32_t pages = parse_uint(args, 32);
+    if (pages == 0) pages = 1;
+
+    vm_space_t* a = cswbench_space(pages);
+    vm_space_t* b = a ? cswbench_space(pages) : NULL;
+    if (!b) {
+        kprintf("cswbench: out of memory\n");
+        if (a) vmm_destroy_space(a);
+        return;
+    }
+
+    kprintf("cswbench: %u pages per side, %u round trips\n", pages, CSWBENCH_ROUNDS);
+    int was_enabled = tlb_pcid_enabled();
+    if (tlb_has_pcid()) {
+        tlb_set_pcid_enabled(1);
+        cswbench_run("PCID on:  ", a, b, pages);
+    } else {
+        kprintf("  PCID not supported by this CPU\n");
+    }
+    tlb_set_pcid_enabled(0);
+    cswbench_run("PCID off: ", a, b, pages);
+    tlb_set_pcid_enabled(was_enabled);
+
+    vmm_destroy_space(a);
+    vmm_destroy_space(b);
+}
+
+#define CLOCKBENCH_READS 100000
+
+static void cmd_clockbench(const char* args) {
+    (void)args;
+    kprintf("clockbench: clocksource %s, TSC at %u kHz\n",
+            clock_source_name(), (uint32_t)clock_tsc_khz());
+
+    // Also checks that consecutive reads never go backwards
+    uint64_t start = clock_monotonic_ns();
+    uint64_t last = 0;
+    for (uint32_t i = 0; i < CLOCKBENCH_READS; i++) {
+        uint64_t now = clock_monotonic_ns();
+        if (now < last) {
+            kprintf("  clock went backwards: %u ns\n", (uint32_t)(last - now));
+            return;
+        }
+        last = now;
+    }
+    uint64_t ns = clock_monotonic_ns() - start;
+    kprintf("  clock_monotonic_ns: %u ns/read\n", (uint32_t)(ns / CLOCKBENCH_READS));
+
+    start = clock_monotonic_ns();
+    for (uint32_t i = 0; i < CLOCKBENCH_READS; i++) {
+        last = hpet_get_nanos();
+        __asm__ volatile("" : : "r"(last) : "memory");
+    }
+    ns = clock_monotonic_ns() - start;
+    kprintf("  hpet_get_nanos:     %u ns/read\n", (uint32_t)(ns / CLOCKBENCH_READS));
+}
+
+/* The benchmark is a 64-bit user program: it makes SYS_GETPID calls in
+   a loop, by int 0x80 or by SYSCALL, and exits with the average TSC
+   cycles per call. It goes through exec's path as a one-segment ELF64. */
+#define SYSCALLBENCH_BASE       0x400000
+#define SYSCALLBENCH_TIMEOUT_NS 10000000000ULL
+
+static const uint8_t syscallbench_code[] = {
+    0x41, 0xbc, 0, 0, 0, 0,             // mov $iterations, %r12d
+    0x41, 0xbd, 0, 0, 0, 0,             // mov $use_syscall, %r13d
+    0x0f, 0x31,                         // rdtsc
+    0x48, 0xc1, 0xe2, 0x20,             // shl $32, %rdx
+    0x48, 0x09, 0xd0,                   // or %rdx, %rax
+    0x49, 0x89, 0xc6,                   // mov %rax, %r14
+    0x4c, 0x89, 0xe3,                   // mov %r12, %rbx
+    0x4d, 0x85, 0xed,                   // test %r13, %r13
+    0x75, 0x0e,                         // jnz 2f
+    0xb8, SYS_GETPID, 0, 0, 0,          // 1: mov $SYS_GETPID, %eax
+    0xcd, 0x80,                         // int $0x80
+    0x48, 0xff, 0xcb,                   // dec %rbx
+    0x75, 0xf4,                         // jnz 1b
+    0xeb, 0x0c,                         // jmp 3f
+    0xb8, SYS_GETPID, 0, 0, 0,          // 2: mov $SYS_GETPID, %eax
+    0x0f, 0x05,                         // syscall
+    0x48, 0xff, 0xcb,                   // dec %rbx
+    0x75, 0xf4,                         // jnz 2b
+    0x0f, 0x31,                         // 3: rdtsc
+    0x48, 0xc1, 0xe2, 0x20,             // shl $32, %rdx
+    0x48, 0x09, 0xd0,                   // or %rdx, %rax
+    0x4c, 0x29, 0xf0,                   // sub %r14, %rax
+    0x31, 0xd2,                         // xor %edx, %edx
+    0x49, 0xf7, 0xf4,                   // div %r12
+    0x48, 0x89, 0xc3,                   // mov %rax, %rbx
+    0xb8, SYS_EXIT, 0, 0, 0,            // mov $SYS_EXIT, %eax
+    0xcd, 0x80,                         // int $0x80
+    0xeb, 0xfe,                         // jmp .
+};
+
+static struct {
+    elf64_header_t hdr;
+    elf64_program_header_t phdr;
+    uint8_t code[sizeof(syscallbench_code)];
+} __attribute__((packed)) syscallbench_image;
+
+/* Static: a timed-out run may still exit later */
+static wait_queue_t syscallbench_wait = WAIT_QUEUE_INIT;
+static volatile int syscallbench_result;
+
+/* Headers for a one-segment ELF64 loaded at base, size bytes in all,
+   entered at base + entry_off */
+static void user_image_headers(elf64_header_t* hdr, elf64_program_header_t* phdr,
+                               uint64_t base, uint64_t entry_off, uint64_t size) {
+    hdr->e_ident[0] = 0x7F; hdr->e_ident[1] = 'E'; hdr->e_ident[2] = 'L'; hdr->e_ident[3] = 'F';
+    hdr->e_ident[4] = ELF_CLASS_64;
+    hdr->e_ident[5] = ELF_DATA_LSB;
+    hdr->e_ident[6] = 1;
+    hdr->e_type = ELF_TYPE_EXEC;
+    hdr->e_machine = ELF_MACHINE_X86_64;
+    hdr->e_version = 1;
+    hdr->e_entry = base + entry_off;
+    hdr->e_phoff = sizeof(elf64_header_t);
+    hdr->e_ehsize = sizeof(elf64_header_t);
+    hdr->e_phentsize = sizeof(elf64_program_header_t);
+    hdr->e_phnum = 1;
+
+    phdr->p_type = PT_LOAD;
+    phdr->p_flags = PF_R | PF_X;
+    phdr->p_vaddr = base;
+    phdr->p_filesz = size;
+    phdr->p_memsz = size;
+}
+
+static void syscallbench_build(uint32_t iterations, int use_syscall) {
+    memset(&syscallbench_image, 0, sizeof(syscallbench_image));
+    user_image_headers(&syscallbench_image.hdr, &syscallbench_image.phdr, SYSCALLBENCH_BASE,
+                       __builtin_offsetof(__typeof__(syscallbench_image), code),
+                       sizeof(syscallbench_image));
+
+    memcpy(syscallbench_image.code, syscallbench_code, sizeof(syscallbench_code));
+    memcpy(&syscallbench_image.code[2], &iterations, 4);
+    uint32_t mode = use_syscall ? 1 : 0;
+    memcpy(&syscallbench_image.code[8], &mode, 4);
+}
+
+/* Cycles per call, or -1 */
+static int syscallbench_run(uint32_t iterations, int use_syscall) {
+    syscallbench_build(iterations, use_syscall);
+    syscallbench_result = -1;
+
+    process_t* proc = process_create("syscallbench", elf_get_entry(&syscallbench_image));
+    if (!proc) return -1;
+    proc->exit_wait = &syscallbench_wait;
+    proc->exit_status = &syscallbench_result;
+    process_load_and_execute(proc, &syscallbench_image, sizeof(syscallbench_image));
+
+    uint64_t deadline = clock_monotonic_ns() + SYSCALLBENCH_TIMEOUT_NS;
+    for (;;) {
+        uint32_t seq = wait_queue_seq(&syscallbench_wait);
+        if (syscallbench_result >= 0) break;
+        if (wait_queue_sleep(&syscallbench_wait, seq, deadline) != 0) break;
+    }
+    return syscallbench_result;
+}
+
+static void cmd_syscallbench(const char* args) {
+    uint32_t iterations = parse_uint(args, 100000);
+    if (iterations == 0) iterations = 1;
+    uint32_t khz = (uint32_t)clock_tsc_khz();
+    kprintf("syscallbench: %u SYS_GETPID calls from a 64-bit program, TSC at %u kHz\n",
+            iterations, khz);
+
+    const char* labels[2] = { "int 0x80:", "SYSCALL: " };
+    for (int use_syscall = 0; use_syscall < 2; use_syscall++) {
+        int cycles = syscallbench_run(iterations, use_syscall);
+        if (cycles < 0) {
+            kprintf("  %s did not finish\n", labels[use_syscall]);
+            continue;
+        }
+        uint32_t ns = khz ? (uint32_t)((uint64_t)cycles * 1000000ULL / khz) : 0;
+        kprintf("  %s %u cycles (%u ns) per round trip\n", labels[use_syscall], (uint32_t)cycles, ns);
+    }
+}
+
+/* A 64-bit user program for the mapped-surface path: it opens a 256x256
+   window, maps its surface (SYS_GUI_MAP_SURFACE), writes a gradient
+   straight into it, presents it (SYS_GUI_PRESENT) and then polls
+   events until the window is closed. */
+#define SURFACEDEMO_BASE 0x400000
+
+static const uint8_t surfacedemo_code[] = {
+    0xb8, SYS_GUI_WINDOW_OPEN, 0, 0, 0, // mov $SYS_GUI_WINDOW_OPEN, %eax
+    0xbb, 200, 0, 0, 0,                 // mov $200, %ebx
+    0xb9, 150, 0, 0, 0,                 // mov $150, %ecx
+    0xba, 0x00, 0x01, 0, 0,             // mov $256, %edx
+    0xbe, 0x00, 0x01, 0, 0,             // mov $256, %esi
+    0x48, 0x8d, 0x3d, 0x93, 0, 0, 0,    // lea title(%rip), %rdi
+    0xcd, 0x80,                         // int $0x80
+    0x49, 0x89, 0xc4,                   // mov %rax, %r12
+    0x48, 0x85, 0xc0,                   // test %rax, %rax
+    0x74, 0x7e,                         // jz 5f
+    0xb8, SYS_GUI_MAP_SURFACE, 0, 0, 0, // mov $SYS_GUI_MAP_SURFACE, %eax
+    0x4c, 0x89, 0xe3,                   // mov %r12, %rbx
+    0xcd, 0x80,                         // int $0x80
+    0x48, 0x83, 0xf8, 0xff,             // cmp $-1, %rax
+    0x74, 0x6e,                         // je 5f
+    0x48, 0x89, 0xc7,                   // mov %rax, %rdi
+    0x31, 0xc9,                         // xor %ecx, %ecx
+    0x31, 0xd2,                         // 1: xor %edx, %edx
+    0x89, 0xd0,                         // 2: mov %edx, %eax
+    0xc1, 0xe0, 0x10,                   // shl $16, %eax
+    0x41, 0x89, 0xc8,                   // mov %ecx, %r8d
+    0x41, 0xc1, 0xe0, 0x08,             // shl $8, %r8d
+    0x44, 0x09, 0xc0,                   // or %r8d, %eax
+    0x0d, 0x80, 0x00, 0x00, 0xff,       // or $0xFF000080, %eax
+    0x89, 0x07,                         // mov %eax, (%rdi)
+    0x48, 0x83, 0xc7, 0x04,             // add $4, %rdi
+    0xff, 0xc2,                         // inc %edx
+    0x81, 0xfa, 0x00, 0x01, 0, 0,       // cmp $256, %edx
+    0x72, 0xdc,                         // jb 2b
+    0xff, 0xc1,                         // inc %ecx
+    0x81, 0xf9, 0x00, 0x01, 0, 0,       // cmp $256, %ecx
+    0x72, 0xd0,                         // jb 1b
+    0xb8, SYS_GUI_PRESENT, 0, 0, 0,     // mov $SYS_GUI_PRESENT, %eax
+    0x4c, 0x89, 0xe3,                   // mov %r12, %rbx
+    0x31, 0xc9,                         // xor %ecx, %ecx
+    0x31, 0xd2,                         // xor %edx, %edx
+    0xbe, 0x00, 0x01, 0, 0,             // mov $256, %esi
+    0xbf, 0x00, 0x01, 0, 0,             // mov $256, %edi
+    0xcd, 0x80,                         // int $0x80
+    0x48, 0x83, 0xec, 0x20,             // sub $32, %rsp
+    0xb8, SYS_GUI_EVENT_POLL, 0, 0, 0,  // 3: mov $SYS_GUI_EVENT_POLL, %eax
+    0x4c, 0x89, 0xe3,                   // mov %r12, %rbx
+    0x48, 0x89, 0xe1,                   // mov %rsp, %rcx
+    0xcd, 0x80,                         // int $0x80
+    0x85, 0xc0,                         // test %eax, %eax
+    0x74, 0x08,                         // jz 4f
+    0x83, 0x3c, 0x24, HZ_EVENT_QUIT,    // cmpl $HZ_EVENT_QUIT, (%rsp)
+    0x74, 0x06,                         // je 5f
+    0xeb, 0xe7,                         // jmp 3b
+    0xf3, 0x90,                         // 4: pause
+    0xeb, 0xe3,                         // jmp 3b
+    0x31, 0xdb,                         // 5: xor %ebx, %ebx
+    0xb8, SYS_EXIT, 0, 0, 0,            // mov $SYS_EXIT, %eax
+    0xcd, 0x80,                         // int $0x80
+    0xeb, 0xfe,                         // jmp .
+    's', 'u', 'r', 'f', 'a', 'c', 'e',  // title: .asciz "surfacedemo"
+    'd', 'e', 'm', 'o', 0,
+};
+
+static struct {
+    elf64_header_t hdr;
+    elf64_program_header_t phdr;
+    uint8_t code[sizeof(surfacedemo_code)];
+} __attribute__((packed)) surfacedemo_image;
+
+static void cmd_surfacedemo(const char* args) {
+    (void)args;
+    if (!wm_is_running()) {
+        kprintf("surfacedemo: the GUI is not running\n");
+        return;
+    }
+
+    memset(&surfacedemo_image, 0, sizeof(surfacedemo_image));
+    user_image_headers(&surfacedemo_image.hdr, &surfacedemo_image.phdr, SURFACEDEMO_BASE,
+                       __builtin_offsetof(__typeof__(surfacedemo_image), code),
+                       sizeof(surfacedemo_image));
+    memcpy(surfacedemo_image.code, surfacedemo_code, sizeof(surfacedemo_code));
+
+    process_t* proc = process_create("surfacedemo", elf_get_entry(&surfacedemo_image));
+    if (!proc) {
+        kprintf("surfacedemo: out of memory\n");
+        return;
+    }
+    process_load_and_execute(proc, &surfacedemo_image, sizeof(surfacedemo_image));
+}
+
+#define MEMSTAT_TOP 10
+
+static void cmd_memstat(const char* args) {
+    while (args && (*args == ' ' || *args == '\t')) args++;
+    if (args && args[0] == 'o' && args[1] == 'n') {
+        alloc_trace_enable(1);
+        kprintf("memstat: tracing kmalloc call sites\n");
+        return;
+    }
+    if (args && args[0] == 'o' && args[1] == 'f') {
+        alloc_trace_enable(0);
+        kprintf("memstat: tracing off (figures frozen)\n");
+        return;
+    }
+
+    kprintf("memstat: %u KB of %u KB in use, %u large pages\n",
+            (uint32_t)memory_get_used_kb(), (uint32_t)memory_get_total_kb(),
+            (uint32_t)kmalloc_get_large_pages());
+
+    alloc_trace_summary_t sum;
+    alloc_trace_get_summary(&sum);
+    if (!alloc_trace_enabled() && sum.sites == 0) {
+        kprintf("  call-site tracing is off; 'memstat on' to start\n");
+        return;
+    }
+
+    uint64_t secs = (clock_monotonic_ns() - sum.since_ns) / 1000000000ULL;
+    if (secs == 0) secs = 1;
+    kprintf("  %u sites, %u live allocations, %u dropped, %u s of data\n",
+            (uint32_t)sum.sites, (uint32_t)sum.live_objs, (uint32_t)sum.dropped, (uint32_t)secs);
+
+    static alloc_site_stats_t top[MEMSTAT_TOP];
+    int n = alloc_trace_top(top, MEMSTAT_TOP);
+    kprintf("  site, live bytes, peak bytes, live objects, allocs/s:\n");
+    for (int i = 0; i < n; i++) {
+        kprintf("  %p %u %u %u %u\n", (void*)top[i].site, (uint32_t)top[i].live_bytes,
+                (uint32_t)top[i].peak_bytes, (uint32_t)top[i].live_objs,
+                (uint32_t)(top[i].allocs / secs));
+    }
+    kprintf("  (addr2line -e build/kernel.elf <site> names the caller)\n");
+}
+
+static void cmd_lockstat(const char* args) {
+    while (args && (*args == ' ' || *args == '\t')) args++;
+    if (args && args[0] == 'r') {
+        spinlock_stats_reset();
+        kprintf("lockstat: counters cleared\n");
+        return;
+    }
+
+    static lock_stat_t stats[LOCKSTAT_MAX];
+    int n = spinlock_stats(stats, LOCKSTAT_MAX);
+    uint64_t khz = clock_tsc_khz();
+    kprintf("lockstat: %d locks tracked\n", n);
+    kprintf("  lock, acquisitions, contended, spins per contention, max hold (us):\n");
+    for (int i = 0; i < n; i++) {
+        uint64_t spins = stats[i].contended ? stats[i].spins / stats[i].contended : 0;
+        uint64_t hold_us = khz ? stats[i].max_hold_cycles * 1000 / khz : 0;
+        kprintf("  %s %u %u %u %u\n", stats[i].name, (uint32_t)stats[i].acquisitions,
+                (uint32_t)stats[i].contended, (uint32_t)spins, (uint32_t)hold_us);
+    }
+}
+
+static void cmd_irqs(const char* args) {
+    const char* p = args;
+    while (p && (*p == ' ' || *p == '\t')) p++;
+    if (p && *p >= '0' && *p <= '9') {
+        uint32_t gsi = parse_uint(p, 0);
+        while (*p >= '0' && *p <= '9') p++;
+        uint32_t cpu = parse_uint(p, 0);
+        if (ioapic_set_affinity(gsi, (int)cpu) < 0) {
+            kprintf("irqs: GSI %u is not routed\n", gsi);
+            return;
+        }
+    }
+
+    static ioapic_route_t routes[64];
+    int n = ioapic_routes(routes, 64);
+    kprintf("irqs: %d GSIs routed\n", n);
+    kprintf("  gsi, vector, cpu, trigger:\n");
+    for (int i = 0; i < n; i++) {
+        kprintf("  %u %x %d %s/%s\n", routes[i].gsi, routes[i].vector, routes[i].cpu,
+                routes[i].level ? "level" : "edge", routes[i].active_low ? "low" : "high");
+    }
+}
+
+static void cmd_cpustat(const char* args) {
+    (void)args;
+    kprintf("cpustat: %u CPUs online\n", smp_get_cpu_count());
+    kprintf("  cpu, irqs, syscalls, switches, page faults, net rx, net tx, softirqs:\n");
+    for (int cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        percpu_t* pc = percpu_of(cpu);
+        if (!pc->self) continue;
+        kprintf("  %d %u %u %u %u %u %u %u\n", cpu,
+                (uint32_t)pc->stats[PERCPU_STAT_IRQS], (uint32_t)pc->stats[PERCPU_STAT_SYSCALLS],
+                (uint32_t)pc->stats[PERCPU_STAT_CTX_SWITCHES], (uint32_t)pc->stats[PERCPU_STAT_PAGE_FAULTS],
+                (uint32_t)pc->stats[PERCPU_STAT_NET_RX], (uint32_t)pc->stats[PERCPU_STAT_NET_TX],
+                (uint32_t)pc->stats[PERCPU_STAT_SOFTIRQS]);
+    }
+    kprintf("  all %u %u %u %u %u %u %u\n",
+            (uint32_t)percpu_stat_sum(PERCPU_STAT_IRQS), (uint32_t)percpu_stat_sum(PERCPU_STAT_SYSCALLS),
+            (uint32_t)percpu_stat_sum(PERCPU_STAT_CTX_SWITCHES), (uint32_t)percpu_stat_sum(PERCPU_STAT_PAGE_FAULTS),
+            (uint32_t)percpu_stat_sum(PERCPU_STAT_NET_RX), (uint32_t)percpu_stat_sum(PERCPU_STAT_NET_TX),
+            (uint32_t)percpu_stat_sum(PERCPU_STAT_SOFTIRQS));
+}
@@ -1,6 +1,8 @@
 #include "terminal.h"
 #include "../drivers/vesa.h"
 #include "../gui/font.h"
+#include "../core/process.h"
+#include "../core/spinlock.h"
 
 extern uint64_t g_hhdm_offset;
 static uint16_t* VIDEO_MEMORY = 0; // Will be set in terminal_init
@@ -15,6 +17,11 @@ static int vesa_enabled = 0;
 static const int VESA_CHAR_W = 8;
 static const int VESA_CHAR_H = 8;
 
+/* Cursor, screen and the capture buffer. Programs write and read the
+   terminal from syscalls on any CPU while the kernel prints from
+   interrupt handlers, so the lock is taken with interrupts off. */
+static spinlock_t terminal_lock = SPINLOCK_INIT;
+
 #define TERM_BUF_SIZE 1024
 static char term_buffer[TERM_BUF_SIZE];
 static int term_buf_head = 0;
@@ -46,8 +53,7 @@ void terminal_setcolor(uint8_t color) {
     terminal_color = color;
 }
 
-void terminal_clear(void) {
-    if (!VIDEO_MEMORY) return; // Not initialized yet
+static void clear(void) {
     for (int y = 0; y < VGA_HEIGHT; y++) {
         for (int x = 0; x < VGA_WIDTH; x++) {
             VIDEO_MEMORY[y * VGA_WIDTH + x] = vga_entry(' ', terminal_color);
@@ -63,6 +69,13 @@ void terminal_clear(void) {
     terminal_column = 0;
 }
 
+void terminal_clear(void) {
+    if (!VIDEO_MEMORY) return; // Not initialized yet
+    uint64_t flags = spinlock_lock_irqsave(&terminal_lock);
+    clear();
+    spinlock_unlock_irqrestore(&terminal_lock, flags);
+}
+
 static void vesa_draw_char(char c, int x, int y, uint32_t color) {
     if (!vesa_video_memory) return;
     uint8_t* glyph = font8x8_basic[(uint8_t)c];
@@ -97,7 +110,8 @@ void terminal_set_sink(term_sink_t sink) {
     terminal_sink = sink;
 }
 
-void terminal_putc(char c) {
+static int putc_locked(char c) {
+    int captured = 0;
     if (terminal_sink) {
         terminal_sink(c);
     }
@@ -107,9 +121,10 @@ void terminal_putc(char c) {
     if (next != term_buf_tail) {
         term_buffer[term_buf_head] = c;
         term_buf_head = next;
+        captured = 1;
     }
 
-    if (terminal_sink) return;
+    if (terminal_sink) return captured;
 
     // VESA Boot Console Support
     if (vesa_video_memory) {
@@ -133,7 +148,7 @@ void terminal_putc(char c) {
         if (terminal_row >= max_rows) {
             vesa_scroll();
         }
-        return;
+        return captured;
     }
 
     // Original VGA Fallback
@@ -162,6 +177,15 @@ void terminal_putc(char c) {
     if (terminal_row >= VGA_HEIGHT) {
         terminal_scroll();
     }
+    return captured;
+}
+
+void terminal_putc(char c) {
+    uint64_t flags = spinlock_lock_irqsave(&terminal_lock);
+    int captured = putc_locked(c);
+    spinlock_unlock_irqrestore(&terminal_lock, flags);
+    // Wakes take the run queue locks; not under ours
+    if (captured) scheduler_wake_input();
 }
 
 void terminal_write(const char* str) {
@@ -176,8 +200,12 @@ void terminal_writeln(const char* str) {
 }
 
 int terminal_get_char(void) {
-    if (term_buf_head == term_buf_tail) return -1;
-    char c = term_buffer[term_buf_tail];
-    term_buf_tail = (term_buf_tail + 1) % TERM_BUF_SIZE;
-    return (int)c;
+    int c = -1;
+    uint64_t flags = spinlock_lock_irqsave(&terminal_lock);
+    if (term_buf_head != term_buf_tail) {
+        c = term_buffer[term_buf_tail];
+        term_buf_tail = (term_buf_tail + 1) % TERM_BUF_SIZE;
+    }
+    spinlock_unlock_irqrestore(&terminal_lock, flags);
+    return c;
 }
\ No newline at end of file